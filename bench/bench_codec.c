@@ -0,0 +1,126 @@
+// bench_codec - messages per second through the text protocol (snprintf on send, sscanf and
+// parse_floor on receive) against binary protocol version 2 (fixed-size encode and decode), for the
+// three messages on the hot path: STATUS, CALL and FLOOR.
+//
+//   ./bench/bench_codec [messages]     (default: 2000000)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../common.h"
+#include "../protocol.h"
+
+double seconds_since(const struct timespec *start);
+void report(const char *message, long count, double text_seconds, double binary_seconds, size_t text_bytes, size_t binary_bytes);
+
+int main(int argc, char **argv)
+{
+    long count = (argc > 1) ? atol(argv[1]) : 2000000;
+    struct timespec start;
+    long checksum = 0; // Keeps the compiler from discarding the work
+    char text[64];
+    char status_text[8], first_text[4], second_text[4];
+    size_t text_bytes = 0;
+
+    printf("%8s %16s %16s %12s %12s\n", "message", "text msgs/s", "binary msgs/s", "text bytes", "binary bytes");
+
+    // STATUS {status} {current floor} {destination floor}
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < count; i++)
+    {
+        char current[FLOOR_STRING_SIZE], destination[FLOOR_STRING_SIZE];
+        format_floor((floor_t)(1 + i % 500), current);
+        format_floor((floor_t)(1 + i % 700), destination);
+        text_bytes = snprintf(text, sizeof(text), "STATUS %s %s %s", format_status((car_status)(i % 5)), current, destination);
+        if (sscanf(text, "STATUS %7s %3s %3s", status_text, first_text, second_text) == 3)
+        {
+            checksum += parse_status(status_text) + parse_floor(first_text) + parse_floor(second_text);
+        }
+    }
+    double text_seconds = seconds_since(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < count; i++)
+    {
+        proto_status frame;
+        car_status status;
+        floor_t current, destination;
+        size_t len = proto_encode_status(&frame, (car_status)(i % 5), (floor_t)(1 + i % 500), (floor_t)(1 + i % 700));
+        if (proto_decode_status(&frame, len, &status, &current, &destination))
+        {
+            checksum += status + current + destination;
+        }
+    }
+    report("STATUS", count, text_seconds, seconds_since(&start), text_bytes, sizeof(proto_status));
+
+    // CALL {source floor} {destination floor}
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < count; i++)
+    {
+        char source[FLOOR_STRING_SIZE], destination[FLOOR_STRING_SIZE];
+        format_floor((floor_t)(1 + i % 500), source);
+        format_floor((floor_t)(1 + i % 700), destination);
+        text_bytes = snprintf(text, sizeof(text), "CALL %s %s", source, destination);
+        if (sscanf(text, "CALL %3s %3s", first_text, second_text) == 2)
+        {
+            checksum += parse_floor(first_text) + parse_floor(second_text);
+        }
+    }
+    text_seconds = seconds_since(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < count; i++)
+    {
+        proto_call frame;
+        floor_t source, destination;
+        size_t len = proto_encode_call(&frame, (floor_t)(1 + i % 500), (floor_t)(1 + i % 700));
+        if (proto_decode_call(&frame, len, &source, &destination))
+        {
+            checksum += source + destination;
+        }
+    }
+    report("CALL", count, text_seconds, seconds_since(&start), text_bytes, sizeof(proto_call));
+
+    // FLOOR {floor}
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < count; i++)
+    {
+        char floor_text[FLOOR_STRING_SIZE];
+        format_floor((floor_t)(1 + i % 500), floor_text);
+        text_bytes = snprintf(text, sizeof(text), "FLOOR %s", floor_text);
+        if (sscanf(text, "FLOOR %3s", first_text) == 1)
+        {
+            checksum += parse_floor(first_text);
+        }
+    }
+    text_seconds = seconds_since(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < count; i++)
+    {
+        proto_floor frame;
+        floor_t floor;
+        size_t len = proto_encode_floor(&frame, (floor_t)(1 + i % 500));
+        if (proto_decode_floor(&frame, len, &floor))
+        {
+            checksum += floor;
+        }
+    }
+    report("FLOOR", count, text_seconds, seconds_since(&start), text_bytes, sizeof(proto_floor));
+
+    printf("(checksum %ld)\n", checksum);
+    return 0;
+}
+
+void report(const char *message, long count, double text_seconds, double binary_seconds, size_t text_bytes, size_t binary_bytes)
+{
+    printf("%8s %16.0f %16.0f %12zu %12zu\n", message, count / text_seconds, count / binary_seconds, text_bytes, binary_bytes);
+}
+
+double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
@@ -0,0 +1,173 @@
+// bench_connections - measures controller memory and CPU against the number of connected cars.
+//
+// Start the controller first, then run:
+//   ./bench/bench_connections {controller pid} [max cars]
+// The benchmark registers fake cars in steps (10, 100, 1000, ...) and after each step samples the
+// controller's resident set size and CPU usage from /proc over a one second idle window.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "../network_utils.h"
+
+#define SAMPLE_WINDOW_MS 1000
+
+long read_rss_kb(int pid);
+long read_cpu_ticks(int pid);
+double elapsed_ms(const struct timespec *start, const struct timespec *end);
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3)
+    {
+        printf("Usage: {controller pid} [max cars]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int pid = atoi(argv[1]);
+    int max_cars = (argc == 3) ? atoi(argv[2]) : 1000;
+
+    // Leave room for the requested number of sockets.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)max_cars + 64)
+    {
+        limit.rlim_cur = (limit.rlim_max < (rlim_t)max_cars + 64) ? limit.rlim_max : (rlim_t)max_cars + 64;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    int *fds = malloc(sizeof(int) * max_cars);
+    if (fds == NULL)
+    {
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    long ticks_per_second = sysconf(_SC_CLK_TCK);
+    int connected = 0;
+
+    printf("%10s %12s %12s %10s\n", "cars", "rss_kb", "kb_per_car", "cpu_pct");
+
+    for (int step = 10; step <= max_cars; step *= 10)
+    {
+        while (connected < step)
+        {
+            char msg[128];
+            fds[connected] = establish_connection();
+
+            snprintf(msg, sizeof(msg), "CAR bench%d 1 999", connected);
+            send_message(fds[connected], msg);
+            send_message(fds[connected], "STATUS Closed 1 1");
+            connected++;
+        }
+
+        // Let the controller settle, then sample over an idle window.
+        usleep(200 * 1000);
+
+        struct timespec start, end;
+        long start_ticks = read_cpu_ticks(pid);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        usleep(SAMPLE_WINDOW_MS * 1000);
+        long end_ticks = read_cpu_ticks(pid);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (start_ticks < 0 || end_ticks < 0)
+        {
+            printf("Unable to read /proc/%d.\n", pid);
+            exit(EXIT_FAILURE);
+        }
+
+        double cpu_seconds = (double)(end_ticks - start_ticks) / ticks_per_second;
+        double cpu_pct = 100.0 * cpu_seconds / (elapsed_ms(&start, &end) / 1000.0);
+        long rss = read_rss_kb(pid);
+
+        printf("%10d %12ld %12.1f %10.1f\n", connected, rss, (double)rss / connected, cpu_pct);
+
+        if (step == max_cars)
+        {
+            break;
+        }
+        if (step * 10 > max_cars)
+        {
+            step = max_cars / 10;
+        }
+    }
+
+    for (int i = 0; i < connected; i++)
+    {
+        close(fds[i]);
+    }
+    free(fds);
+
+    return 0;
+}
+
+// Function: reads the resident set size of a process.
+// Returns: the RSS in kilobytes, or -1 if it could not be read.
+long read_rss_kb(int pid)
+{
+    char path[64];
+    char line[256];
+    long rss = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (sscanf(line, "VmRSS: %ld", &rss) == 1)
+        {
+            break;
+        }
+    }
+
+    fclose(fp);
+    return rss;
+}
+
+// Function: reads the user plus system CPU time consumed by a process.
+// Returns: the CPU time in clock ticks, or -1 if it could not be read.
+long read_cpu_ticks(int pid)
+{
+    char path[64];
+    char buf[1024];
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+
+    size_t len = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[len] = '\0';
+
+    // The command name may contain spaces, so start after its closing parenthesis.
+    char *fields = strrchr(buf, ')');
+    if (fields == NULL)
+    {
+        return -1;
+    }
+
+    unsigned long utime, stime;
+    if (sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    {
+        return -1;
+    }
+
+    return (long)(utime + stime);
+}
+
+// Function: computes the time between two timestamps.
+// Returns: the difference in milliseconds.
+double elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
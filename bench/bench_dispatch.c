@@ -0,0 +1,263 @@
+// bench_dispatch - throughput of choose_car and add_call_request with integer floors, against the
+// original string-floor implementations (reproduced below as legacy_*) for comparison. First checks
+// that a same-floor call queues no stops.
+//
+//   ./bench/bench_dispatch [cars] [stops per car]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../dispatch.h"
+
+#define CHOOSE_ITERATIONS 200000
+#define QUEUE_ROUNDS 20
+
+// The pre-integer representation: floors as text, compared with atoi on every call.
+typedef struct legacy_car
+{
+    char lowest_floor[4];
+    char highest_floor[5];
+    struct legacy_car *next;
+} legacy_car;
+
+typedef struct legacy_call
+{
+    char direction;
+    char floor[4];
+    int assigned_car_fd;
+    struct legacy_call *next;
+} legacy_call;
+
+legacy_call *legacy_call_list_head = NULL;
+car_list bench_cars;
+
+char legacy_get_call_direction(const char *source, const char *destination);
+int legacy_is_car_available(const char *source_floor, const char *destination_floor, legacy_car *car);
+legacy_car *legacy_choose_car(legacy_car *head, const char *source_floor, const char *destination_floor);
+void legacy_add_call_request(char direction, const char *floor, int car_fd);
+int legacy_pop_first_stop(int car_fd);
+double seconds_since(const struct timespec *start);
+
+int main(int argc, char **argv)
+{
+    int car_count = (argc > 1) ? atoi(argv[1]) : 100;
+    int stops_per_car = (argc > 2) ? atoi(argv[2]) : 200;
+    car_list_init(&bench_cars);
+
+    // Compare like with like: the legacy code is first-fit.
+    set_dispatch_strategy("first-fit");
+
+    // Each car serves a band of 10 floors, so a first-fit scan has to walk part of the list.
+    legacy_car *legacy_head = NULL;
+    for (int i = 0; i < car_count; i++)
+    {
+        car_information info;
+        memset(&info, 0, sizeof(info));
+        snprintf(info.name, sizeof(info.name), "bench%d", i);
+        info.car_fd = i;
+        info.lowest_floor = (floor_t)(1 + (i * 10) % 990);
+        info.highest_floor = info.lowest_floor + 9;
+        add_car_to_list(&bench_cars, info, NULL);
+
+        legacy_car *car = malloc(sizeof(legacy_car));
+        format_floor(info.lowest_floor, car->lowest_floor);
+        format_floor(info.highest_floor, car->highest_floor);
+        car->next = legacy_head;
+        legacy_head = car;
+    }
+
+    // A call to the floor it is made from queues nothing, so it cannot leave a dropoff waiting forever.
+    update_call_queue(5, 5, bench_cars.head);
+    if (stop_queue_length(&bench_cars.head->stops) != 0)
+    {
+        fprintf(stderr, "A same-floor call left %d stops queued\n", stop_queue_length(&bench_cars.head->stops));
+        exit(EXIT_FAILURE);
+    }
+
+    floor_t *sources = malloc(sizeof(floor_t) * CHOOSE_ITERATIONS);
+    floor_t *destinations = malloc(sizeof(floor_t) * CHOOSE_ITERATIONS);
+    char (*source_text)[4] = malloc(4 * CHOOSE_ITERATIONS);
+    char (*destination_text)[4] = malloc(4 * CHOOSE_ITERATIONS);
+    int bands = (car_count < 99) ? car_count : 99;
+    srand(1);
+    for (int i = 0; i < CHOOSE_ITERATIONS; i++)
+    {
+        floor_t base = (floor_t)(1 + (rand() % bands) * 10);
+        sources[i] = base + rand() % 10;
+        destinations[i] = base + rand() % 10;
+        format_floor(sources[i], source_text[i]);
+        format_floor(destinations[i], destination_text[i]);
+    }
+
+    struct timespec start;
+    long found = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < CHOOSE_ITERATIONS; i++)
+    {
+        found += legacy_choose_car(legacy_head, source_text[i], destination_text[i]) != NULL;
+    }
+    double legacy_choose = seconds_since(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < CHOOSE_ITERATIONS; i++)
+    {
+        found += choose_car(&bench_cars, sources[i], destinations[i], NULL) != NULL;
+    }
+    double int_choose = seconds_since(&start);
+
+    // Queue a burst of stops for every car, then drain them.
+    long queue_ops = (long)QUEUE_ROUNDS * car_count * stops_per_car * 2;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int round = 0; round < QUEUE_ROUNDS; round++)
+    {
+        for (int i = 0; i < car_count * stops_per_car; i++)
+        {
+            legacy_add_call_request((i & 1) ? 'D' : 'U', source_text[i % CHOOSE_ITERATIONS], i % car_count);
+        }
+        for (int i = 0; i < car_count * stops_per_car; i++)
+        {
+            legacy_pop_first_stop(i % car_count);
+        }
+    }
+    double legacy_queue = seconds_since(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int round = 0; round < QUEUE_ROUNDS; round++)
+    {
+        CarNode *car = bench_cars.head;
+        for (int c = 0; c < car_count; c++, car = car->next)
+        {
+            for (int i = 0; i < stops_per_car; i++)
+            {
+                call_requests call = {(i & 1) ? 'D' : 'U', sources[(c * stops_per_car + i) % CHOOSE_ITERATIONS]};
+                add_call_request(car, call);
+            }
+        }
+        car = bench_cars.head;
+        for (int c = 0; c < car_count; c++, car = car->next)
+        {
+            floor_t floor;
+            while (get_and_pop_first_stop(car, &floor))
+            {
+            }
+        }
+    }
+    double int_queue = seconds_since(&start);
+
+    printf("cars=%d stops_per_car=%d (matches=%ld)\n", car_count, stops_per_car, found);
+    printf("%-28s %14s %14s\n", "", "string floors", "int floors");
+    printf("%-28s %14.0f %14.0f\n", "choose_car calls/s", CHOOSE_ITERATIONS / legacy_choose, CHOOSE_ITERATIONS / int_choose);
+    printf("%-28s %14.0f %14.0f\n", "add+pop stop ops/s", queue_ops / legacy_queue, queue_ops / int_queue);
+
+    return 0;
+}
+
+char legacy_get_call_direction(const char *source, const char *destination)
+{
+    int source_int = (source[0] == 'B') ? -atoi(source + 1) : atoi(source);
+    int destination_int = (destination[0] == 'B') ? -atoi(destination + 1) : atoi(destination);
+
+    if (source_int < destination_int)
+        return 'U';
+    if (source_int > destination_int)
+        return 'D';
+    return 'S';
+}
+
+int legacy_is_car_available(const char *source_floor, const char *destination_floor, legacy_car *car)
+{
+    if ((legacy_get_call_direction(car->highest_floor, source_floor) == 'U') ||
+        (legacy_get_call_direction(car->highest_floor, destination_floor) == 'U'))
+    {
+        return 0;
+    }
+    if ((legacy_get_call_direction(car->lowest_floor, source_floor) == 'D') ||
+        (legacy_get_call_direction(car->lowest_floor, destination_floor) == 'D'))
+    {
+        return 0;
+    }
+    return 1;
+}
+
+legacy_car *legacy_choose_car(legacy_car *head, const char *source_floor, const char *destination_floor)
+{
+    for (legacy_car *current = head; current != NULL; current = current->next)
+    {
+        if (legacy_is_car_available(source_floor, destination_floor, current))
+        {
+            return current;
+        }
+    }
+    return NULL;
+}
+
+// The original single global list: U stops kept ascending, D stops descending, one atoi pair per node.
+void legacy_add_call_request(char direction, const char *floor, int car_fd)
+{
+    legacy_call *new_node = malloc(sizeof(legacy_call));
+    new_node->direction = direction;
+    strcpy(new_node->floor, floor);
+    new_node->assigned_car_fd = car_fd;
+    new_node->next = NULL;
+
+    legacy_call *current = legacy_call_list_head;
+    legacy_call *previous = NULL;
+    char passed = (direction == 'U') ? 'D' : 'U';
+
+    while (current != NULL)
+    {
+        if (current->direction == passed ||
+            (current->direction == direction && legacy_get_call_direction(current->floor, floor) == passed))
+        {
+            break;
+        }
+        previous = current;
+        current = current->next;
+    }
+
+    new_node->next = current;
+    if (previous == NULL)
+    {
+        legacy_call_list_head = new_node;
+    }
+    else
+    {
+        previous->next = new_node;
+    }
+}
+
+int legacy_pop_first_stop(int car_fd)
+{
+    legacy_call *current = legacy_call_list_head;
+    legacy_call *previous = NULL;
+
+    while (current != NULL)
+    {
+        if (current->assigned_car_fd == car_fd)
+        {
+            if (previous == NULL)
+            {
+                legacy_call_list_head = current->next;
+            }
+            else
+            {
+                previous->next = current->next;
+            }
+            free(current);
+            return 1;
+        }
+        previous = current;
+        current = current->next;
+    }
+    return 0;
+}
+
+double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
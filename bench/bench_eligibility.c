@@ -0,0 +1,121 @@
+// bench_eligibility - eligibility lookups per second with the floor bitmap index, against a walk of
+// the car list calling is_car_available on every car.
+//
+//   ./bench/bench_eligibility [car counts...]     (default: 10 1000 10000)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../dispatch.h"
+
+#define LOOKUPS 20000
+
+car_list bench_cars;
+
+double seconds_since(const struct timespec *start);
+void run_case(int car_count);
+
+int main(int argc, char **argv)
+{
+    car_list_init(&bench_cars);
+    printf("%10s %16s %16s %10s\n", "cars", "list lookups/s", "index lookups/s", "eligible");
+
+    if (argc > 1)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            run_case(atoi(argv[i]));
+        }
+    }
+    else
+    {
+        run_case(10);
+        run_case(1000);
+        run_case(10000);
+    }
+    return 0;
+}
+
+// Function: registers car_count cars with random floor ranges, then times both lookup methods over
+// the same random calls.
+void run_case(int car_count)
+{
+    srand(42);
+    for (int i = 0; i < car_count; i++)
+    {
+        car_information info;
+        memset(&info, 0, sizeof(info));
+        snprintf(info.name, sizeof(info.name), "bench%d", i);
+        info.car_fd = i;
+
+        // Towers of various heights, some with basements
+        floor_t a = (floor_t)(FLOOR_LOWEST + rand() % FLOOR_COUNT);
+        floor_t b = (floor_t)(FLOOR_LOWEST + rand() % FLOOR_COUNT);
+        info.lowest_floor = (a < b) ? a : b;
+        info.highest_floor = (a < b) ? b : a;
+        if (info.lowest_floor == 0)
+        {
+            info.lowest_floor = 1;
+        }
+        if (info.highest_floor == 0)
+        {
+            info.highest_floor = 1;
+        }
+        add_car_to_list(&bench_cars, info, NULL);
+    }
+
+    floor_t sources[LOOKUPS], destinations[LOOKUPS];
+    for (int i = 0; i < LOOKUPS; i++)
+    {
+        sources[i] = (floor_t)(1 + rand() % FLOOR_HIGHEST);
+        destinations[i] = (floor_t)(1 + rand() % FLOOR_HIGHEST);
+    }
+
+    struct timespec start;
+    long list_matches = 0;
+    long index_matches = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < LOOKUPS; i++)
+    {
+        for (CarNode *car = bench_cars.head; car != NULL; car = car->next)
+        {
+            list_matches += is_car_available(sources[i], destinations[i], car);
+        }
+    }
+    double list_seconds = seconds_since(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < LOOKUPS; i++)
+    {
+        size_t word_count;
+        const uint64_t *eligible = car_index_match(&bench_cars.eligibility, sources[i], destinations[i], &word_count);
+        for (size_t word = 0; word < word_count; word++)
+        {
+            index_matches += __builtin_popcountll(eligible[word]);
+        }
+    }
+    double index_seconds = seconds_since(&start);
+
+    if (list_matches != index_matches)
+    {
+        printf("Mismatch: list found %ld, index found %ld\n", list_matches, index_matches);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%10d %16.0f %16.0f %10.1f\n", car_count, LOOKUPS / list_seconds, LOOKUPS / index_seconds,
+           (double)index_matches / LOOKUPS);
+
+    while (bench_cars.head != NULL)
+    {
+        remove_car_from_list(&bench_cars, bench_cars.head->car_info.car_fd);
+    }
+}
+
+double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
@@ -0,0 +1,189 @@
+// bench_frames - frames per second received over a loopback TCP socket, with receive_msg (two
+// blocking read loops and a malloc per frame) against a frame_reader (one read per buffer fill,
+// frames handed out in place).
+//
+//   ./bench/bench_frames [frames] [body bytes]     (default: 1000000 frames of 22 bytes, a STATUS)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "../network_utils.h"
+
+#define FRAMES_PER_WRITE 512
+
+typedef struct
+{
+    int fd;
+    long frames;
+    uint32_t body_length;
+} writer_args;
+
+double seconds_since(const struct timespec *start);
+void *write_frames(void *arg);
+void connect_pair(int *reader_fd, int *writer_fd);
+double run_receive_msg(long frames, uint32_t body_length);
+double run_frame_reader(long frames, uint32_t body_length, long *fills);
+
+int main(int argc, char **argv)
+{
+    long frames = (argc > 1) ? atol(argv[1]) : 1000000;
+    uint32_t body_length = (argc > 2) ? (uint32_t)atol(argv[2]) : 22;
+
+    if (frames <= 0 || body_length == 0 || body_length > DEFAULT_MAX_FRAME_SIZE)
+    {
+        printf("Usage: bench_frames [frames] [body bytes, 1-%d]\n", DEFAULT_MAX_FRAME_SIZE);
+        exit(EXIT_FAILURE);
+    }
+
+    long fills;
+    double legacy_seconds = run_receive_msg(frames, body_length);
+    double reader_seconds = run_frame_reader(frames, body_length, &fills);
+
+    printf("%14s %14s %14s\n", "reader", "frames/s", "reads/frame");
+    printf("%14s %14.0f %14s\n", "receive_msg", frames / legacy_seconds, ">= 2");
+    printf("%14s %14.0f %14.3f\n", "frame_reader", frames / reader_seconds, (double)fills / frames);
+    return 0;
+}
+
+// Function: times receive_msg over a fresh loopback connection.
+double run_receive_msg(long frames, uint32_t body_length)
+{
+    int reader_fd, writer_fd;
+    connect_pair(&reader_fd, &writer_fd);
+
+    pthread_t writer;
+    writer_args args = {writer_fd, frames, body_length};
+    pthread_create(&writer, NULL, write_frames, &args);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < frames; i++)
+    {
+        free(receive_msg(reader_fd));
+    }
+    double seconds = seconds_since(&start);
+
+    pthread_join(writer, NULL);
+    close(reader_fd);
+    close(writer_fd);
+    return seconds;
+}
+
+// Function: times a frame_reader over a fresh loopback connection, counting its reads.
+double run_frame_reader(long frames, uint32_t body_length, long *fills)
+{
+    int reader_fd, writer_fd;
+    connect_pair(&reader_fd, &writer_fd);
+
+    pthread_t writer;
+    writer_args args = {writer_fd, frames, body_length};
+    pthread_create(&writer, NULL, write_frames, &args);
+
+    frame_reader reader;
+    if (frame_reader_init(&reader, DEFAULT_MAX_FRAME_SIZE) == -1)
+    {
+        perror("frame_reader_init()");
+        exit(EXIT_FAILURE);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long received = 0;
+    *fills = 0;
+    while (received < frames)
+    {
+        char *frame;
+        uint32_t len;
+        while (received < frames && frame_reader_next(&reader, &frame, &len) == 1)
+        {
+            received++;
+        }
+        if (received < frames)
+        {
+            if (frame_reader_fill(&reader, reader_fd) <= 0)
+            {
+                perror("frame_reader_fill()");
+                exit(EXIT_FAILURE);
+            }
+            (*fills)++;
+        }
+    }
+    double seconds = seconds_since(&start);
+
+    frame_reader_destroy(&reader);
+    pthread_join(writer, NULL);
+    close(reader_fd);
+    close(writer_fd);
+    return seconds;
+}
+
+// Function: writer thread; sends the frames in batches so the sender is not the bottleneck.
+void *write_frames(void *arg)
+{
+    writer_args *args = arg;
+    size_t frame_size = FRAME_HEADER_SIZE + args->body_length;
+    char *batch = malloc(frame_size * FRAMES_PER_WRITE);
+    uint32_t nlen = htonl(args->body_length);
+
+    for (int i = 0; i < FRAMES_PER_WRITE; i++)
+    {
+        memcpy(batch + i * frame_size, &nlen, sizeof(nlen));
+        memset(batch + i * frame_size + FRAME_HEADER_SIZE, 'x', args->body_length);
+    }
+
+    for (long sent = 0; sent < args->frames; sent += FRAMES_PER_WRITE)
+    {
+        long count = (args->frames - sent < FRAMES_PER_WRITE) ? args->frames - sent : FRAMES_PER_WRITE;
+        send_looped(args->fd, batch, frame_size * count);
+    }
+
+    free(batch);
+    return NULL;
+}
+
+// Function: creates a connected pair of TCP sockets on 127.0.0.1, using an ephemeral port.
+void connect_pair(int *reader_fd, int *writer_fd)
+{
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t addr_length = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, 1) == -1 || getsockname(listen_fd, (struct sockaddr *)&addr, &addr_length) == -1)
+    {
+        perror("loopback listen");
+        exit(EXIT_FAILURE);
+    }
+
+    *writer_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (*writer_fd == -1 || connect(*writer_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        perror("loopback connect");
+        exit(EXIT_FAILURE);
+    }
+
+    *reader_fd = accept(listen_fd, NULL, NULL);
+    if (*reader_fd == -1)
+    {
+        perror("accept()");
+        exit(EXIT_FAILURE);
+    }
+    close(listen_fd);
+}
+
+double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
@@ -0,0 +1,253 @@
+// bench_journal - cost of journaling calls (journal.h): call assignment throughput with no journal,
+// with one commit per batch of calls (as the controller's event loops commit), and with a commit
+// after every call; then the time a restarted controller takes to replay the journal. First checks
+// that calls journaled as the file fills, registering a car or assigning a call, survive the checkpoint.
+//
+//   ./bench/bench_journal [directory, default /tmp] [calls] [cars]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../journal.h"
+
+#define BATCH_CALLS 64 // Calls answered per commit in the batched run, like one full epoll batch
+
+car_list bench_cars;
+
+double seconds_since(const struct timespec *start);
+void reset_cars(CarNode **cars, int car_count);
+void check_checkpoint(const char *directory);
+int recovered_length(call_journal *journal, const char *name);
+double run_calls(call_journal *journal, CarNode **cars, int car_count, int calls, int batch);
+
+int main(int argc, char **argv)
+{
+    const char *directory = (argc > 1) ? argv[1] : "/tmp";
+    int calls = (argc > 2) ? atoi(argv[2]) : 200000;
+    int car_count = (argc > 3) ? atoi(argv[3]) : 32;
+    if (calls < 1 || car_count < 1)
+    {
+        printf("Usage: bench_journal [directory] [calls] [cars]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    car_list_init(&bench_cars);
+    CarNode **cars = malloc(car_count * sizeof(CarNode *));
+    for (int i = 0; i < car_count; i++)
+    {
+        car_information info;
+        memset(&info, 0, sizeof(info));
+        snprintf(info.name, sizeof(info.name), "bench%d", i);
+        info.car_fd = i;
+        info.lowest_floor = 1;
+        info.highest_floor = 100;
+        cars[i] = add_car_to_list(&bench_cars, info, NULL);
+    }
+
+    check_checkpoint(directory);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench_journal-%d.journal", directory, (int)getpid());
+    printf("%d calls over %d cars, journal %s\n\n", calls, car_count, path);
+    printf("%-28s %12s %12s\n", "run", "calls/s", "us/call");
+
+    double elapsed = run_calls(NULL, cars, car_count, calls, 0);
+    printf("%-28s %12.0f %12.3f\n", "no journal", calls / elapsed, elapsed * 1e6 / calls);
+
+    // Commit per call does a full msync each time, so it gets fewer calls to stay quick.
+    int per_call_calls = (calls < 2000) ? calls : 2000;
+    call_journal journal;
+    unlink(path);
+    if (journal_open(&journal, path, JOURNAL_DEFAULT_SIZE) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+    reset_cars(cars, car_count);
+    elapsed = run_calls(&journal, cars, car_count, per_call_calls, 1);
+    printf("%-28s %12.0f %12.3f\n", "commit every call", per_call_calls / elapsed, elapsed * 1e6 / per_call_calls);
+    journal_close(&journal);
+
+    unlink(path);
+    if (journal_open(&journal, path, JOURNAL_DEFAULT_SIZE) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+    reset_cars(cars, car_count);
+    elapsed = run_calls(&journal, cars, car_count, calls, BATCH_CALLS);
+    char label[64];
+    snprintf(label, sizeof(label), "commit every %d calls", BATCH_CALLS);
+    printf("%-28s %12.0f %12.3f\n", label, calls / elapsed, elapsed * 1e6 / calls);
+    journal_close(&journal);
+
+    // The last run left every call's ASSIGN and half its stops popped: what a crash would leave.
+    printf("\nrecovery:\n");
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    call_journal recovered;
+    if (journal_open(&recovered, path, JOURNAL_DEFAULT_SIZE) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+    elapsed = seconds_since(&start);
+    printf("%-28s %12.3f ms\n", "replay and checkpoint", elapsed * 1e3);
+    journal_close(&recovered);
+    unlink(path);
+
+    free(cars);
+    return 0;
+}
+
+// Function: empties the cars' stop queues and forgets their journal ids, for a run with a new journal.
+void reset_cars(CarNode **cars, int car_count)
+{
+    for (int i = 0; i < car_count; i++)
+    {
+        floor_t floor;
+        while (get_and_pop_first_stop(cars[i], &floor))
+        {
+        }
+        cars[i]->journal_id = -1;
+    }
+}
+
+// Function: fills a small journal to just short of a checkpoint with calls for car A, registers car
+// B and assigns a call to each, then reopens the journal and compares the queues it recovered with
+// the live ones. Each run stops a slot earlier than the last, so that the checkpoint comes with B's
+// name or with either call. Exits if any recovered queue differs.
+void check_checkpoint(const char *directory)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench_journal-check-%d.journal", directory, (int)getpid());
+    size_t size = 4096;
+    int slots = (int)((size - JOURNAL_HEADER_SIZE) / sizeof(journal_record));
+
+    for (int fill = slots - 16; fill <= slots; fill++)
+    {
+        car_list cars;
+        car_list_init(&cars);
+        CarNode *car[2];
+        for (int i = 0; i < 2; i++)
+        {
+            car_information info;
+            memset(&info, 0, sizeof(info));
+            snprintf(info.name, sizeof(info.name), "%c", 'A' + i);
+            info.car_fd = i;
+            info.lowest_floor = 1;
+            info.highest_floor = 100;
+            car[i] = add_car_to_list(&cars, info, NULL);
+        }
+
+        call_journal journal;
+        unlink(path);
+        if (journal_open(&journal, path, size) == -1)
+        {
+            exit(EXIT_FAILURE);
+        }
+        journal_register(&journal, car[0]);
+        for (int i = 0; journal.written - journal.base < (uint64_t)fill; i++)
+        {
+            journal_assign(&journal, car[0], (floor_t)(1 + i % 50), (floor_t)(51 + i % 50));
+        }
+        journal_register(&journal, car[1]);
+        journal_assign(&journal, car[1], 10, 20);
+        uint64_t position = journal_assign(&journal, car[0], 30, 5);
+        journal_commit(&journal, position);
+        journal_close(&journal);
+
+        call_journal recovered;
+        if (journal_open(&recovered, path, size) == -1)
+        {
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            int live = stop_queue_length(&car[i]->stops);
+            int replayed = recovered_length(&recovered, car[i]->car_info.name);
+            if (replayed != live)
+            {
+                fprintf(stderr, "Checkpoint after %d slots: car %s recovered %d stops, had %d\n", fill,
+                        car[i]->car_info.name, replayed, live);
+                exit(EXIT_FAILURE);
+            }
+        }
+        journal_close(&recovered);
+
+        remove_car_from_list(&cars, 0);
+        remove_car_from_list(&cars, 1);
+    }
+    unlink(path);
+    printf("calls journaled across a checkpoint recovered\n\n");
+}
+
+// Function: the number of stops a journal holds for a car name, or -1 if it has none.
+int recovered_length(call_journal *journal, const char *name)
+{
+    for (int id = 0; id < journal->car_count; id++)
+    {
+        if (strcmp(journal->cars[id]->name, name) == 0)
+        {
+            return stop_queue_length(&journal->cars[id]->stops);
+        }
+    }
+    return -1;
+}
+
+// Function: assigns calls round-robin to the cars, popping one stop per call as dispatching would.
+// Arguments:
+// - journal: the journal, or NULL for none.
+// - cars, car_count: the cars.
+// - calls: how many calls to assign.
+// - batch: calls per commit.
+// Returns: the seconds taken.
+double run_calls(call_journal *journal, CarNode **cars, int car_count, int calls, int batch)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint64_t position = 0;
+    for (int i = 0; i < calls; i++)
+    {
+        CarNode *car = cars[i % car_count];
+        floor_t source = (floor_t)(1 + (i * 7) % 100);
+        floor_t destination = (floor_t)(1 + (i * 13 + 50) % 100);
+        if (destination == source)
+        {
+            destination = (source == 100) ? 1 : source + 1;
+        }
+
+        // The car reaches each stop before it takes the next, as it would from dispatch_car.
+        floor_t floor;
+        if (journal == NULL)
+        {
+            update_call_queue(source, destination, car);
+            if (get_and_pop_first_stop(car, &floor))
+            {
+                car->car_info.current_floor = car->car_info.destination_floor = floor;
+            }
+            continue;
+        }
+        position = journal_assign(journal, car, source, destination);
+        if (journal_pop_stop(journal, car, &floor))
+        {
+            car->car_info.current_floor = car->car_info.destination_floor = floor;
+        }
+        if ((i + 1) % batch == 0)
+        {
+            journal_commit(journal, position);
+        }
+    }
+    if (journal != NULL)
+    {
+        journal_commit(journal, position);
+    }
+    return seconds_since(&start);
+}
+
+double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
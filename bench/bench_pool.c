@@ -0,0 +1,200 @@
+// bench_pool - allocations made on the controller's call path: each call is dispatched with
+// choose_car and update_call_queue, and its stops are popped again with get_and_pop_first_stop, by
+// several threads at once so that stops queued on one thread are freed on another, as they are when
+// one event loop takes a CALL and another serves the car's STATUS. Runs once with every pool calling
+// malloc and free, and once with the pools, and counts the mallocs made in each after a warmup.
+//
+// Linked with -Wl,--wrap=malloc, so every malloc in the program goes through __wrap_malloc below.
+//
+//   ./bench/bench_pool [threads] [cars] [calls per thread]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "../dispatch.h"
+#include "../pool.h"
+
+#define FLOORS 200
+#define WARMUP_CALLS 20000
+#define QUEUE_DEPTH 8 // Stops left queued for each car, so that dispatch costs stay small beside allocation
+
+typedef struct
+{
+    int thread;
+    int thread_count;
+    int calls;
+    car_list *list;
+    CarNode **cars; // Every car; this thread pops the stops of every thread_count'th one
+    int car_count;
+    unsigned int random_state;
+} worker;
+
+void *__real_malloc(size_t size);
+void *__wrap_malloc(size_t size);
+void run_pass(int use_malloc, int thread_count, int car_count, int calls);
+void *run_worker(void *arg);
+void make_calls(worker *w, int calls, int *next_car);
+void print_pools(void);
+double seconds_since(const struct timespec *start);
+
+static uint64_t malloc_count;
+static pthread_barrier_t warmed_up;
+static pthread_barrier_t measured;
+
+void *__wrap_malloc(size_t size)
+{
+    __atomic_add_fetch(&malloc_count, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+int main(int argc, char **argv)
+{
+    int thread_count = (argc > 1) ? atoi(argv[1]) : 2;
+    int car_count = (argc > 2) ? atoi(argv[2]) : 16;
+    int calls = (argc > 3) ? atoi(argv[3]) : 500000;
+    if (thread_count < 1 || car_count < thread_count || calls < 1)
+    {
+        fprintf(stderr, "Usage: %s [threads] [cars, at least one per thread] [calls per thread]\n", argv[0]);
+        exit(1);
+    }
+
+    printf("threads=%d cars=%d calls=%d per thread, after %d to warm up\n", thread_count, car_count, calls, WARMUP_CALLS);
+    printf("%-8s %14s %16s\n", "", "calls/s", "mallocs/call");
+    run_pass(1, thread_count, car_count, calls);
+    run_pass(0, thread_count, car_count, calls);
+    print_pools();
+    return 0;
+}
+
+// Function: registers the cars, runs every worker through a warmup and then the measured calls, and
+// removes the cars again. Everything a pass allocates is freed by the end of it, so the next pass can
+// switch pool_use_malloc.
+void run_pass(int use_malloc, int thread_count, int car_count, int calls)
+{
+    pool_use_malloc = use_malloc;
+
+    car_list cars;
+    car_list_init(&cars);
+    CarNode **nodes = malloc(car_count * sizeof(CarNode *));
+    for (int i = 0; i < car_count; i++)
+    {
+        car_information info;
+        memset(&info, 0, sizeof(info));
+        snprintf(info.name, sizeof(info.name), "bench%d", i);
+        info.car_fd = i;
+        info.lowest_floor = 1;
+        info.highest_floor = FLOORS;
+        nodes[i] = add_car_to_list(&cars, info, NULL);
+    }
+
+    pthread_t *threads = malloc(thread_count * sizeof(pthread_t));
+    worker *workers = malloc(thread_count * sizeof(worker));
+    pthread_barrier_init(&warmed_up, NULL, thread_count + 1);
+    pthread_barrier_init(&measured, NULL, thread_count + 1);
+    for (int i = 0; i < thread_count; i++)
+    {
+        workers[i].thread = i;
+        workers[i].thread_count = thread_count;
+        workers[i].calls = calls;
+        workers[i].list = &cars;
+        workers[i].cars = nodes;
+        workers[i].car_count = car_count;
+        workers[i].random_state = 1 + i;
+        pthread_create(&threads[i], NULL, run_worker, &workers[i]);
+    }
+
+    struct timespec start;
+    pthread_barrier_wait(&warmed_up);
+    uint64_t mallocs_before = __atomic_load_n(&malloc_count, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_barrier_wait(&measured);
+    double elapsed = seconds_since(&start);
+    uint64_t mallocs = __atomic_load_n(&malloc_count, __ATOMIC_RELAXED) - mallocs_before;
+
+    for (int i = 0; i < thread_count; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < car_count; i++)
+    {
+        remove_car_from_list(&cars, i);
+    }
+    pthread_barrier_destroy(&warmed_up);
+    pthread_barrier_destroy(&measured);
+
+    long total = (long)thread_count * calls;
+    printf("%-8s %14.0f %16.4f\n", use_malloc ? "malloc" : "pools", total / elapsed, (double)mallocs / total);
+
+    free(workers);
+    free(threads);
+    free(nodes);
+}
+
+void *run_worker(void *arg)
+{
+    worker *w = arg;
+    int next_car = w->thread;
+
+    make_calls(w, WARMUP_CALLS, &next_car);
+    pthread_barrier_wait(&warmed_up);
+    make_calls(w, w->calls, &next_car);
+    pthread_barrier_wait(&measured);
+    return NULL;
+}
+
+// Function: dispatches calls between random floors, and after each serves the next of this thread's
+// cars, popping its stops down to QUEUE_DEPTH.
+void make_calls(worker *w, int calls, int *next_car)
+{
+    for (int i = 0; i < calls; i++)
+    {
+        floor_t source = (floor_t)(1 + rand_r(&w->random_state) % FLOORS);
+        floor_t destination = (floor_t)(1 + rand_r(&w->random_state) % FLOORS);
+        if (source != destination)
+        {
+            pthread_mutex_lock(&w->list->mutex);
+            CarNode *car = choose_car(w->list, source, destination, NULL);
+            if (car != NULL)
+            {
+                update_call_queue(source, destination, car);
+            }
+            pthread_mutex_unlock(&w->list->mutex);
+        }
+
+        CarNode *served = w->cars[*next_car];
+        floor_t floor;
+        while (stop_queue_length(&served->stops) > QUEUE_DEPTH && get_and_pop_first_stop(served, &floor))
+        {
+        }
+        *next_car += w->thread_count;
+        if (*next_car >= w->car_count)
+        {
+            *next_car = w->thread;
+        }
+    }
+}
+
+// Function: prints every pool's occupancy after both passes.
+void print_pools(void)
+{
+    object_pool *pools[POOL_MAX_POOLS];
+    int count = pool_list(pools, POOL_MAX_POOLS);
+    printf("\n%-16s %10s %10s %14s\n", "pool", "objects", "in use", "allocations");
+    for (int i = 0; i < count; i++)
+    {
+        pool_stats stats;
+        pool_read_stats(pools[i], &stats);
+        printf("%-16s %10llu %10llu %14llu\n", pools[i]->name, (unsigned long long)stats.capacity,
+               (unsigned long long)stats.in_use, (unsigned long long)stats.allocations);
+    }
+}
+
+double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
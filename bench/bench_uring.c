@@ -0,0 +1,474 @@
+// bench_uring - a controller-shaped server answering request frames on many loopback connections,
+// with the classic path (epoll, then read until EAGAIN and one send per connection per batch)
+// against io_uring (a multishot receive per connection into registered buffers, every send of a
+// batch submitted by the one io_uring_enter that waits for the next). Each request is a 22 byte
+// frame, as a STATUS, and each reply an 8 byte one, as a FLOOR. A client thread keeps a number of
+// requests in flight on every connection. Built with "make URING=1 bench".
+//
+//   ./bench/bench_uring [connections] [requests] [in flight per connection]
+//                       (default: 64 connections, 1000000 requests, 4 in flight)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "../network_utils.h"
+#include "../uring.h"
+
+#define REQUEST_BODY 22
+#define REPLY_BODY 8
+#define REQUEST_SIZE (FRAME_HEADER_SIZE + REQUEST_BODY)
+#define REPLY_SIZE (FRAME_HEADER_SIZE + REPLY_BODY)
+#define MAX_EVENTS 64
+#define URING_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+#define URING_BUFFER_COUNT 256
+#define URING_BUFFER_SIZE 4096
+
+typedef struct
+{
+    int *fds;
+    int count;
+    long requests;
+    int in_flight;
+} client_args;
+
+// One server-side connection's replies: collected in pending while a send goes out from sending.
+typedef struct
+{
+    int fd;
+    frame_reader reader;
+    char *pending;
+    size_t pending_len;
+    char *sending;
+    size_t sending_len;
+    size_t sending_offset;
+    int send_in_flight;
+} server_connection;
+
+char request_frame[REQUEST_SIZE];
+char reply_frame[REPLY_SIZE];
+
+double seconds_since(const struct timespec *start);
+void connect_pairs(int count, int *server_fds, int *client_fds);
+void *run_client(void *arg);
+server_connection *make_connections(int *server_fds, int count, int in_flight);
+void free_connections(server_connection *connections, int count);
+long take_requests(server_connection *conn);
+double run_classic(int count, long requests, int in_flight, long *syscalls);
+double run_uring(int count, long requests, int in_flight, long *syscalls);
+
+int main(int argc, char **argv)
+{
+    int count = (argc > 1) ? atoi(argv[1]) : 64;
+    long requests = (argc > 2) ? atol(argv[2]) : 1000000;
+    int in_flight = (argc > 3) ? atoi(argv[3]) : 4;
+    if (count < 1 || requests < (long)count * in_flight || in_flight < 1)
+    {
+        printf("Usage: bench_uring [connections] [requests, at least connections x in flight] [in flight per connection]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t nlen = htonl(REQUEST_BODY);
+    memcpy(request_frame, &nlen, sizeof(nlen));
+    memset(request_frame + FRAME_HEADER_SIZE, 'x', REQUEST_BODY);
+    nlen = htonl(REPLY_BODY);
+    memcpy(reply_frame, &nlen, sizeof(nlen));
+    memcpy(reply_frame + FRAME_HEADER_SIZE, "FLOOR 12", REPLY_BODY);
+
+    printf("%d connections, %ld requests, %d in flight per connection\n\n", count, requests, in_flight);
+    printf("%14s %14s %18s\n", "server", "requests/s", "syscalls/request");
+
+    long syscalls;
+    double seconds = run_classic(count, requests, in_flight, &syscalls);
+    printf("%14s %14.0f %18.3f\n", "epoll", requests / seconds, (double)syscalls / requests);
+
+    seconds = run_uring(count, requests, in_flight, &syscalls);
+    printf("%14s %14.0f %18.3f\n", "io_uring", requests / seconds, (double)syscalls / requests);
+    return 0;
+}
+
+// Function: serves the requests with epoll, read and send, as the controller does without -U.
+double run_classic(int count, long requests, int in_flight, long *syscalls)
+{
+    int *server_fds = malloc(count * sizeof(int));
+    int *client_fds = malloc(count * sizeof(int));
+    connect_pairs(count, server_fds, client_fds);
+    server_connection *connections = make_connections(server_fds, count, in_flight);
+
+    int epoll_fd = epoll_create1(0);
+    for (int i = 0; i < count; i++)
+    {
+        fcntl(server_fds[i], F_SETFL, O_NONBLOCK);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &connections[i];
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fds[i], &ev);
+    }
+
+    pthread_t client;
+    client_args args = {client_fds, count, requests, in_flight};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_create(&client, NULL, run_client, &args);
+
+    long served = 0;
+    *syscalls = 0;
+    struct epoll_event events[MAX_EVENTS];
+    while (served < requests)
+    {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        (*syscalls)++;
+        for (int i = 0; i < ready; i++)
+        {
+            server_connection *conn = events[i].data.ptr;
+            ssize_t received;
+            do
+            {
+                received = frame_reader_fill(&conn->reader, conn->fd);
+                (*syscalls)++;
+                served += take_requests(conn);
+            } while (received > 0);
+
+            if (conn->pending_len > 0)
+            {
+                send_looped(conn->fd, conn->pending, conn->pending_len);
+                (*syscalls)++;
+                conn->pending_len = 0;
+            }
+        }
+    }
+    double seconds = seconds_since(&start);
+
+    pthread_join(client, NULL);
+    close(epoll_fd);
+    free_connections(connections, count);
+    for (int i = 0; i < count; i++)
+    {
+        close(client_fds[i]);
+    }
+    free(server_fds);
+    free(client_fds);
+    return seconds;
+}
+
+// Function: serves the requests from an io_uring, as the controller does with -U.
+double run_uring(int count, long requests, int in_flight, long *syscalls)
+{
+    int *server_fds = malloc(count * sizeof(int));
+    int *client_fds = malloc(count * sizeof(int));
+    connect_pairs(count, server_fds, client_fds);
+    server_connection *connections = make_connections(server_fds, count, in_flight);
+
+    uring ring;
+    uring_buffers buffers;
+    if (uring_init(&ring, URING_ENTRIES, URING_CQ_ENTRIES) == -1 ||
+        uring_buffers_init(&ring, &buffers, 0, URING_BUFFER_COUNT, URING_BUFFER_SIZE) == -1)
+    {
+        perror("io_uring setup");
+        exit(EXIT_FAILURE);
+    }
+    // user_data: the connection index times two, plus one for a send.
+    for (int i = 0; i < count; i++)
+    {
+        uring_prep_recv_multishot(uring_get_sqe(&ring), server_fds[i], &buffers, (uint64_t)i * 2);
+    }
+
+    pthread_t client;
+    client_args args = {client_fds, count, requests, in_flight};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_create(&client, NULL, run_client, &args);
+
+    long served = 0;
+    while (served < requests)
+    {
+        if (uring_enter(&ring, 1) == -1 && errno != EBUSY)
+        {
+            perror("io_uring_enter()");
+            exit(EXIT_FAILURE);
+        }
+
+        const struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(&ring)) != NULL)
+        {
+            server_connection *conn = &connections[cqe->user_data / 2];
+            if (cqe->res < 0 && cqe->res != -ENOBUFS)
+            {
+                errno = -cqe->res;
+                perror("io_uring request");
+                exit(EXIT_FAILURE);
+            }
+            if (cqe->user_data % 2 == 1)
+            {
+                conn->sending_offset += (size_t)cqe->res;
+                conn->send_in_flight = 0;
+            }
+            else
+            {
+                if (cqe->res > 0)
+                {
+                    const char *data = uring_buffer(&buffers, cqe);
+                    size_t remaining = (size_t)cqe->res;
+                    while (remaining > 0)
+                    {
+                        size_t taken = frame_reader_append(&conn->reader, data, remaining);
+                        data += taken;
+                        remaining -= taken;
+                        served += take_requests(conn);
+                    }
+                }
+                if (cqe->flags & IORING_CQE_F_BUFFER)
+                {
+                    uring_buffer_recycle(&buffers, cqe);
+                }
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                {
+                    uring_prep_recv_multishot(uring_get_sqe(&ring), conn->fd, &buffers, cqe->user_data);
+                }
+            }
+            uring_seen(&ring);
+        }
+
+        // One send per connection with replies waiting, all submitted by the next enter.
+        for (int i = 0; i < count; i++)
+        {
+            server_connection *conn = &connections[i];
+            if (conn->send_in_flight)
+            {
+                continue;
+            }
+            if (conn->sending_offset == conn->sending_len && conn->pending_len > 0)
+            {
+                char *swap = conn->sending;
+                conn->sending = conn->pending;
+                conn->sending_len = conn->pending_len;
+                conn->sending_offset = 0;
+                conn->pending = swap;
+                conn->pending_len = 0;
+            }
+            if (conn->sending_offset < conn->sending_len)
+            {
+                uring_prep_send(uring_get_sqe(&ring), conn->fd, conn->sending + conn->sending_offset,
+                                conn->sending_len - conn->sending_offset, (uint64_t)i * 2 + 1);
+                conn->send_in_flight = 1;
+            }
+        }
+    }
+    double seconds = seconds_since(&start);
+
+    // Flush the last replies, which the client is waiting for.
+    for (int i = 0; i < count; i++)
+    {
+        server_connection *conn = &connections[i];
+        while (conn->send_in_flight || conn->sending_offset < conn->sending_len || conn->pending_len > 0)
+        {
+            if (uring_enter(&ring, conn->send_in_flight ? 1 : 0) == -1)
+            {
+                perror("io_uring_enter()");
+                exit(EXIT_FAILURE);
+            }
+            const struct io_uring_cqe *cqe;
+            while ((cqe = uring_peek(&ring)) != NULL)
+            {
+                server_connection *done = &connections[cqe->user_data / 2];
+                if (cqe->user_data % 2 == 1)
+                {
+                    done->sending_offset += (cqe->res > 0) ? (size_t)cqe->res : 0;
+                    done->send_in_flight = 0;
+                }
+                else if (cqe->flags & IORING_CQE_F_BUFFER)
+                {
+                    uring_buffer_recycle(&buffers, cqe);
+                }
+                uring_seen(&ring);
+            }
+            if (!conn->send_in_flight)
+            {
+                send_looped(conn->fd, conn->sending + conn->sending_offset, conn->sending_len - conn->sending_offset);
+                send_looped(conn->fd, conn->pending, conn->pending_len);
+                conn->sending_offset = conn->sending_len;
+                conn->pending_len = 0;
+            }
+        }
+    }
+    *syscalls = (long)ring.enters;
+
+    pthread_join(client, NULL);
+    free_connections(connections, count);
+    for (int i = 0; i < count; i++)
+    {
+        close(client_fds[i]);
+    }
+    uring_destroy(&ring);
+    free(server_fds);
+    free(client_fds);
+    return seconds;
+}
+
+// Function: hands out the requests in a connection's reader, queueing a reply to each.
+// Returns: the number of requests taken.
+long take_requests(server_connection *conn)
+{
+    char *frame;
+    uint32_t len;
+    long taken = 0;
+    while (frame_reader_next(&conn->reader, &frame, &len) == 1)
+    {
+        memcpy(conn->pending + conn->pending_len, reply_frame, REPLY_SIZE);
+        conn->pending_len += REPLY_SIZE;
+        taken++;
+    }
+    return taken;
+}
+
+// Function: client thread. Keeps in_flight requests outstanding on every connection, sending a new
+// one for each reply until all the requests have been sent, then waits for the last replies.
+void *run_client(void *arg)
+{
+    client_args *args = arg;
+    int epoll_fd = epoll_create1(0);
+    frame_reader *readers = calloc(args->count, sizeof(frame_reader));
+    char *batch = malloc((size_t)REQUEST_SIZE * args->in_flight);
+    for (int i = 0; i < args->in_flight; i++)
+    {
+        memcpy(batch + (size_t)i * REQUEST_SIZE, request_frame, REQUEST_SIZE);
+    }
+
+    long sent = 0;
+    for (int i = 0; i < args->count; i++)
+    {
+        frame_reader_init(&readers[i], DEFAULT_MAX_FRAME_SIZE);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = (uint32_t)i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, args->fds[i], &ev);
+        send_looped(args->fds[i], batch, (size_t)REQUEST_SIZE * args->in_flight);
+        sent += args->in_flight;
+    }
+
+    long replies = 0;
+    struct epoll_event events[MAX_EVENTS];
+    while (replies < args->requests)
+    {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        for (int i = 0; i < ready; i++)
+        {
+            int index = (int)events[i].data.u32;
+            if (frame_reader_fill(&readers[index], args->fds[index]) <= 0)
+            {
+                perror("client read");
+                exit(EXIT_FAILURE);
+            }
+            char *frame;
+            uint32_t len;
+            long answered = 0;
+            while (frame_reader_next(&readers[index], &frame, &len) == 1)
+            {
+                answered++;
+            }
+            replies += answered;
+
+            long more = (args->requests - sent < answered) ? args->requests - sent : answered;
+            if (more > 0)
+            {
+                send_looped(args->fds[index], batch, (size_t)REQUEST_SIZE * more);
+                sent += more;
+            }
+        }
+    }
+
+    for (int i = 0; i < args->count; i++)
+    {
+        frame_reader_destroy(&readers[i]);
+    }
+    free(readers);
+    free(batch);
+    close(epoll_fd);
+    return NULL;
+}
+
+// Function: sets up the server side of each connection, with room for every reply it can owe.
+server_connection *make_connections(int *server_fds, int count, int in_flight)
+{
+    server_connection *connections = calloc(count, sizeof(server_connection));
+    for (int i = 0; i < count; i++)
+    {
+        connections[i].fd = server_fds[i];
+        connections[i].pending = malloc((size_t)REPLY_SIZE * in_flight);
+        connections[i].sending = malloc((size_t)REPLY_SIZE * in_flight);
+        if (connections[i].pending == NULL || connections[i].sending == NULL ||
+            frame_reader_init(&connections[i].reader, DEFAULT_MAX_FRAME_SIZE) == -1)
+        {
+            perror("malloc()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return connections;
+}
+
+void free_connections(server_connection *connections, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        close(connections[i].fd);
+        frame_reader_destroy(&connections[i].reader);
+        free(connections[i].pending);
+        free(connections[i].sending);
+    }
+    free(connections);
+}
+
+// Function: creates count connected pairs of TCP sockets on 127.0.0.1, using an ephemeral port.
+void connect_pairs(int count, int *server_fds, int *client_fds)
+{
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t addr_length = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, count) == -1 || getsockname(listen_fd, (struct sockaddr *)&addr, &addr_length) == -1)
+    {
+        perror("loopback listen");
+        exit(EXIT_FAILURE);
+    }
+
+    int opt_enable = 1;
+    for (int i = 0; i < count; i++)
+    {
+        client_fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+        if (client_fds[i] == -1 || connect(client_fds[i], (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        {
+            perror("loopback connect");
+            exit(EXIT_FAILURE);
+        }
+        server_fds[i] = accept(listen_fd, NULL, NULL);
+        if (server_fds[i] == -1)
+        {
+            perror("accept()");
+            exit(EXIT_FAILURE);
+        }
+        setsockopt(client_fds[i], IPPROTO_TCP, TCP_NODELAY, &opt_enable, sizeof(opt_enable));
+        setsockopt(server_fds[i], IPPROTO_TCP, TCP_NODELAY, &opt_enable, sizeof(opt_enable));
+    }
+    close(listen_fd);
+}
+
+double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
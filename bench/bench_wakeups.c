@@ -0,0 +1,247 @@
+// bench_wakeups - wakeups per state change in a car's shared memory, with every waiter on the one
+// condition variable (pthread_cond_broadcast on every change) against the per-channel futex wakeups
+// of car_wakeup.h.
+//
+// The waiters are the threads that watch a car: the button thread (buttons), the state machine
+// waiting for work (doors, motion, safety), the STATUS sender (doors, motion) and a safety monitor
+// (doors, safety). A driver thread replays the changes of a car's trips: a dispatch, three floors of
+// travel, the door cycle and a close button press, pausing between changes as a car would between
+// steps. Each waiter counts how often it returns from waiting, how many of those were for a change
+// it acts on, and its voluntary context switches (each sleep, on the condition variable, the futex
+// or the mutex).
+//
+//   ./bench/bench_wakeups [changes] [pause us]     (default: 10000 changes, 100 us apart)
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "../car_wakeup.h"
+
+#define WAITER_COUNT 4
+
+typedef struct
+{
+    const char *name;
+    uint32_t channels;
+    int use_channels; // 0: pthread_cond_wait, 1: car_wait
+    long returns;
+    long relevant;
+    long context_switches;
+} waiter;
+
+// One trip: the changes a car makes between being dispatched and closing its doors again.
+static const uint32_t trip[] = {
+    CAR_CHANGE_MOTION,                    // Destination set by the controller
+    CAR_CHANGE_DOORS,                     // Between
+    CAR_CHANGE_MOTION | CAR_CHANGE_DOORS, // Next floor, Closed
+    CAR_CHANGE_DOORS,                     // Between
+    CAR_CHANGE_MOTION | CAR_CHANGE_DOORS, // Next floor, Closed
+    CAR_CHANGE_DOORS,                     // Between
+    CAR_CHANGE_MOTION | CAR_CHANGE_DOORS, // Destination reached, Opening
+    CAR_CHANGE_DOORS,                     // Open
+    CAR_CHANGE_BUTTONS,                   // Close button pressed
+    CAR_CHANGE_DOORS,                     // Closing
+    CAR_CHANGE_DOORS,                     // Closed
+};
+
+car_shared_mem *shared_mem;
+pthread_cond_t changed_cond; // The single condition variable of shared memory layout version 1
+int stopping = 0; // Protected by the shared memory mutex
+
+car_shared_mem *create_shared_mem();
+void *wait_for_changes(void *arg);
+void run(int use_channels, long changes, long pause_us, waiter *waiters, double *cpu_seconds);
+double cpu_seconds_used();
+
+int main(int argc, char **argv)
+{
+    long changes = (argc > 1) ? atol(argv[1]) : 10000;
+    long pause_us = (argc > 2) ? atol(argv[2]) : 100;
+
+    if (changes <= 0 || pause_us < 0)
+    {
+        printf("Usage: bench_wakeups [changes] [pause us]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    shared_mem = create_shared_mem();
+
+    waiter broadcast[WAITER_COUNT];
+    waiter channels[WAITER_COUNT];
+    double broadcast_cpu, channels_cpu;
+    run(0, changes, pause_us, broadcast, &broadcast_cpu);
+    run(1, changes, pause_us, channels, &channels_cpu);
+
+    printf("%-16s %28s %28s\n", "", "condition variable", "wakeup channels");
+    printf("%-16s %9s %9s %9s %9s %9s %9s\n", "waiter", "wakes", "relevant", "csw", "wakes", "relevant", "csw");
+    long broadcast_total = 0, channels_total = 0;
+    for (int i = 0; i < WAITER_COUNT; i++)
+    {
+        printf("%-16s %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n", broadcast[i].name,
+               (double)broadcast[i].returns / changes, (double)broadcast[i].relevant / changes,
+               (double)broadcast[i].context_switches / changes,
+               (double)channels[i].returns / changes, (double)channels[i].relevant / changes,
+               (double)channels[i].context_switches / changes);
+        broadcast_total += broadcast[i].returns;
+        channels_total += channels[i].returns;
+    }
+    printf("\nwakeups per change: %.3f with the condition variable, %.3f with wakeup channels\n",
+           (double)broadcast_total / changes, (double)channels_total / changes);
+    printf("CPU per change:     %.2f us with the condition variable, %.2f us with wakeup channels\n",
+           broadcast_cpu * 1e6 / changes, channels_cpu * 1e6 / changes);
+    return 0;
+}
+
+// Function: maps an anonymous shared segment set up like a car's, plus a condition variable for the
+// broadcast runs.
+car_shared_mem *create_shared_mem()
+{
+    car_shared_mem *mem = mmap(NULL, sizeof(car_shared_mem), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        perror("mmap()");
+        exit(EXIT_FAILURE);
+    }
+    memset(mem, 0, sizeof(*mem));
+
+    pthread_mutexattr_t mutattr;
+    pthread_mutexattr_init(&mutattr);
+    pthread_mutexattr_setpshared(&mutattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&mem->mutex, &mutattr);
+    pthread_mutexattr_destroy(&mutattr);
+
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setpshared(&condattr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&changed_cond, &condattr);
+    pthread_condattr_destroy(&condattr);
+    return mem;
+}
+
+// Function: runs the waiters against one replay of the trips.
+// Arguments:
+// - use_channels: 0 to wait on the condition variable, 1 to use car_wait.
+// - changes, pause_us: how many changes to make and how long to pause after each.
+// - waiters: receives each waiter's counts.
+// - cpu_seconds: receives the process CPU time used.
+// Returns: void
+void run(int use_channels, long changes, long pause_us, waiter *waiters, double *cpu_seconds)
+{
+    const char *names[WAITER_COUNT] = {"buttons", "state machine", "status sender", "safety"};
+    const uint32_t masks[WAITER_COUNT] = {
+        CAR_CHANGE_BUTTONS,
+        CAR_CHANGE_DOORS | CAR_CHANGE_MOTION | CAR_CHANGE_SAFETY,
+        CAR_CHANGE_DOORS | CAR_CHANGE_MOTION,
+        CAR_CHANGE_DOORS | CAR_CHANGE_SAFETY,
+    };
+
+    stopping = 0;
+    pthread_t threads[WAITER_COUNT];
+    for (int i = 0; i < WAITER_COUNT; i++)
+    {
+        memset(&waiters[i], 0, sizeof(waiter));
+        waiters[i].name = names[i];
+        waiters[i].channels = masks[i];
+        waiters[i].use_channels = use_channels;
+        if (pthread_create(&threads[i], NULL, wait_for_changes, &waiters[i]) != 0)
+        {
+            perror("pthread_create()");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct timespec pause = {0, pause_us * 1000};
+    nanosleep(&pause, NULL); // Let the waiters get to sleep
+
+    double cpu_start = cpu_seconds_used();
+    for (long i = 0; i < changes; i++)
+    {
+        pthread_mutex_lock(&shared_mem->mutex);
+        car_notify(shared_mem, trip[i % (sizeof(trip) / sizeof(trip[0]))]);
+        if (!use_channels)
+        {
+            pthread_cond_broadcast(&changed_cond);
+        }
+        pthread_mutex_unlock(&shared_mem->mutex);
+        if (pause_us > 0)
+        {
+            nanosleep(&pause, NULL);
+        }
+    }
+
+    pthread_mutex_lock(&shared_mem->mutex);
+    stopping = 1;
+    car_notify(shared_mem, CAR_CHANGE_ALL);
+    pthread_cond_broadcast(&changed_cond);
+    pthread_mutex_unlock(&shared_mem->mutex);
+    for (int i = 0; i < WAITER_COUNT; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    *cpu_seconds = cpu_seconds_used() - cpu_start;
+}
+
+// Function: waiter thread. Waits for changes the way car.c's threads do and counts the wakeups.
+// Arguments: the waiter to run and fill in.
+// Returns: NULL
+void *wait_for_changes(void *arg)
+{
+    waiter *self = arg;
+    uint32_t seen[CAR_CHANNEL_COUNT];
+    struct rusage usage;
+
+    getrusage(RUSAGE_THREAD, &usage);
+    long start_switches = usage.ru_nvcsw;
+
+    pthread_mutex_lock(&shared_mem->mutex);
+    car_watch(shared_mem, seen);
+    while (1)
+    {
+        uint32_t changed;
+        if (self->use_channels)
+        {
+            changed = car_wait(shared_mem, self->channels, seen);
+        }
+        else
+        {
+            pthread_cond_wait(&changed_cond, &shared_mem->mutex);
+            changed = 0;
+            for (int i = 0; i < CAR_CHANNEL_COUNT; i++)
+            {
+                if (shared_mem->channel_seq[i] != seen[i])
+                {
+                    changed |= 1U << i;
+                }
+            }
+            car_watch(shared_mem, seen);
+        }
+
+        if (stopping)
+        {
+            break;
+        }
+        self->returns++;
+        if (changed & self->channels)
+        {
+            self->relevant++;
+        }
+    }
+    pthread_mutex_unlock(&shared_mem->mutex);
+
+    getrusage(RUSAGE_THREAD, &usage);
+    self->context_switches = usage.ru_nvcsw - start_switches;
+    return NULL;
+}
+
+// Function: CPU time used by the whole process so far, user and system.
+double cpu_seconds_used()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
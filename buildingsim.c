@@ -0,0 +1,632 @@
+// buildingsim - discrete-event simulation of a building. Passenger traffic from a chosen profile is
+// fed through the controller's own car selection and stop queues (dispatch.c); the cars follow the
+// same state machine as car.c and report every change the way a STATUS would. Time is simulated, so
+// each run is limited only by CPU; sweep strategies or fleet sizes by running several at once.
+//
+//   ./buildingsim [-p profile] [-f floors] [-c cars] [-k capacity] [-l delay ms]
+//                 [-a arrivals per 5 minutes] [-H hours] [-d strategy] [-s seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "dispatch.h"
+
+#define LOBBY_FLOOR 1
+#define FIVE_MINUTES_MS (5 * 60 * 1000L)
+#define HOUR_MS (60 * 60 * 1000L)
+#define MAX_CARS 256
+#define SATURATION_LIMIT 10000 // Passengers waiting at which demand is taken to exceed handling capacity
+
+// Share of passengers travelling up from the lobby and down to it, in percent. The rest travel
+// between two upper floors.
+typedef struct
+{
+    const char *name;
+    int incoming;
+    int outgoing;
+} traffic_profile;
+
+static const traffic_profile profiles[] = {
+    {"up-peak", 85, 10},
+    {"down-peak", 10, 85},
+    {"lunch", 40, 40},
+    {"interfloor", 10, 10},
+};
+
+typedef struct passenger
+{
+    long arrival_ms;
+    long board_ms;
+    floor_t source_floor;
+    floor_t destination_floor;
+    int car; // Assigned car, an index into cars
+    struct passenger *next;
+} passenger;
+
+// What a car's pending delay is for, as in go_through_sequence.
+typedef enum
+{
+    STEP_NONE, // Idle until the controller sends a floor
+    STEP_DOORS,
+    STEP_MOVE_UP,
+    STEP_MOVE_DOWN
+} car_step;
+
+typedef struct
+{
+    CarNode *node;          // The car's record in the controller's list; its car_info is the car's state
+    car_step step;
+    car_status step_status; // Status when a door delay started
+    long step_done_ms;
+    unsigned long step_sequence; // Orders delays that end at the same time
+    int load;
+    passenger *riders;
+    passenger *left_behind; // Passengers who did not board, calling again when the car leaves
+} sim_car;
+
+typedef struct
+{
+    long arrived;
+    long delivered;
+    long unserved; // No car serves both floors
+    long recalls;  // Calls made again after a car was full or going the other way
+    long waiting;  // Passengers not yet on board
+    double wait_ms;
+    double transit_ms;
+    long longest_wait_ms;
+    long bucket;         // Current five minute window
+    long bucket_count;   // Deliveries in the current window
+    long busiest_bucket; // Most deliveries in any completed window
+} sim_stats;
+
+// Global variables:
+sim_car cars[MAX_CARS];
+car_list building_cars; // The controller's view of the cars
+int car_count = 4;
+int floor_count = 20;
+int capacity = 16;
+int delay_ms = 1000;
+passenger **waiting; // Per floor, in arrival order
+sim_stats stats;
+unsigned long next_sequence = 0;
+unsigned long long random_state = 1;
+
+// Function definitions:
+double random_unit(void);
+floor_t random_upper_floor(floor_t except);
+passenger *generate_passenger(const traffic_profile *profile, long now);
+void assign_passenger(passenger *rider, long now);
+void controller_dispatch(sim_car *car, long now);
+void receive_floor(sim_car *car, floor_t floor, long now);
+void report_status(sim_car *car, long now);
+void run_car(sim_car *car, long now);
+void finish_step(sim_car *car, long now);
+void exchange_passengers(sim_car *car, long now);
+void record_delivery(passenger *rider, long now);
+void print_report(const traffic_profile *profile, double hours, double seconds, long now);
+
+int main(int argc, char **argv)
+{
+    const traffic_profile *profile = &profiles[3];
+    double arrivals_per_five_minutes = 100;
+    double hours = 100;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:f:c:k:l:a:H:d:s:")) != -1)
+    {
+        int valid = 1;
+        if (opt == 'p')
+        {
+            valid = 0;
+            for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+            {
+                if (strcmp(profiles[i].name, optarg) == 0)
+                {
+                    profile = &profiles[i];
+                    valid = 1;
+                }
+            }
+        }
+        else if (opt == 'f')
+        {
+            floor_count = atoi(optarg);
+            valid = floor_count >= 2 && floor_count <= FLOOR_HIGHEST;
+        }
+        else if (opt == 'c')
+        {
+            car_count = atoi(optarg);
+            valid = car_count >= 1 && car_count <= MAX_CARS;
+        }
+        else if (opt == 'k')
+        {
+            capacity = atoi(optarg);
+            valid = capacity >= 1;
+        }
+        else if (opt == 'l')
+        {
+            delay_ms = atoi(optarg);
+            valid = delay_ms >= 1;
+        }
+        else if (opt == 'a')
+        {
+            arrivals_per_five_minutes = atof(optarg);
+            valid = arrivals_per_five_minutes > 0;
+        }
+        else if (opt == 'H')
+        {
+            hours = atof(optarg);
+            valid = hours > 0;
+        }
+        else if (opt == 'd')
+        {
+            valid = set_dispatch_strategy(optarg);
+        }
+        else if (opt == 's')
+        {
+            random_state = strtoull(optarg, NULL, 10);
+            valid = random_state != 0;
+        }
+        else
+        {
+            valid = 0;
+        }
+
+        if (!valid)
+        {
+            printf("Usage: buildingsim [-p {profile}] [-f {floors}] [-c {cars, 1-%d}] [-k {capacity}] [-l {delay ms}]\n"
+                   "                   [-a {arrivals per 5 minutes}] [-H {hours}] [-d {dispatch strategy}] [-s {seed}]\n",
+                   MAX_CARS);
+            printf("Profiles: up-peak, down-peak, lunch, interfloor\n");
+            printf("Dispatch strategies: ");
+            print_dispatch_strategies();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    waiting = calloc(floor_count + 1, sizeof(passenger *));
+    if (waiting == NULL)
+    {
+        perror("calloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    // Every car serves the whole building and starts at the lobby with its doors closed.
+    car_list_init(&building_cars);
+    for (int i = 0; i < car_count; i++)
+    {
+        car_information info;
+        memset(&info, 0, sizeof(info));
+        snprintf(info.name, sizeof(info.name), "Car%d", i + 1);
+        info.car_fd = i;
+        info.lowest_floor = LOBBY_FLOOR;
+        info.highest_floor = (floor_t)floor_count;
+        info.current_floor = LOBBY_FLOOR;
+        info.destination_floor = LOBBY_FLOOR;
+        info.status = CAR_STATUS_CLOSED;
+        info.delay_ms = delay_ms;
+
+        memset(&cars[i], 0, sizeof(cars[i]));
+        cars[i].node = add_car_to_list(&building_cars, info, NULL);
+        if (cars[i].node == NULL)
+        {
+            fprintf(stderr, "add_car_to_list() failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    double mean_gap_ms = FIVE_MINUTES_MS / arrivals_per_five_minutes;
+    long end_ms = (long)(hours * HOUR_MS);
+    long next_arrival_ms = (long)(-log(random_unit()) * mean_gap_ms);
+    long now = 0;
+
+    while (1)
+    {
+        // The next event is either a passenger arriving or a car's delay ending.
+        sim_car *next_car = NULL;
+        for (int i = 0; i < car_count; i++)
+        {
+            if (cars[i].step != STEP_NONE &&
+                (next_car == NULL || cars[i].step_done_ms < next_car->step_done_ms ||
+                 (cars[i].step_done_ms == next_car->step_done_ms && cars[i].step_sequence < next_car->step_sequence)))
+            {
+                next_car = &cars[i];
+            }
+        }
+
+        if (next_car != NULL && next_car->step_done_ms < next_arrival_ms)
+        {
+            now = next_car->step_done_ms;
+            if (now >= end_ms)
+            {
+                now = end_ms;
+                break;
+            }
+            finish_step(next_car, now);
+        }
+        else
+        {
+            now = next_arrival_ms;
+            if (now >= end_ms)
+            {
+                now = end_ms;
+                break;
+            }
+            assign_passenger(generate_passenger(profile, now), now);
+            if (stats.waiting > SATURATION_LIMIT)
+            {
+                break; // The queue would only keep growing
+            }
+            next_arrival_ms = now + 1 + (long)(-log(random_unit()) * mean_gap_ms);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double seconds = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
+    print_report(profile, hours, seconds, now);
+    return 0;
+}
+
+// Function: xorshift64* generator, so a seed always gives the same run.
+// Returns: a number in (0, 1].
+double random_unit(void)
+{
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return ((random_state * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0) + (1.0 / 9007199254740992.0);
+}
+
+// Function: picks an upper floor (above the lobby) uniformly.
+// Arguments: except - a floor not to pick, or FLOOR_INVALID.
+// Returns: the floor.
+floor_t random_upper_floor(floor_t except)
+{
+    int choices = floor_count - 1 - ((except > LOBBY_FLOOR) ? 1 : 0);
+    floor_t floor = (floor_t)(LOBBY_FLOOR + 1 + (int)(random_unit() * choices) % choices);
+    if (except > LOBBY_FLOOR && floor >= except)
+    {
+        floor++;
+    }
+    return floor;
+}
+
+// Function: creates a passenger whose trip follows the traffic profile.
+// Arguments:
+// - profile: the traffic mix.
+// - now: the arrival time.
+// Returns: the new passenger.
+passenger *generate_passenger(const traffic_profile *profile, long now)
+{
+    passenger *rider = malloc(sizeof(passenger));
+    if (rider == NULL)
+    {
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    double kind = random_unit() * 100;
+    if (kind <= profile->incoming || floor_count == 2)
+    {
+        rider->source_floor = LOBBY_FLOOR;
+        rider->destination_floor = random_upper_floor(FLOOR_INVALID);
+    }
+    else if (kind <= profile->incoming + profile->outgoing)
+    {
+        rider->source_floor = random_upper_floor(FLOOR_INVALID);
+        rider->destination_floor = LOBBY_FLOOR;
+    }
+    else
+    {
+        rider->source_floor = random_upper_floor(FLOOR_INVALID);
+        rider->destination_floor = random_upper_floor(rider->source_floor);
+    }
+
+    rider->arrival_ms = now;
+    rider->board_ms = -1;
+    rider->next = NULL;
+    stats.arrived++;
+    stats.waiting++;
+    return rider;
+}
+
+// Function: gives a waiting passenger's call to the controller's car selection, as handle_call does,
+// and queues the passenger at the source floor for the chosen car.
+// Arguments:
+// - rider: the passenger.
+// - now: the current time.
+// Returns: void
+void assign_passenger(passenger *rider, long now)
+{
+    CarNode *chosen_car = choose_car(&building_cars, rider->source_floor, rider->destination_floor, NULL);
+    if (chosen_car == NULL)
+    {
+        stats.unserved++;
+        stats.waiting--;
+        free(rider);
+        return;
+    }
+
+    update_call_queue(rider->source_floor, rider->destination_floor, chosen_car);
+    rider->car = chosen_car->car_info.car_fd;
+
+    passenger **tail = &waiting[rider->source_floor];
+    while (*tail != NULL)
+    {
+        tail = &(*tail)->next;
+    }
+    rider->next = NULL;
+    *tail = rider;
+
+    controller_dispatch(&cars[rider->car], now); // The car may be idle at its destination
+}
+
+// Function: the controller's dispatch_car. A car at its destination is sent its next stop, and a
+// moving car a stop it can still make on the way (take_next_stop).
+// Arguments:
+// - car: the car.
+// - now: the current time.
+// Returns: void
+void controller_dispatch(sim_car *car, long now)
+{
+    call_requests next_stop;
+    call_requests requeued;
+
+    if (take_next_stop(car->node, &next_stop, &requeued))
+    {
+        receive_floor(car, next_stop.floor, now);
+    }
+}
+
+// Function: the car's car_core_dispatch_floor. On the car's floor the doors open, otherwise the floor
+// becomes the destination; between floors it does so once the car reaches the next floor.
+// Arguments:
+// - car: the car.
+// - floor: the dispatched floor.
+// - now: the current time.
+// Returns: void
+void receive_floor(sim_car *car, floor_t floor, long now)
+{
+    car_information *info = &car->node->car_info;
+
+    if (info->status == CAR_STATUS_BETWEEN)
+    {
+        if (info->destination_floor == floor)
+        {
+            return;
+        }
+        info->destination_floor = floor;
+    }
+    else if (info->current_floor == floor)
+    {
+        if (info->status == CAR_STATUS_OPENING && info->destination_floor == floor)
+        {
+            return; // Nothing changed, so no STATUS is sent
+        }
+        info->destination_floor = floor;
+        info->status = CAR_STATUS_OPENING;
+    }
+    else if (info->destination_floor != floor)
+    {
+        info->destination_floor = floor;
+    }
+    else
+    {
+        return;
+    }
+
+    report_status(car, now);
+    if (car->step == STEP_NONE)
+    {
+        run_car(car, now);
+    }
+}
+
+// Function: the car reports a change; the controller reacts as it would to a STATUS.
+void report_status(sim_car *car, long now)
+{
+    controller_dispatch(car, now);
+}
+
+// Function: starts the car's next step, as one pass of go_through_sequence: a door phase, a move
+// towards the destination, or nothing until a floor arrives.
+// Arguments:
+// - car: the car.
+// - now: the current time.
+// Returns: void
+void run_car(sim_car *car, long now)
+{
+    car_information *info = &car->node->car_info;
+
+    if (info->status == CAR_STATUS_OPENING || info->status == CAR_STATUS_OPEN || info->status == CAR_STATUS_CLOSING)
+    {
+        car->step = STEP_DOORS;
+        car->step_status = info->status;
+    }
+    else if (info->status == CAR_STATUS_CLOSED && info->current_floor != info->destination_floor)
+    {
+        car->step = (get_call_direction(info->current_floor, info->destination_floor) == 'U') ? STEP_MOVE_UP : STEP_MOVE_DOWN;
+        info->status = CAR_STATUS_BETWEEN;
+
+        // Passengers left on the landing call again once the car has gone.
+        while (car->left_behind != NULL)
+        {
+            passenger *rider = car->left_behind;
+            car->left_behind = rider->next;
+            stats.recalls++;
+            assign_passenger(rider, now);
+        }
+        report_status(car, now);
+    }
+    else
+    {
+        car->step = STEP_NONE;
+        return;
+    }
+
+    car->step_done_ms = now + delay_ms;
+    car->step_sequence = next_sequence++;
+}
+
+// Function: ends the car's current delay and moves its state on.
+// Arguments:
+// - car: the car.
+// - now: the current time.
+// Returns: void
+void finish_step(sim_car *car, long now)
+{
+    car_information *info = &car->node->car_info;
+
+    if (car->step == STEP_DOORS)
+    {
+        // A floor dispatched during the delay may already have reopened the doors.
+        if (info->status == car->step_status)
+        {
+            info->status = car->step_status + 1; // Opening -> Open -> Closing -> Closed
+            if (info->status == CAR_STATUS_OPEN)
+            {
+                exchange_passengers(car, now);
+            }
+            report_status(car, now);
+        }
+    }
+    else if (car->step == STEP_MOVE_UP || car->step == STEP_MOVE_DOWN)
+    {
+        info->current_floor = next_floor_towards(info->current_floor, (car->step == STEP_MOVE_UP) ? FLOOR_HIGHEST : FLOOR_LOWEST);
+        info->status = (info->current_floor == info->destination_floor) ? CAR_STATUS_OPENING : CAR_STATUS_CLOSED;
+        report_status(car, now);
+    }
+
+    run_car(car, now);
+}
+
+// Function: with the doors open, riders for this floor get out and passengers waiting for this car
+// get in if it has room and is going their way (or has nowhere else to go).
+// Arguments:
+// - car: the car.
+// - now: the current time.
+// Returns: void
+void exchange_passengers(sim_car *car, long now)
+{
+    car_information *info = &car->node->car_info;
+    floor_t floor = info->current_floor;
+
+    passenger **link = &car->riders;
+    while (*link != NULL)
+    {
+        passenger *rider = *link;
+        if (rider->destination_floor == floor)
+        {
+            *link = rider->next;
+            car->load--;
+            record_delivery(rider, now);
+        }
+        else
+        {
+            link = &rider->next;
+        }
+    }
+
+    char heading = (info->destination_floor == floor) ? 0 : get_call_direction(floor, info->destination_floor);
+    link = &waiting[floor];
+    while (*link != NULL)
+    {
+        passenger *rider = *link;
+        if (&cars[rider->car] != car)
+        {
+            link = &rider->next;
+            continue;
+        }
+
+        *link = rider->next;
+        if (car->load < capacity && (heading == 0 || heading == get_call_direction(floor, rider->destination_floor)))
+        {
+            if (rider->board_ms == -1)
+            {
+                rider->board_ms = now;
+            }
+            stats.waiting--;
+            rider->next = car->riders;
+            car->riders = rider;
+            car->load++;
+        }
+        else
+        {
+            rider->next = car->left_behind;
+            car->left_behind = rider;
+        }
+    }
+}
+
+// Function: adds a delivered passenger to the statistics.
+// Arguments:
+// - rider: the passenger, freed here.
+// - now: the time they got out.
+// Returns: void
+void record_delivery(passenger *rider, long now)
+{
+    long wait = rider->board_ms - rider->arrival_ms;
+
+    stats.delivered++;
+    stats.wait_ms += wait;
+    stats.transit_ms += now - rider->board_ms;
+    if (wait > stats.longest_wait_ms)
+    {
+        stats.longest_wait_ms = wait;
+    }
+
+    long bucket = now / FIVE_MINUTES_MS;
+    if (bucket != stats.bucket)
+    {
+        if (stats.bucket_count > stats.busiest_bucket)
+        {
+            stats.busiest_bucket = stats.bucket_count;
+        }
+        stats.bucket = bucket;
+        stats.bucket_count = 0;
+    }
+    stats.bucket_count++;
+
+    free(rider);
+}
+
+// Function: prints the run's configuration and metrics.
+// Arguments:
+// - profile: the traffic mix.
+// - hours: the simulated hours asked for.
+// - seconds: the real time taken.
+// - now: the simulated time reached, short of the hours asked for if the building saturated.
+// Returns: void
+void print_report(const traffic_profile *profile, double hours, double seconds, long now)
+{
+    if (stats.bucket_count > stats.busiest_bucket)
+    {
+        stats.busiest_bucket = stats.bucket_count;
+    }
+
+    long delivered = (stats.delivered > 0) ? stats.delivered : 1;
+    double windows = (double)now / FIVE_MINUTES_MS;
+
+    printf("Profile %s: %d floors, %d cars of %d passengers, %d ms per floor and door phase, %s dispatch\n",
+           profile->name, floor_count, car_count, capacity, delay_ms, get_dispatch_strategy_name());
+    double simulated_hours = (double)now / HOUR_MS;
+    printf("Simulated %.0f hours in %.2f s (%.0f simulated hours per minute)\n", simulated_hours, seconds, simulated_hours * 60 / seconds);
+    if (stats.waiting > SATURATION_LIMIT)
+    {
+        printf("Saturated after %.1f of %.0f hours: over %d passengers waiting, demand exceeds handling capacity\n",
+               simulated_hours, hours, SATURATION_LIMIT);
+    }
+    printf("Passengers:             %ld arrived, %ld delivered, %ld still waiting or travelling, %ld unserved\n",
+           stats.arrived, stats.delivered, stats.arrived - stats.delivered - stats.unserved, stats.unserved);
+    printf("Handling capacity:      %.1f passengers per 5 minutes (busiest 5 minutes: %ld)\n",
+           stats.delivered / windows, stats.busiest_bucket);
+    printf("Average waiting time:   %.1f s (longest %.1f s, %ld calls made again)\n",
+           stats.wait_ms / delivered / 1000, stats.longest_wait_ms / 1000.0, stats.recalls);
+    printf("Average transit time:   %.1f s\n", stats.transit_ms / delivered / 1000);
+    printf("Average journey time:   %.1f s\n", (stats.wait_ms + stats.transit_ms) / delivered / 1000);
+}
@@ -11,9 +11,45 @@
 #include <errno.h>
 #include <ctype.h>
 #include <signal.h>
+#include <time.h>
 #include "network_utils.h"
+#include "common.h"
+#include "protocol.h"
+#include "trace.h"
 
 #define BUFFER_SIZE 1024
+#define SESSION_BUFFER_SIZE 8192 // Calls are written in bursts of up to this many bytes
+#define DEFAULT_WINDOW 64        // Calls in flight before the session waits for a reply
+
+// One call sent in a session and not yet answered.
+typedef struct
+{
+    int in_use;
+    uint32_t request_id;
+    floor_t source_floor;
+    floor_t destination_floor;
+} pending_call;
+
+// A session sends many calls over one connection, each tagged with a request ID, and matches
+// the replies by ID. Calls are buffered and written in bursts; in binary mode they are packed
+// into CALL_BATCH frames.
+typedef struct
+{
+    int fd;
+    int protocol;
+    int batch_size;
+    int window;
+    frame_reader reader;
+    pending_call *pending; // Indexed by request ID modulo window
+    int pending_count;
+    uint32_t next_request_id;
+    char out_buf[SESSION_BUFFER_SIZE];
+    size_t out_len;
+    proto_call_batch batch;
+    uint16_t batch_count;
+    long assigned;
+    long unavailable;
+} call_session;
 
 int socket_fd = -1; // Global to allow cleanup in the signal handler
 
@@ -23,30 +59,98 @@ char *receive_msg(int fd);
 void recv_looped(int fd, void *buf, size_t sz);
 void send_message(int fd, const char *buf);
 void send_looped(int fd, const void *buf, size_t sz);
+void send_frame(int fd, const void *buf, size_t len);
 
-int is_valid_floor(const char *floor);
 void handle_signal(int signal);
+void call_text(int fd, floor_t source_floor, floor_t destination_floor);
+void call_binary(int fd, floor_t source_floor, floor_t destination_floor);
+int run_session(int fd, int protocol, FILE *input, int batch_size, int window);
+void session_send_call(call_session *session, floor_t source_floor, floor_t destination_floor);
+void session_append_frame(call_session *session, const void *frame, size_t len);
+void session_flush_batch(call_session *session);
+void session_flush(call_session *session);
+int session_receive_reply(call_session *session);
 
 int main(int argc, char **argv)
 {
+    trace_init("call", NULL);
+
     // Register signal handler for SIGINT (Ctrl+C) and SIGTERM
     signal(SIGINT, handle_signal);
     signal(SIGTERM, handle_signal);
 
-    // Check the number of command line arguments.
-    if (argc != 3)
+    // Parse options, then check the number of command line arguments.
+    int protocol = PROTOCOL_TEXT;
+    const char *input_path = NULL;
+    int batch_size = 1;
+    int window = DEFAULT_WINDOW;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:f:b:w:")) != -1)
     {
-        printf("Usage: {source floor} {destination floor}\n");
+        if (opt == 'p' && (atoi(optarg) == PROTOCOL_TEXT || atoi(optarg) == PROTOCOL_VERSION))
+        {
+            protocol = atoi(optarg);
+        }
+        else if (opt == 'f')
+        {
+            input_path = optarg;
+        }
+        else if (opt == 'b' && atoi(optarg) >= 1 && atoi(optarg) <= PROTOCOL_MAX_BATCH)
+        {
+            batch_size = atoi(optarg);
+            protocol = PROTOCOL_VERSION; // Batches are binary frames
+        }
+        else if (opt == 'w' && atoi(optarg) >= 1)
+        {
+            window = atoi(optarg);
+        }
+        else
+        {
+            optind = argc + 1; // Force the usage message
+            break;
+        }
+    }
+
+    if (argc - optind != ((input_path == NULL) ? 2 : 0))
+    {
+        printf("Usage: [-p {protocol version}] {source floor} {destination floor}\n");
+        printf("       [-p {protocol version}] [-b {calls per batch, 1-%d}] [-w {calls in flight}] -f {file of calls, or - for stdin}\n",
+               PROTOCOL_MAX_BATCH);
         return EXIT_FAILURE;
     }
 
-    if (!is_valid_floor(argv[1]) || !is_valid_floor(argv[2]))
+    if (input_path != NULL)
+    {
+        FILE *input = (strcmp(input_path, "-") == 0) ? stdin : fopen(input_path, "r");
+        if (input == NULL)
+        {
+            perror("fopen()");
+            return EXIT_FAILURE;
+        }
+        if (isatty(fileno(input)))
+        {
+            window = 1; // Someone is typing: answer each call before reading the next
+            batch_size = 1;
+        }
+
+        socket_fd = establish_connection();
+        int result = run_session(socket_fd, protocol, input, batch_size, window);
+        close(socket_fd);
+        socket_fd = -1;
+        return result;
+    }
+
+    // Parse the floors once; they are only turned back into text for the wire.
+    floor_t source_floor = parse_floor(argv[optind]);
+    floor_t destination_floor = parse_floor(argv[optind + 1]);
+
+    if (source_floor == FLOOR_INVALID || destination_floor == FLOOR_INVALID)
     {
         printf("Invalid floor(s) specified.\n");
         return EXIT_FAILURE;
     }
 
-    if (strcmp(argv[1], argv[2]) == 0)
+    if (source_floor == destination_floor)
     {
         printf("You are already on that floor!\n");
         return EXIT_FAILURE;
@@ -60,23 +164,66 @@ int main(int argc, char **argv)
         return EXIT_FAILURE;
     }
 
+    if (protocol == PROTOCOL_VERSION)
+    {
+        call_binary(socket_fd, source_floor, destination_floor);
+    }
+    else
+    {
+        call_text(socket_fd, source_floor, destination_floor);
+    }
+
+    // Close the connection.
+    if (close(socket_fd) == -1)
+    {
+        perror("close()");
+        return EXIT_FAILURE;
+    }
+
+    socket_fd = -1; // Reset after closing
+
+    return EXIT_SUCCESS;
+}
+
+// Function: Sends a text CALL and prints the controller's response.
+// Arguments:
+// - fd: the connection to the controller.
+// - source_floor, destination_floor: the call's floors.
+// Returns: void
+void call_text(int fd, floor_t source_floor, floor_t destination_floor)
+{
     char send_controller_buffer[BUFFER_SIZE];
+    char source_text[FLOOR_STRING_SIZE], destination_text[FLOOR_STRING_SIZE];
+    format_floor(source_floor, source_text);
+    format_floor(destination_floor, destination_text);
 
     // Format and send message to the controller: CALL {source floor} {destination floor}
-    snprintf(send_controller_buffer, sizeof(send_controller_buffer), "CALL %s %s", argv[1], argv[2]);
-    send_message(socket_fd, send_controller_buffer);
+    snprintf(send_controller_buffer, sizeof(send_controller_buffer), "CALL %s %s", source_text, destination_text);
+    trace_emit(TRACE_CALL_SENT, NULL, 0, source_floor, destination_floor);
+    send_message(fd, send_controller_buffer);
 
     // Blocking function to wait for the controller's response.
-    char *msg_from_controller = receive_msg(socket_fd);
+    frame_reader reader;
+    char *msg_from_controller;
+    uint32_t len;
+    if (frame_reader_init(&reader, DEFAULT_MAX_FRAME_SIZE) == -1 ||
+        frame_reader_read(&reader, fd, &msg_from_controller, &len) != 1)
+    {
+        printf("Unable to read the controller's response.\n");
+        frame_reader_destroy(&reader);
+        return;
+    }
     fflush(stdout);
 
     // Handle the controller's response and print appropriate message.
     if (strncmp(msg_from_controller, "UNAVAILABLE", 11) == 0)
     {
+        trace_emit(TRACE_MESSAGE_RECEIVED, NULL, TRACE_MESSAGE_UNAVAILABLE, source_floor, destination_floor);
         printf("Sorry, no car is available to take this request.\n");
     }
     else if (strncmp(msg_from_controller, "CAR", 3) == 0) // CAR {car name}
     {
+        trace_emit(TRACE_MESSAGE_RECEIVED, msg_from_controller + 4, TRACE_MESSAGE_CAR, source_floor, destination_floor);
         printf("Car %s is arriving.\n", msg_from_controller + 4);
     }
     else
@@ -85,53 +232,277 @@ int main(int argc, char **argv)
         printf("Unexpected response: %s\n", msg_from_controller);
     }
 
-    free(msg_from_controller);
+    frame_reader_destroy(&reader);
+}
 
-    // Close the connection.
-    if (close(socket_fd) == -1)
+// Function: Sends a binary (protocol version 2) CALL and prints the controller's response.
+// Arguments:
+// - fd: the connection to the controller.
+// - source_floor, destination_floor: the call's floors.
+// Returns: void
+void call_binary(int fd, floor_t source_floor, floor_t destination_floor)
+{
+    proto_call call;
+    trace_emit(TRACE_CALL_SENT, NULL, 0, source_floor, destination_floor);
+    send_frame(fd, &call, proto_encode_call(&call, source_floor, destination_floor));
+
+    // Blocking function to wait for the controller's response.
+    frame_reader reader;
+    char *msg_from_controller;
+    uint32_t len;
+    if (frame_reader_init(&reader, DEFAULT_MAX_FRAME_SIZE) == -1 ||
+        frame_reader_read(&reader, fd, &msg_from_controller, &len) != 1)
     {
-        perror("close()");
-        return EXIT_FAILURE;
+        printf("Unable to read the controller's response.\n");
+        frame_reader_destroy(&reader);
+        return;
     }
 
-    socket_fd = -1; // Reset after closing
+    char name[PROTOCOL_MAX_NAME];
+    floor_t lowest_floor, highest_floor;
+    uint32_t delay_ms;
 
-    return EXIT_SUCCESS;
+    if (proto_type_of(msg_from_controller, len) == PROTO_UNAVAILABLE)
+    {
+        trace_emit(TRACE_MESSAGE_RECEIVED, NULL, TRACE_MESSAGE_UNAVAILABLE, source_floor, destination_floor);
+        printf("Sorry, no car is available to take this request.\n");
+    }
+    else if (proto_decode_car(msg_from_controller, len, name, &lowest_floor, &highest_floor, &delay_ms))
+    {
+        trace_emit(TRACE_MESSAGE_RECEIVED, name, TRACE_MESSAGE_CAR, source_floor, destination_floor);
+        printf("Car %s is arriving.\n", name);
+    }
+    else
+    {
+        printf("Unexpected response (%u bytes).\n", len);
+    }
+
+    frame_reader_destroy(&reader);
 }
 
-// Signal handler function to close the socket and exit gracefully
-void handle_signal(int signal)
+// Function: Sends every call read from input over one connection, pipelining up to window calls,
+// and prints each reply. Input lines are "{source floor} {destination floor}"; blank lines and lines
+// starting with # are skipped.
+// Arguments:
+// - fd: the connection to the controller.
+// - protocol: PROTOCOL_TEXT or PROTOCOL_VERSION.
+// - input: where the calls are read from.
+// - batch_size: calls per CALL_BATCH frame (binary protocol only).
+// - window: the most calls in flight at once.
+// Returns: EXIT_SUCCESS, or EXIT_FAILURE if the connection failed.
+int run_session(int fd, int protocol, FILE *input, int batch_size, int window)
 {
-    if (socket_fd != -1)
+    call_session *session = calloc(1, sizeof(call_session));
+    if (session == NULL || (session->pending = calloc(window, sizeof(pending_call))) == NULL ||
+        frame_reader_init(&session->reader, DEFAULT_MAX_FRAME_SIZE) == -1)
     {
-        printf("\nReceived signal %d, closing the connection...\n", signal);
-        close(socket_fd); // Close the socket
-        socket_fd = -1;   // Reset the socket descriptor to avoid double closing
+        perror("calloc()");
+        exit(EXIT_FAILURE);
     }
+    session->fd = fd;
+    session->protocol = protocol;
+    session->batch_size = batch_size;
+    session->window = window;
 
-    exit(EXIT_FAILURE); // Exit after cleanup
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int result = EXIT_SUCCESS;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    long line_number = 0;
+    while (result == EXIT_SUCCESS && getline(&line, &line_capacity, input) != -1)
+    {
+        char source_text[8], destination_text[8];
+        line_number++;
+        if (sscanf(line, "%7s %7s", source_text, destination_text) != 2)
+        {
+            continue; // Blank line
+        }
+        if (source_text[0] == '#')
+        {
+            continue; // Comment
+        }
+
+        floor_t source_floor = parse_floor(source_text);
+        floor_t destination_floor = parse_floor(destination_text);
+        if (source_floor == FLOOR_INVALID || destination_floor == FLOOR_INVALID || source_floor == destination_floor)
+        {
+            fprintf(stderr, "Line %ld: invalid call \"%s %s\", skipped.\n", line_number, source_text, destination_text);
+            continue;
+        }
+
+        // Wait for replies while the window is full
+        while (result == EXIT_SUCCESS && session->pending_count + session->batch_count >= window)
+        {
+            if (session->batch_count > 0)
+            {
+                session_flush_batch(session);
+            }
+            else
+            {
+                session_flush(session);
+                result = session_receive_reply(session);
+            }
+        }
+
+        session_send_call(session, source_floor, destination_floor);
+    }
+
+    // Send what is left and collect the remaining replies
+    session_flush_batch(session);
+    session_flush(session);
+    while (result == EXIT_SUCCESS && session->pending_count > 0)
+    {
+        result = session_receive_reply(session);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    long answered = session->assigned + session->unavailable;
+    fprintf(stderr, "%ld calls in %.3f s (%.0f calls/s): %ld assigned, %ld unavailable.\n", answered, seconds,
+            seconds > 0 ? answered / seconds : 0.0, session->assigned, session->unavailable);
+
+    free(line);
+    if (input != stdin)
+    {
+        fclose(input);
+    }
+    frame_reader_destroy(&session->reader);
+    free(session->pending);
+    free(session);
+    return result;
 }
 
-// Function: checks if the argument (floor) is valid.
-// Returns: 1 if valid, else 0
-int is_valid_floor(const char *floor)
+// Function: Records a call as pending and queues it for sending.
+void session_send_call(call_session *session, floor_t source_floor, floor_t destination_floor)
 {
-    size_t len = strlen(floor);
+    uint32_t request_id = session->next_request_id++;
+    pending_call *pending = &session->pending[request_id % session->window];
+    pending->in_use = 1;
+    pending->request_id = request_id;
+    pending->source_floor = source_floor;
+    pending->destination_floor = destination_floor;
+    session->pending_count++;
+    trace_emit(TRACE_CALL_SENT, NULL, 0, source_floor, destination_floor);
+
+    if (session->protocol == PROTOCOL_VERSION)
+    {
+        proto_encode_call_entry(&session->batch.calls[session->batch_count++], request_id, source_floor, destination_floor);
+        if (session->batch_count == session->batch_size)
+        {
+            session_flush_batch(session);
+        }
+        return;
+    }
+
+    char message[BUFFER_SIZE];
+    char source_text[FLOOR_STRING_SIZE], destination_text[FLOOR_STRING_SIZE];
+    format_floor(source_floor, source_text);
+    format_floor(destination_floor, destination_text);
+    int length = snprintf(message, sizeof(message), "CALL %s %s %u", source_text, destination_text, request_id);
+    session_append_frame(session, message, (size_t)length);
+}
 
-    // Check for length and valid first character
-    if (len == 0 || len > 3 || (isalpha(floor[0]) && floor[0] != 'B'))
+// Function: Moves the calls gathered so far into one CALL_BATCH frame.
+void session_flush_batch(call_session *session)
+{
+    if (session->batch_count > 0)
     {
-        return 0;
+        session_append_frame(session, &session->batch, proto_encode_call_batch(&session->batch, session->batch_count));
+        session->batch_count = 0;
     }
+}
 
-    // Ensure all remaining characters are digits
-    for (size_t i = 1; i < len; i++)
+// Function: Adds a length-prefixed frame to the session's output, writing out the buffer first if
+// the frame does not fit.
+void session_append_frame(call_session *session, const void *frame, size_t len)
+{
+    if (session->out_len + FRAME_HEADER_SIZE + len > sizeof(session->out_buf))
     {
-        if (!isdigit(floor[i]))
+        session_flush(session);
+    }
+
+    uint32_t nlen = htonl(len);
+    memcpy(session->out_buf + session->out_len, &nlen, sizeof(nlen));
+    memcpy(session->out_buf + session->out_len + sizeof(nlen), frame, len);
+    session->out_len += FRAME_HEADER_SIZE + len;
+}
+
+// Function: Writes out everything queued in the session's output buffer.
+void session_flush(call_session *session)
+{
+    if (session->out_len > 0)
+    {
+        send_looped(session->fd, session->out_buf, session->out_len);
+        session->out_len = 0;
+    }
+}
+
+// Function: Waits for one reply, matches it to its call by request ID and prints it.
+// Returns: EXIT_SUCCESS, or EXIT_FAILURE if the connection closed or the reply was not understood.
+int session_receive_reply(call_session *session)
+{
+    char *msg;
+    uint32_t len;
+    if (frame_reader_read(&session->reader, session->fd, &msg, &len) != 1)
+    {
+        fprintf(stderr, "Connection to the controller lost with %d calls unanswered.\n", session->pending_count);
+        return EXIT_FAILURE;
+    }
+
+    char name[PROTOCOL_MAX_NAME] = "";
+    uint32_t request_id;
+    if (session->protocol == PROTOCOL_VERSION)
+    {
+        if (!proto_decode_assignment(msg, len, &request_id, name))
         {
-            return 0;
+            fprintf(stderr, "Unexpected response (%u bytes).\n", len);
+            return EXIT_FAILURE;
         }
     }
+    else if (sscanf(msg, "CAR %99s %u", name, &request_id) != 2 && sscanf(msg, "UNAVAILABLE %u", &request_id) != 1)
+    {
+        fprintf(stderr, "Unexpected response: %s\n", msg);
+        return EXIT_FAILURE;
+    }
+
+    pending_call *pending = &session->pending[request_id % session->window];
+    if (!pending->in_use || pending->request_id != request_id)
+    {
+        fprintf(stderr, "Response for unknown request %u.\n", request_id);
+        return EXIT_FAILURE;
+    }
+    pending->in_use = 0;
+    session->pending_count--;
+
+    char source_text[FLOOR_STRING_SIZE], destination_text[FLOOR_STRING_SIZE];
+    format_floor(pending->source_floor, source_text);
+    format_floor(pending->destination_floor, destination_text);
+    trace_emit(TRACE_MESSAGE_RECEIVED, name, (name[0] == '\0') ? TRACE_MESSAGE_UNAVAILABLE : TRACE_MESSAGE_CAR,
+               pending->source_floor, pending->destination_floor);
+    if (name[0] == '\0')
+    {
+        session->unavailable++;
+        printf("Call %u (%s to %s): no car is available.\n", request_id, source_text, destination_text);
+    }
+    else
+    {
+        session->assigned++;
+        printf("Call %u (%s to %s): car %s is arriving.\n", request_id, source_text, destination_text, name);
+    }
+    return EXIT_SUCCESS;
+}
+
+// Signal handler function to close the socket and exit gracefully
+void handle_signal(int signal)
+{
+    if (socket_fd != -1)
+    {
+        printf("\nReceived signal %d, closing the connection...\n", signal);
+        close(socket_fd); // Close the socket
+        socket_fd = -1;   // Reset the socket descriptor to avoid double closing
+    }
 
-    return 1;
+    exit(EXIT_FAILURE); // Exit after cleanup
 }
@@ -14,113 +14,126 @@
 #include <signal.h>
 #include "network_utils.h"
 #include "common.h"
+#include "protocol.h"
+#include "car_core.h"
+#include "car_wakeup.h"
+#include "sim_clock.h"
+#include "trace.h"
 #include <unistd.h>
 #include <time.h>
 #include <sys/time.h>
 
 #define MILLISECOND 1000
 
-char *status_names[] = {
-    "Opening", "Open", "Closing", "Closed", "Between"};
-
-// Store the car details:
-typedef struct
-{
-    char name[100];
-    char lowest_floor[4];
-    char highest_floor[4];
-    int delay;
-} car_information;
-
 // Global variables:
 car_shared_mem *shared_mem;
-car_information car_info;
+car_config car_info;
 char car_name[100] = "/car";
 int shm_fd = -1;
-int early_exit_delay = 0;
-pthread_mutex_t early_exit_delay_mutex = PTHREAD_MUTEX_INITIALIZER;
+int delay_armed = 0; // A step's delay is pending; cleared to cancel it. Protected by delay_mutex
+uint64_t delay_deadline_ns; // CLOCK_MONOTONIC time the pending delay ends
 pthread_mutex_t delay_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t delay_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t delay_cond; // Waits on CLOCK_MONOTONIC, so wall-clock steps do not stretch a delay
 int controller_sock_fd;
+int protocol = PROTOCOL_TEXT; // Wire protocol spoken to the controller
+int status_sender_running = 0; // Protected by the shared memory mutex
+sim_clock *simulation_clock = NULL; // Set with -s; delays then run on simulated time
+const char *simulation_clock_name = NULL;
+int clock_participant = -1;
+int sequence_idle = 0; // The state machine is waiting for a change; protected by the shared memory mutex
+int status_interval_ms = CAR_STATUS_INTERVAL_MS; // Set with -i; 0 on a simulated clock
+int heartbeat_ms = CAR_HEARTBEAT_MS;             // Set with -H
 
 // Function definitions:
 void terminate_shared_memory(int sig_num);
 void *go_through_sequence(void *arg);
 void *handle_button_press(void *arg);
-void *individual_service_mode(void *arg);
-char get_call_direction(const char *source, const char *destination);
 void *connect_to_controller(void *arg);
+void *send_status_messages(void *arg);
+void arm_delay();
+void cancel_delay();
 void delay();
+void wait_for_change();
+void handle_dispatch_floor(floor_t dispatch_floor);
 
 int main(int argc, char **argv)
 {
-    if (argc != 5)
+    int opt;
+    while ((opt = getopt(argc, argv, "p:s:i:H:")) != -1)
+    {
+        if (opt == 'p' && (atoi(optarg) == PROTOCOL_TEXT || atoi(optarg) == PROTOCOL_VERSION))
+        {
+            protocol = atoi(optarg);
+        }
+        else if (opt == 's' && optarg[0] == '/')
+        {
+            simulation_clock_name = optarg;
+        }
+        else if (opt == 'i' && atoi(optarg) >= 0)
+        {
+            status_interval_ms = atoi(optarg);
+        }
+        else if (opt == 'H' && atoi(optarg) >= 0)
+        {
+            heartbeat_ms = atoi(optarg);
+        }
+        else
+        {
+            optind = argc + 1; // Force the usage message
+            break;
+        }
+    }
+
+    if (argc - optind != 4)
     {
-        printf("Usage: {name} {lowest floor} {highest floor} {delay}\n");
+        printf("Usage: [-p {protocol version}] [-s {simulation clock, e.g. /simclock}] [-i {status interval ms}] [-H {heartbeat ms}]\n"
+               "       {name} {lowest floor} {highest floor} {delay}\n");
         exit(1);
     }
+    argv += optind - 1; // Positional arguments start at argv[1]
+
+    trace_init("car", argv[1]);
+    trace_name_thread("main");
 
     signal(SIGINT, terminate_shared_memory);
 
+    // Only the main thread takes SIGINT, so the handler never interrupts a thread holding a mutex it needs.
+    sigset_t interrupt_set;
+    sigemptyset(&interrupt_set);
+    sigaddset(&interrupt_set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &interrupt_set, NULL);
+
     // Ensure the car doesn't crash when write fails.
     signal(SIGPIPE, SIG_IGN);
 
     strcat(car_name, argv[1]);
 
     strcpy(car_info.name, argv[1]);
-    strcpy(car_info.lowest_floor, argv[2]);
-    strcpy(car_info.highest_floor, argv[3]);
+    car_info.lowest_floor = parse_floor(argv[2]);
+    car_info.highest_floor = parse_floor(argv[3]);
     car_info.delay = atoi(argv[4]);
 
-    // Unlink the shared memory in case it exists.
-    shm_unlink(car_name);
-
-    shm_fd = shm_open(car_name, O_CREAT | O_RDWR, 0666);
-    if (shm_fd == -1)
+    if (car_info.lowest_floor == FLOOR_INVALID || car_info.highest_floor == FLOOR_INVALID ||
+        car_info.lowest_floor > car_info.highest_floor)
     {
-        perror("shm_open");
+        printf("Invalid floor range.\n");
         exit(1);
     }
 
-    if (ftruncate(shm_fd, sizeof(car_shared_mem)) == -1)
-    {
-        perror("ftruncate");
-        exit(1);
-    }
+    shared_mem = car_core_create_shm(car_name, &car_info, &shm_fd);
+
+    pthread_condattr_t delay_cond_attr;
+    pthread_condattr_init(&delay_cond_attr);
+    pthread_condattr_setclock(&delay_cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&delay_cond, &delay_cond_attr);
+    pthread_condattr_destroy(&delay_cond_attr);
 
-    shared_mem = mmap(0, sizeof(car_shared_mem), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    if (shared_mem == MAP_FAILED)
+    if (simulation_clock_name != NULL)
     {
-        perror("mmap");
-        exit(1);
+        simulation_clock = sim_clock_join(simulation_clock_name, &clock_participant);
+        status_interval_ms = 0; // A report held back in real time would arrive late in simulated time
     }
 
-    // Initialize the mutex.
-    pthread_mutexattr_t mutattr;
-    pthread_mutexattr_init(&mutattr);
-    pthread_mutexattr_setpshared(&mutattr, PTHREAD_PROCESS_SHARED);
-    pthread_mutex_init(&shared_mem->mutex, &mutattr);
-    pthread_mutexattr_destroy(&mutattr);
-
-    // Initialize the condition variable.
-    pthread_condattr_t condattr;
-    pthread_condattr_init(&condattr);
-    pthread_condattr_setpshared(&condattr, PTHREAD_PROCESS_SHARED);
-    pthread_cond_init(&shared_mem->cond, &condattr);
-    pthread_condattr_destroy(&condattr);
-
-    // Initialize the shared memory.
-    strcpy(shared_mem->current_floor, argv[2]);
-    strcpy(shared_mem->destination_floor, argv[2]);
-    strcpy(shared_mem->status, status_names[3]); // Initially "Closed"
-    shared_mem->open_button = 0;
-    shared_mem->close_button = 0;
-    shared_mem->door_obstruction = 0;
-    shared_mem->overload = 0;
-    shared_mem->emergency_stop = 0;
-    shared_mem->individual_service_mode = 0;
-    shared_mem->emergency_mode = 0;
-
     // Create handle button press thread
     pthread_t button_thread;
     if (pthread_create(&button_thread, NULL, handle_button_press, NULL) != 0)
@@ -137,253 +150,194 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
-    pthread_t individual_service_mode_thread;
-    if (pthread_create(&individual_service_mode_thread, NULL, individual_service_mode, NULL) != 0)
-    {
-        perror("pthread_create() for individual service mode thread.");
-        exit(EXIT_FAILURE);
-    }
-
     pthread_t connect_to_controller_thread;
     if (pthread_create(&connect_to_controller_thread, NULL, connect_to_controller, NULL) != 0)
     {
-        perror("pthread_create() for individual service mode thread.");
+        perror("pthread_create() for controller thread.");
         exit(EXIT_FAILURE);
     }
+    pthread_sigmask(SIG_UNBLOCK, &interrupt_set, NULL);
     pthread_join(connect_to_controller_thread, NULL);
 
     pthread_join(button_thread, NULL);
-    pthread_join(individual_service_mode_thread, NULL);
     pthread_join(go_through_sequence_thread, NULL);
 
     return 0;
 }
 
-// Function: handles operations for individual service mode.
-void *individual_service_mode(void *arg)
-{
-    while (1)
-    {
-        pthread_mutex_lock(&shared_mem->mutex);
-        if (shared_mem->individual_service_mode == 1)
-        {
-            pthread_cond_wait(&shared_mem->cond, &shared_mem->mutex);
-
-            if (get_call_direction(car_info.highest_floor, shared_mem->destination_floor) == 'U')
-            {
-                strcpy(shared_mem->destination_floor, shared_mem->current_floor);
-            }
-            else if (strcmp(shared_mem->current_floor, shared_mem->destination_floor) != 0 &&
-                     strcmp(shared_mem->status, "Closed") == 0)
-            {
-                strcpy(shared_mem->status, "Between");
-                pthread_cond_broadcast(&shared_mem->cond);
-
-                pthread_mutex_unlock(&shared_mem->mutex);
-                delay();
-                pthread_mutex_lock(&shared_mem->mutex);
-
-                strcpy(shared_mem->current_floor, shared_mem->destination_floor);
-                strcpy(shared_mem->status, "Closed");
-
-                pthread_cond_broadcast(&shared_mem->cond);
-            }
-        }
-        pthread_mutex_unlock(&shared_mem->mutex);
-    }
-
-    pthread_exit(NULL);
-}
-
 // Function: updates the car's status based on the button presses.
 void *handle_button_press(void *arg)
 {
+    uint32_t seen[CAR_CHANNEL_COUNT];
+    trace_name_thread("buttons");
+
+    pthread_mutex_lock(&shared_mem->mutex);
+    car_watch(shared_mem, seen);
     while (1)
     {
-        pthread_mutex_lock(&shared_mem->mutex);
-        pthread_cond_wait(&shared_mem->cond, &shared_mem->mutex);
-
-        if (shared_mem->open_button)
+        while (!shared_mem->open_button && !shared_mem->close_button)
         {
-            shared_mem->open_button = 0;
-            if (shared_mem->individual_service_mode == 1)
-            {
-                strcpy(shared_mem->status, "Open");
-                pthread_cond_broadcast(&shared_mem->cond);
-            }
-            else if (strcmp(shared_mem->status, "Closing") == 0 || strcmp(shared_mem->status, "Closed") == 0)
-            {
-                strcpy(shared_mem->status, "Opening");
-                pthread_cond_broadcast(&shared_mem->cond);
-            }
+            car_wait(shared_mem, CAR_CHANGE_BUTTONS, seen);
         }
-        else if (shared_mem->close_button)
+
+        if (car_core_handle_buttons(shared_mem))
         {
-            shared_mem->close_button = 0;
-            if (shared_mem->individual_service_mode == 1)
-            {
-                strcpy(shared_mem->status, "Closed");
-                pthread_cond_broadcast(&shared_mem->cond);
-            }
-            else if (strcmp(shared_mem->status, "Open") == 0)
-            {
-                strcpy(shared_mem->status, "Closing");
-                pthread_cond_broadcast(&shared_mem->cond);
-
-                pthread_mutex_lock(&delay_mutex);
-                early_exit_delay = 1;
-                pthread_cond_signal(&delay_cond);
-                pthread_mutex_unlock(&delay_mutex);
-            }
+            cancel_delay(); // The close button cuts the doors' open time short
         }
-
-        pthread_mutex_unlock(&shared_mem->mutex);
     }
+    pthread_mutex_unlock(&shared_mem->mutex);
     pthread_exit(NULL);
 }
 
-// Function: state machine for status. Attempt to get the car's status to closed, and react to changes from external programs.
+// Function: state machine for status. Each pass takes one step of car_core (a door phase or a
+// floor's travel) and waits out its delay, then re-reads the shared memory, so a button pressed
+// during a delay is seen before the next step.
 void *go_through_sequence(void *arg)
 {
     (void)arg;
+    trace_name_thread("sequence");
 
+    pthread_mutex_lock(&shared_mem->mutex);
     while (1)
     {
-        pthread_mutex_lock(&shared_mem->mutex);
-        pthread_cond_wait(&shared_mem->cond, &shared_mem->mutex);
-        if (shared_mem->individual_service_mode == 0)
+        car_status step_status;
+        car_step step = car_core_begin_step(shared_mem, &car_info, &step_status);
+        if (step == CAR_STEP_NONE)
         {
-            if (strcmp(shared_mem->status, "Opening") == 0)
-            {
-                pthread_mutex_unlock(&shared_mem->mutex);
-                delay();
-                pthread_mutex_lock(&shared_mem->mutex);
-                strcpy(shared_mem->status, "Open");
-                pthread_cond_broadcast(&shared_mem->cond);
-            }
-
-            if (strcmp(shared_mem->status, "Open") == 0)
-            {
-                pthread_mutex_unlock(&shared_mem->mutex);
-                delay();
-                pthread_mutex_lock(&shared_mem->mutex);
-                strcpy(shared_mem->status, "Closing");
-                pthread_cond_broadcast(&shared_mem->cond);
-            }
-
-            if (strcmp(shared_mem->status, "Closing") == 0)
-            {
-                pthread_mutex_unlock(&shared_mem->mutex);
-                delay();
-                pthread_mutex_lock(&shared_mem->mutex);
-                strcpy(shared_mem->status, "Closed");
-                pthread_cond_broadcast(&shared_mem->cond);
-            }
+            wait_for_change();
+            continue;
         }
 
+        // Armed before the mutex is let go, so a button handled from here on cancels this delay.
+        arm_delay();
         pthread_mutex_unlock(&shared_mem->mutex);
+        delay();
+        pthread_mutex_lock(&shared_mem->mutex);
+        car_core_finish_step(shared_mem, step, step_status);
     }
 
+    pthread_mutex_unlock(&shared_mem->mutex);
     pthread_exit(NULL);
 }
 
-// Function: delay mechanism that utilizes pthread_cond_timedwait for absolute delays.
-void delay()
+// Function: waits for a change that could give the car something to do: a new status or
+// destination, or a change of mode. Button presses reach it through the status they set. Mutex
+// held. On a simulated clock the car counts as idle meanwhile, so time can move on for the other cars.
+// Returns: void
+void wait_for_change()
 {
-    struct timespec ts;
-    int rt = 0;
+    uint32_t seen[CAR_CHANNEL_COUNT];
+    car_watch(shared_mem, seen);
 
-    clock_gettime(CLOCK_REALTIME, &ts);
-    ts.tv_sec += car_info.delay / 1000;
-    ts.tv_nsec += (car_info.delay % 1000) * 1000000;
-
-    // Adjust for nanosecond overflow
-    if (ts.tv_nsec >= 1000000000)
+    if (simulation_clock != NULL)
     {
-        ts.tv_sec += 1;
-        ts.tv_nsec -= 1000000000;
+        sim_clock_set_busy(simulation_clock, clock_participant, 0);
     }
-
-    pthread_mutex_lock(&delay_mutex);
-    while (1)
+    sequence_idle = 1;
+    car_wait(shared_mem, CAR_CHANGE_DOORS | CAR_CHANGE_MOTION | CAR_CHANGE_SAFETY, seen);
+    sequence_idle = 0;
+    if (simulation_clock != NULL)
     {
-        rt = pthread_cond_timedwait(&delay_cond, &delay_mutex, &ts);
-        pthread_mutex_lock(&early_exit_delay_mutex);
-        if (early_exit_delay)
-        {
-            early_exit_delay = 0;
-            pthread_mutex_unlock(&early_exit_delay_mutex);
-            pthread_mutex_unlock(&delay_mutex);
-            return; // Exit early
-        }
-        pthread_mutex_unlock(&early_exit_delay_mutex);
-
-        // If the timeout occurred, break the loop
-        if (rt == ETIMEDOUT)
-        {
-            break;
-        }
+        sim_clock_set_busy(simulation_clock, clock_participant, 1);
     }
-    pthread_mutex_unlock(&delay_mutex);
 }
 
-// Send messages in the form:
-// STATUS {status} {current floor} {destination floor}
+// Function: starts the delay for the step just begun: the car's delay from now, on CLOCK_MONOTONIC.
+// Shared memory mutex held, so that the button thread sees it armed.
+// Returns: void
+void arm_delay()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-// Function: periodically send status messages to the controller.
-void *send_status_messages(void *arg)
+    pthread_mutex_lock(&delay_mutex);
+    delay_armed = 1;
+    delay_deadline_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec + (uint64_t)car_info.delay * 1000000ULL;
+    pthread_mutex_unlock(&delay_mutex);
+}
+
+// Function: cancels the pending delay, if there is one, so the step ends at once. A press while no
+// delay is pending has nothing to cancel and does not cut the next delay short. Shared memory mutex
+// held.
+// Returns: void
+void cancel_delay()
 {
-    // Send messages in the form:
-    // STATUS {status} {current floor} {destination floor}
+    pthread_mutex_lock(&delay_mutex);
+    int armed = delay_armed;
+    delay_armed = 0;
+    pthread_cond_signal(&delay_cond);
+    pthread_mutex_unlock(&delay_mutex);
 
-    char status_message[256];
-    while (1)
+    if (armed && simulation_clock != NULL)
     {
-        pthread_mutex_lock(&shared_mem->mutex);
-        pthread_cond_wait(&shared_mem->cond, &shared_mem->mutex);
-
-        sprintf(status_message, "STATUS %s %s %s", shared_mem->status, shared_mem->current_floor, shared_mem->destination_floor);
+        sim_clock_interrupt(simulation_clock, clock_participant);
+    }
+}
 
-        pthread_mutex_unlock(&shared_mem->mutex);
-        send_message(controller_sock_fd, status_message);
+// Function: waits until the delay armed by arm_delay ends or is cancelled. On the simulated clock
+// given with -s, sleeps in simulated time instead.
+// Returns: void
+void delay()
+{
+    if (simulation_clock != NULL)
+    {
+        pthread_mutex_lock(&delay_mutex);
+        int armed = delay_armed;
+        pthread_mutex_unlock(&delay_mutex);
+        if (armed) // Not cancelled before the sleep could start
+        {
+            sim_clock_sleep(simulation_clock, clock_participant, (uint64_t)car_info.delay * MILLISECOND);
+        }
+    }
+    else
+    {
+        pthread_mutex_lock(&delay_mutex);
+        struct timespec deadline = {(time_t)(delay_deadline_ns / 1000000000ULL), (long)(delay_deadline_ns % 1000000000ULL)};
+        while (delay_armed && pthread_cond_timedwait(&delay_cond, &delay_mutex, &deadline) != ETIMEDOUT)
+        {
+        }
+        pthread_mutex_unlock(&delay_mutex);
     }
 
-    // This message should be sent when:
-    // - Everytime the shared memory changes (check condition variable)
-    // - If delay (ms) has passed since the last message.
-    pthread_exit(NULL);
+    pthread_mutex_lock(&delay_mutex);
+    delay_armed = 0;
+    pthread_mutex_unlock(&delay_mutex);
 }
 
-// If the destination floor is different from the current floor and the doors are closed, the car will:
-// - Change its status to Between
-// - Wait (delay) ms
-// - Change its current floor to be 1 closer to the destination floor, and its status to Closed
-
-// Function: Function thread to move the cars current floor to the destination floor.
+// Function: reports the car's status to the controller (car_core_publish_status): changes as they
+// happen, coalesced to one report per status interval, and a heartbeat while nothing changes.
 // Arguments: unused void pointer
 // Returns: void
-void *normal_operation(void *arg)
+void *send_status_messages(void *arg)
 {
-    while (1)
-    {
-        pthread_mutex_lock(&shared_mem->mutex);
-        pthread_cond_wait(&shared_mem->cond, &shared_mem->mutex);
-        if (strcmp(shared_mem->destination_floor, shared_mem->current_floor) != 0)
-        {
-            if (strcmp(shared_mem->status, "Closed") == 0)
-            {
-                strcpy(shared_mem->status, "Between");
-                pthread_cond_broadcast(&shared_mem->cond);
+    (void)arg;
+    car_status_publisher publisher;
+    car_core_init_publisher(&publisher, status_interval_ms, heartbeat_ms);
+    uint32_t seen[CAR_CHANNEL_COUNT];
+    trace_name_thread("status");
 
-                delay();
+    pthread_mutex_lock(&shared_mem->mutex);
+    car_watch(shared_mem, seen);
+    while (status_sender_running)
+    {
+        car_status status = shared_mem->status;
+        floor_t current_floor = shared_mem->current_floor;
+        floor_t destination_floor = shared_mem->destination_floor;
 
-                // - Change its current floor to be 1 closer to the destination floor, and its status to Closed
-            }
-        }
+        // Changes made while the report is sent are picked up on the next pass.
         pthread_mutex_unlock(&shared_mem->mutex);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        uint64_t next_ns;
+        car_core_publish_status(controller_sock_fd, protocol, &publisher, status, current_floor, destination_floor,
+                                (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec, &next_ns);
+        pthread_mutex_lock(&shared_mem->mutex);
+
+        struct timespec next = {(time_t)(next_ns / 1000000000ULL), (long)(next_ns % 1000000000ULL)};
+        car_wait_until(shared_mem, CAR_CHANGE_DOORS | CAR_CHANGE_MOTION, seen, &next);
     }
+    pthread_mutex_unlock(&shared_mem->mutex);
 
-    // If the current floor and destination floor are equal, call "reached_destination_floor" function.
     pthread_exit(NULL);
 }
 
@@ -392,6 +346,7 @@ void *normal_operation(void *arg)
 // Returns: void
 void *connect_to_controller(void *arg)
 {
+    trace_name_thread("controller");
     controller_sock_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (controller_sock_fd == -1)
     {
@@ -418,49 +373,56 @@ void *connect_to_controller(void *arg)
         pthread_exit(NULL);
     }
 
-    char car_initialisation_message[256];
-    sprintf(car_initialisation_message, "CAR %s %s %s", car_info.name, car_info.lowest_floor, car_info.highest_floor);
-    send_message(controller_sock_fd, car_initialisation_message);
+    car_core_send_registration(controller_sock_fd, protocol, &car_info);
 
-    char status_message[256];
-    pthread_mutex_lock(&shared_mem->mutex);
-    sprintf(status_message, "STATUS %s %s %s", shared_mem->status, shared_mem->current_floor, shared_mem->destination_floor);
-    pthread_mutex_unlock(&shared_mem->mutex);
-    send_message(controller_sock_fd, status_message);
+    pthread_t status_thread;
+    status_sender_running = 1;
+    if (pthread_create(&status_thread, NULL, send_status_messages, NULL) != 0)
+    {
+        perror("pthread_create() for status thread");
+        exit(EXIT_FAILURE);
+    }
+
+    frame_reader reader;
+    if (frame_reader_init(&reader, DEFAULT_MAX_FRAME_SIZE) == -1)
+    {
+        perror("frame_reader_init()");
+        exit(EXIT_FAILURE);
+    }
 
     while (1)
     {
-        char *message_from_controller = receive_msg(controller_sock_fd);
+        uint32_t len;
+        char *message_from_controller;
+        floor_t dispatch_floor;
 
-        if (strncmp(message_from_controller, "FLOOR", 5) == 0)
+        if (frame_reader_read(&reader, controller_sock_fd, &message_from_controller, &len) != 1)
         {
-            char dispatch_floor[4];
-            sscanf(message_from_controller, "FLOOR %s", dispatch_floor); // New floor call.
-
-            pthread_mutex_lock(&shared_mem->mutex);
-            if (strcmp(shared_mem->current_floor, dispatch_floor) == 0) // If the car is already on that floor.
-            {
-                strcpy(shared_mem->status, "Opening");
-                pthread_cond_broadcast(&shared_mem->cond);
-            }
-            else // Set the new destination floor.
-            {
-                if (strcmp(shared_mem->status, "Between") != 0) // If a new destination arrives while the car is in the Between status, that destination will not replace the car's current destination until the car reaches the next floor.
-                {
-                    strcpy(shared_mem->destination_floor, dispatch_floor);
-                    pthread_cond_broadcast(&shared_mem->cond);
-                }
-            }
-            pthread_mutex_unlock(&shared_mem->mutex);
+            break; // Controller went away or sent a frame we cannot accept
+        }
+
+        if (protocol == PROTOCOL_VERSION && proto_decode_floor(message_from_controller, len, &dispatch_floor))
+        {
+            handle_dispatch_floor(dispatch_floor); // Binary frames carry the floor as an integer
+        }
+        else if (protocol == PROTOCOL_TEXT && strncmp(message_from_controller, "FLOOR", 5) == 0)
+        {
+            char floor_text[4];
+            sscanf(message_from_controller, "FLOOR %3s", floor_text); // New floor call.
+            handle_dispatch_floor(parse_floor(floor_text));
         }
         else
         {
-            free(message_from_controller);
             break;
         }
-
-        free(message_from_controller);
     }
+    frame_reader_destroy(&reader);
+
+    pthread_mutex_lock(&shared_mem->mutex);
+    status_sender_running = 0;
+    car_notify(shared_mem, CAR_CHANGE_DOORS); // Wakes the status thread to see it should stop
+    pthread_mutex_unlock(&shared_mem->mutex);
+    pthread_join(status_thread, NULL);
 
     shutdown(controller_sock_fd, SHUT_RDWR); // Disable both reading and writing
     close(controller_sock_fd);
@@ -468,17 +430,39 @@ void *connect_to_controller(void *arg)
     pthread_exit(NULL);
 }
 
+// Function: Acts on a floor dispatched by the controller.
+// Arguments:
+// - dispatch_floor: the floor to go to.
+// Returns: void
+void handle_dispatch_floor(floor_t dispatch_floor)
+{
+    if (dispatch_floor == FLOOR_INVALID)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&shared_mem->mutex);
+    if (simulation_clock != NULL && sequence_idle)
+    {
+        // Busy from here, so simulated time cannot move on before the idle car has acted on the floor.
+        sim_clock_set_busy(simulation_clock, clock_participant, 1);
+    }
+    car_core_dispatch_floor(shared_mem, dispatch_floor);
+    pthread_mutex_unlock(&shared_mem->mutex);
+}
+
 // Cleans up the shared memory upon program termination.
 // Returns: void.
 void terminate_shared_memory(int sig_num)
 {
     signal(SIGINT, terminate_shared_memory);
 
-    munmap(shared_mem, sizeof(car_shared_mem));
-
-    close(shm_fd);
+    if (simulation_clock != NULL)
+    {
+        sim_clock_leave(simulation_clock, simulation_clock_name, clock_participant);
+    }
 
-    shm_unlink(car_name);
+    car_core_destroy_shm(shared_mem, car_name, shm_fd);
 
     exit(0);
 }
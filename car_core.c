@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "car_core.h"
+#include "car_wakeup.h"
+#include "network_utils.h"
+#include "protocol.h"
+#include "trace.h"
+
+// Function: creates a car's shared memory segment (replacing any left behind) and initialises it
+// (car_shm_init): doors closed at the lowest floor, every button and flag clear.
+// Arguments:
+// - shm_name: the segment name, e.g. "/carA".
+// - config: the car's floors.
+// - shm_fd: receives the segment's descriptor.
+// Returns: the mapped segment. Exits on failure.
+car_shared_mem *car_core_create_shm(const char *shm_name, const car_config *config, int *shm_fd)
+{
+    // Unlink the shared memory in case it exists.
+    shm_unlink(shm_name);
+
+    *shm_fd = shm_open(shm_name, O_CREAT | O_RDWR, 0666);
+    if (*shm_fd == -1)
+    {
+        perror("shm_open");
+        exit(1);
+    }
+
+    if (ftruncate(*shm_fd, sizeof(car_shared_mem)) == -1)
+    {
+        perror("ftruncate");
+        exit(1);
+    }
+
+    car_shared_mem *shared_mem = mmap(0, sizeof(car_shared_mem), PROT_READ | PROT_WRITE, MAP_SHARED, *shm_fd, 0);
+    if (shared_mem == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+
+    car_shm_init(shared_mem, config->lowest_floor, config->highest_floor);
+
+    return shared_mem;
+}
+
+// Function: unmaps and removes a car's shared memory segment.
+void car_core_destroy_shm(car_shared_mem *shared_mem, const char *shm_name, int shm_fd)
+{
+    munmap(shared_mem, sizeof(car_shared_mem));
+    close(shm_fd);
+    shm_unlink(shm_name);
+}
+
+// Records the car's status and floors after a status change (trace.h).
+static void trace_state(const car_shared_mem *shared_mem)
+{
+    trace_emit(TRACE_STATUS, NULL, shared_mem->status, shared_mem->current_floor, shared_mem->destination_floor);
+}
+
+// Function: sets the car's status and wakes the threads waiting on the door channel. Mutex held.
+// Arguments:
+// - shared_mem: the car's segment.
+// - status: the new status.
+// Returns: void
+void car_core_set_status(car_shared_mem *shared_mem, car_status status)
+{
+    car_shm_write_begin(shared_mem);
+    shared_mem->status = status;
+    car_shm_write_end(shared_mem);
+    car_notify(shared_mem, CAR_CHANGE_DOORS);
+    trace_state(shared_mem);
+}
+
+// Function: starts the car's next step: the door cycle, a move one floor towards the destination,
+// or in service mode a move straight to it. Changes made before the delay (going Between) are
+// applied here. Mutex held.
+// Arguments:
+// - shared_mem: the car's segment.
+// - config: the car's floors.
+// - step_status: receives the status the step started from, for car_core_finish_step.
+// Returns: the step to wait one delay for, or CAR_STEP_NONE if the car has nothing to do.
+car_step car_core_begin_step(car_shared_mem *shared_mem, const car_config *config, car_status *step_status)
+{
+    car_status status = shared_mem->status;
+    floor_t current_floor = shared_mem->current_floor;
+    floor_t destination_floor = shared_mem->destination_floor;
+    *step_status = status;
+
+    if (shared_mem->individual_service_mode == 1)
+    {
+        // A destination outside the car's range is ignored.
+        if (get_call_direction(config->highest_floor, destination_floor) == 'U' ||
+            get_call_direction(config->lowest_floor, destination_floor) == 'D')
+        {
+            car_shm_write_begin(shared_mem);
+            shared_mem->destination_floor = current_floor;
+            car_shm_write_end(shared_mem);
+            car_notify(shared_mem, CAR_CHANGE_MOTION);
+            return CAR_STEP_NONE;
+        }
+
+        // In service mode the car goes straight to the destination and leaves the doors to the technician.
+        if (status == CAR_STATUS_CLOSED && current_floor != destination_floor)
+        {
+            car_core_set_status(shared_mem, CAR_STATUS_BETWEEN);
+            return CAR_STEP_SERVICE_MOVE;
+        }
+        return CAR_STEP_NONE;
+    }
+
+    if (status == CAR_STATUS_OPENING || status == CAR_STATUS_OPEN || status == CAR_STATUS_CLOSING)
+    {
+        return CAR_STEP_DOORS;
+    }
+
+    if (status == CAR_STATUS_CLOSED && current_floor != destination_floor && shared_mem->emergency_mode == 0)
+    {
+        car_core_set_status(shared_mem, CAR_STATUS_BETWEEN);
+        return (get_call_direction(current_floor, destination_floor) == 'U') ? CAR_STEP_MOVE_UP : CAR_STEP_MOVE_DOWN;
+    }
+
+    return CAR_STEP_NONE;
+}
+
+// Function: applies the end of a step's delay. Mutex held.
+// Arguments:
+// - shared_mem: the car's segment.
+// - step: the step returned by car_core_begin_step.
+// - step_status: the status it started from.
+// Returns: void
+void car_core_finish_step(car_shared_mem *shared_mem, car_step step, car_status step_status)
+{
+    if (step == CAR_STEP_DOORS)
+    {
+        // A button press during the delay has already moved the doors on.
+        if (shared_mem->status == step_status && shared_mem->individual_service_mode == 0)
+        {
+            car_core_set_status(shared_mem, step_status + 1); // Opening -> Open -> Closing -> Closed
+        }
+    }
+    else if (step == CAR_STEP_MOVE_UP || step == CAR_STEP_MOVE_DOWN)
+    {
+        // The destination may have changed during the move; the car reaches the next floor regardless.
+        floor_t destination_floor = shared_mem->destination_floor;
+        floor_t next_floor = next_floor_towards(shared_mem->current_floor,
+                                                (step == CAR_STEP_MOVE_UP) ? FLOOR_HIGHEST : FLOOR_LOWEST);
+        car_shm_write_begin(shared_mem);
+        shared_mem->current_floor = next_floor;
+        shared_mem->status = (next_floor == destination_floor) ? CAR_STATUS_OPENING : CAR_STATUS_CLOSED;
+        car_shm_write_end(shared_mem);
+        car_notify(shared_mem, CAR_CHANGE_MOTION | CAR_CHANGE_DOORS);
+        trace_state(shared_mem);
+    }
+    else if (step == CAR_STEP_SERVICE_MOVE)
+    {
+        car_shm_write_begin(shared_mem);
+        shared_mem->current_floor = shared_mem->destination_floor;
+        shared_mem->status = CAR_STATUS_CLOSED;
+        car_shm_write_end(shared_mem);
+        car_notify(shared_mem, CAR_CHANGE_MOTION | CAR_CHANGE_DOORS);
+        trace_state(shared_mem);
+    }
+}
+
+// Function: acts on a pressed open or close button and clears it. Mutex held.
+// Arguments: shared_mem - the car's segment.
+// Returns: 1 if the delay in progress should end now (the close button cut the doors' open time
+// short), 0 otherwise.
+int car_core_handle_buttons(car_shared_mem *shared_mem)
+{
+    if (shared_mem->open_button)
+    {
+        car_shm_write_begin(shared_mem);
+        shared_mem->open_button = 0;
+        car_shm_write_end(shared_mem);
+        if (shared_mem->individual_service_mode == 1)
+        {
+            car_core_set_status(shared_mem, CAR_STATUS_OPEN);
+        }
+        else if (shared_mem->status == CAR_STATUS_CLOSING || shared_mem->status == CAR_STATUS_CLOSED)
+        {
+            car_core_set_status(shared_mem, CAR_STATUS_OPENING);
+        }
+    }
+    else if (shared_mem->close_button)
+    {
+        car_shm_write_begin(shared_mem);
+        shared_mem->close_button = 0;
+        car_shm_write_end(shared_mem);
+        if (shared_mem->individual_service_mode == 1)
+        {
+            car_core_set_status(shared_mem, CAR_STATUS_CLOSED);
+        }
+        else if (shared_mem->status == CAR_STATUS_OPEN)
+        {
+            car_core_set_status(shared_mem, CAR_STATUS_CLOSING);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function: acts on a floor dispatched by the controller. Mutex held.
+// Arguments:
+// - shared_mem: the car's segment.
+// - dispatch_floor: the floor to go to.
+// Returns: void
+void car_core_dispatch_floor(car_shared_mem *shared_mem, floor_t dispatch_floor)
+{
+    if (dispatch_floor == FLOOR_INVALID)
+    {
+        return;
+    }
+    trace_emit(TRACE_MESSAGE_RECEIVED, NULL, TRACE_MESSAGE_FLOOR, dispatch_floor, 0);
+
+    if (shared_mem->status == CAR_STATUS_BETWEEN)
+    {
+        // The move under way still ends at the next floor: the car stops there if it is the new
+        // destination, and otherwise carries on or turns back from there. A service move goes straight
+        // to its destination, so that is left alone.
+        if (shared_mem->individual_service_mode == 0 && shared_mem->destination_floor != dispatch_floor)
+        {
+            car_shm_write_begin(shared_mem);
+            shared_mem->destination_floor = dispatch_floor;
+            car_shm_write_end(shared_mem);
+            car_notify(shared_mem, CAR_CHANGE_MOTION);
+        }
+    }
+    else if (shared_mem->current_floor == dispatch_floor) // If the car is already on that floor.
+    {
+        // It stops here for now; the controller sends on the destination it was going to later.
+        if (shared_mem->destination_floor != dispatch_floor)
+        {
+            car_shm_write_begin(shared_mem);
+            shared_mem->destination_floor = dispatch_floor;
+            car_shm_write_end(shared_mem);
+            car_notify(shared_mem, CAR_CHANGE_MOTION);
+        }
+        car_core_set_status(shared_mem, CAR_STATUS_OPENING);
+    }
+    else
+    {
+        car_shm_write_begin(shared_mem);
+        shared_mem->destination_floor = dispatch_floor;
+        car_shm_write_end(shared_mem);
+        car_notify(shared_mem, CAR_CHANGE_MOTION);
+    }
+}
+
+// Function: registers a car with the controller in the selected protocol.
+// Arguments:
+// - fd: the connection to the controller.
+// - protocol: PROTOCOL_TEXT or PROTOCOL_VERSION.
+// - config: the car's name, floors and delay.
+// Returns: 0 on success, -1 if the connection failed.
+int car_core_send_registration(int fd, int protocol, const car_config *config)
+{
+    if (protocol == PROTOCOL_VERSION)
+    {
+        proto_car registration;
+        return write_frame(fd, &registration,
+                           proto_encode_car(&registration, config->name, config->lowest_floor, config->highest_floor, (uint32_t)config->delay));
+    }
+
+    char car_initialisation_message[256];
+    char lowest_floor[FLOOR_STRING_SIZE], highest_floor[FLOOR_STRING_SIZE];
+    format_floor(config->lowest_floor, lowest_floor);
+    format_floor(config->highest_floor, highest_floor);
+    snprintf(car_initialisation_message, sizeof(car_initialisation_message), "CAR %s %s %s %d", config->name, lowest_floor, highest_floor, config->delay);
+    return write_frame(fd, car_initialisation_message, strlen(car_initialisation_message));
+}
+
+// Function: sends a status to the controller in the selected protocol.
+// Arguments:
+// - fd: the connection to the controller.
+// - protocol: PROTOCOL_TEXT or PROTOCOL_VERSION.
+// - status, current_floor, destination_floor: the values to report.
+// Returns: 0 on success, -1 if the connection failed.
+int car_core_send_status(int fd, int protocol, car_status status, floor_t current_floor, floor_t destination_floor)
+{
+    if (protocol == PROTOCOL_VERSION)
+    {
+        proto_status status_frame;
+        return write_frame(fd, &status_frame, proto_encode_status(&status_frame, status, current_floor, destination_floor));
+    }
+
+    char status_message[256];
+    char current_text[FLOOR_STRING_SIZE], destination_text[FLOOR_STRING_SIZE];
+    format_floor(current_floor, current_text);
+    format_floor(destination_floor, destination_text);
+    snprintf(status_message, sizeof(status_message), "STATUS %s %s %s", format_status(status), current_text, destination_text);
+    return write_frame(fd, status_message, strlen(status_message));
+}
+
+// Function: sets up a status publisher for a new connection: nothing reported yet.
+// Arguments:
+// - publisher: the publisher.
+// - interval_ms: the least time between two reports; 0 reports every change at once.
+// - heartbeat_ms: the longest time without a report; 0 sends no heartbeats.
+// Returns: void
+void car_core_init_publisher(car_status_publisher *publisher, int interval_ms, int heartbeat_ms)
+{
+    memset(publisher, 0, sizeof(*publisher));
+    publisher->interval_ns = (uint64_t)interval_ms * 1000000ULL;
+    publisher->heartbeat_ns = (heartbeat_ms > 0) ? (uint64_t)heartbeat_ms * 1000000ULL : UINT64_MAX / 2;
+}
+
+// Function: reports the car's state to the controller if it is due. A change is reported at once
+// unless the last report went out less than an interval ago; changes made meanwhile are folded into
+// one report at the end of the interval. An idle car repeats its state once a heartbeat. In the
+// binary protocol only the first report is a full STATUS: later ones are STATUS_UPDATE frames
+// carrying the fields that changed, with none for a heartbeat. Text reports are always full.
+// Arguments:
+// - fd: the connection to the controller.
+// - protocol: PROTOCOL_TEXT or PROTOCOL_VERSION.
+// - publisher: what was last reported.
+// - status, current_floor, destination_floor: the car's state now.
+// - now_ns: the current CLOCK_MONOTONIC time.
+// - next_ns: receives when to call again if nothing changes first.
+// Returns: 0 on success, -1 if the connection failed.
+int car_core_publish_status(int fd, int protocol, car_status_publisher *publisher, car_status status,
+                            floor_t current_floor, floor_t destination_floor, uint64_t now_ns, uint64_t *next_ns)
+{
+    uint8_t fields = PROTO_FIELDS_ALL;
+    if (publisher->sent)
+    {
+        fields = 0;
+        fields |= (status != publisher->status) ? PROTO_FIELD_STATUS : 0;
+        fields |= (current_floor != publisher->current_floor) ? PROTO_FIELD_CURRENT : 0;
+        fields |= (destination_floor != publisher->destination_floor) ? PROTO_FIELD_DESTINATION : 0;
+
+        uint64_t due_ns = publisher->sent_ns + (fields != 0 ? publisher->interval_ns : publisher->heartbeat_ns);
+        if (now_ns < due_ns)
+        {
+            *next_ns = due_ns; // Coalescing, or idle until the next heartbeat
+            return 0;
+        }
+    }
+
+    int result;
+    if (!publisher->sent || protocol != PROTOCOL_VERSION)
+    {
+        result = car_core_send_status(fd, protocol, status, current_floor, destination_floor);
+    }
+    else
+    {
+        proto_status_update update;
+        result = write_frame(fd, &update, proto_encode_status_update(&update, fields, status, current_floor, destination_floor));
+    }
+
+    publisher->sent = 1;
+    publisher->sent_ns = now_ns;
+    publisher->status = status;
+    publisher->current_floor = current_floor;
+    publisher->destination_floor = destination_floor;
+    *next_ns = now_ns + publisher->heartbeat_ns;
+    return result;
+}
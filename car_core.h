@@ -0,0 +1,57 @@
+#ifndef CAR_CORE_H
+#define CAR_CORE_H
+
+#include "car_shm.h"
+
+// The car's state machine, shared by car (one car, one thread per activity) and carhost (many cars
+// driven by a worker pool and a timer queue). Nothing here blocks or sleeps: each function makes one
+// change to a car's shared memory, with its mutex held by the caller, and says what to wait for next.
+
+typedef struct
+{
+    char name[100];
+    floor_t lowest_floor;
+    floor_t highest_floor;
+    int delay; // Milliseconds per door phase and per floor travelled
+} car_config;
+
+#define CAR_STATUS_INTERVAL_MS 10 // Default least time between two STATUS reports of changes
+#define CAR_HEARTBEAT_MS 1000     // Default longest time without a STATUS report
+
+// Reports a car's status to the controller, coalescing bursts of changes (car_core_publish_status).
+// Only used by the thread reporting for the car.
+typedef struct
+{
+    uint64_t interval_ns;  // Least time between two reports; 0 reports every change at once
+    uint64_t heartbeat_ns; // Longest time without a report
+    uint64_t sent_ns;      // When the last report went out
+    int sent;              // Set once the first, full STATUS has gone out
+    car_status status;     // As last reported
+    floor_t current_floor;
+    floor_t destination_floor;
+} car_status_publisher;
+
+// What the car is waiting out a delay for.
+typedef enum
+{
+    CAR_STEP_NONE,         // Nothing to do until the shared memory changes
+    CAR_STEP_DOORS,        // One door phase: Opening, Open or Closing
+    CAR_STEP_MOVE_UP,      // One floor up, towards the destination as it was when the move began
+    CAR_STEP_MOVE_DOWN,    // One floor down, likewise
+    CAR_STEP_SERVICE_MOVE  // Straight to the destination, in individual service mode
+} car_step;
+
+car_shared_mem *car_core_create_shm(const char *shm_name, const car_config *config, int *shm_fd);
+void car_core_destroy_shm(car_shared_mem *shared_mem, const char *shm_name, int shm_fd);
+car_step car_core_begin_step(car_shared_mem *shared_mem, const car_config *config, car_status *step_status);
+void car_core_finish_step(car_shared_mem *shared_mem, car_step step, car_status step_status);
+int car_core_handle_buttons(car_shared_mem *shared_mem);
+void car_core_dispatch_floor(car_shared_mem *shared_mem, floor_t dispatch_floor);
+void car_core_set_status(car_shared_mem *shared_mem, car_status status);
+int car_core_send_registration(int fd, int protocol, const car_config *config);
+int car_core_send_status(int fd, int protocol, car_status status, floor_t current_floor, floor_t destination_floor);
+void car_core_init_publisher(car_status_publisher *publisher, int interval_ms, int heartbeat_ms);
+int car_core_publish_status(int fd, int protocol, car_status_publisher *publisher, car_status status,
+                            floor_t current_floor, floor_t destination_floor, uint64_t now_ns, uint64_t *next_ns);
+
+#endif // CAR_CORE_H
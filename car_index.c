@@ -0,0 +1,147 @@
+#include "car_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_WORDS_PER_FLOOR 1
+
+// Function: returns the row holding a floor's bitset.
+static uint64_t *floor_row(car_index *index, floor_t floor)
+{
+    return index->floor_bits + (size_t)(floor - FLOOR_LOWEST) * index->words_per_floor;
+}
+
+// Function: doubles (or creates) the index's slot capacity, restriding every floor row.
+// Arguments: index - the index to grow.
+// Returns: 1 on success, 0 if memory could not be allocated.
+static int grow_index(car_index *index)
+{
+    size_t old_words = index->words_per_floor;
+    size_t new_words = (old_words == 0) ? INITIAL_WORDS_PER_FLOOR : old_words * 2;
+
+    uint64_t *floor_bits = calloc((size_t)FLOOR_COUNT * new_words, sizeof(uint64_t));
+    uint64_t *slots_used = calloc(new_words, sizeof(uint64_t));
+    uint64_t *scratch = calloc(new_words, sizeof(uint64_t));
+    struct CarNode **cars = calloc(new_words * CAR_INDEX_WORD_BITS, sizeof(struct CarNode *));
+    if (floor_bits == NULL || slots_used == NULL || scratch == NULL || cars == NULL)
+    {
+        perror("calloc()");
+        free(floor_bits);
+        free(slots_used);
+        free(scratch);
+        free(cars);
+        return 0;
+    }
+
+    for (size_t floor = 0; floor < FLOOR_COUNT && old_words > 0; floor++)
+    {
+        memcpy(floor_bits + floor * new_words, index->floor_bits + floor * old_words, old_words * sizeof(uint64_t));
+    }
+    if (old_words > 0)
+    {
+        memcpy(slots_used, index->slots_used, old_words * sizeof(uint64_t));
+        memcpy(cars, index->cars, old_words * CAR_INDEX_WORD_BITS * sizeof(struct CarNode *));
+    }
+
+    free(index->floor_bits);
+    free(index->slots_used);
+    free(index->scratch);
+    free(index->cars);
+
+    index->floor_bits = floor_bits;
+    index->slots_used = slots_used;
+    index->scratch = scratch;
+    index->cars = cars;
+    index->words_per_floor = new_words;
+    return 1;
+}
+
+// Function: gives a car the lowest free slot and marks it on every floor it serves.
+// Arguments:
+// - index: the eligibility index.
+// - car: the car being registered.
+// - lowest_floor, highest_floor: the car's (valid) floor range.
+// Returns: the car's slot, or -1 if the index could not grow.
+int car_index_add(car_index *index, struct CarNode *car, floor_t lowest_floor, floor_t highest_floor)
+{
+    size_t word = 0;
+    while (word < index->words_per_floor && index->slots_used[word] == UINT64_MAX)
+    {
+        word++;
+    }
+    if (word == index->words_per_floor && !grow_index(index))
+    {
+        return -1;
+    }
+
+    int bit = __builtin_ctzll(~index->slots_used[word]);
+    uint64_t mask = 1ULL << bit;
+    int slot = (int)(word * CAR_INDEX_WORD_BITS) + bit;
+
+    index->slots_used[word] |= mask;
+    index->cars[slot] = car;
+    if (word + 1 > index->words_in_use)
+    {
+        index->words_in_use = word + 1;
+    }
+
+    for (int floor = lowest_floor; floor <= highest_floor; floor++)
+    {
+        floor_row(index, floor)[word] |= mask;
+    }
+    return slot;
+}
+
+// Function: clears a car's slot from every floor it served and frees the slot for reuse.
+// Arguments:
+// - index: the eligibility index.
+// - slot: the slot returned by car_index_add.
+// - lowest_floor, highest_floor: the floor range the car was added with.
+void car_index_remove(car_index *index, int slot, floor_t lowest_floor, floor_t highest_floor)
+{
+    size_t word = (size_t)slot / CAR_INDEX_WORD_BITS;
+    uint64_t mask = ~(1ULL << (slot % CAR_INDEX_WORD_BITS));
+
+    for (int floor = lowest_floor; floor <= highest_floor; floor++)
+    {
+        floor_row(index, floor)[word] &= mask;
+    }
+    index->slots_used[word] &= mask;
+    index->cars[slot] = NULL;
+}
+
+// Function: finds the cars that serve both floors of a call.
+// Arguments:
+// - index: the eligibility index.
+// - source_floor, destination_floor: the call's (valid) floors.
+// - word_count: receives the number of words in the returned bitset.
+// Returns: a bitset of eligible slots, valid until the next call on this index.
+const uint64_t *car_index_match(car_index *index, floor_t source_floor, floor_t destination_floor, size_t *word_count)
+{
+    *word_count = index->words_in_use;
+    if (index->words_in_use == 0)
+    {
+        return index->scratch;
+    }
+
+    const uint64_t *restrict source_row = floor_row(index, source_floor);
+    const uint64_t *restrict destination_row = floor_row(index, destination_floor);
+    uint64_t *restrict eligible = index->scratch;
+
+    // Word-wise AND; the compiler vectorises this loop at -O2 and above.
+    for (size_t i = 0; i < index->words_in_use; i++)
+    {
+        eligible[i] = source_row[i] & destination_row[i];
+    }
+    return eligible;
+}
+
+// Function: frees the index's storage, leaving it empty.
+void car_index_destroy(car_index *index)
+{
+    free(index->floor_bits);
+    free(index->slots_used);
+    free(index->scratch);
+    free(index->cars);
+    memset(index, 0, sizeof(*index));
+}
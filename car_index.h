@@ -0,0 +1,31 @@
+#ifndef CAR_INDEX_H
+#define CAR_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+
+#define FLOOR_COUNT (FLOOR_HIGHEST - FLOOR_LOWEST + 1) // Every floor B99..999, one row each
+#define CAR_INDEX_WORD_BITS 64
+
+struct CarNode;
+
+// Maps each floor to a bitset of the cars that serve it. Every car owns a slot (a bit position);
+// the cars able to take a call are the AND of the source and destination rows. Rows are stored
+// contiguously, words_per_floor words each, so the AND is a straight loop over two arrays.
+typedef struct
+{
+    uint64_t *floor_bits;
+    uint64_t *slots_used;
+    uint64_t *scratch;
+    struct CarNode **cars; // Slot number to car
+    size_t words_per_floor;
+    size_t words_in_use;   // Words up to the highest slot ever handed out
+} car_index;
+
+int car_index_add(car_index *index, struct CarNode *car, floor_t lowest_floor, floor_t highest_floor);
+void car_index_remove(car_index *index, int slot, floor_t lowest_floor, floor_t highest_floor);
+const uint64_t *car_index_match(car_index *index, floor_t source_floor, floor_t destination_floor, size_t *word_count);
+void car_index_destroy(car_index *index);
+
+#endif // CAR_INDEX_H
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "car_shm.h"
+
+// Function: sets up a newly created segment: header, process-shared mutex, doors closed at the
+// lowest floor, every control clear and no changes counted.
+// Arguments:
+// - shared_mem: the mapped segment.
+// - lowest_floor, highest_floor: the car's range.
+// Returns: void
+void car_shm_init(car_shared_mem *shared_mem, floor_t lowest_floor, floor_t highest_floor)
+{
+    memset(shared_mem, 0, sizeof(*shared_mem));
+
+    pthread_mutexattr_t mutattr;
+    pthread_mutexattr_init(&mutattr);
+    pthread_mutexattr_setpshared(&mutattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&shared_mem->mutex, &mutattr);
+    pthread_mutexattr_destroy(&mutattr);
+
+    shared_mem->status = CAR_STATUS_CLOSED;
+    shared_mem->current_floor = lowest_floor;
+    shared_mem->destination_floor = lowest_floor;
+
+    shared_mem->header.version = CAR_SHM_VERSION;
+    shared_mem->header.size = sizeof(car_shared_mem);
+    shared_mem->header.v1_guard = CAR_SHM_V1_GUARD;
+    shared_mem->header.lowest_floor = lowest_floor;
+    shared_mem->header.highest_floor = highest_floor;
+
+    // The magic goes in last: a program that finds it sees a complete segment.
+    __atomic_store_n(&shared_mem->header.magic, CAR_SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+// Function: maps an existing car's segment after checking it has this layout.
+// Arguments:
+// - car_name: the car's name, without the "/car" prefix.
+// - writable: 0 to map read-only (the segment cannot then be locked), 1 for read and write.
+// - shared_mem: receives the mapping when CAR_SHM_OK is returned.
+// Returns: CAR_SHM_OK, or why the segment cannot be used.
+car_shm_result car_shm_open(const char *car_name, int writable, car_shared_mem **shared_mem)
+{
+    char shm_name[128];
+    snprintf(shm_name, sizeof(shm_name), "/car%s", car_name);
+
+    int shm_fd = shm_open(shm_name, writable ? O_RDWR : O_RDONLY, 0666);
+    if (shm_fd == -1)
+    {
+        return CAR_SHM_NOT_FOUND;
+    }
+
+    // Check the size before mapping, so a smaller segment cannot fault on access.
+    struct stat info;
+    if (fstat(shm_fd, &info) == -1)
+    {
+        close(shm_fd);
+        return CAR_SHM_FAILED;
+    }
+    if (info.st_size != sizeof(car_shared_mem))
+    {
+        close(shm_fd);
+        return CAR_SHM_WRONG_LAYOUT;
+    }
+
+    car_shared_mem *mapped = mmap(NULL, sizeof(car_shared_mem), writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (mapped == MAP_FAILED)
+    {
+        return CAR_SHM_FAILED;
+    }
+
+    if (__atomic_load_n(&mapped->header.magic, __ATOMIC_ACQUIRE) != CAR_SHM_MAGIC ||
+        mapped->header.version != CAR_SHM_VERSION || mapped->header.size != sizeof(car_shared_mem))
+    {
+        munmap(mapped, sizeof(car_shared_mem));
+        return CAR_SHM_WRONG_LAYOUT;
+    }
+
+    *shared_mem = mapped;
+    return CAR_SHM_OK;
+}
+
+// Function: unmaps a segment mapped with car_shm_open.
+void car_shm_close(car_shared_mem *shared_mem)
+{
+    munmap(shared_mem, sizeof(car_shared_mem));
+}
+
+// Function: marks the start of a change to the state or controls. Mutex held.
+// Arguments: shared_mem - the car's segment.
+// Returns: void
+void car_shm_write_begin(car_shared_mem *shared_mem)
+{
+    __atomic_store_n(&shared_mem->sequence, shared_mem->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE); // The odd count is visible before any field changes
+}
+
+// Function: marks the end of a change started with car_shm_write_begin. Mutex held.
+// Arguments: shared_mem - the car's segment.
+// Returns: void
+void car_shm_write_end(car_shared_mem *shared_mem)
+{
+    __atomic_store_n(&shared_mem->sequence, shared_mem->sequence + 1, __ATOMIC_RELEASE);
+}
+
+// Function: copies a car's state and controls without taking the mutex, so it works on a read-only
+// mapping and never holds up the car. A copy that overlapped a change is thrown away and taken again.
+// Arguments:
+// - shared_mem: the car's segment.
+// - snapshot: receives the copy.
+// Returns: the number of copies thrown away, or -1 if none was consistent after CAR_SHM_READ_ATTEMPTS
+// (a writer died part way through a change).
+int car_shm_read(const car_shared_mem *shared_mem, car_shm_snapshot *snapshot)
+{
+    for (int attempt = 0; attempt < CAR_SHM_READ_ATTEMPTS; attempt++)
+    {
+        uint32_t before = __atomic_load_n(&shared_mem->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1)
+        {
+            continue; // A change is being written
+        }
+
+        snapshot->status = __atomic_load_n(&shared_mem->status, __ATOMIC_RELAXED);
+        snapshot->current_floor = __atomic_load_n(&shared_mem->current_floor, __ATOMIC_RELAXED);
+        snapshot->destination_floor = __atomic_load_n(&shared_mem->destination_floor, __ATOMIC_RELAXED);
+        snapshot->open_button = __atomic_load_n(&shared_mem->open_button, __ATOMIC_RELAXED);
+        snapshot->close_button = __atomic_load_n(&shared_mem->close_button, __ATOMIC_RELAXED);
+        snapshot->door_obstruction = __atomic_load_n(&shared_mem->door_obstruction, __ATOMIC_RELAXED);
+        snapshot->overload = __atomic_load_n(&shared_mem->overload, __ATOMIC_RELAXED);
+        snapshot->emergency_stop = __atomic_load_n(&shared_mem->emergency_stop, __ATOMIC_RELAXED);
+        snapshot->individual_service_mode = __atomic_load_n(&shared_mem->individual_service_mode, __ATOMIC_RELAXED);
+        snapshot->emergency_mode = __atomic_load_n(&shared_mem->emergency_mode, __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE); // The copy is complete before the counter is read again
+        if (__atomic_load_n(&shared_mem->sequence, __ATOMIC_RELAXED) == before)
+        {
+            snapshot->sequence = before;
+            return attempt;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,126 @@
+#ifndef CAR_SHM_H
+#define CAR_SHM_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+
+// Layout of a car's shared memory segment (/car{name}), shared by every program that maps one.
+//
+// Version 2 stores the status as a car_status and the floors as floor_t values, and puts fields
+// written by different parties on different cache lines: the read-only header, the mutex, the car's
+// state (written by the car on every step), the controls (written by internal and safety) and the
+// wakeup channels (written on every change and every wait). Programs map a segment with
+// car_shm_open, which refuses any other layout.
+//
+// The state and controls are also covered by a sequence counter (a seqlock), so read-only observers
+// can take a consistent snapshot without the mutex. Writers, who hold the mutex, bracket each change
+// with car_shm_write_begin and car_shm_write_end, which make the counter odd while it is under way.
+// car_shm_read copies the fields and retries if the counter was odd or moved during the copy.
+//
+// Version 1 put a pthread mutex at offset 0 and its fields, as strings and bytes, at offsets 88 to
+// 111. A version 2 segment keeps those bytes in the header: the word where a version 1 mutex keeps its
+// type holds an invalid type, so a version 1 program's pthread_mutex_lock fails with EINVAL at once,
+// and its field offsets fall on unused header bytes, so a version 1 program that ignores the error
+// finds no status or floors and changes nothing a version 2 program reads.
+
+#define CAR_SHM_MAGIC 0x32524143 // "CAR2"
+#define CAR_SHM_VERSION 2
+#define CAR_SHM_CACHE_LINE 64
+#define CAR_SHM_HEADER_SIZE (2 * CAR_SHM_CACHE_LINE)
+#define CAR_SHM_V1_GUARD (-1) // Not a valid pthread mutex type
+
+// Wakeup channels: what a change to the shared memory was about. A waiter sleeps on the channels it
+// acts on and is not woken by the rest (car_wakeup.h).
+#define CAR_CHANGE_BUTTONS 0x1 // open_button, close_button
+#define CAR_CHANGE_DOORS 0x2   // status
+#define CAR_CHANGE_MOTION 0x4  // current_floor, destination_floor
+#define CAR_CHANGE_SAFETY 0x8  // door_obstruction, overload, emergency_stop, individual_service_mode, emergency_mode
+#define CAR_CHANGE_ALL 0xF
+#define CAR_CHANNEL_COUNT 4
+
+typedef struct
+{
+    uint32_t magic;        // CAR_SHM_MAGIC
+    uint16_t version;      // CAR_SHM_VERSION
+    uint16_t reserved;
+    uint32_t size;         // sizeof(car_shared_mem)
+    uint32_t reserved2;
+    int32_t v1_guard;      // Where a version 1 mutex keeps its type: CAR_SHM_V1_GUARD
+    floor_t lowest_floor;  // The car's range, fixed when the car starts
+    floor_t highest_floor;
+} car_shm_header;
+
+typedef struct
+{
+    // Written once, when the car creates the segment.
+    car_shm_header header;
+    uint8_t header_padding[CAR_SHM_HEADER_SIZE - sizeof(car_shm_header)];
+
+    pthread_mutex_t mutex __attribute__((aligned(CAR_SHM_CACHE_LINE))); // Lock for everything below
+
+    // Car state, written by the car.
+    uint32_t sequence __attribute__((aligned(CAR_SHM_CACHE_LINE))); // Seqlock: odd while a change is being written
+    uint8_t status;                                                    // car_status
+    floor_t current_floor;
+    floor_t destination_floor;
+
+    // Controls, written by internal and safety.
+    uint8_t open_button __attribute__((aligned(CAR_SHM_CACHE_LINE)));
+    uint8_t close_button;
+    uint8_t door_obstruction;
+    uint8_t overload;
+    uint8_t emergency_stop;
+    uint8_t individual_service_mode;
+    uint8_t emergency_mode;
+
+    // Wakeup channels (car_wakeup.h).
+    uint32_t wake_word __attribute__((aligned(CAR_SHM_CACHE_LINE))); // Futex word, bumped on every change
+    uint32_t channel_seq[CAR_CHANNEL_COUNT];                           // Changes made on each channel
+    uint32_t sleepers[CAR_CHANNEL_COUNT];                              // Threads asleep on each channel
+} car_shared_mem;
+
+_Static_assert(offsetof(car_shm_header, v1_guard) == 16, "v1 mutex type offset");
+_Static_assert(sizeof(car_shm_header) <= 88, "header must leave the v1 field offsets unused");
+_Static_assert(offsetof(car_shared_mem, mutex) == 128, "car_shared_mem layout");
+_Static_assert(offsetof(car_shared_mem, sequence) == 192, "car_shared_mem layout");
+_Static_assert(offsetof(car_shared_mem, open_button) == 256, "car_shared_mem layout");
+_Static_assert(offsetof(car_shared_mem, wake_word) == 320, "car_shared_mem layout");
+_Static_assert(sizeof(car_shared_mem) == 384, "car_shared_mem layout");
+
+// A consistent copy of a car's state and controls, taken without the mutex.
+typedef struct
+{
+    uint32_t sequence; // The counter the copy was taken at; it changes with every write
+    car_status status;
+    floor_t current_floor;
+    floor_t destination_floor;
+    uint8_t open_button;
+    uint8_t close_button;
+    uint8_t door_obstruction;
+    uint8_t overload;
+    uint8_t emergency_stop;
+    uint8_t individual_service_mode;
+    uint8_t emergency_mode;
+} car_shm_snapshot;
+
+#define CAR_SHM_READ_ATTEMPTS 100000 // car_shm_read gives up after this many torn reads
+
+// Results of car_shm_open.
+typedef enum
+{
+    CAR_SHM_OK,
+    CAR_SHM_NOT_FOUND,    // No segment for that car
+    CAR_SHM_WRONG_LAYOUT, // A segment of another layout version, or not a car segment
+    CAR_SHM_FAILED        // The segment exists but could not be mapped
+} car_shm_result;
+
+void car_shm_init(car_shared_mem *shared_mem, floor_t lowest_floor, floor_t highest_floor);
+car_shm_result car_shm_open(const char *car_name, int writable, car_shared_mem **shared_mem);
+void car_shm_close(car_shared_mem *shared_mem);
+void car_shm_write_begin(car_shared_mem *shared_mem);
+void car_shm_write_end(car_shared_mem *shared_mem);
+int car_shm_read(const car_shared_mem *shared_mem, car_shm_snapshot *snapshot);
+
+#endif // CAR_SHM_H
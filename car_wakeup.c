@@ -0,0 +1,117 @@
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "car_wakeup.h"
+
+// For FUTEX_WAIT_BITSET the timeout is an absolute CLOCK_MONOTONIC time, or NULL to wait forever.
+static long futex(uint32_t *word, int op, uint32_t value, const struct timespec *timeout, uint32_t bitset)
+{
+    return syscall(SYS_futex, word, op, value, timeout, NULL, bitset);
+}
+
+// Function: records a change and wakes the threads waiting on its channels.
+// Arguments:
+// - shared_mem: the car's segment, mutex held.
+// - changes: the CAR_CHANGE_* channels the change affects.
+// Returns: void
+void car_notify(car_shared_mem *shared_mem, uint32_t changes)
+{
+    int sleeping = 0;
+    for (int i = 0; i < CAR_CHANNEL_COUNT; i++)
+    {
+        if (changes & (1U << i))
+        {
+            shared_mem->channel_seq[i]++;
+            sleeping += shared_mem->sleepers[i];
+        }
+    }
+    __atomic_add_fetch(&shared_mem->wake_word, 1, __ATOMIC_SEQ_CST);
+
+    // Waiters register under the mutex, so when nobody is asleep on these channels there is no
+    // need to enter the kernel.
+    if (sleeping > 0)
+    {
+        futex(&shared_mem->wake_word, FUTEX_WAKE_BITSET, INT_MAX, NULL, changes);
+    }
+}
+
+// Function: records how many changes each channel has seen, as the starting point for car_wait.
+// Arguments:
+// - shared_mem: the car's segment, mutex held.
+// - seen: receives the channel counts.
+// Returns: void
+void car_watch(car_shared_mem *shared_mem, uint32_t seen[CAR_CHANNEL_COUNT])
+{
+    for (int i = 0; i < CAR_CHANNEL_COUNT; i++)
+    {
+        seen[i] = shared_mem->channel_seq[i];
+    }
+}
+
+// Function: waits until one of the given channels changes. Like pthread_cond_wait, the mutex is
+// released while asleep and held again on return.
+// Arguments:
+// - shared_mem: the car's segment, mutex held.
+// - channels: the CAR_CHANGE_* channels to wait for.
+// - seen: the channel counts already acted on (from car_watch or the last car_wait); updated.
+// Returns: the channels that changed.
+uint32_t car_wait(car_shared_mem *shared_mem, uint32_t channels, uint32_t seen[CAR_CHANNEL_COUNT])
+{
+    return car_wait_until(shared_mem, channels, seen, NULL);
+}
+
+// Function: as car_wait, but gives up at a deadline.
+// Arguments:
+// - shared_mem, channels, seen: as car_wait.
+// - deadline: an absolute CLOCK_MONOTONIC time, or NULL to wait as long as it takes.
+// Returns: the channels that changed, or 0 if none had by the deadline.
+uint32_t car_wait_until(car_shared_mem *shared_mem, uint32_t channels, uint32_t seen[CAR_CHANNEL_COUNT],
+                        const struct timespec *deadline)
+{
+    int timed_out = 0;
+    while (1)
+    {
+        uint32_t changed = 0;
+        for (int i = 0; i < CAR_CHANNEL_COUNT; i++)
+        {
+            if ((channels & (1U << i)) && shared_mem->channel_seq[i] != seen[i])
+            {
+                changed |= 1U << i;
+                seen[i] = shared_mem->channel_seq[i];
+            }
+        }
+        if (changed != 0 || timed_out)
+        {
+            return changed;
+        }
+
+        // The word is read under the mutex, so a change made after the mutex is released moves it
+        // on and the futex wait returns at once rather than missing the wake.
+        uint32_t word = __atomic_load_n(&shared_mem->wake_word, __ATOMIC_SEQ_CST);
+        for (int i = 0; i < CAR_CHANNEL_COUNT; i++)
+        {
+            if (channels & (1U << i))
+            {
+                shared_mem->sleepers[i]++;
+            }
+        }
+
+        pthread_mutex_unlock(&shared_mem->mutex);
+        if (futex(&shared_mem->wake_word, FUTEX_WAIT_BITSET, word, deadline, channels) == -1 && errno == ETIMEDOUT)
+        {
+            timed_out = 1; // One last look at the channels before giving up
+        }
+        pthread_mutex_lock(&shared_mem->mutex);
+
+        for (int i = 0; i < CAR_CHANNEL_COUNT; i++)
+        {
+            if (channels & (1U << i))
+            {
+                shared_mem->sleepers[i]--;
+            }
+        }
+    }
+}
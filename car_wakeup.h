@@ -0,0 +1,20 @@
+#ifndef CAR_WAKEUP_H
+#define CAR_WAKEUP_H
+
+#include <time.h>
+#include "car_shm.h"
+
+// Targeted wakeups for a car's shared memory. Every change is tagged with the channels it affects
+// (CAR_CHANGE_* in common.h). Each channel counts its changes, and a waiter sleeps on the segment's
+// futex word with a bitset of the channels it wants, so FUTEX_WAKE_BITSET only wakes the threads
+// that act on what changed. The futex is not private, so waiters in other processes are woken too.
+//
+// Both functions are called with the shared memory mutex held.
+
+void car_notify(car_shared_mem *shared_mem, uint32_t changes);
+void car_watch(car_shared_mem *shared_mem, uint32_t seen[CAR_CHANNEL_COUNT]);
+uint32_t car_wait(car_shared_mem *shared_mem, uint32_t channels, uint32_t seen[CAR_CHANNEL_COUNT]);
+uint32_t car_wait_until(car_shared_mem *shared_mem, uint32_t channels, uint32_t seen[CAR_CHANNEL_COUNT],
+                        const struct timespec *deadline);
+
+#endif // CAR_WAKEUP_H
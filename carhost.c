@@ -0,0 +1,767 @@
+// carhost - runs many elevator cars in one process.
+//
+// Each car behaves exactly like a `car` process: it has its own /carX shared memory segment (so
+// `internal` and `safety` work unchanged), its own connection to the controller and the same state
+// machine (car_core.c). What differs is how the cars are driven. Instead of four threads per car
+// blocked on condition variables and timed waits:
+// - a pool of worker threads runs the cars' state machines. A car is queued for the pool when
+//   something happens to it, and only one worker handles a car at a time;
+// - one I/O thread waits in epoll on every car's controller connection and on a timer wheel that
+//   holds every car's current delay and when its next STATUS report is due;
+// - a small watcher thread per car waits on the car's wakeup channels (car_wakeup.h) and queues the
+//   car when another program (internal, safety) changes its shared memory. A futex cannot be waited
+//   on from epoll, so this is the one thread per car that is left.
+//
+// Built with `make URING=1`, -U runs the I/O thread on an io_uring instead of epoll: each connection
+// has a multishot receive into buffers registered with the ring, so FLOORs for many cars are read
+// with one system call per batch rather than one read per car.
+//
+// Usage: carhost [-p {protocol version}] [-w {workers}] [-i {status interval ms}] [-H {heartbeat ms}] [-U] {config file}
+// Each line of the config file is "{name} {lowest floor} {highest floor} {delay}", as the arguments
+// to `car`. Blank lines and lines starting with '#' are skipped.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "network_utils.h"
+#include "common.h"
+#include "protocol.h"
+#include "car_core.h"
+#include "car_wakeup.h"
+#include "timer_wheel.h"
+#include "trace.h"
+#ifdef USE_URING
+#include "uring.h"
+#endif
+
+#define MAX_CARS 1024
+#define DEFAULT_WORKERS 4
+#define MAX_EVENTS 64
+#define WATCHER_STACK_SIZE (64 * 1024)
+#define URING_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+#define URING_BUFFER_COUNT 256
+#define URING_BUFFER_SIZE 4096
+
+// Events queued for a car, handled by the next worker to run it.
+#define CAR_EVENT_CHANGED 1 // The shared memory changed or a floor was dispatched
+#define CAR_EVENT_TIMER 2   // The delay for the current step is over
+#define CAR_EVENT_STATUS 4  // A coalesced STATUS or a heartbeat may be due
+
+struct hosted_car;
+
+// A car's timer in the timer wheel, which says what it is for when it expires.
+typedef struct
+{
+    timer_wheel_timer timer; // First, so an expired timer is its car_timer
+    struct hosted_car *car;
+    int event; // CAR_EVENT_TIMER or CAR_EVENT_STATUS
+} car_timer;
+
+typedef struct hosted_car
+{
+    car_config config;
+    char shm_name[104];
+    car_shared_mem *shared_mem;
+    int shm_fd;
+    int controller_fd; // -1 when not connected
+    frame_reader reader;
+
+    // Protected by lock: the events waiting for a worker and whether the car is on the run queue.
+    pthread_mutex_t lock;
+    int pending_events;
+    uint64_t fired_generation; // Generation of the timer behind the last CAR_EVENT_TIMER
+    int queued;
+    struct hosted_car *next_queued;
+
+    // Only touched by the worker running the car.
+    car_step step;
+    car_status step_status;
+    car_timer step_timer;
+    car_timer status_timer;
+    uint64_t status_timer_ns; // When the status timer is armed to expire
+    car_status_publisher publisher;
+} hosted_car;
+
+// Cars with events waiting, oldest first.
+typedef struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    hosted_car *head;
+    hosted_car *tail;
+} run_queue;
+
+hosted_car *cars;
+int car_count = 0;
+int protocol = PROTOCOL_TEXT;
+int status_interval_ms = CAR_STATUS_INTERVAL_MS;
+int heartbeat_ms = CAR_HEARTBEAT_MS;
+run_queue runnable = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL};
+timer_wheel timers;
+int use_uring; // The I/O thread waits on an io_uring rather than epoll (-U)
+
+void usage();
+void load_config(const char *path);
+void connect_car(hosted_car *car);
+void post_events(hosted_car *car, int events, uint64_t generation);
+void *worker(void *arg);
+void step_car(hosted_car *car, int events, uint64_t fired_generation);
+void *io_loop(void *arg);
+void handle_controller_readable(hosted_car *car);
+void handle_controller_frames(hosted_car *car, int failed);
+void expire_timers();
+#ifdef USE_URING
+void *uring_io_loop();
+void handle_car_received(hosted_car *car, const struct io_uring_cqe *cqe, uring *ring, uring_buffers *buffers);
+#endif
+void *watch_shared_memory(void *arg);
+
+int main(int argc, char **argv)
+{
+    int worker_count = DEFAULT_WORKERS;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:w:i:H:U")) != -1)
+    {
+        if (opt == 'p' && (atoi(optarg) == PROTOCOL_TEXT || atoi(optarg) == PROTOCOL_VERSION))
+        {
+            protocol = atoi(optarg);
+        }
+        else if (opt == 'w' && atoi(optarg) > 0)
+        {
+            worker_count = atoi(optarg);
+        }
+        else if (opt == 'i' && atoi(optarg) >= 0)
+        {
+            status_interval_ms = atoi(optarg);
+        }
+        else if (opt == 'H' && atoi(optarg) >= 0)
+        {
+            heartbeat_ms = atoi(optarg);
+        }
+        else if (opt == 'U')
+        {
+#ifdef USE_URING
+            use_uring = 1;
+#else
+            printf("This carhost was built without io_uring; rebuild it with \"make URING=1\".\n");
+            exit(EXIT_FAILURE);
+#endif
+        }
+        else
+        {
+            usage();
+        }
+    }
+    if (argc - optind != 1)
+    {
+        usage();
+    }
+    trace_init("carhost", NULL);
+
+    // Every thread inherits a blocked SIGINT; main collects it with sigwait and cleans up.
+    sigset_t interrupt_set;
+    sigemptyset(&interrupt_set);
+    sigaddset(&interrupt_set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &interrupt_set, NULL);
+
+    // Ensure the host doesn't crash when a write to the controller fails.
+    signal(SIGPIPE, SIG_IGN);
+
+    load_config(argv[optind]);
+
+    if (timer_wheel_init(&timers) == -1)
+    {
+        perror("timer_wheel_init()");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < car_count; i++)
+    {
+        hosted_car *car = &cars[i];
+        snprintf(car->shm_name, sizeof(car->shm_name), "/car%s", car->config.name);
+        car->shared_mem = car_core_create_shm(car->shm_name, &car->config, &car->shm_fd);
+        pthread_mutex_init(&car->lock, NULL);
+        car->step = CAR_STEP_NONE;
+        car->step_timer.car = car;
+        car->step_timer.event = CAR_EVENT_TIMER;
+        car->status_timer.car = car;
+        car->status_timer.event = CAR_EVENT_STATUS;
+        car_core_init_publisher(&car->publisher, status_interval_ms, heartbeat_ms);
+        connect_car(car);
+    }
+
+    pthread_t io_thread;
+    if (pthread_create(&io_thread, NULL, io_loop, NULL) != 0)
+    {
+        perror("pthread_create() for I/O thread");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < worker_count; i++)
+    {
+        pthread_t worker_thread;
+        if (pthread_create(&worker_thread, NULL, worker, NULL) != 0)
+        {
+            perror("pthread_create() for worker");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The watchers only wait on a futex, so they get small stacks.
+    pthread_attr_t watcher_attr;
+    pthread_attr_init(&watcher_attr);
+    pthread_attr_setstacksize(&watcher_attr, WATCHER_STACK_SIZE);
+    for (int i = 0; i < car_count; i++)
+    {
+        pthread_t watcher_thread;
+        if (pthread_create(&watcher_thread, &watcher_attr, watch_shared_memory, &cars[i]) != 0)
+        {
+            perror("pthread_create() for watcher");
+            exit(EXIT_FAILURE);
+        }
+        post_events(&cars[i], CAR_EVENT_CHANGED, 0); // Send the first STATUS
+    }
+    pthread_attr_destroy(&watcher_attr);
+
+    int sig;
+    sigwait(&interrupt_set, &sig);
+
+    for (int i = 0; i < car_count; i++)
+    {
+        car_core_destroy_shm(cars[i].shared_mem, cars[i].shm_name, cars[i].shm_fd);
+    }
+    exit(0);
+}
+
+void usage()
+{
+    printf("Usage: carhost [-p {protocol version}] [-w {workers}] [-i {status interval ms}] [-H {heartbeat ms}] {config file}\n");
+    printf("Config lines: {name} {lowest floor} {highest floor} {delay}\n");
+    exit(1);
+}
+
+// Function: Reads the cars to host from the config file.
+// Arguments: path - the config file.
+// Returns: void. Exits on an unreadable file or an invalid line.
+void load_config(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror("fopen()");
+        exit(1);
+    }
+
+    cars = calloc(MAX_CARS, sizeof(hosted_car));
+    if (cars == NULL)
+    {
+        perror("calloc()");
+        exit(1);
+    }
+
+    char line[256];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line_number++;
+        char name[100], lowest[8], highest[8];
+        int delay;
+        char *text = line + strspn(line, " \t");
+        if (*text == '#' || *text == '\n' || *text == '\0')
+        {
+            continue;
+        }
+
+        if (sscanf(text, "%99s %7s %7s %d", name, lowest, highest, &delay) != 4 || car_count == MAX_CARS)
+        {
+            fprintf(stderr, "%s:%d: expected {name} {lowest floor} {highest floor} {delay}\n", path, line_number);
+            exit(1);
+        }
+
+        car_config *config = &cars[car_count].config;
+        strcpy(config->name, name);
+        config->lowest_floor = parse_floor(lowest);
+        config->highest_floor = parse_floor(highest);
+        config->delay = delay;
+        if (config->lowest_floor == FLOOR_INVALID || config->highest_floor == FLOOR_INVALID ||
+            config->lowest_floor > config->highest_floor)
+        {
+            fprintf(stderr, "%s:%d: invalid floor range\n", path, line_number);
+            exit(1);
+        }
+        cars[car_count].controller_fd = -1;
+        car_count++;
+    }
+    fclose(file);
+
+    if (car_count == 0)
+    {
+        fprintf(stderr, "%s: no cars\n", path);
+        exit(1);
+    }
+}
+
+// Function: Connects a car to the controller and registers it. A car that cannot connect runs
+// without a controller, as `car` does.
+// Arguments: car - the car to connect.
+// Returns: void
+void connect_car(hosted_car *car)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        perror("socket()");
+        return;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(3000);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+    if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return;
+    }
+
+    // Many cars share the host's writes; do not hold a small STATUS back waiting for an ACK.
+    int opt_enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt_enable, sizeof(opt_enable));
+
+    if (car_core_send_registration(fd, protocol, &car->config) == -1 ||
+        frame_reader_init(&car->reader, DEFAULT_MAX_FRAME_SIZE) == -1)
+    {
+        close(fd);
+        return;
+    }
+    car->controller_fd = fd;
+}
+
+// Function: Records events for a car and puts it on the run queue unless it is already there.
+// Arguments:
+// - car: the car.
+// - events: CAR_EVENT_* bits.
+// - generation: for CAR_EVENT_TIMER, the generation of the timer that expired.
+// Returns: void
+void post_events(hosted_car *car, int events, uint64_t generation)
+{
+    pthread_mutex_lock(&car->lock);
+    car->pending_events |= events;
+    if (events & CAR_EVENT_TIMER)
+    {
+        car->fired_generation = generation;
+    }
+    int enqueue = !car->queued;
+    car->queued = 1;
+    pthread_mutex_unlock(&car->lock);
+
+    if (!enqueue)
+    {
+        return; // The worker that has it will see the new events before letting it go
+    }
+
+    pthread_mutex_lock(&runnable.mutex);
+    car->next_queued = NULL;
+    if (runnable.tail == NULL)
+    {
+        runnable.head = car;
+    }
+    else
+    {
+        runnable.tail->next_queued = car;
+    }
+    runnable.tail = car;
+    pthread_cond_signal(&runnable.cond);
+    pthread_mutex_unlock(&runnable.mutex);
+}
+
+// Function: Worker thread. Takes cars off the run queue and handles their events until none are left.
+// A car stays marked as queued while a worker has it, so no other worker picks it up.
+// Arguments: unused
+// Returns: never
+void *worker(void *arg)
+{
+    (void)arg;
+    trace_name_thread("worker");
+
+    while (1)
+    {
+        pthread_mutex_lock(&runnable.mutex);
+        while (runnable.head == NULL)
+        {
+            pthread_cond_wait(&runnable.cond, &runnable.mutex);
+        }
+        hosted_car *car = runnable.head;
+        runnable.head = car->next_queued;
+        if (runnable.head == NULL)
+        {
+            runnable.tail = NULL;
+        }
+        pthread_mutex_unlock(&runnable.mutex);
+
+        while (1)
+        {
+            pthread_mutex_lock(&car->lock);
+            int events = car->pending_events;
+            uint64_t fired_generation = car->fired_generation;
+            car->pending_events = 0;
+            if (events == 0)
+            {
+                car->queued = 0;
+                pthread_mutex_unlock(&car->lock);
+                break;
+            }
+            pthread_mutex_unlock(&car->lock);
+
+            step_car(car, events, fired_generation);
+        }
+    }
+    return NULL;
+}
+
+// Function: Runs a car's state machine as far as it can go without waiting: acts on the buttons,
+// finishes the current step if its delay is over, starts the next step and arms a timer for it, then
+// reports to the controller if a report is due, arming a timer for the next one. The same steps
+// `car` takes on its threads.
+// Arguments:
+// - car: the car.
+// - events: CAR_EVENT_* bits.
+// - fired_generation: the generation of the expired timer, with CAR_EVENT_TIMER.
+// Returns: void
+void step_car(hosted_car *car, int events, uint64_t fired_generation)
+{
+    car_shared_mem *shared_mem = car->shared_mem;
+    trace_subject(car->config.name);
+
+    pthread_mutex_lock(&shared_mem->mutex);
+    // A timer that expired as the step it was armed for ended early is from an older generation.
+    int delay_over = (events & CAR_EVENT_TIMER) && fired_generation == car->step_timer.timer.generation;
+    int cut_short = car_core_handle_buttons(shared_mem); // The close button cuts the doors' open time short
+
+    if ((delay_over || cut_short) && car->step != CAR_STEP_NONE)
+    {
+        car_core_finish_step(shared_mem, car->step, car->step_status);
+        car->step = CAR_STEP_NONE;
+        if (!delay_over)
+        {
+            timer_wheel_cancel(&timers, &car->step_timer.timer);
+        }
+    }
+
+    if (car->step == CAR_STEP_NONE)
+    {
+        car->step = car_core_begin_step(shared_mem, &car->config, &car->step_status);
+        if (car->step != CAR_STEP_NONE)
+        {
+            uint64_t deadline = timer_wheel_now() + (uint64_t)car->config.delay * 1000000ULL;
+            timer_wheel_arm(&timers, &car->step_timer.timer, deadline);
+        }
+    }
+
+    car_status status = shared_mem->status;
+    floor_t current_floor = shared_mem->current_floor;
+    floor_t destination_floor = shared_mem->destination_floor;
+    pthread_mutex_unlock(&shared_mem->mutex);
+
+    if (car->controller_fd == -1)
+    {
+        return;
+    }
+
+    // A failed write means the controller went away; the I/O thread sees the EOF.
+    uint64_t now = timer_wheel_now();
+    uint64_t next_ns;
+    car_core_publish_status(car->controller_fd, protocol, &car->publisher, status, current_floor, destination_floor, now, &next_ns);
+
+    // Re-arming moves the status timer, so a report that pushes the next heartbeat back costs no wakeup.
+    if (car->status_timer_ns <= now || next_ns != car->status_timer_ns)
+    {
+        timer_wheel_arm(&timers, &car->status_timer.timer, next_ns);
+        car->status_timer_ns = next_ns;
+    }
+}
+
+// Function: I/O thread. Waits on every car's controller connection and on the timer wheel, and turns
+// what arrives into events for the workers.
+// Arguments: unused
+// Returns: never
+void *io_loop(void *arg)
+{
+    (void)arg;
+    trace_name_thread("io");
+#ifdef USE_URING
+    if (use_uring)
+    {
+        return uring_io_loop();
+    }
+#endif
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1)
+    {
+        perror("epoll_create1()");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // The timer wheel
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timers.timer_fd, &ev) == -1)
+    {
+        perror("epoll_ctl()");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < car_count; i++)
+    {
+        if (cars[i].controller_fd == -1)
+        {
+            continue;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &cars[i];
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cars[i].controller_fd, &ev) == -1)
+        {
+            perror("epoll_ctl()");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1)
+    {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("epoll_wait()");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < ready; i++)
+        {
+            hosted_car *car = events[i].data.ptr;
+            if (car == NULL)
+            {
+                expire_timers();
+                continue;
+            }
+
+            int fd = car->controller_fd;
+            handle_controller_readable(car);
+            if (car->controller_fd == -1)
+            {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Function: Queues the cars whose timers are due for the workers.
+// Arguments: none
+// Returns: void
+void expire_timers()
+{
+    timer_expiry expired[MAX_EVENTS];
+    size_t count = timer_wheel_expire(&timers, expired, MAX_EVENTS);
+    for (size_t j = 0; j < count; j++)
+    {
+        car_timer *timer = (car_timer *)expired[j].timer;
+        post_events(timer->car, timer->event, expired[j].generation);
+    }
+}
+
+// Function: Reads the FLOOR frames waiting on a car's connection and dispatches them.
+// Arguments: car - the car whose connection is readable.
+// Returns: void
+void handle_controller_readable(hosted_car *car)
+{
+    int failed = (frame_reader_fill(&car->reader, car->controller_fd) <= 0);
+    handle_controller_frames(car, failed);
+}
+
+// Function: Dispatches the FLOOR frames in a car's reader. When the controller goes away the car
+// carries on without it, as `car` does.
+// Arguments:
+// - car: the car.
+// - failed: 1 if reading the connection failed or hit end of file.
+// Returns: void
+void handle_controller_frames(hosted_car *car, int failed)
+{
+    int fd = car->controller_fd;
+    trace_subject(car->config.name);
+
+    char *frame;
+    uint32_t len;
+    int status = 0;
+    while (!failed && (status = frame_reader_next(&car->reader, &frame, &len)) == 1)
+    {
+        floor_t dispatch_floor = FLOOR_INVALID;
+        if (protocol == PROTOCOL_TEXT && strncmp(frame, "FLOOR", 5) == 0)
+        {
+            char floor_text[4];
+            sscanf(frame, "FLOOR %3s", floor_text); // New floor call.
+            dispatch_floor = parse_floor(floor_text);
+        }
+        else if (protocol == PROTOCOL_TEXT || !proto_decode_floor(frame, len, &dispatch_floor))
+        {
+            failed = 1; // Binary frames carry the floor as an integer; anything else ends the connection
+            break;
+        }
+
+        if (dispatch_floor != FLOOR_INVALID)
+        {
+            pthread_mutex_lock(&car->shared_mem->mutex);
+            car_core_dispatch_floor(car->shared_mem, dispatch_floor);
+            pthread_mutex_unlock(&car->shared_mem->mutex);
+            post_events(car, CAR_EVENT_CHANGED, 0);
+        }
+    }
+    if (!failed && status == -1)
+    {
+        failed = 1; // A frame we cannot accept
+    }
+
+    if (failed)
+    {
+        // Shut the connection down but keep the descriptor open, so a worker still holding it
+        // writes to a dead socket rather than to a reused descriptor.
+        shutdown(fd, SHUT_RDWR);
+        car->controller_fd = -1;
+        frame_reader_destroy(&car->reader);
+    }
+}
+
+#ifdef USE_URING
+// Function: I/O thread on an io_uring (-U). Every car's connection has a multishot receive, and the
+// timer wheel's timerfd a multishot poll; what completes becomes events for the workers, as with epoll.
+// Arguments: none
+// Returns: never
+void *uring_io_loop()
+{
+    uring ring;
+    uring_buffers buffers;
+    if (uring_init(&ring, URING_ENTRIES, URING_CQ_ENTRIES) == -1 ||
+        uring_buffers_init(&ring, &buffers, 0, URING_BUFFER_COUNT, URING_BUFFER_SIZE) == -1)
+    {
+        perror("io_uring setup (needs Linux 5.19 or later)");
+        exit(EXIT_FAILURE);
+    }
+
+    uring_prep_poll_multishot(uring_get_sqe(&ring), timers.timer_fd, 0); // user_data 0: the timer wheel
+    for (int i = 0; i < car_count; i++)
+    {
+        if (cars[i].controller_fd != -1)
+        {
+            uring_prep_recv_multishot(uring_get_sqe(&ring), cars[i].controller_fd, &buffers, (uint64_t)(uintptr_t)&cars[i]);
+        }
+    }
+
+    while (1)
+    {
+        if (uring_enter(&ring, 1) == -1 && errno != EBUSY)
+        {
+            perror("io_uring_enter()");
+            exit(EXIT_FAILURE);
+        }
+
+        const struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(&ring)) != NULL)
+        {
+            hosted_car *car = (hosted_car *)(uintptr_t)cqe->user_data;
+            if (car == NULL)
+            {
+                expire_timers();
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                {
+                    uring_prep_poll_multishot(uring_get_sqe(&ring), timers.timer_fd, 0);
+                }
+            }
+            else
+            {
+                handle_car_received(car, cqe, &ring, &buffers);
+            }
+            uring_seen(&ring);
+        }
+    }
+    return NULL;
+}
+
+// Function: Takes the bytes a receive delivered into the car's frame reader and dispatches the frames
+// they complete, re-arming the receive if the kernel ended it while the connection is still up.
+// Arguments:
+// - car: the car.
+// - cqe: the receive's completion.
+// - ring, buffers: the I/O thread's ring and its receive buffers.
+// Returns: void
+void handle_car_received(hosted_car *car, const struct io_uring_cqe *cqe, uring *ring, uring_buffers *buffers)
+{
+    if (cqe->res > 0 && car->controller_fd != -1)
+    {
+        const char *data = uring_buffer(buffers, cqe);
+        size_t remaining = (size_t)cqe->res;
+        while (remaining > 0 && car->controller_fd != -1)
+        {
+            size_t taken = frame_reader_append(&car->reader, data, remaining);
+            data += taken;
+            remaining -= taken;
+            handle_controller_frames(car, 0);
+        }
+    }
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        uring_buffer_recycle(buffers, cqe);
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE) && car->controller_fd != -1)
+    {
+        if (cqe->res > 0 || cqe->res == -ENOBUFS)
+        {
+            uring_prep_recv_multishot(uring_get_sqe(ring), car->controller_fd, buffers, (uint64_t)(uintptr_t)car);
+        }
+        else
+        {
+            handle_controller_frames(car, 1); // End of file or an error
+        }
+    }
+}
+#endif
+
+// Function: Watcher thread for one car. Queues the car whenever its shared memory changes, whether
+// the change came from this process or from another program.
+// Arguments: the hosted_car to watch.
+// Returns: never
+void *watch_shared_memory(void *arg)
+{
+    hosted_car *car = arg;
+    car_shared_mem *shared_mem = car->shared_mem;
+    uint32_t seen[CAR_CHANNEL_COUNT];
+
+    pthread_mutex_lock(&shared_mem->mutex);
+    car_watch(shared_mem, seen);
+    while (1)
+    {
+        car_wait(shared_mem, CAR_CHANGE_ALL, seen);
+
+        pthread_mutex_unlock(&shared_mem->mutex);
+        post_events(car, CAR_EVENT_CHANGED, 0);
+        pthread_mutex_lock(&shared_mem->mutex);
+    }
+    return NULL;
+}
@@ -0,0 +1,239 @@
+// carwatch - samples the state of many cars at a high rate without disturbing them.
+//
+// Each car's segment is mapped read-only and read with car_shm_read, the seqlock snapshot, so the
+// watcher never takes a car's mutex and cannot hold up its state machine however often it samples.
+// Every change seen is printed with the time it was seen; a summary of the sampling follows on exit.
+//
+// Usage: carwatch [-r {samples per second}] [-d {seconds}] [-q] [{car name}...]
+// - With no names, every car segment in /dev/shm is watched.
+// - -r 0 samples as fast as possible (default 1000 per second, for each car).
+// - -d stops after that many seconds (default: until interrupted).
+// - -q prints only the summary.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "common.h"
+#include "car_shm.h"
+
+#define SHM_DIRECTORY "/dev/shm"
+
+typedef struct
+{
+    char name[100];
+    car_shared_mem *shared_mem;
+    car_shm_snapshot last; // Most recent snapshot
+    int seen;              // A snapshot has been taken
+} watched_car;
+
+watched_car *cars = NULL;
+int car_count = 0;
+int car_capacity = 0;
+volatile sig_atomic_t running = 1;
+
+void usage();
+void stop_watching(int sig_num);
+void watch_car(const char *name, int report_errors);
+void watch_all_cars();
+void print_change(double seconds, const watched_car *car);
+uint64_t now_ns();
+
+int main(int argc, char **argv)
+{
+    double rate = 1000;
+    double duration = 0;
+    int quiet = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:d:q")) != -1)
+    {
+        if (opt == 'r' && atof(optarg) >= 0)
+        {
+            rate = atof(optarg);
+        }
+        else if (opt == 'd' && atof(optarg) > 0)
+        {
+            duration = atof(optarg);
+        }
+        else if (opt == 'q')
+        {
+            quiet = 1;
+        }
+        else
+        {
+            usage();
+        }
+    }
+
+    if (optind == argc)
+    {
+        watch_all_cars();
+    }
+    for (int i = optind; i < argc; i++)
+    {
+        watch_car(argv[i], 1);
+    }
+    if (car_count == 0)
+    {
+        printf("No cars to watch.\n");
+        exit(1);
+    }
+
+    signal(SIGINT, stop_watching);
+
+    uint64_t period_ns = (rate > 0) ? (uint64_t)(1e9 / rate) : 0;
+    uint64_t start = now_ns();
+    uint64_t stop = (duration > 0) ? start + (uint64_t)(duration * 1e9) : UINT64_MAX;
+    uint64_t next_sweep = start;
+    long snapshots = 0, retries = 0, unreadable = 0, changes = 0;
+
+    while (running)
+    {
+        uint64_t now = now_ns();
+        if (now >= stop)
+        {
+            break;
+        }
+
+        for (int i = 0; i < car_count; i++)
+        {
+            watched_car *car = &cars[i];
+            car_shm_snapshot snapshot;
+            int torn = car_shm_read(car->shared_mem, &snapshot);
+            if (torn == -1)
+            {
+                unreadable++;
+                continue;
+            }
+            snapshots++;
+            retries += torn;
+
+            if (car->seen && snapshot.sequence == car->last.sequence)
+            {
+                continue; // Nothing written since the last sample
+            }
+            car->last = snapshot;
+            car->seen = 1;
+            changes++;
+            if (!quiet)
+            {
+                print_change((now - start) / 1e9, car);
+            }
+        }
+
+        if (period_ns > 0)
+        {
+            next_sweep += period_ns;
+            struct timespec wake = {next_sweep / 1000000000ULL, next_sweep % 1000000000ULL};
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+        }
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+    printf("\n%d cars, %.2f s: %ld snapshots (%.0f per second), %ld changes seen, %ld torn reads retried, %ld unreadable\n",
+           car_count, elapsed, snapshots, snapshots / elapsed, changes, retries, unreadable);
+    return 0;
+}
+
+void usage()
+{
+    printf("Usage: carwatch [-r {samples per second}] [-d {seconds}] [-q] [{car name}...]\n");
+    exit(1);
+}
+
+// Function: SIGINT handler; ends the sampling loop so the summary is printed.
+void stop_watching(int sig_num)
+{
+    (void)sig_num;
+    running = 0;
+}
+
+// Function: maps a car's segment read-only and adds it to the cars being watched.
+// Arguments:
+// - name: the car's name.
+// - report_errors: 1 to say why a car cannot be watched, 0 to skip it silently.
+// Returns: void
+void watch_car(const char *name, int report_errors)
+{
+    car_shared_mem *shared_mem;
+    car_shm_result result = car_shm_open(name, 0, &shared_mem);
+    if (result != CAR_SHM_OK)
+    {
+        if (report_errors && result == CAR_SHM_WRONG_LAYOUT)
+        {
+            printf("Car %s uses a different shared memory layout (this program needs version %d).\n", name, CAR_SHM_VERSION);
+        }
+        else if (report_errors)
+        {
+            printf("Unable to access car %s.\n", name);
+        }
+        return;
+    }
+
+    if (car_count == car_capacity)
+    {
+        car_capacity = (car_capacity == 0) ? 16 : car_capacity * 2;
+        cars = realloc(cars, car_capacity * sizeof(watched_car));
+        if (cars == NULL)
+        {
+            perror("realloc()");
+            exit(1);
+        }
+    }
+    watched_car *car = &cars[car_count++];
+    memset(car, 0, sizeof(*car));
+    snprintf(car->name, sizeof(car->name), "%s", name);
+    car->shared_mem = shared_mem;
+}
+
+// Function: watches every car segment in /dev/shm. Segments of another layout are skipped.
+void watch_all_cars()
+{
+    DIR *directory = opendir(SHM_DIRECTORY);
+    if (directory == NULL)
+    {
+        perror("opendir()");
+        exit(1);
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL)
+    {
+        if (strncmp(entry->d_name, "car", 3) == 0 && entry->d_name[3] != '\0')
+        {
+            watch_car(entry->d_name + 3, 0);
+        }
+    }
+    closedir(directory);
+}
+
+// Function: prints a car's latest snapshot: time seen, status, floors and any controls that are set.
+void print_change(double seconds, const watched_car *car)
+{
+    const car_shm_snapshot *snapshot = &car->last;
+    char current_floor[FLOOR_STRING_SIZE], destination_floor[FLOOR_STRING_SIZE];
+    format_floor(snapshot->current_floor, current_floor);
+    format_floor(snapshot->destination_floor, destination_floor);
+
+    printf("%12.6f %-10s %-8s %3s -> %-3s%s%s%s%s%s%s%s\n", seconds, car->name, format_status(snapshot->status), current_floor, destination_floor,
+           snapshot->open_button ? " open-button" : "",
+           snapshot->close_button ? " close-button" : "",
+           snapshot->door_obstruction ? " obstruction" : "",
+           snapshot->overload ? " overload" : "",
+           snapshot->emergency_stop ? " stop" : "",
+           snapshot->individual_service_mode ? " service" : "",
+           snapshot->emergency_mode ? " emergency" : "");
+    fflush(stdout);
+}
+
+// Function: current CLOCK_MONOTONIC time in nanoseconds.
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -1,15 +1,117 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "common.h"
 
-char get_call_direction(const char *source, const char *destination)
+// Function: converts floor text ("B99".."B1", "1".."999") to its integer form.
+// Returns: the floor, or FLOOR_INVALID if the text is not a valid floor.
+floor_t parse_floor(const char *floor)
 {
-    int source_int = (source[0] == 'B') ? -atoi(source + 1) : atoi(source);
-    int destination_int = (destination[0] == 'B') ? -atoi(destination + 1) : atoi(destination);
+    int sign = 1;
+    int value = 0;
+    size_t digits = 0;
 
-    if (source_int < destination_int)
+    if (floor[0] == 'B')
+    {
+        sign = -1;
+        floor++;
+    }
+
+    for (; floor[digits] != '\0'; digits++)
+    {
+        if (floor[digits] < '0' || floor[digits] > '9' || digits == 3)
+        {
+            return FLOOR_INVALID;
+        }
+        value = value * 10 + (floor[digits] - '0');
+    }
+
+    if (digits == 0 || value == 0 || (sign == -1 && value > -FLOOR_LOWEST))
+    {
+        return FLOOR_INVALID;
+    }
+
+    return (floor_t)(sign * value);
+}
+
+// Function: writes the text form of a floor.
+// Arguments:
+// - floor: a valid floor.
+// - buf: a buffer of at least FLOOR_STRING_SIZE bytes.
+void format_floor(floor_t floor, char *buf)
+{
+    if (floor < 0)
+    {
+        snprintf(buf, FLOOR_STRING_SIZE, "B%d", -floor % 100);
+    }
+    else
+    {
+        snprintf(buf, FLOOR_STRING_SIZE, "%d", floor % 1000);
+    }
+}
+
+// Function: counts the floors travelled between two floors, remembering there is no floor 0.
+// Returns: the number of floors between source and destination.
+int floor_distance(floor_t source, floor_t destination)
+{
+    int distance = (source < destination) ? destination - source : source - destination;
+
+    if ((source < 0) != (destination < 0))
+    {
+        distance--; // B1 to 1 is a single floor
+    }
+    return distance;
+}
+
+// Function: Finds the next floor from one floor towards another, stepping over the missing floor 0.
+// Returns: the next floor, or from itself when the floors are equal.
+floor_t next_floor_towards(floor_t from, floor_t to)
+{
+    if (from == to)
+    {
+        return from;
+    }
+    floor_t next = (from < to) ? from + 1 : from - 1;
+    if (next == 0)
+    {
+        next = (from < to) ? 1 : -1; // B1 and 1 are adjacent
+    }
+    return next;
+}
+
+static const char *car_status_names[] = {
+    "Opening", "Open", "Closing", "Closed", "Between"};
+
+// Function: converts a status name to its enum value.
+// Returns: the status, or CAR_STATUS_INVALID if the name is unknown.
+car_status parse_status(const char *status)
+{
+    for (int i = 0; i < CAR_STATUS_INVALID; i++)
+    {
+        if (strcmp(status, car_status_names[i]) == 0)
+        {
+            return (car_status)i;
+        }
+    }
+    return CAR_STATUS_INVALID;
+}
+
+// Function: gives the text form of a status.
+// Returns: the status name, or "Invalid" for values outside the enum.
+const char *format_status(car_status status)
+{
+    if (status < 0 || status >= CAR_STATUS_INVALID)
+    {
+        return "Invalid";
+    }
+    return car_status_names[status];
+}
+
+char get_call_direction(floor_t source, floor_t destination)
+{
+    if (source < destination)
         return 'U'; // Up
-    if (source_int > destination_int)
+    if (source > destination)
         return 'D'; // Down
     return 'S';     // Same
-}
\ No newline at end of file
+}
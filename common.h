@@ -1,26 +1,37 @@
 #ifndef COMMON_H
 #define COMMON_H
 
-#include <pthread.h>
 #include <stdint.h>
 
-typedef struct
+// Floors are carried as integers inside every program: basements are negative (B99 is -99, B1 is -1)
+// and there is no floor 0. Text like "B12" only appears on the wire.
+typedef int16_t floor_t;
+
+#define FLOOR_LOWEST (-99)
+#define FLOOR_HIGHEST 999
+#define FLOOR_INVALID INT16_MIN
+#define FLOOR_STRING_SIZE 4 // Longest floor text ("B99", "999") plus the NUL
+
+// Car statuses, in the order of the door cycle. The text form is used on the text wire protocol.
+typedef enum
 {
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
-    char current_floor[4];
-    char destination_floor[4];
-    char status[8];
-    uint8_t open_button;
-    uint8_t close_button;
-    uint8_t door_obstruction;
-    uint8_t overload;
-    uint8_t emergency_stop;
-    uint8_t individual_service_mode;
-    uint8_t emergency_mode;
-} car_shared_mem;
+    CAR_STATUS_OPENING,
+    CAR_STATUS_OPEN,
+    CAR_STATUS_CLOSING,
+    CAR_STATUS_CLOSED,
+    CAR_STATUS_BETWEEN,
+    CAR_STATUS_INVALID
+} car_status;
+
+// Function prototypes for floor handling
+floor_t parse_floor(const char *floor);
+void format_floor(floor_t floor, char *buf);
+char get_call_direction(floor_t source, floor_t destination);
 
-// Function prototype for get_call_direction
-char get_call_direction(const char *source, const char *destination);
+// Function prototypes for status handling
+car_status parse_status(const char *status);
+const char *format_status(car_status status);
+int floor_distance(floor_t source, floor_t destination);
+floor_t next_floor_towards(floor_t from, floor_t to);
 
 #endif // COMMON_H
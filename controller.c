@@ -1,637 +1,2036 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
 #include "network_utils.h"
 #include "common.h"
+#include "dispatch.h"
+#include "protocol.h"
+#include "metrics.h"
+#include "trace.h"
+#include "journal.h"
+#include "mailbox.h"
+#include "pool.h"
+#ifdef USE_URING
+#include "uring.h"
+#endif
 #include <signal.h>
 
+#define MAX_EVENTS 64
+#define MAX_EVENT_LOOPS 64
+#define MIN_FRAME_SIZE 128 // Room for every fixed-size message
+#define MAX_FRAME_SIZE_LIMIT (1 << 20)
+
+#ifdef USE_URING
+#define URING_ENTRIES 256       // Requests prepared per batch before they are submitted early
+#define URING_CQ_ENTRIES 4096   // Completions, mostly multishot receives, held between batches
+#define URING_BUFFER_COUNT 256  // Receive buffers registered with each loop's ring
+#define URING_BUFFER_SIZE 4096
+
+// What a ring request is for, in the low bits of its user_data; the rest is the connection or loop.
+#define URING_RECEIVE 0 // Connection: multishot receive
+#define URING_SEND 1    // Connection: send from send_buf
+#define URING_CANCEL 2  // Connection: cancel of its receive, when handing it to another shard
+#define URING_ACCEPT 0  // Loop: multishot accept
+#define URING_WAKE 1    // Loop: read of wake_fd
+#define URING_TAG_MASK 3
+#endif
+
+// Per-connection state. Every client (car or call pad) is owned by exactly one event loop,
+// so only that loop's thread ever reads from or writes to the connection.
+typedef struct connection
+{
+    int fd;
+    int is_car;
+    int protocol; // 0 until the first frame arrives, then PROTOCOL_TEXT or PROTOCOL_VERSION
+    CarNode *car_node;
+
+    // Incoming length-prefixed frames, handed to process_frame in place.
+    frame_reader reader;
+
+    // Bytes queued while the socket was not writable.
+    char *out_buf;
+    size_t out_len;
+    size_t out_capacity;
+    int waiting_for_write;
+    int corked; // Set while a batch of frames is handled, so their replies go out in one send
+    uint64_t received_ns; // When the read that brought in the frames being handled returned
+    int held;             // Left corked until the journal is committed, on the loop's held list
+    struct connection *next_held;
+
+#ifdef USE_URING
+    // With -U, waiting_for_write means a send is in flight from send_buf. Frames queued meanwhile
+    // collect in out_buf, which can grow without moving bytes the kernel is sending.
+    char *send_buf;
+    size_t send_capacity;
+    size_t send_len;
+    size_t send_offset;
+    int ring_requests; // Requests on the owning loop's ring that still name this connection
+    int closed;        // Closed while requests were outstanding; freed when the last completes
+#endif
+
+    // A car that registered on a shard other than its own (-S), kept until the owner takes it over.
+    int handing_off;
+    char pending_name[100];
+    floor_t pending_lowest_floor;
+    floor_t pending_highest_floor;
+    int pending_delay_ms;
+
+    // The owning loop, and this car's place in that loop's dispatch queue.
+    struct event_loop *loop;
+    int dispatch_queued;
+    struct connection *next_dispatch;
+
+    // Car metrics. status_received_ns is only used by the owning loop; the status times are
+    // protected by the car list's mutex.
+    uint64_t status_received_ns;            // When the STATUS awaiting a dispatch check arrived, or 0
+    uint64_t registered_ns;
+    uint64_t status_since_ns;               // When the car entered its current status
+    uint64_t status_ns[CAR_STATUS_INVALID]; // Time spent in each earlier status
+    uint64_t reported_ns;                   // When the car last reported, heartbeats included; relaxed stores
+} connection;
+
+// Metrics recorded by one event loop, written only by its thread and merged when scraped (metrics.h).
 typedef struct
 {
-    int car_fd;
-    char name[100];
-    char lowest_floor[4];
-    char highest_floor[5];
-    char current_floor[4];    
-    char destination_floor[4];
-    char status[8];
-} car_information;
-
+    uint64_t calls_accepted;
+    uint64_t calls_unavailable;
+    uint64_t status_reports;
+    uint64_t status_heartbeats;
+    uint64_t floors_sent;
+    uint64_t calls_routed;           // Calls assigned to a car owned by another shard (-S)
+    uint64_t connections_handed_off; // Cars that registered on another shard and were handed to it (-S)
+    metrics_histogram call_latency;     // From the read that brought a CALL in to its reply being queued
+    metrics_histogram dispatch_latency; // From the read that brought a STATUS in to the FLOOR it led to
+} loop_metrics;
+
+// One car's gauges, copied out of the car list for a scrape.
 typedef struct
 {
-    char direction;
-    char floor[4];
-    int assigned_car_fd;
-} call_requests;
+    char name[100];
+    int queue_depth;
+    uint64_t elapsed_ns;
+    uint64_t report_age_ns;
+    uint64_t status_ns[CAR_STATUS_INVALID];
+} car_sample;
 
-// Linked list node structure
-typedef struct CarNode
+typedef struct event_loop
 {
-    car_information car_info;
-    struct CarNode *next;
-} CarNode;
-
-typedef struct CallNode
+    int id;
+    int epoll_fd;
+    int listen_fd;
+    int wake_fd; // eventfd written when another loop queues one of our cars for dispatch or posts to our mailbox
+    pthread_t thread;
+    car_list *cars; // Where this loop's cars register: the building's list, or the loop's own as a shard (-S)
+    mailbox mailbox; // Calls and connections handed over by other shards (-S)
+
+    // Cars whose state changed since the last dispatch check, protected by dispatch_mutex.
+    pthread_mutex_t dispatch_mutex;
+    connection *dispatch_head;
+    connection *dispatch_tail;
+
+    // Connections whose replies wait for the calls they answer to be journaled (-J).
+    uint64_t journal_position;  // Journal position of the last call this loop assigned
+    uint64_t journal_committed; // Journal position this loop last committed
+    connection *held_head;
+
+#ifdef USE_URING
+    uring ring; // Used instead of epoll_fd with -U
+    uring_buffers receive_buffers;
+    uint64_t wake_count; // Where the ring reads wake_fd into
+#endif
+
+    loop_metrics metrics;
+} event_loop;
+
+uint32_t max_frame_size = DEFAULT_MAX_FRAME_SIZE; // Larger frames close the connection
+event_loop *event_loops;
+int event_loop_count;
+call_journal *journal; // NULL unless calls are journaled (-J)
+int sharded;           // Each loop owns the cars whose names hash to it, with its own listener and car list (-S)
+car_list *car_lists;   // One for the building, or one per shard
+int car_list_count;
+int use_uring;         // Event loops submit their I/O to an io_uring rather than waiting in epoll (-U)
+
+// A message from one shard to another (-S). SHARD_CALL asks the owner of the car chosen for a call
+// to queue its stops; SHARD_CONNECTION hands over a car that registered on another shard.
+typedef enum
 {
-    call_requests call;
-    struct CallNode *next;
-} CallNode;
+    SHARD_CALL,
+    SHARD_CONNECTION
+} shard_message_type;
 
 typedef struct
 {
-    char *source_floor;
-    char *destination_floor;
-    int chosen_car_fd;
-} CallInfo;
-
-// Mutex to protect access to the linked list
-pthread_mutex_t car_list_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t call_list_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-// Head of the linked lists
-CarNode *car_list_head = NULL;
-CallNode *call_list_head = NULL;
+    mailbox_node node; // First, so a taken node is the message
+    shard_message_type type;
+    connection *conn;  // SHARD_CONNECTION
+    CarNode *car;      // SHARD_CALL: only dereferenced once the owner finds it still registered
+    int index_slot;
+    uint64_t serial;
+    floor_t source_floor;
+    floor_t destination_floor;
+} shard_message;
+
+static object_pool shard_message_pool = POOL_INITIALIZER("shard_message", sizeof(shard_message));
 
 // Function definitions
-void *handle_car(void *arg);
-void *update_call_queue(void *arg);
-void remove_car_from_list(int car_fd);
-void add_car_to_list(car_information new_car);
+int open_listener(int reuse_port);
+void *run_event_loop(void *arg);
+int handle_frames(event_loop *loop, connection *conn);
+int shard_of(const char *name);
+void hand_off_connection(event_loop *loop, connection *conn);
+void adopt_connection(event_loop *loop, connection *conn);
+void receive_shard_messages(event_loop *loop);
+void queue_routed_call(event_loop *loop, shard_message *message);
+void accept_connections(event_loop *loop);
+void add_connection(event_loop *loop, int clientfd);
+void post_connection(event_loop *loop, connection *conn);
+void handle_readable(event_loop *loop, connection *conn);
+void handle_writable(event_loop *loop, connection *conn);
+void hold_replies(event_loop *loop, connection *conn);
+void unhold_replies(event_loop *loop, connection *conn);
+void release_replies(event_loop *loop);
+int process_frame(event_loop *loop, connection *conn, char *msg, uint32_t len);
+int process_binary_frame(event_loop *loop, connection *conn, const char *msg, uint32_t len);
+int process_text_frame(event_loop *loop, connection *conn, char *msg);
+int register_car(connection *conn, const char *name, floor_t lowest_floor, floor_t highest_floor, int delay_ms);
+void handle_status(event_loop *loop, connection *conn, car_status status, floor_t current_floor, floor_t destination_floor);
+void handle_status_update(event_loop *loop, connection *conn, uint8_t fields, car_status status, floor_t current_floor, floor_t destination_floor);
+void handle_call(event_loop *loop, connection *conn, floor_t source_floor, floor_t destination_floor);
+void handle_call_batch(event_loop *loop, connection *conn, const char *msg, uint32_t len);
+int assign_call(event_loop *loop, floor_t source_floor, floor_t destination_floor, car_information *assigned_car);
+void record_call(event_loop *loop, connection *conn, int assigned);
+trace_message classify_frame(const connection *conn, const char *msg, uint32_t len);
+void queue_frame(event_loop *loop, connection *conn, const char *msg);
+void queue_frame_bytes(event_loop *loop, connection *conn, const void *msg, size_t msg_len);
+void close_connection(event_loop *loop, connection *conn);
+void request_dispatch(event_loop *current_loop, connection *car_conn);
+void dispatch_queued_cars(event_loop *loop);
+void dispatch_car(connection *conn);
+int write_metrics(FILE *out, void *arg);
 void print_car_list();
 void print_call_list();
-char get_call_direction(const char *source, const char *destination);
-void add_call_request(call_requests new_call);
-char *get_and_pop_first_stop(int socket_fd);
-int is_car_available(char *source_floor, char *destination_floor, CarNode *car);
-CarNode *choose_car(char *source_floor, char *destination_floor);
-
-int main()
+#ifdef USE_URING
+void *run_uring_loop(event_loop *loop);
+void handle_completion(event_loop *loop, const struct io_uring_cqe *cqe);
+void uring_receive(event_loop *loop, connection *conn);
+void handle_received(event_loop *loop, connection *conn, const struct io_uring_cqe *cqe);
+void uring_send(event_loop *loop, connection *conn);
+void handle_sent(event_loop *loop, connection *conn, int result);
+void retire_connection(event_loop *loop, connection *conn);
+#endif
+
+int main(int argc, char **argv)
 {
-    // Create a socket
-    int listensockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listensockfd == -1)
+    int loop_count = 1;
+    const char *metrics_address = NULL;
+    const char *journal_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:Sd:m:M:J:U")) != -1)
     {
-        perror("socket()"); // Error handling for socket creation
-        exit(EXIT_FAILURE);
+        if (opt == 't')
+        {
+            loop_count = atoi(optarg);
+        }
+        else if (opt == 'S')
+        {
+            sharded = 1;
+        }
+        else if (opt == 'm' && atol(optarg) >= MIN_FRAME_SIZE && atol(optarg) <= MAX_FRAME_SIZE_LIMIT)
+        {
+            max_frame_size = (uint32_t)atol(optarg);
+        }
+        else if (opt == 'd' && set_dispatch_strategy(optarg))
+        {
+            // Strategy selected
+        }
+        else if (opt == 'M')
+        {
+            metrics_address = optarg;
+        }
+        else if (opt == 'J')
+        {
+            journal_path = optarg;
+        }
+        else if (opt == 'U')
+        {
+#ifdef USE_URING
+            use_uring = 1;
+#else
+            printf("This controller was built without io_uring; rebuild it with \"make URING=1\".\n");
+            exit(EXIT_FAILURE);
+#endif
+        }
+        else
+        {
+            printf("Usage: controller [-t {event loops}] [-S] [-U] [-d {dispatch strategy}] [-m {max frame bytes, %d-%d}]\n"
+                   "                  [-M {metrics socket path or port}] [-J {call journal path}]\n",
+                   MIN_FRAME_SIZE, MAX_FRAME_SIZE_LIMIT);
+            printf("Dispatch strategies: ");
+            print_dispatch_strategies();
+            exit(EXIT_FAILURE);
+        }
     }
 
-    // Set socket options to allow reuse of the address
-    int opt_enable = 1;
-    if (setsockopt(listensockfd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof(opt_enable)) == -1)
+    if (loop_count < 1 || loop_count > MAX_EVENT_LOOPS)
     {
-        perror("setsockopt()"); // Error handling for setting socket options
+        printf("Event loop count must be between 1 and %d.\n", MAX_EVENT_LOOPS);
         exit(EXIT_FAILURE);
     }
+    trace_init("controller", NULL);
 
-    // Bind the socket to the address
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));           // Clear the address structure
-    addr.sin_family = AF_INET;                // IPv4
-    addr.sin_port = htons(3000);              // Port number
-    addr.sin_addr.s_addr = htonl(INADDR_ANY); // Accept connections from any address
-
-    if (bind(listensockfd, (const struct sockaddr *)&addr, sizeof(addr)) == -1)
+    if (journal_path != NULL)
     {
-        perror("bind()"); // Error handling for binding
-        exit(EXIT_FAILURE);
+        journal = malloc(sizeof(call_journal));
+        if (journal == NULL || journal_open(journal, journal_path, JOURNAL_DEFAULT_SIZE) == -1)
+        {
+            exit(EXIT_FAILURE);
+        }
     }
 
-    // Listen for incoming connections
-    if (listen(listensockfd, 10) == -1)
+    // Writes to a client that has gone away must not kill the controller.
+    signal(SIGPIPE, SIG_IGN);
+
+    // Unsharded, every loop watches one listening socket and EPOLLEXCLUSIVE wakes only one of them per
+    // connection. Sharded, each loop has its own SO_REUSEPORT socket and the kernel spreads connections.
+    int listensockfd = sharded ? -1 : open_listener(0);
+    event_loop *loops = calloc(loop_count, sizeof(event_loop));
+    car_list_count = sharded ? loop_count : 1;
+    car_lists = calloc(car_list_count, sizeof(car_list));
+    if (loops == NULL || car_lists == NULL)
     {
-        perror("listen()"); // Error handling for listening
+        perror("calloc()");
         exit(EXIT_FAILURE);
     }
+    for (int i = 0; i < car_list_count; i++)
+    {
+        car_list_init(&car_lists[i]);
+    }
 
-    for (;;)
+    for (int i = 0; i < loop_count; i++)
     {
-        struct sockaddr_in clientaddr;
-        socklen_t clientaddr_len = sizeof(clientaddr);
-        // Accept a new client connection
-        int clientfd = accept(listensockfd, (struct sockaddr *)&clientaddr, &clientaddr_len);
-        if (clientfd == -1)
+        loops[i].id = i;
+        loops[i].listen_fd = sharded ? open_listener(1) : listensockfd;
+        loops[i].cars = &car_lists[sharded ? i : 0];
+        pthread_mutex_init(&loops[i].dispatch_mutex, NULL);
+        loops[i].wake_fd = eventfd(0, EFD_NONBLOCK);
+        if (loops[i].wake_fd == -1)
         {
-            perror("accept()"); // Error handling for accepting connections
+            perror("eventfd()");
             exit(EXIT_FAILURE);
         }
+        mailbox_init(&loops[i].mailbox, loops[i].wake_fd);
 
-        // Receive message from the client
-        char *msg = receive_msg(clientfd);
-
-        // Check if the message is from a car
-        if (strncmp(msg, "CAR", 3) == 0)
+        if (use_uring)
         {
-            printf(">>> Car received: %s\n", msg);
-
-            car_information new_car;
-            sscanf(msg, "CAR %99s %3s %3s", new_car.name, new_car.lowest_floor, new_car.highest_floor); // Parse car info
-            new_car.car_fd = clientfd;                                                                  // Set file descriptor for the car
-
-            add_car_to_list(new_car); // Add the new car to the list
-
-            int *car_clientfd = malloc(sizeof(int)); // Allocate memory for the car's file descriptor
-            *car_clientfd = clientfd;
-
-            pthread_t car_thread;
-            // Create a thread to handle the car
-            if (pthread_create(&car_thread, NULL, handle_car, car_clientfd) != 0)
-            {
-                perror("pthread_create()"); // Error handling for thread creation
-                exit(EXIT_FAILURE);
-            }
+            continue; // Each loop sets up its ring on its own thread (run_uring_loop)
         }
-        // Check if the message is a call request
-        else if (strncmp(msg, "CALL", 4) == 0)
+        loops[i].epoll_fd = epoll_create1(0);
+        if (loops[i].epoll_fd == -1)
         {
-            // Extract source and destination floors from the message
-            char source_floor[4], destination_floor[4];
-            sscanf(msg, "CALL %3s %3s", source_floor, destination_floor);
+            perror("epoll_create1()");
+            exit(EXIT_FAILURE);
+        }
 
-            // Choose an available car for the call
-            CarNode *chosen_car = choose_car(source_floor, destination_floor);
-            if (chosen_car == NULL)
-            {
-                send_message(clientfd, "UNAVAILABLE\n"); // Notify the client if no car is available
-            }
-            else
-            {
-                CallInfo *call_info = malloc(sizeof(CallInfo));           // Allocate memory for call info
-                call_info->source_floor = strdup(source_floor);           // Duplicate the source floor string
-                call_info->destination_floor = strdup(destination_floor); // Duplicate the destination floor string
-                call_info->chosen_car_fd = chosen_car->car_info.car_fd;   // Set the chosen car's file descriptor
-
-                pthread_t call_thread;
-                // Create a thread to update the call queue
-                if (pthread_create(&call_thread, NULL, update_call_queue, call_info) != 0)
-                {
-                    perror("pthread_create() for handle_call"); // Error handling for thread creation
-                    free(call_info);                            // Free allocated memory if thread creation fails
-                    exit(EXIT_FAILURE);
-                }
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | (loop_count > 1 && !sharded ? EPOLLEXCLUSIVE : 0);
+        ev.data.ptr = NULL; // NULL marks the listening socket
+        if (epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD, loops[i].listen_fd, &ev) == -1)
+        {
+            perror("epoll_ctl()");
+            exit(EXIT_FAILURE);
+        }
 
-                // Notify the client of the assigned car
-                char msg_to_client[110];
-                snprintf(msg_to_client, sizeof(msg_to_client), "CAR %s\n", chosen_car->car_info.name);
-                send_message(clientfd, msg_to_client);
-            }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &loops[i]; // The loop itself marks its wake eventfd
+        if (epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD, loops[i].wake_fd, &ev) == -1)
+        {
+            perror("epoll_ctl()");
+            exit(EXIT_FAILURE);
         }
+    }
 
-        free(msg); // Free the received message
+    event_loops = loops;
+    event_loop_count = loop_count;
+    if (metrics_address != NULL && metrics_serve(metrics_address, write_metrics, NULL) == -1)
+    {
+        exit(EXIT_FAILURE);
     }
-}
 
-// Function: Chooses an available car based on the source and destination floors.
-// Arguments:
-// - char *source_floor: The starting floor for the call.
-// - char *destination_floor: The target floor for the call.
-// Returns:
-// - A pointer to the first available CarNode if found, or NULL if no car is available.
-CarNode *choose_car(char *source_floor, char *destination_floor)
-{
-    CarNode *current = car_list_head;
-    while (current != NULL)
+    // Loop 0 runs on the main thread, the rest get a thread each.
+    for (int i = 1; i < loop_count; i++)
     {
-        if (is_car_available(source_floor, destination_floor, current))
+        if (pthread_create(&loops[i].thread, NULL, run_event_loop, &loops[i]) != 0)
         {
-            return current; // Return the first available car
+            perror("pthread_create() for event loop");
+            exit(EXIT_FAILURE);
         }
-        current = current->next;
     }
-    return NULL; // No available car found
+
+    run_event_loop(&loops[0]);
+    return 0;
 }
 
-// Function: Checks if a specific car can service a call based on source and destination floors.
-// Arguments:
-// - char *source_floor: The starting floor for the call.
-// - char *destination_floor: The target floor for the call.
-// - CarNode *car: A pointer to the car being checked for availability.
-// Returns:
-// - 1 if the car is available to service the call,
-// - 0 if it is not available.
-int is_car_available(char *source_floor, char *destination_floor, CarNode *car)
+// Function: Creates the non-blocking socket listening on port 3000.
+// Arguments: reuse_port - 1 to set SO_REUSEPORT, so each shard can bind a socket of its own.
+// Returns: the socket. Exits on failure.
+int open_listener(int reuse_port)
 {
-    if (car_list_head == NULL)
+    // Create a non-blocking socket
+    int listensockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listensockfd == -1)
     {
-        return 0; // No cars available
+        perror("socket()"); // Error handling for socket creation
+        exit(EXIT_FAILURE);
     }
 
-    char *highest_floor = car->car_info.highest_floor;
-    char *lowest_floor = car->car_info.lowest_floor;
-
-    // Check if source or destination floor is above highest floor
-    if ((get_call_direction(highest_floor, source_floor) == 'U') ||
-        (get_call_direction(highest_floor, destination_floor) == 'U'))
+    // Set socket options to allow reuse of the address
+    int opt_enable = 1;
+    if (setsockopt(listensockfd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof(opt_enable)) == -1 ||
+        (reuse_port && setsockopt(listensockfd, SOL_SOCKET, SO_REUSEPORT, &opt_enable, sizeof(opt_enable)) == -1))
     {
-        return 0; // Car cannot service the call if above highest floor
+        perror("setsockopt()"); // Error handling for setting socket options
+        exit(EXIT_FAILURE);
     }
 
-    // Check if source or destination floor is below lowest floor
-    if ((get_call_direction(lowest_floor, source_floor) == 'D') ||
-        (get_call_direction(lowest_floor, destination_floor) == 'D'))
+    // Bind the socket to the address
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));           // Clear the address structure
+    addr.sin_family = AF_INET;                // IPv4
+    addr.sin_port = htons(3000);              // Port number
+    addr.sin_addr.s_addr = htonl(INADDR_ANY); // Accept connections from any address
+
+    if (bind(listensockfd, (const struct sockaddr *)&addr, sizeof(addr)) == -1)
     {
-        return 0; // Car cannot service the call if below lowest floor
+        perror("bind()"); // Error handling for binding
+        exit(EXIT_FAILURE);
     }
 
-    return 1; // Car is available to service the call
-}
-
-// Function: Checks if there is a call assigned to a specific car.
-// Arguments:
-// - int car_clientfd: The file descriptor of the car to check for calls.
-// Returns:
-// - 1 if a call is found for the specified car,
-// - 0 if no call is assigned.
-int has_call_for_car(int car_clientfd)
-{
-    CallNode *current = call_list_head;
-    while (current != NULL)
+    // Listen for incoming connections
+    if (listen(listensockfd, SOMAXCONN) == -1)
     {
-        if (current->call.assigned_car_fd == car_clientfd)
-        {
-            return 1; // Found a call for this car
-        }
-        current = current->next;
+        perror("listen()"); // Error handling for listening
+        exit(EXIT_FAILURE);
     }
-    return 0; // No call for this car
+    return listensockfd;
 }
 
-// Function: Monitors the status of a car and updates its information in the car list.
-// Arguments:
-// - void *arg: A pointer to an integer representing the car's client file descriptor.
-// Returns: void (exits the thread upon completion).
-void *status_checking_thread(void *arg)
+// Function: Runs one event loop, servicing every connection it owns until the process exits.
+// Arguments: A pointer to the event_loop to run.
+// Returns: void
+void *run_event_loop(void *arg)
 {
-    int car_clientfd = *((int *)arg);
-    free(arg);
+    event_loop *loop = (event_loop *)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    char thread_name[TRACE_SUBJECT_SIZE];
+    snprintf(thread_name, sizeof(thread_name), "loop %d", loop->id);
+    trace_name_thread(thread_name);
 
-    // Lock mutex to access the car list safely
-    pthread_mutex_lock(&car_list_mutex);
-    CarNode *car_node = car_list_head;
-    while (car_node != NULL)
+#ifdef USE_URING
+    if (use_uring)
     {
-        if (car_node->car_info.car_fd == car_clientfd)
-        {
-            break; // Found the correct car
-        }
-        car_node = car_node->next;
+        return run_uring_loop(loop);
     }
-    pthread_mutex_unlock(&car_list_mutex);
+#endif
 
-    char status[8];
-    char current_floor[4];
-    char destination_floor[4];
-
-    while (1)
+    for (;;)
     {
-        char *msg = receive_msg(car_clientfd);
+        // Block until there is I/O or a car to dispatch; an idle building costs no wakeups.
+        int ready = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("epoll_wait()");
+            exit(EXIT_FAILURE);
+        }
 
-        sscanf(msg, "STATUS %s %s %s", status, current_floor, destination_floor);
+        for (int i = 0; i < ready; i++)
+        {
+            if (events[i].data.ptr == NULL)
+            {
+                accept_connections(loop);
+                continue;
+            }
+            if (events[i].data.ptr == loop)
+            {
+                uint64_t wakeups;
+                while (read(loop->wake_fd, &wakeups, sizeof(wakeups)) > 0)
+                {
+                    // Drain the counter; the queue and mailbox themselves say what to do
+                }
+                receive_shard_messages(loop);
+                continue;
+            }
 
-        // Lock mutex to update car information safely
-        pthread_mutex_lock(&car_list_mutex);
-        strcpy(car_node->car_info.current_floor, current_floor);
-        strcpy(car_node->car_info.destination_floor, destination_floor);
-        strcpy(car_node->car_info.status, status);
-        pthread_mutex_unlock(&car_list_mutex);
+            connection *conn = events[i].data.ptr;
 
-        // Exit if an emergency or individual service message is received
-        if (strcmp(msg, "EMERGENCY") == 0 || strcmp(msg, "INDIVIDUAL SERVICE") == 0)
-        {
-            break;
+            if (events[i].events & EPOLLOUT)
+            {
+                handle_writable(loop, conn);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            {
+                handle_readable(loop, conn);
+            }
         }
 
-        free(msg);
+        release_replies(loop);
+        dispatch_queued_cars(loop);
     }
 
-    shutdown(car_clientfd, SHUT_RDWR);
-    close(car_clientfd);
-    remove_car_from_list(car_clientfd);
-    pthread_exit(NULL);
+    return NULL;
 }
 
-// Function: Handles the operations for a car, including checking its status and dispatching floor calls.
-// Argument: A pointer to the car's client file descriptor.
-// Returns: void
-void *handle_car(void *arg)
+#ifdef USE_URING
+// Function: Runs one event loop on an io_uring (-U). The listener and wake_fd are read by requests
+// that stay armed, each connection by a multishot receive, and replies go out as sends. Everything a
+// batch of completions queues, sends included, is submitted by the same io_uring_enter that waits for
+// the next batch.
+// Arguments: loop - the event loop to run.
+// Returns: never
+void *run_uring_loop(event_loop *loop)
 {
-    int car_clientfd = *((int *)arg);
-    free(arg);
-
-    if (pthread_detach(pthread_self()) != 0)
+    if (uring_init(&loop->ring, URING_ENTRIES, URING_CQ_ENTRIES) == -1 ||
+        uring_buffers_init(&loop->ring, &loop->receive_buffers, 0, URING_BUFFER_COUNT, URING_BUFFER_SIZE) == -1)
     {
-        perror("pthread_detach()");
+        perror("io_uring setup (needs Linux 5.19 or later)");
         exit(EXIT_FAILURE);
     }
+    uring_prep_accept_multishot(uring_get_sqe(&loop->ring), loop->listen_fd, (uint64_t)(uintptr_t)loop | URING_ACCEPT);
+    uring_prep_read(uring_get_sqe(&loop->ring), loop->wake_fd, &loop->wake_count, sizeof(loop->wake_count),
+                    (uint64_t)(uintptr_t)loop | URING_WAKE);
 
-    // Locate the car's information in the list
-    CarNode *car_node = car_list_head;
-    while (car_node != NULL)
+    for (;;)
     {
-        if (car_node->car_info.car_fd == car_clientfd)
+        // EBUSY means completions are backed up in the kernel: handle the ones we have and retry.
+        if (uring_enter(&loop->ring, 1) == -1 && errno != EBUSY)
         {
-            break; // Found the correct car
+            perror("io_uring_enter()");
+            exit(EXIT_FAILURE);
         }
-        car_node = car_node->next;
-    }
-
-    char dispatched_floor[4];
-
-    // Create a thread to check the car's status
-    int *status_fd = malloc(sizeof(int));
-    *status_fd = car_clientfd;
-    pthread_t status_thread;
-    if (pthread_create(&status_thread, NULL, status_checking_thread, status_fd) != 0)
-    {
-        perror("pthread_create() for status_checking_thread");
-        exit(EXIT_FAILURE);
-    }
-
-    while (1)
-    {
-        pthread_mutex_lock(&call_list_mutex);
 
-        // Check if the car has reached its destination or is opening its doors
-        if ((strcmp(car_node->car_info.current_floor, car_node->car_info.destination_floor) == 0) ||
-            (strcmp(car_node->car_info.status, "Opening") == 0))
+        // At most MAX_EVENTS completions a batch, as with epoll, so replies and dispatches are not
+        // held back behind a flood of frames.
+        const struct io_uring_cqe *cqe;
+        for (int handled = 0; handled < MAX_EVENTS && (cqe = uring_peek(&loop->ring)) != NULL; handled++)
         {
-            char *next_stop = get_and_pop_first_stop(car_clientfd);
-
-            if (strcmp(next_stop, "E") != 0) // Valid next stop
-            {
-                snprintf(dispatched_floor, sizeof(dispatched_floor), "%s", next_stop);
-                char msg_to_car[10];
-                snprintf(msg_to_car, sizeof(msg_to_car), "FLOOR %s", dispatched_floor);
-                send_message(car_clientfd, msg_to_car); // Dispatch the floor
-
-                free(next_stop); // Free allocated memory for next_stop
-            }
+            handle_completion(loop, cqe);
+            uring_seen(&loop->ring);
         }
 
-        pthread_mutex_unlock(&call_list_mutex);
-        usleep(1000); // Sleep to avoid busy waiting
+        release_replies(loop);
+        dispatch_queued_cars(loop);
     }
-    pthread_exit(NULL);
+    return NULL;
 }
 
-// Function: Retrieves and removes the first stop assigned to the specified car.
-// Argument: socket_fd - the file descriptor for the car requesting the stop.
-// Returns: A pointer to the floor string of the stop, or "E" if no stop is found or the list is empty.
-char *get_and_pop_first_stop(int socket_fd)
+// Function: Handles one completion from a loop's ring.
+// Arguments:
+// - loop: the event loop.
+// - cqe: the completion; its slot is not reused until the caller moves past it.
+// Returns: void
+void handle_completion(event_loop *loop, const struct io_uring_cqe *cqe)
 {
-    if (call_list_head == NULL)
-    {
-        return "E"; // Return "E" if the list is empty
-    }
+    void *target = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_TAG_MASK);
+    int tag = (int)(cqe->user_data & URING_TAG_MASK);
+    int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
 
-    CallNode *current = call_list_head;
-    CallNode *previous = NULL;
-
-    while (current != NULL)
+    if (target == loop)
     {
-        // Check if the current call is assigned to the requested car
-        if (current->call.assigned_car_fd == socket_fd)
+        if (tag == URING_ACCEPT)
         {
-            char *first_floor = malloc(strlen(current->call.floor) + 1);
-            if (first_floor == NULL)
+            if (cqe->res >= 0)
             {
-                return "Memory allocation failed"; // Handle memory allocation failure
+                add_connection(loop, cqe->res);
             }
-            strcpy(first_floor, current->call.floor);
-
-            // Remove the node from the linked list
-            if (previous == NULL)
+            else if (cqe->res != -EAGAIN && cqe->res != -EINTR)
             {
-                call_list_head = call_list_head->next;
+                errno = -cqe->res;
+                perror("accept()"); // Transient (EMFILE and the like); keep serving existing clients
             }
-            else
+            if (!more)
             {
-                previous->next = current->next;
+                uring_prep_accept_multishot(uring_get_sqe(&loop->ring), loop->listen_fd, (uint64_t)(uintptr_t)loop | URING_ACCEPT);
             }
-
-            free(current); // Free the memory allocated for the removed node
-            return first_floor; // Return the floor value of the deleted node
         }
-        previous = current;
-        current = current->next;
+        else
+        {
+            receive_shard_messages(loop);
+            uring_prep_read(uring_get_sqe(&loop->ring), loop->wake_fd, &loop->wake_count, sizeof(loop->wake_count),
+                            (uint64_t)(uintptr_t)loop | URING_WAKE);
+        }
+        return;
     }
 
-    return "E"; // Return "E" if no matching FD was found
+    connection *conn = target;
+    if (tag == URING_RECEIVE)
+    {
+        handle_received(loop, conn, cqe);
+    }
+    else if (tag == URING_SEND)
+    {
+        handle_sent(loop, conn, cqe->res);
+    }
+    if (!more && --conn->ring_requests == 0)
+    {
+        retire_connection(loop, conn);
+    }
 }
 
-// Function: Updates the call queue with source and destination floor requests.
-// Argument: A void pointer that is cast to a CallInfo pointer.
+// Function: Arms a multishot receive for a connection on the loop's ring.
+// Arguments:
+// - loop: the event loop that owns the connection.
+// - conn: the connection.
 // Returns: void
-void *update_call_queue(void *arg)
+void uring_receive(event_loop *loop, connection *conn)
 {
-    CallInfo *call_info = (CallInfo *)arg;
-
-    // Create call requests for source and destination
-    call_requests source_call = {get_call_direction(call_info->source_floor, call_info->destination_floor), "", call_info->chosen_car_fd};
-    strcpy(source_call.floor, call_info->source_floor);
-    add_call_request(source_call);
-
-    call_requests destination_call = {source_call.direction, "", call_info->chosen_car_fd};
-    strcpy(destination_call.floor, call_info->destination_floor);
-    add_call_request(destination_call);
-
-    // Free allocated memory for floor strings and CallInfo structure
-    free(call_info->source_floor);
-    free(call_info->destination_floor);
-    free(call_info);
-
-    //print_call_list();
-
-    pthread_exit(NULL);
+    uring_prep_recv_multishot(uring_get_sqe(&loop->ring), conn->fd, &loop->receive_buffers,
+                              (uint64_t)(uintptr_t)conn | URING_RECEIVE);
+    conn->ring_requests++;
 }
 
-// Function: takes a call and adds it to the queue ensuring floors of the same direction
-// are together, while have D floors in descending order and U floors in ascending.
+// Function: Takes the bytes a receive delivered into the connection's frame reader and handles the
+// frames they complete. A connection being handed off only keeps them, for its new owner.
 // Arguments:
-// new_call - a struct containing the floor, direction, and assigned car.
-// Returns: void.
-void add_call_request(call_requests new_call)
+// - loop: the event loop that owns the connection.
+// - conn: the connection.
+// - cqe: the receive's completion.
+// Returns: void (the connection is closed on EOF, error or a terminating message).
+void handle_received(event_loop *loop, connection *conn, const struct io_uring_cqe *cqe)
 {
-    CallNode *new_node = malloc(sizeof(CallNode));
-    new_node->call = new_call;
-    new_node->next = NULL;
-
-    pthread_mutex_lock(&call_list_mutex);
-
-    // If the call list is empty
-    if (call_list_head == NULL)
-    {
-        call_list_head = new_node;
-        pthread_mutex_unlock(&call_list_mutex);
-        return;
-    }
-
-    CallNode *current = call_list_head;
-    CallNode *previous = NULL;
-
-    // Handle insertion for Upward Call (U)
-    if (new_call.direction == 'U')
+    if (cqe->res > 0)
     {
-        while (current != NULL)
+        const char *data = uring_buffer(&loop->receive_buffers, cqe);
+        size_t remaining = (size_t)cqe->res;
+        conn->received_ns = metrics_now_ns();
+        while (remaining > 0 && !conn->closed)
         {
-            if (current->call.direction == 'U')
+            size_t taken = frame_reader_append(&conn->reader, data, remaining);
+            data += taken;
+            remaining -= taken;
+            if (conn->handing_off)
             {
-                if (get_call_direction(current->call.floor, new_call.floor) == 'D')
+                if (taken == 0)
                 {
-                    // Insert before the current node
-                    if (previous == NULL)
-                    {
-                        // Inserting at the head
-                        new_node->next = call_list_head;
-                        call_list_head = new_node;
-                    }
-                    else
-                    {
-                        previous->next = new_node;
-                        new_node->next = current;
-                    }
-                    pthread_mutex_unlock(&call_list_mutex);
-                    return;
+                    close_connection(loop, conn); // More than a buffer sent before the car was registered
                 }
             }
-            else if (current->call.direction == 'D')
+            else
             {
-                // Insert before the first downward call
-                if (previous == NULL)
-                {
-                    new_node->next = call_list_head;
-                    call_list_head = new_node;
-                }
-                else
-                {
-                    previous->next = new_node;
-                    new_node->next = current;
-                }
-                pthread_mutex_unlock(&call_list_mutex);
-                return;
+                handle_frames(loop, conn);
             }
-            previous = current;
-            current = current->next;
         }
+        uring_buffer_recycle(&loop->receive_buffers, cqe);
     }
-    // Handle insertion for Downward Call (D)
-    else if (new_call.direction == 'D')
+    else if (cqe->flags & IORING_CQE_F_BUFFER)
     {
-        while (current != NULL)
-        {
-            if (current->call.direction == 'D')
-            {
-                if (get_call_direction(current->call.floor, new_call.floor) == 'U')
-                {
-                    // Insert before the current node
-                    if (previous == NULL)
-                    {
-                        // Inserting at the head
-                        new_node->next = call_list_head;
-                        call_list_head = new_node;
-                    }
-                    else
-                    {
-                        previous->next = new_node;
-                        new_node->next = current;
-                    }
-                    pthread_mutex_unlock(&call_list_mutex);
-                    return;
-                }
-            }
-            else if (current->call.direction == 'U')
-            {
-                // Insert before the first upward call
-                if (previous == NULL)
-                {
-                    new_node->next = call_list_head;
-                    call_list_head = new_node;
-                }
-                else
-                {
-                    previous->next = new_node;
-                    new_node->next = current;
-                }
-                pthread_mutex_unlock(&call_list_mutex);
-                return;
-            }
-            previous = current;
-            current = current->next;
-        }
+        uring_buffer_recycle(&loop->receive_buffers, cqe);
     }
 
-    // If no suitable position was found, append to the end of the list
-    if (previous != NULL)
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !conn->closed && !conn->handing_off)
     {
-        previous->next = new_node;
+        if (cqe->res > 0 || cqe->res == -ENOBUFS)
+        {
+            uring_receive(loop, conn); // The kernel ended it early, or every buffer was in use
+        }
+        else
+        {
+            close_connection(loop, conn); // End of file or an error
+        }
     }
-    else
+}
+
+// Function: Sends a connection's queued frames, unless a send is already in flight; the frames
+// queued meanwhile go once it completes.
+// Arguments:
+// - loop: the event loop that owns the connection.
+// - conn: the connection.
+// Returns: void
+void uring_send(event_loop *loop, connection *conn)
+{
+    if (conn->waiting_for_write || conn->out_len == 0 || conn->closed)
     {
-        call_list_head = new_node;
+        return;
     }
 
-    pthread_mutex_unlock(&call_list_mutex);
+    // Swap buffers: out_buf goes to the kernel, and the one it last sent from collects new frames.
+    char *buf = conn->send_buf;
+    size_t capacity = conn->send_capacity;
+    conn->send_buf = conn->out_buf;
+    conn->send_capacity = conn->out_capacity;
+    conn->send_len = conn->out_len;
+    conn->send_offset = 0;
+    conn->out_buf = buf;
+    conn->out_capacity = capacity;
+    conn->out_len = 0;
+
+    uring_prep_send(uring_get_sqe(&loop->ring), conn->fd, conn->send_buf, conn->send_len,
+                    (uint64_t)(uintptr_t)conn | URING_SEND);
+    conn->ring_requests++;
+    conn->waiting_for_write = 1;
 }
 
-// Function: Adds a new car the to car linked list.
-// Arguments: new_car - struct containing important information about the available cars.
-// Returns: void.
-void add_car_to_list(car_information new_car)
+// Function: Carries on after a send completes: sends the rest after a short send, else whatever was
+// queued meanwhile.
+// Arguments:
+// - loop: the event loop that owns the connection.
+// - conn: the connection.
+// - result: bytes sent, or a negative errno.
+// Returns: void
+void handle_sent(event_loop *loop, connection *conn, int result)
 {
-    pthread_mutex_lock(&car_list_mutex);
-
-    CarNode *new_node = (CarNode *)malloc(sizeof(CarNode));
-    if (new_node == NULL)
+    if (conn->closed)
     {
-        perror("malloc()");
-        pthread_mutex_unlock(&car_list_mutex);
+        return;
+    }
+    if (result < 0)
+    {
+        conn->waiting_for_write = 0;
+        conn->out_len = 0; // Peer is gone, the receive will notice and close
         return;
     }
 
-    new_node->car_info = new_car;
-    new_node->next = car_list_head;
-
-    car_list_head = new_node;
-
-    pthread_mutex_unlock(&car_list_mutex);
+    conn->send_offset += (size_t)result;
+    if (conn->send_offset < conn->send_len)
+    {
+        uring_prep_send(uring_get_sqe(&loop->ring), conn->fd, conn->send_buf + conn->send_offset,
+                        conn->send_len - conn->send_offset, (uint64_t)(uintptr_t)conn | URING_SEND);
+        conn->ring_requests++;
+        return;
+    }
+    conn->waiting_for_write = 0;
+    if (!conn->corked)
+    {
+        uring_send(loop, conn);
+    }
 }
 
-// Function: Removes a car from the car linked list.
-// Arguments: car_fd - the file descriptor for the car to be removed.
+// Function: Called once a loop's ring has no requests left that name a connection: frees it if it was
+// closed, or posts it to its owner if it is being handed off.
+// Arguments:
+// - loop: the event loop.
+// - conn: the connection.
 // Returns: void
-void remove_car_from_list(int car_fd)
+void retire_connection(event_loop *loop, connection *conn)
 {
-    pthread_mutex_lock(&car_list_mutex);
-
-    CarNode *current = car_list_head;
-    CarNode *prev = NULL;
+    if (conn->closed)
+    {
+        free(conn->send_buf);
+        free(conn);
+    }
+    else if (conn->handing_off)
+    {
+        post_connection(loop, conn);
+    }
+}
+#endif
 
-    // Loop through the car linked list
-    while (current != NULL)
+// Function: Accepts every pending client on the listening socket and registers it with the loop.
+// Arguments: loop - the event loop that will own the new connections.
+// Returns: void
+void accept_connections(event_loop *loop)
+{
+    for (;;)
     {
-        // If found a matching car.
-        if (current->car_info.car_fd == car_fd)
+        int clientfd = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (clientfd == -1)
         {
-            if (prev == NULL)
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
             {
-                car_list_head = current->next;
+                return; // Another loop took it, or nothing left to accept
             }
-            else
+            if (errno == EMFILE || errno == ENFILE || errno == ECONNABORTED)
             {
-                prev->next = current->next;
+                perror("accept()"); // Transient, keep serving existing clients
+                return;
             }
-            free(current);
-            break;
+            perror("accept()");
+            exit(EXIT_FAILURE);
         }
-        prev = current;
-        current = current->next;
+        add_connection(loop, clientfd);
     }
+}
 
-    pthread_mutex_unlock(&car_list_mutex);
+// Function: Sets up a newly accepted client and starts reading from it.
+// Arguments:
+// - loop: the event loop that will own the connection.
+// - clientfd: the client's non-blocking socket.
+// Returns: void (the socket is closed if the connection cannot be set up).
+void add_connection(event_loop *loop, int clientfd)
+{
+    // Replies are small and latency-bound; send them without waiting on Nagle's algorithm.
+    int opt_enable = 1;
+    setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &opt_enable, sizeof(opt_enable));
+
+    connection *conn = calloc(1, sizeof(connection));
+    if (conn == NULL)
+    {
+        perror("calloc()");
+        close(clientfd);
+        return;
+    }
+    conn->fd = clientfd;
+    conn->loop = loop;
+    if (frame_reader_init(&conn->reader, max_frame_size) == -1)
+    {
+        perror("frame_reader_init()");
+        close(clientfd);
+        free(conn);
+        return;
+    }
+
+#ifdef USE_URING
+    if (use_uring)
+    {
+        uring_receive(loop, conn);
+        return;
+    }
+#endif
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, clientfd, &ev) == -1)
+    {
+        perror("epoll_ctl()");
+        close(clientfd);
+        frame_reader_destroy(&conn->reader);
+        free(conn);
+    }
+}
+
+// Function: Drains the socket through the connection's frame reader and handles each complete frame.
+// Arguments:
+// - loop: the event loop that owns the connection.
+// - conn: the readable connection.
+// Returns: void (the connection is closed on EOF, error or a terminating message).
+void handle_readable(event_loop *loop, connection *conn)
+{
+    for (;;)
+    {
+        ssize_t received = frame_reader_fill(&conn->reader, conn->fd);
+        if (received == 0)
+        {
+            close_connection(loop, conn);
+            return;
+        }
+        if (received == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                close_connection(loop, conn);
+            }
+            return;
+        }
+        conn->received_ns = metrics_now_ns();
+        if (!handle_frames(loop, conn))
+        {
+            return;
+        }
+    }
+}
+
+// Function: Handles every complete frame buffered for a connection; a partial one stays buffered.
+// Replies to pipelined requests are gathered and sent together once the batch is handled.
+// Arguments:
+// - loop: the event loop that owns the connection.
+// - conn: the connection.
+// Returns: 1 if the loop still owns the connection, 0 if it was closed or handed to another shard.
+int handle_frames(event_loop *loop, connection *conn)
+{
+    char *msg;
+    uint32_t len;
+    int status;
+    conn->corked = 1;
+    while ((status = frame_reader_next(&conn->reader, &msg, &len)) == 1)
+    {
+        if (!process_frame(loop, conn, msg, len))
+        {
+            close_connection(loop, conn);
+            return 0;
+        }
+        if (conn->handing_off)
+        {
+            hand_off_connection(loop, conn); // Frames after the CAR are left for the owner
+            return 0;
+        }
+    }
+    if (status == -1)
+    {
+        close_connection(loop, conn); // Oversized frame: the peer is broken or hostile
+        return 0;
+    }
+    if (loop->journal_position > loop->journal_committed)
+    {
+        hold_replies(loop, conn); // Sent once the calls they answer are journaled
+        return 1;
+    }
+    conn->corked = 0;
+    if (conn->out_len > 0 && !conn->waiting_for_write)
+    {
+        handle_writable(loop, conn);
+    }
+    return 1;
+}
+
+// Function: Handles one complete message from a client. The first frame on a connection decides
+// whether it speaks the text protocol or binary protocol version 2.
+// Arguments:
+// - loop: the event loop that owns the connection.
+// - conn: the connection the message arrived on.
+// - msg: the message body, NUL-terminated.
+// - len: the body length.
+// Returns: 1 to keep the connection open, 0 to close it.
+int process_frame(event_loop *loop, connection *conn, char *msg, uint32_t len)
+{
+    if (conn->protocol == 0)
+    {
+        if (len > 0 && (unsigned char)msg[0] == PROTOCOL_MAGIC && !proto_is_binary(msg, len))
+        {
+            return 0; // A binary protocol version we do not speak
+        }
+        conn->protocol = proto_is_binary(msg, len) ? PROTOCOL_VERSION : PROTOCOL_TEXT;
+    }
+
+    if (__atomic_load_n(&trace_active, __ATOMIC_RELAXED))
+    {
+        trace_record(TRACE_MESSAGE_RECEIVED, conn->is_car ? conn->car_node->car_info.name : "",
+                     classify_frame(conn, msg, len), 0, 0);
+    }
+
+    if (conn->protocol == PROTOCOL_VERSION)
+    {
+        return process_binary_frame(loop, conn, msg, len);
+    }
+    return process_text_frame(loop, conn, msg);
+}
+
+// Function: Handles one binary protocol frame.
+// Arguments: as process_frame.
+// Returns: 1 to keep the connection open, 0 to close it.
+int process_binary_frame(event_loop *loop, connection *conn, const char *msg, uint32_t len)
+{
+    int type = proto_type_of(msg, len);
+
+    if (conn->is_car)
+    {
+        car_status status;
+        floor_t current_floor, destination_floor;
+        uint8_t fields;
+
+        // Exit if an emergency or individual service message is received
+        if (type == PROTO_EMERGENCY || type == PROTO_INDIVIDUAL_SERVICE)
+        {
+            return 0;
+        }
+
+        // Decoded straight out of the frame: no parsing and no allocation
+        if (proto_decode_status(msg, len, &status, &current_floor, &destination_floor))
+        {
+            handle_status(loop, conn, status, current_floor, destination_floor);
+        }
+        else if (proto_decode_status_update(msg, len, &fields, &status, &current_floor, &destination_floor))
+        {
+            handle_status_update(loop, conn, fields, status, current_floor, destination_floor);
+        }
+        return 1;
+    }
+
+    if (type == PROTO_CAR)
+    {
+        char name[PROTOCOL_MAX_NAME];
+        floor_t lowest_floor, highest_floor;
+        uint32_t delay_ms;
+
+        if (!proto_decode_car(msg, len, name, &lowest_floor, &highest_floor, &delay_ms))
+        {
+            return 0; // A car we cannot schedule is not registered
+        }
+        printf(">>> Car received: %s (binary)\n", name);
+        return register_car(conn, name, lowest_floor, highest_floor, (int)delay_ms);
+    }
+
+    if (type == PROTO_CALL)
+    {
+        floor_t source_floor, destination_floor;
+
+        if (!proto_decode_call(msg, len, &source_floor, &destination_floor))
+        {
+            proto_header unavailable;
+            queue_frame_bytes(loop, conn, &unavailable, proto_encode_header(&unavailable, PROTO_UNAVAILABLE));
+            record_call(loop, conn, 0);
+            return 1;
+        }
+        handle_call(loop, conn, source_floor, destination_floor);
+    }
+    else if (type == PROTO_CALL_BATCH)
+    {
+        handle_call_batch(loop, conn, msg, len);
+    }
+
+    return 1;
+}
+
+// Function: Handles one text protocol message.
+// Arguments: as process_frame.
+// Returns: 1 to keep the connection open, 0 to close it.
+int process_text_frame(event_loop *loop, connection *conn, char *msg)
+{
+    if (conn->is_car)
+    {
+        char status[8];
+        char current_floor[4];
+        char destination_floor[4];
+
+        // Exit if an emergency or individual service message is received
+        if (strcmp(msg, "EMERGENCY") == 0 || strcmp(msg, "INDIVIDUAL SERVICE") == 0)
+        {
+            return 0;
+        }
+
+        if (sscanf(msg, "STATUS %7s %3s %3s", status, current_floor, destination_floor) == 3)
+        {
+            car_status parsed_status = parse_status(status);
+            floor_t current = parse_floor(current_floor);
+            floor_t destination = parse_floor(destination_floor);
+            if (parsed_status == CAR_STATUS_INVALID || current == FLOOR_INVALID || destination == FLOOR_INVALID)
+            {
+                return 1; // Ignore malformed status reports
+            }
+            handle_status(loop, conn, parsed_status, current, destination);
+        }
+        return 1;
+    }
+
+    // Check if the message is from a car
+    if (strncmp(msg, "CAR", 3) == 0)
+    {
+        printf(">>> Car received: %s\n", msg);
+
+        char name[100], lowest_floor[4], highest_floor[4];
+        int delay_ms = DEFAULT_CAR_DELAY_MS;
+
+        // Parse car info; cars that predate the delay field are costed with the default
+        if (sscanf(msg, "CAR %99s %3s %3s %d", name, lowest_floor, highest_floor, &delay_ms) < 3)
+        {
+            return 0;
+        }
+        floor_t lowest = parse_floor(lowest_floor);
+        floor_t highest = parse_floor(highest_floor);
+        if (lowest == FLOOR_INVALID || highest == FLOOR_INVALID)
+        {
+            return 0; // A car we cannot schedule is not registered
+        }
+        return register_car(conn, name, lowest, highest, delay_ms);
+    }
+    // Check if the message is a call request: CALL {source floor} {destination floor} [{request id}]
+    else if (strncmp(msg, "CALL", 4) == 0)
+    {
+        // Extract source and destination floors from the message, parsing them once here
+        char source_text[4], destination_text[4];
+        unsigned int request_id;
+        floor_t source_floor = FLOOR_INVALID, destination_floor = FLOOR_INVALID;
+        int fields = sscanf(msg, "CALL %3s %3s %u", source_text, destination_text, &request_id);
+        if (fields >= 2)
+        {
+            source_floor = parse_floor(source_text);
+            destination_floor = parse_floor(destination_text);
+        }
+
+        if (fields < 3)
+        {
+            if (source_floor == FLOOR_INVALID || destination_floor == FLOOR_INVALID)
+            {
+                queue_frame(loop, conn, "UNAVAILABLE\n");
+                record_call(loop, conn, 0);
+                return 1;
+            }
+            handle_call(loop, conn, source_floor, destination_floor);
+            return 1;
+        }
+
+        // A pipelined call: the reply echoes the request ID
+        car_information assigned_car;
+        char reply[120];
+        int assigned = source_floor != FLOOR_INVALID && destination_floor != FLOOR_INVALID &&
+                       assign_call(loop, source_floor, destination_floor, &assigned_car);
+        if (assigned)
+        {
+            snprintf(reply, sizeof(reply), "CAR %s %u", assigned_car.name, request_id);
+        }
+        else
+        {
+            snprintf(reply, sizeof(reply), "UNAVAILABLE %u", request_id);
+        }
+        queue_frame(loop, conn, reply);
+        record_call(loop, conn, assigned);
+    }
+
+    return 1;
+}
+
+// Function: Adds a newly connected car to the car list.
+// Arguments:
+// - conn: the car's connection.
+// - name, lowest_floor, highest_floor, delay_ms: the car's registration details.
+// Returns: 1 if the car was registered or is being handed to the shard that owns it, 0 if the
+// connection should be closed.
+int register_car(connection *conn, const char *name, floor_t lowest_floor, floor_t highest_floor, int delay_ms)
+{
+    if (sharded && shard_of(name) != conn->loop->id)
+    {
+        // Registered by the owner once it has the connection (adopt_connection)
+        snprintf(conn->pending_name, sizeof(conn->pending_name), "%s", name);
+        conn->pending_lowest_floor = lowest_floor;
+        conn->pending_highest_floor = highest_floor;
+        conn->pending_delay_ms = delay_ms;
+        conn->handing_off = 1;
+        return 1;
+    }
+
+    car_information new_car;
+    memset(&new_car, 0, sizeof(new_car));
+
+    snprintf(new_car.name, sizeof(new_car.name), "%s", name);
+    new_car.lowest_floor = lowest_floor;
+    new_car.highest_floor = highest_floor;
+    new_car.current_floor = lowest_floor;
+    new_car.destination_floor = lowest_floor;
+    new_car.status = CAR_STATUS_CLOSED;
+    new_car.delay_ms = delay_ms;
+    new_car.car_fd = conn->fd; // Set file descriptor for the car
+
+    conn->is_car = 1;
+    conn->registered_ns = conn->received_ns;
+    conn->status_since_ns = conn->received_ns;
+    conn->reported_ns = conn->received_ns;
+    conn->car_node = add_car_to_list(conn->loop->cars, new_car, conn); // Add the new car to the list
+    if (conn->car_node != NULL && journal != NULL)
+    {
+        journal_register(journal, conn->car_node); // Hands over any stops recovered under its name
+    }
+    return conn->car_node != NULL;
+}
+
+// Function: Records a car's reported status and queues it for a dispatch check.
+// Arguments:
+// - loop: the event loop that owns the car.
+// - conn: the car's connection.
+// - status, current_floor, destination_floor: the reported state.
+// Returns: void
+void handle_status(event_loop *loop, connection *conn, car_status status, floor_t current_floor, floor_t destination_floor)
+{
+    // Lock mutex to update car information safely
+    pthread_mutex_lock(&loop->cars->mutex);
+    car_information *car_info = &conn->car_node->car_info;
+    if (status != car_info->status)
+    {
+        conn->status_ns[car_info->status] += conn->received_ns - conn->status_since_ns;
+        conn->status_since_ns = conn->received_ns;
+    }
+    car_info->current_floor = current_floor;
+    car_info->destination_floor = destination_floor;
+    car_info->status = status;
+    pthread_mutex_unlock(&loop->cars->mutex);
+
+    metrics_add(&loop->metrics.status_reports, 1);
+    __atomic_store_n(&conn->reported_ns, conn->received_ns, __ATOMIC_RELAXED);
+    conn->status_received_ns = conn->received_ns;
+    request_dispatch(loop, conn); // The car may now be ready for its next stop
+}
+
+// Function: Applies a STATUS_UPDATE, which carries only the fields that changed since the car's last
+// report. One with no fields is a heartbeat: the car is alive and unchanged, so nothing is dispatched.
+// Arguments:
+// - loop: the event loop that owns the car.
+// - conn: the car's connection.
+// - fields: PROTO_FIELD_* bits saying which of the values were sent.
+// - status, current_floor, destination_floor: the values sent.
+// Returns: void
+void handle_status_update(event_loop *loop, connection *conn, uint8_t fields, car_status status, floor_t current_floor, floor_t destination_floor)
+{
+    if (fields == 0)
+    {
+        metrics_add(&loop->metrics.status_heartbeats, 1);
+        __atomic_store_n(&conn->reported_ns, conn->received_ns, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // Only this loop writes the car's state, so it can be read without the lock.
+    const car_information *car_info = &conn->car_node->car_info;
+    handle_status(loop, conn, (fields & PROTO_FIELD_STATUS) ? status : car_info->status,
+                  (fields & PROTO_FIELD_CURRENT) ? current_floor : car_info->current_floor,
+                  (fields & PROTO_FIELD_DESTINATION) ? destination_floor : car_info->destination_floor);
+}
+
+// Function: Assigns a call to a car and tells the call pad which car is coming.
+// Arguments:
+// - loop: the event loop that owns the call pad's connection.
+// - conn: the call pad's connection.
+// - source_floor, destination_floor: the call's floors.
+// Returns: void
+void handle_call(event_loop *loop, connection *conn, floor_t source_floor, floor_t destination_floor)
+{
+    car_information assigned_car;
+    int assigned = assign_call(loop, source_floor, destination_floor, &assigned_car);
+
+    if (conn->protocol == PROTOCOL_VERSION)
+    {
+        if (!assigned)
+        {
+            proto_header unavailable;
+            queue_frame_bytes(loop, conn, &unavailable, proto_encode_header(&unavailable, PROTO_UNAVAILABLE));
+        }
+        else
+        {
+            proto_car reply;
+            queue_frame_bytes(loop, conn, &reply,
+                              proto_encode_car(&reply, assigned_car.name, assigned_car.lowest_floor,
+                                               assigned_car.highest_floor, (uint32_t)assigned_car.delay_ms));
+        }
+    }
+    else if (!assigned)
+    {
+        queue_frame(loop, conn, "UNAVAILABLE\n"); // Notify the client if no car is available
+    }
+    else
+    {
+        // Notify the client of the assigned car
+        char msg_to_client[110];
+        snprintf(msg_to_client, sizeof(msg_to_client), "CAR %s\n", assigned_car.name);
+        queue_frame(loop, conn, msg_to_client);
+    }
+    record_call(loop, conn, assigned);
+}
+
+// Function: Assigns every call in a CALL_BATCH frame, answering each with an ASSIGNMENT in order.
+// Arguments:
+// - loop: the event loop that owns the call pad's connection.
+// - conn: the call pad's connection.
+// - msg, len: the CALL_BATCH frame.
+// Returns: void
+void handle_call_batch(event_loop *loop, connection *conn, const char *msg, uint32_t len)
+{
+    uint16_t count;
+    if (!proto_decode_call_batch(msg, len, &count))
+    {
+        return; // Nothing in a malformed batch can be answered by ID
+    }
+
+    for (uint16_t i = 0; i < count; i++)
+    {
+        uint32_t request_id;
+        floor_t source_floor, destination_floor;
+        car_information assigned_car;
+        proto_assignment reply;
+
+        int assigned = proto_decode_call_entry(msg, i, &request_id, &source_floor, &destination_floor) &&
+                       assign_call(loop, source_floor, destination_floor, &assigned_car);
+        queue_frame_bytes(loop, conn, &reply, proto_encode_assignment(&reply, request_id, assigned ? assigned_car.name : NULL));
+        record_call(loop, conn, assigned);
+    }
+}
+
+// Function: Chooses a car for a call and queues the stops on it. Sharded, every shard's cars are
+// considered and a car owned by another shard has the stops queued by that shard (SHARD_CALL).
+// Arguments:
+// - loop: the event loop handling the call.
+// - source_floor, destination_floor: the call's floors.
+// - assigned_car: set to a copy of the chosen car's details.
+// Returns: 1 if a car was assigned, 0 if none is available or the call goes nowhere.
+int assign_call(event_loop *loop, floor_t source_floor, floor_t destination_floor, car_information *assigned_car)
+{
+    if (source_floor == destination_floor)
+    {
+        trace_emit(TRACE_CALL_UNAVAILABLE, "", 0, source_floor, destination_floor);
+        return 0; // No stop to queue: answered UNAVAILABLE
+    }
+
+    // The chosen car's list stays locked until its stops are queued or on their way to its owner,
+    // so the car cannot be removed underneath us. Lists are locked in order, holding at most the
+    // best one so far, so two loops never wait on each other.
+    CarNode *chosen_car = NULL;
+    car_list *chosen_list = NULL;
+    long best_cost = 0;
+    for (int i = 0; i < car_list_count; i++)
+    {
+        long cost;
+        pthread_mutex_lock(&car_lists[i].mutex);
+        CarNode *car = choose_car(&car_lists[i], source_floor, destination_floor, &cost);
+        if (car != NULL && (chosen_car == NULL || cost < best_cost))
+        {
+            if (chosen_list != NULL)
+            {
+                pthread_mutex_unlock(&chosen_list->mutex);
+            }
+            chosen_car = car;
+            chosen_list = &car_lists[i];
+            best_cost = cost;
+        }
+        else
+        {
+            pthread_mutex_unlock(&car_lists[i].mutex);
+        }
+    }
+
+    if (chosen_car == NULL)
+    {
+        trace_emit(TRACE_CALL_UNAVAILABLE, "", 0, source_floor, destination_floor);
+        return 0;
+    }
+
+    *assigned_car = chosen_car->car_info;
+    event_loop *owner = chosen_car->connection->loop;
+    if (!sharded || owner == loop)
+    {
+        if (journal != NULL)
+        {
+            loop->journal_position = journal_assign(journal, chosen_car, source_floor, destination_floor);
+        }
+        else
+        {
+            update_call_queue(source_floor, destination_floor, chosen_car);
+        }
+        trace_emit(TRACE_CALL_QUEUED, assigned_car->name, 0, source_floor, destination_floor);
+        request_dispatch(loop, chosen_car->connection);
+    }
+    else
+    {
+        shard_message *message = pool_alloc(&shard_message_pool);
+        if (message == NULL)
+        {
+            perror("pool_alloc()");
+            pthread_mutex_unlock(&chosen_list->mutex);
+            return 0;
+        }
+        message->type = SHARD_CALL;
+        message->car = chosen_car;
+        message->index_slot = chosen_car->index_slot;
+        message->serial = chosen_car->serial;
+        message->source_floor = source_floor;
+        message->destination_floor = destination_floor;
+        if (journal != NULL)
+        {
+            loop->journal_position = journal_record_assign(journal, chosen_car, source_floor, destination_floor);
+        }
+        metrics_add(&loop->metrics.calls_routed, 1);
+        mailbox_post(&owner->mailbox, &message->node);
+    }
+    pthread_mutex_unlock(&chosen_list->mutex);
+    return 1;
+}
+
+// Function: Says which shard owns a car (-S).
+// Arguments: name - the car's name.
+// Returns: the owning event loop's id.
+int shard_of(const char *name)
+{
+    uint32_t hash = 2166136261U; // FNV-1a
+    for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++)
+    {
+        hash = (hash ^ *c) * 16777619U;
+    }
+    return (int)(hash % (uint32_t)event_loop_count);
+}
+
+// Function: Passes a car that registered on this shard to the shard that owns it. The connection
+// leaves this loop's epoll first, so only one loop ever touches it. On a ring (-U) its receive is
+// cancelled instead, and it is posted once the ring is done with it (retire_connection).
+// Arguments:
+// - loop: the event loop the car registered on.
+// - conn: the car's connection, with its registration pending.
+// Returns: void
+void hand_off_connection(event_loop *loop, connection *conn)
+{
+    unhold_replies(loop, conn);
+    metrics_add(&loop->metrics.connections_handed_off, 1);
+#ifdef USE_URING
+    if (use_uring)
+    {
+        uring_prep_cancel(uring_get_sqe(&loop->ring), (uint64_t)(uintptr_t)conn | URING_RECEIVE,
+                          (uint64_t)(uintptr_t)conn | URING_CANCEL);
+        conn->ring_requests++;
+        return;
+    }
+#endif
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    post_connection(loop, conn);
+}
+
+// Function: Posts a car being handed off to the mailbox of the shard that owns it.
+// Arguments:
+// - loop: the event loop the car registered on, which no longer watches the connection.
+// - conn: the car's connection.
+// Returns: void
+void post_connection(event_loop *loop, connection *conn)
+{
+    shard_message *message = pool_alloc(&shard_message_pool);
+    if (message == NULL)
+    {
+        perror("pool_alloc()");
+        close_connection(loop, conn);
+        return;
+    }
+    message->type = SHARD_CONNECTION;
+    message->conn = conn;
+    mailbox_post(&event_loops[shard_of(conn->pending_name)].mailbox, &message->node);
+}
+
+// Function: Takes over a car handed on by another shard: registers it and handles whatever it sent
+// after its CAR.
+// Arguments:
+// - loop: the owning event loop.
+// - conn: the car's connection.
+// Returns: void
+void adopt_connection(event_loop *loop, connection *conn)
+{
+    conn->loop = loop;
+    conn->handing_off = 0;
+
+#ifdef USE_URING
+    if (use_uring)
+    {
+        uring_receive(loop, conn);
+        if (!register_car(conn, conn->pending_name, conn->pending_lowest_floor, conn->pending_highest_floor, conn->pending_delay_ms))
+        {
+            close_connection(loop, conn);
+            return;
+        }
+        handle_frames(loop, conn);
+        return;
+    }
+#endif
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (conn->waiting_for_write ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) == -1)
+    {
+        perror("epoll_ctl()");
+        shutdown(conn->fd, SHUT_RDWR);
+        close(conn->fd);
+        frame_reader_destroy(&conn->reader);
+        free(conn->out_buf);
+        free(conn);
+        return;
+    }
+
+    if (!register_car(conn, conn->pending_name, conn->pending_lowest_floor, conn->pending_highest_floor, conn->pending_delay_ms))
+    {
+        close_connection(loop, conn);
+        return;
+    }
+    handle_frames(loop, conn);
+}
+
+// Function: Handles every message other shards have posted to this loop's mailbox.
+// Arguments: loop - the event loop, woken through its eventfd.
+// Returns: void
+void receive_shard_messages(event_loop *loop)
+{
+    mailbox_drained(&loop->mailbox);
+
+    mailbox_node *node;
+    while ((node = mailbox_take(&loop->mailbox)) != NULL)
+    {
+        shard_message *message = (shard_message *)node;
+        if (message->type == SHARD_CALL)
+        {
+            queue_routed_call(loop, message);
+        }
+        else
+        {
+            adopt_connection(loop, message->conn);
+        }
+        pool_free(&shard_message_pool, message);
+    }
+}
+
+// Function: Queues the stops of a call another shard assigned to one of this shard's cars. If the
+// car left meanwhile the call is lost with it, as the stops of a car that leaves always are.
+// Arguments:
+// - loop: the owning event loop.
+// - message: the SHARD_CALL.
+// Returns: void
+void queue_routed_call(event_loop *loop, shard_message *message)
+{
+    // Only this shard adds and removes its cars, so they can be looked up without the lock.
+    car_index *index = &loop->cars->eligibility;
+    if (index->cars[message->index_slot] != message->car || message->car->serial != message->serial)
+    {
+        return;
+    }
+
+    CarNode *car = message->car;
+    update_call_queue(message->source_floor, message->destination_floor, car);
+    trace_emit(TRACE_CALL_QUEUED, car->car_info.name, 0, message->source_floor, message->destination_floor);
+    request_dispatch(loop, car->connection);
+}
+
+// Function: Says what kind of message a frame holds, for tracing.
+// Arguments:
+// - conn: the connection it arrived on, whose protocol is known.
+// - msg, len: the frame.
+// Returns: the kind of message.
+trace_message classify_frame(const connection *conn, const char *msg, uint32_t len)
+{
+    if (conn->protocol == PROTOCOL_VERSION)
+    {
+        int type = proto_type_of(msg, len);
+        if (type == PROTO_CAR)
+        {
+            return TRACE_MESSAGE_CAR;
+        }
+        if (type == PROTO_STATUS || type == PROTO_STATUS_UPDATE)
+        {
+            return TRACE_MESSAGE_STATUS;
+        }
+        if (type == PROTO_CALL)
+        {
+            return TRACE_MESSAGE_CALL;
+        }
+        if (type == PROTO_CALL_BATCH)
+        {
+            return TRACE_MESSAGE_CALL_BATCH;
+        }
+        return TRACE_MESSAGE_OTHER;
+    }
+
+    if (strncmp(msg, "STATUS", 6) == 0)
+    {
+        return TRACE_MESSAGE_STATUS;
+    }
+    if (strncmp(msg, "CALL", 4) == 0)
+    {
+        return TRACE_MESSAGE_CALL;
+    }
+    if (strncmp(msg, "CAR", 3) == 0)
+    {
+        return TRACE_MESSAGE_CAR;
+    }
+    return TRACE_MESSAGE_OTHER;
+}
+
+// Function: Counts a call as answered and records how long it took since its frame was read.
+// Arguments:
+// - loop: the event loop that answered it.
+// - conn: the call pad's connection.
+// - assigned: 1 if a car was assigned, 0 if the answer was UNAVAILABLE.
+// Returns: void
+void record_call(event_loop *loop, connection *conn, int assigned)
+{
+    metrics_add(assigned ? &loop->metrics.calls_accepted : &loop->metrics.calls_unavailable, 1);
+    metrics_record(&loop->metrics.call_latency, metrics_now_ns() - conn->received_ns);
+}
+
+// Function: Sends a framed text message without blocking.
+// Arguments:
+// - loop: the event loop that owns the connection.
+// - conn: the destination connection.
+// - msg: the NUL-terminated message to frame and send.
+// Returns: void
+void queue_frame(event_loop *loop, connection *conn, const char *msg)
+{
+    queue_frame_bytes(loop, conn, msg, strlen(msg));
+}
+
+// Function: Sends a framed message without blocking, buffering whatever the socket cannot take yet.
+// Arguments:
+// - loop: the event loop that owns the connection.
+// - conn: the destination connection.
+// - msg: the message body.
+// - msg_len: the body length.
+// Returns: void
+void queue_frame_bytes(event_loop *loop, connection *conn, const void *msg, size_t msg_len)
+{
+    size_t needed = conn->out_len + sizeof(uint32_t) + msg_len;
+
+    if (needed > conn->out_capacity)
+    {
+        size_t new_capacity = conn->out_capacity == 0 ? 256 : conn->out_capacity;
+        while (new_capacity < needed)
+        {
+            new_capacity *= 2;
+        }
+        char *new_buf = realloc(conn->out_buf, new_capacity);
+        if (new_buf == NULL)
+        {
+            perror("realloc()");
+            return;
+        }
+        conn->out_buf = new_buf;
+        conn->out_capacity = new_capacity;
+    }
+
+    uint32_t len = htonl(msg_len);
+    memcpy(conn->out_buf + conn->out_len, &len, sizeof(len));
+    memcpy(conn->out_buf + conn->out_len + sizeof(len), msg, msg_len);
+    conn->out_len = needed;
+
+    if (!conn->waiting_for_write && !conn->corked)
+    {
+        handle_writable(loop, conn);
+    }
+}
+
+// Function: Flushes as much buffered output as the socket accepts, and waits for EPOLLOUT if any remains.
+// Arguments:
+// - loop: the event loop that owns the connection.
+// - conn: the connection to flush.
+// Returns: void
+void handle_writable(event_loop *loop, connection *conn)
+{
+#ifdef USE_URING
+    if (use_uring)
+    {
+        uring_send(loop, conn);
+        return;
+    }
+#endif
+    size_t sent_total = 0;
+
+    while (sent_total < conn->out_len)
+    {
+        ssize_t sent = send(conn->fd, conn->out_buf + sent_total, conn->out_len - sent_total, MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                conn->out_len = 0; // Peer is gone, the read side will notice and close
+                return;
+            }
+            break;
+        }
+        sent_total += sent;
+    }
+
+    memmove(conn->out_buf, conn->out_buf + sent_total, conn->out_len - sent_total);
+    conn->out_len -= sent_total;
+
+    int want_write = conn->out_len > 0;
+    if (want_write != conn->waiting_for_write)
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+        ev.data.ptr = conn;
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->waiting_for_write = want_write;
+    }
+}
+
+// Function: Keeps a connection's replies corked until the loop commits the journal.
+// Arguments:
+// - loop: the event loop that owns the connection.
+// - conn: the connection, still corked.
+// Returns: void
+void hold_replies(event_loop *loop, connection *conn)
+{
+    if (!conn->held)
+    {
+        conn->held = 1;
+        conn->next_held = loop->held_head;
+        loop->held_head = conn;
+    }
+}
+
+// Function: Takes a connection off the loop's held list, if it is on it.
+// Arguments:
+// - loop: the event loop that owns the connection.
+// - conn: the connection.
+// Returns: void
+void unhold_replies(event_loop *loop, connection *conn)
+{
+    if (conn->held)
+    {
+        connection **link = &loop->held_head;
+        while (*link != conn)
+        {
+            link = &(*link)->next_held;
+        }
+        *link = conn->next_held;
+        conn->held = 0;
+    }
+}
+
+// Function: Commits the calls this loop assigned in its last batch of events, then sends the replies
+// held for them. One msync covers the whole batch, and any other loop's calls appended meanwhile.
+// Arguments: loop - the event loop.
+// Returns: void
+void release_replies(event_loop *loop)
+{
+    if (loop->journal_position > loop->journal_committed)
+    {
+        journal_commit(journal, loop->journal_position);
+        loop->journal_committed = loop->journal_position;
+    }
+
+    while (loop->held_head != NULL)
+    {
+        connection *conn = loop->held_head;
+        loop->held_head = conn->next_held;
+        conn->held = 0;
+        conn->corked = 0;
+        if (conn->out_len > 0 && !conn->waiting_for_write)
+        {
+            handle_writable(loop, conn);
+        }
+    }
+}
+
+// Function: Unregisters and closes a connection, removing the car it belonged to if any.
+// Arguments:
+// - loop: the event loop that owns the connection.
+// - conn: the connection to close; it is freed.
+// Returns: void
+void close_connection(event_loop *loop, connection *conn)
+{
+    if (!use_uring)
+    {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    }
+
+    unhold_replies(loop, conn);
+
+    if (conn->is_car)
+    {
+        // Once the car is off the list no other loop can queue it, so it is safe to unlink it from ours.
+        char name[sizeof(conn->car_node->car_info.name)];
+        snprintf(name, sizeof(name), "%s", conn->car_node->car_info.name);
+        remove_car_from_list(loop->cars, conn->fd);
+        if (journal != NULL)
+        {
+            journal_drop(journal, name);
+        }
+
+        pthread_mutex_lock(&loop->dispatch_mutex);
+        if (conn->dispatch_queued)
+        {
+            connection *previous = NULL;
+            for (connection *current = loop->dispatch_head; current != NULL; current = current->next_dispatch)
+            {
+                if (current == conn)
+                {
+                    if (previous == NULL)
+                    {
+                        loop->dispatch_head = conn->next_dispatch;
+                    }
+                    else
+                    {
+                        previous->next_dispatch = conn->next_dispatch;
+                    }
+                    if (loop->dispatch_tail == conn)
+                    {
+                        loop->dispatch_tail = previous;
+                    }
+                    break;
+                }
+                previous = current;
+            }
+        }
+        pthread_mutex_unlock(&loop->dispatch_mutex);
+    }
+
+    // Shutting the socket down also ends any receive or send a ring still has on it.
+    shutdown(conn->fd, SHUT_RDWR);
+    close(conn->fd);
+    frame_reader_destroy(&conn->reader);
+    free(conn->out_buf);
+#ifdef USE_URING
+    if (conn->ring_requests > 0)
+    {
+        conn->closed = 1; // Freed by retire_connection once the ring is done with it
+        return;
+    }
+    free(conn->send_buf);
+#endif
+    free(conn);
+}
+
+// Function: Queues a car for a dispatch check on the loop that owns it, waking that loop if it is
+// not the caller's.
+// Arguments:
+// - current_loop: the loop making the request.
+// - car_conn: the car's connection.
+// Returns: void
+void request_dispatch(event_loop *current_loop, connection *car_conn)
+{
+    event_loop *owner = car_conn->loop;
+    int was_empty = 0;
+
+    pthread_mutex_lock(&owner->dispatch_mutex);
+    if (!car_conn->dispatch_queued)
+    {
+        car_conn->dispatch_queued = 1;
+        car_conn->next_dispatch = NULL;
+        was_empty = (owner->dispatch_head == NULL);
+        if (owner->dispatch_tail == NULL)
+        {
+            owner->dispatch_head = car_conn;
+        }
+        else
+        {
+            owner->dispatch_tail->next_dispatch = car_conn;
+        }
+        owner->dispatch_tail = car_conn;
+    }
+    pthread_mutex_unlock(&owner->dispatch_mutex);
+
+    // The owner drains its queue after every batch of events, so it only needs a kick from other loops.
+    if (was_empty && owner != current_loop)
+    {
+        uint64_t one = 1;
+        if (write(owner->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        {
+            perror("write() to eventfd");
+        }
+    }
+}
+
+// Function: Runs the dispatch check for every car queued on this loop.
+// Arguments: loop - the event loop whose queue is drained.
+// Returns: void
+void dispatch_queued_cars(event_loop *loop)
+{
+    for (;;)
+    {
+        // Pop one car at a time so other loops can re-queue it while it is being dispatched.
+        pthread_mutex_lock(&loop->dispatch_mutex);
+        connection *conn = loop->dispatch_head;
+        if (conn != NULL)
+        {
+            loop->dispatch_head = conn->next_dispatch;
+            if (loop->dispatch_head == NULL)
+            {
+                loop->dispatch_tail = NULL;
+            }
+            conn->dispatch_queued = 0;
+        }
+        pthread_mutex_unlock(&loop->dispatch_mutex);
+
+        if (conn == NULL)
+        {
+            return;
+        }
+        dispatch_car(conn);
+    }
+}
+
+// Function: Dispatches the car's next stop when it reaches its destination, or a nearer stop it can
+// still make on its way (take_next_stop).
+// Arguments: conn - the car's connection, owned by the calling loop.
+// Returns: void
+void dispatch_car(connection *conn)
+{
+    car_information *car_info = &conn->car_node->car_info;
+    uint64_t status_received_ns = conn->status_received_ns;
+    conn->status_received_ns = 0; // A later FLOOR with no STATUS since was prompted by a call
+
+    // A car is given nothing more until it reports the last stop it was sent as its destination.
+    floor_t next_stop;
+    call_requests stop;
+    call_requests requeued;
+    if (journal != NULL)
+    {
+        if (!journal_pop_stop(journal, conn->car_node, &next_stop))
+        {
+            return;
+        }
+    }
+    else
+    {
+        if (!take_next_stop(conn->car_node, &stop, &requeued))
+        {
+            return;
+        }
+        next_stop = stop.floor;
+    }
+    trace_emit(TRACE_STOP_POPPED, car_info->name, 0, next_stop, 0);
+
+    if (conn->protocol == PROTOCOL_VERSION)
+    {
+        proto_floor msg_to_car;
+        queue_frame_bytes(conn->loop, conn, &msg_to_car, proto_encode_floor(&msg_to_car, next_stop));
+    }
+    else
+    {
+        char floor_text[FLOOR_STRING_SIZE];
+        char msg_to_car[10];
+        format_floor(next_stop, floor_text);
+        snprintf(msg_to_car, sizeof(msg_to_car), "FLOOR %s", floor_text);
+        queue_frame(conn->loop, conn, msg_to_car); // Dispatch the floor
+    }
+
+    trace_emit(TRACE_FLOOR_SENT, car_info->name, 0, next_stop, 0);
+    metrics_add(&conn->loop->metrics.floors_sent, 1);
+    if (status_received_ns != 0)
+    {
+        metrics_record(&conn->loop->metrics.dispatch_latency, metrics_now_ns() - status_received_ns);
+    }
+}
+
+// Function: Writes the controller's metrics in the text exposition format: every loop's counters and
+// histograms added together, then a gauge per car taken under its car list's mutex.
+// Arguments: out - where to write; arg - unused.
+// Returns: 0 on success, -1 if the cars could not be copied out (with the reason printed).
+int write_metrics(FILE *out, void *arg)
+{
+    (void)arg;
+    uint64_t calls_accepted = 0, calls_unavailable = 0, status_reports = 0, status_heartbeats = 0, floors_sent = 0;
+    uint64_t calls_routed = 0, connections_handed_off = 0;
+    static metrics_histogram call_latency, dispatch_latency; // Only the metrics thread scrapes
+    memset(&call_latency, 0, sizeof(call_latency));
+    memset(&dispatch_latency, 0, sizeof(dispatch_latency));
+
+    for (int i = 0; i < event_loop_count; i++)
+    {
+        loop_metrics *metrics = &event_loops[i].metrics;
+        calls_accepted += metrics_read(&metrics->calls_accepted);
+        calls_unavailable += metrics_read(&metrics->calls_unavailable);
+        status_reports += metrics_read(&metrics->status_reports);
+        status_heartbeats += metrics_read(&metrics->status_heartbeats);
+        floors_sent += metrics_read(&metrics->floors_sent);
+        calls_routed += metrics_read(&metrics->calls_routed);
+        connections_handed_off += metrics_read(&metrics->connections_handed_off);
+        metrics_merge(&call_latency, &metrics->call_latency);
+        metrics_merge(&dispatch_latency, &metrics->dispatch_latency);
+    }
+
+    fprintf(out, "# HELP controller_calls_accepted_total Calls assigned a car.\n# TYPE controller_calls_accepted_total counter\n");
+    fprintf(out, "controller_calls_accepted_total %llu\n", (unsigned long long)calls_accepted);
+    fprintf(out, "# HELP controller_calls_unavailable_total Calls answered UNAVAILABLE.\n# TYPE controller_calls_unavailable_total counter\n");
+    fprintf(out, "controller_calls_unavailable_total %llu\n", (unsigned long long)calls_unavailable);
+    fprintf(out, "# HELP controller_status_reports_total STATUS reports received from cars, full or changed fields only.\n# TYPE controller_status_reports_total counter\n");
+    fprintf(out, "controller_status_reports_total %llu\n", (unsigned long long)status_reports);
+    fprintf(out, "# HELP controller_status_heartbeats_total Binary STATUS_UPDATE heartbeats received from idle cars.\n"
+                 "# TYPE controller_status_heartbeats_total counter\n");
+    fprintf(out, "controller_status_heartbeats_total %llu\n", (unsigned long long)status_heartbeats);
+    fprintf(out, "# HELP controller_floors_sent_total FLOOR messages sent to cars.\n# TYPE controller_floors_sent_total counter\n");
+    fprintf(out, "controller_floors_sent_total %llu\n", (unsigned long long)floors_sent);
+    fprintf(out, "# HELP controller_calls_routed_total Calls assigned to a car owned by another shard.\n# TYPE controller_calls_routed_total counter\n");
+    fprintf(out, "controller_calls_routed_total %llu\n", (unsigned long long)calls_routed);
+    fprintf(out, "# HELP controller_cars_handed_off_total Cars that registered on another shard than their own.\n# TYPE controller_cars_handed_off_total counter\n");
+    fprintf(out, "controller_cars_handed_off_total %llu\n", (unsigned long long)connections_handed_off);
+    metrics_write_histogram(out, "controller_call_latency_seconds",
+                            "Time from reading a CALL to queueing its reply.", &call_latency);
+    metrics_write_histogram(out, "controller_dispatch_latency_seconds",
+                            "Time from reading a car's STATUS to queueing the FLOOR it led to.", &dispatch_latency);
+
+    // Object pools, in the order they were first used.
+    object_pool *pools[POOL_MAX_POOLS];
+    pool_stats stats[POOL_MAX_POOLS];
+    int pool_count = pool_list(pools, POOL_MAX_POOLS);
+    for (int i = 0; i < pool_count; i++)
+    {
+        pool_read_stats(pools[i], &stats[i]);
+    }
+    fprintf(out, "# HELP controller_pool_objects Objects carved from the pool's slabs.\n# TYPE controller_pool_objects gauge\n");
+    for (int i = 0; i < pool_count; i++)
+    {
+        fprintf(out, "controller_pool_objects{pool=\"%s\"} %llu\n", pools[i]->name, (unsigned long long)stats[i].capacity);
+    }
+    fprintf(out, "# HELP controller_pool_objects_in_use Objects allocated from the pool and not yet freed.\n"
+                 "# TYPE controller_pool_objects_in_use gauge\n");
+    for (int i = 0; i < pool_count; i++)
+    {
+        fprintf(out, "controller_pool_objects_in_use{pool=\"%s\"} %llu\n", pools[i]->name, (unsigned long long)stats[i].in_use);
+    }
+    fprintf(out, "# HELP controller_pool_allocations_total Objects allocated from the pool.\n"
+                 "# TYPE controller_pool_allocations_total counter\n");
+    for (int i = 0; i < pool_count; i++)
+    {
+        fprintf(out, "controller_pool_allocations_total{pool=\"%s\"} %llu\n", pools[i]->name,
+                (unsigned long long)stats[i].allocations);
+    }
+
+    // Per-car gauges. Every family is written in one run, so the cars are copied out first.
+    car_sample *cars = NULL;
+    int car_count = 0, car_capacity = 0;
+    uint64_t now = metrics_now_ns();
+
+    for (int list = 0; list < car_list_count; list++)
+    {
+        pthread_mutex_lock(&car_lists[list].mutex);
+        for (CarNode *node = car_lists[list].head; node != NULL; node = node->next)
+        {
+            if (car_count == car_capacity)
+            {
+                int capacity = (car_capacity == 0) ? 64 : car_capacity * 2;
+                car_sample *grown = realloc(cars, capacity * sizeof(car_sample));
+                if (grown == NULL)
+                {
+                    perror("realloc()");
+                    pthread_mutex_unlock(&car_lists[list].mutex);
+                    free(cars);
+                    return -1;
+                }
+                cars = grown;
+                car_capacity = capacity;
+            }
+            connection *conn = node->connection;
+            car_sample *sample = &cars[car_count++];
+            snprintf(sample->name, sizeof(sample->name), "%s", node->car_info.name);
+            sample->queue_depth = stop_queue_length(&node->stops);
+            sample->elapsed_ns = now - conn->registered_ns;
+            uint64_t reported_ns = __atomic_load_n(&conn->reported_ns, __ATOMIC_RELAXED);
+            sample->report_age_ns = (now > reported_ns) ? now - reported_ns : 0;
+            memcpy(sample->status_ns, conn->status_ns, sizeof(sample->status_ns));
+            sample->status_ns[node->car_info.status] += now - conn->status_since_ns;
+        }
+        pthread_mutex_unlock(&car_lists[list].mutex);
+    }
+
+    fprintf(out, "# HELP controller_cars Registered cars.\n# TYPE controller_cars gauge\ncontroller_cars %d\n", car_count);
+    fprintf(out, "# HELP controller_car_queue_depth Stops queued for the car.\n# TYPE controller_car_queue_depth gauge\n");
+    for (int i = 0; i < car_count; i++)
+    {
+        fprintf(out, "controller_car_queue_depth{car=\"%s\"} %d\n", cars[i].name, cars[i].queue_depth);
+    }
+    fprintf(out, "# HELP controller_car_report_age_seconds Time since the car last reported its status or a heartbeat.\n"
+                 "# TYPE controller_car_report_age_seconds gauge\n");
+    for (int i = 0; i < car_count; i++)
+    {
+        fprintf(out, "controller_car_report_age_seconds{car=\"%s\"} %.3f\n", cars[i].name, cars[i].report_age_ns / 1e9);
+    }
+    fprintf(out, "# HELP controller_car_utilisation Share of the time since the car registered spent in any status but Closed.\n"
+                 "# TYPE controller_car_utilisation gauge\n");
+    for (int i = 0; i < car_count; i++)
+    {
+        double elapsed = cars[i].elapsed_ns ? (double)cars[i].elapsed_ns : 1;
+        fprintf(out, "controller_car_utilisation{car=\"%s\"} %.4f\n", cars[i].name,
+                1.0 - cars[i].status_ns[CAR_STATUS_CLOSED] / elapsed);
+    }
+    fprintf(out, "# HELP controller_car_status_seconds_total Time the car has spent in each status, as reported.\n"
+                 "# TYPE controller_car_status_seconds_total counter\n");
+    for (int i = 0; i < car_count; i++)
+    {
+        for (int status = 0; status < CAR_STATUS_INVALID; status++)
+        {
+            fprintf(out, "controller_car_status_seconds_total{car=\"%s\",status=\"%s\"} %.3f\n", cars[i].name,
+                    format_status(status), cars[i].status_ns[status] / 1e9);
+        }
+    }
+    free(cars);
+    return 0;
 }
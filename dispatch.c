@@ -0,0 +1,454 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dispatch.h"
+#include "pool.h"
+
+static uint64_t next_car_serial = 0;
+static object_pool car_node_pool = POOL_INITIALIZER("car_node", sizeof(CarNode));
+
+#define DOOR_CYCLE_PHASES 3  // Opening, Open and Closing each take one delay
+#define MAX_COSTED_STOPS 128 // Queued stops considered when estimating a car's route
+
+// Strategies selectable at controller startup. The first entry is the default.
+static const dispatch_strategy strategies[] = {
+    {"eta", choose_lowest_cost_car},
+    {"first-fit", choose_first_fit_car},
+};
+
+static const dispatch_strategy *active_strategy = &strategies[0];
+
+// Function: Selects the strategy used by choose_car.
+// Arguments: name - the strategy's name.
+// Returns: 1 if the strategy exists, 0 otherwise.
+int set_dispatch_strategy(const char *name)
+{
+    for (size_t i = 0; i < sizeof(strategies) / sizeof(strategies[0]); i++)
+    {
+        if (strcmp(strategies[i].name, name) == 0)
+        {
+            active_strategy = &strategies[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function: Reports which strategy choose_car is using.
+// Returns: the strategy's name.
+const char *get_dispatch_strategy_name(void)
+{
+    return active_strategy->name;
+}
+
+// Function: Prints the available strategy names, for usage messages.
+void print_dispatch_strategies(void)
+{
+    for (size_t i = 0; i < sizeof(strategies) / sizeof(strategies[0]); i++)
+    {
+        printf("%s%s", (i == 0) ? "" : ", ", strategies[i].name);
+    }
+    printf("\n");
+}
+
+// Function: Chooses an available car based on the source and destination floors, using the
+// strategy selected at startup. The list's mutex must be held.
+// Arguments:
+// - car_list *list: The cars to choose from.
+// - floor_t source_floor: The starting floor for the call.
+// - floor_t destination_floor: The target floor for the call.
+// - long *cost: Set to the choice's score, lower is better, for comparing choices from several lists; may be NULL.
+// Returns:
+// - A pointer to the chosen CarNode, or NULL if no car is available.
+CarNode *choose_car(car_list *list, floor_t source_floor, floor_t destination_floor, long *cost)
+{
+    return active_strategy->choose(list, source_floor, destination_floor, cost);
+}
+
+// Function: First-fit strategy, chooses the car in the lowest index slot whose floor range covers
+// the call (usually the longest registered). Every choice costs the same, so across several lists
+// the first list with a car wins.
+// Arguments:
+// - car_list *list: The cars to choose from.
+// - floor_t source_floor: The starting floor for the call.
+// - floor_t destination_floor: The target floor for the call.
+// - long *cost: Set to 0 if a car is found; may be NULL.
+// Returns:
+// - A pointer to the first available CarNode if found, or NULL if no car is available.
+CarNode *choose_first_fit_car(car_list *list, floor_t source_floor, floor_t destination_floor, long *cost)
+{
+    size_t word_count;
+    const uint64_t *eligible = car_index_match(&list->eligibility, source_floor, destination_floor, &word_count);
+
+    for (size_t word = 0; word < word_count; word++)
+    {
+        if (eligible[word] != 0)
+        {
+            if (cost != NULL)
+            {
+                *cost = 0;
+            }
+            return list->eligibility.cars[word * CAR_INDEX_WORD_BITS + __builtin_ctzll(eligible[word])];
+        }
+    }
+    return NULL; // No available car found
+}
+
+// Function: ETA strategy, chooses the eligible car with the lowest estimated cost for the call.
+// Arguments:
+// - car_list *list: The cars to choose from.
+// - floor_t source_floor: The starting floor for the call.
+// - floor_t destination_floor: The target floor for the call.
+// - long *cost: Set to the chosen car's estimate_call_cost; may be NULL.
+// Returns:
+// - A pointer to the cheapest available CarNode, or NULL if no car is available.
+CarNode *choose_lowest_cost_car(car_list *list, floor_t source_floor, floor_t destination_floor, long *cost)
+{
+    CarNode *best_car = NULL;
+    long best_cost = 0;
+    size_t word_count;
+    const uint64_t *eligible = car_index_match(&list->eligibility, source_floor, destination_floor, &word_count);
+
+    for (size_t word = 0; word < word_count; word++)
+    {
+        for (uint64_t bits = eligible[word]; bits != 0; bits &= bits - 1)
+        {
+            CarNode *current = list->eligibility.cars[word * CAR_INDEX_WORD_BITS + __builtin_ctzll(bits)];
+
+            long car_cost = estimate_call_cost(current, source_floor, destination_floor);
+            if (best_car == NULL || car_cost < best_cost)
+            {
+                best_car = current;
+                best_cost = car_cost;
+            }
+        }
+    }
+    if (best_car != NULL && cost != NULL)
+    {
+        *cost = best_cost;
+    }
+    return best_car;
+}
+
+// Function: Walks a car through a list of stops, each costing its travel time plus a door cycle.
+// Arguments:
+// - position: the floor the car starts from.
+// - time: the time already committed before the car can move.
+// - doors_cycling: 1 if the doors are already opening or open at the starting floor.
+// - stops: the floors to visit, in order.
+// - count: the number of stops.
+// - delay: the car's delay per door phase and per floor.
+// - watch_index: a stop whose arrival time should be reported, or -1.
+// - watch_time: receives the time the doors start opening at stops[watch_index].
+// Returns: the time at which the last stop's doors have closed.
+static long walk_route(floor_t position, long time, int doors_cycling, const floor_t *stops, int count,
+                       long delay, int watch_index, long *watch_time)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (stops[i] != position)
+        {
+            time += floor_distance(position, stops[i]) * delay;
+            position = stops[i];
+            doors_cycling = 0;
+        }
+
+        if (i == watch_index)
+        {
+            *watch_time = time + delay;
+        }
+
+        // Several stops on one floor share a single door cycle
+        if (!doors_cycling)
+        {
+            time += DOOR_CYCLE_PHASES * delay;
+            doors_cycling = 1;
+        }
+    }
+    return time;
+}
+
+// Function: Estimates the cost of giving a call to a car: the time until the passenger is delivered,
+// plus the extra time the call adds to the car's existing route. The car visits its committed
+// destination first and then its queued stops in the order it would take them from there, with and
+// without the call's (stop_queue_route).
+// Arguments:
+// - car: the candidate car (the car list must be locked).
+// - source_floor: The starting floor for the call.
+// - destination_floor: The target floor for the call.
+// Returns: the estimated cost in milliseconds.
+long estimate_call_cost(CarNode *car, floor_t source_floor, floor_t destination_floor)
+{
+    car_information *info = &car->car_info;
+    long delay = (info->delay_ms > 0) ? info->delay_ms : DEFAULT_CAR_DELAY_MS;
+
+    // Time left in the current door cycle before the car can leave.
+    long start_time = 0;
+    int doors_cycling = 1;
+    if (info->status == CAR_STATUS_OPENING)
+    {
+        start_time = DOOR_CYCLE_PHASES * delay;
+    }
+    else if (info->status == CAR_STATUS_OPEN)
+    {
+        start_time = 2 * delay;
+    }
+    else if (info->status == CAR_STATUS_CLOSING)
+    {
+        start_time = delay;
+    }
+    else
+    {
+        doors_cycling = 0;
+    }
+
+    // Build the route with and without the call.
+    floor_t without[MAX_COSTED_STOPS + 1];
+    floor_t with[MAX_COSTED_STOPS + 3];
+    int committed = 0;
+    if (info->destination_floor != info->current_floor)
+    {
+        without[0] = info->destination_floor;
+        with[0] = info->destination_floor;
+        committed = 1;
+    }
+
+    int with_count;
+    int dropoff_index;
+    int without_count = committed + stop_queue_route(&car->stops, info->destination_floor, source_floor, destination_floor,
+                                                     without + committed, with + committed, MAX_COSTED_STOPS,
+                                                     &with_count, &dropoff_index);
+    with_count += committed;
+
+    long delivered_at = 0;
+    long time_without = walk_route(info->current_floor, start_time, doors_cycling, without, without_count, delay, -1, NULL);
+    long time_with = walk_route(info->current_floor, start_time, doors_cycling, with, with_count, delay,
+                                (dropoff_index == -1) ? -1 : committed + dropoff_index, &delivered_at);
+
+    // A dropoff beyond the stops costed comes after them all; charge each stop left out a door cycle.
+    if (dropoff_index == -1)
+    {
+        long unseen_stops = stop_queue_length(&car->stops) - (without_count - committed);
+        delivered_at = time_with + ((unseen_stops > 0) ? unseen_stops : 0) * DOOR_CYCLE_PHASES * delay + delay;
+    }
+
+    return delivered_at + (time_with - time_without);
+}
+
+// Function: Checks if a specific car can service a call based on source and destination floors.
+// Arguments:
+// - floor_t source_floor: The starting floor for the call.
+// - floor_t destination_floor: The target floor for the call.
+// - CarNode *car: A pointer to the car being checked for availability.
+// Returns:
+// - 1 if the car is available to service the call,
+// - 0 if it is not available.
+int is_car_available(floor_t source_floor, floor_t destination_floor, CarNode *car)
+{
+    floor_t highest_floor = car->car_info.highest_floor;
+    floor_t lowest_floor = car->car_info.lowest_floor;
+
+    // Check if source or destination floor is above highest floor
+    if (source_floor > highest_floor || destination_floor > highest_floor)
+    {
+        return 0; // Car cannot service the call if above highest floor
+    }
+
+    // Check if source or destination floor is below lowest floor
+    if (source_floor < lowest_floor || destination_floor < lowest_floor)
+    {
+        return 0; // Car cannot service the call if below lowest floor
+    }
+
+    return 1; // Car is available to service the call
+}
+
+// Function: Retrieves and removes the stop a car takes next from its destination floor, in LOOK
+// order (stop_queue_pop), and records it as the stop sent to the car.
+// Arguments:
+// - car: the car requesting its next stop.
+// - floor: receives the stop's floor.
+// Returns: 1 if a stop was found, 0 if the car has no stops queued.
+int get_and_pop_first_stop(CarNode *car, floor_t *floor)
+{
+    call_requests next_stop;
+
+    if (!stop_queue_pop(&car->stops, car->car_info.destination_floor, &next_stop))
+    {
+        car->target.direction = 0;
+        return 0;
+    }
+
+    car->target = next_stop;
+    *floor = next_stop.floor;
+    return 1;
+}
+
+// Function: Decides whether a car should be sent a stop now, and takes it from the car's queue. A
+// car at its destination is given its next stop. A moving car that is going to the stop it was last
+// sent is given a stop of its direction of travel that it can still make before getting there; the
+// stop it was going to is put back in the queue. A car that has not reported the stop it was last
+// sent as its destination yet is given nothing, so a stale report cannot take a second stop.
+// Arguments:
+// - car: the car, whose car_info holds its last report.
+// - stop: receives the stop to send.
+// - requeued: receives the stop put back, direction 0 if none was.
+// Returns: 1 if a stop should be sent, 0 if not.
+int take_next_stop(CarNode *car, call_requests *stop, call_requests *requeued)
+{
+    car_information *info = &car->car_info;
+    floor_t current_floor = info->current_floor;
+    floor_t destination_floor = info->destination_floor;
+    int sent = (car->target.direction != 0);
+
+    requeued->direction = 0;
+    if (sent && car->target.floor != destination_floor)
+    {
+        return 0;
+    }
+
+    if (current_floor == destination_floor)
+    {
+        if (!stop_queue_pop(&car->stops, current_floor, stop))
+        {
+            car->target.direction = 0;
+            return 0;
+        }
+        car->target = *stop;
+        return 1;
+    }
+
+    // Between floors the car can still stop at the floor it is arriving at; stopped with its doors
+    // closed, at the floor it is on.
+    if (!sent || (info->status != CAR_STATUS_CLOSED && info->status != CAR_STATUS_BETWEEN))
+    {
+        return 0;
+    }
+    floor_t nearest_floor = (info->status == CAR_STATUS_BETWEEN) ? next_floor_towards(current_floor, destination_floor)
+                                                                 : current_floor;
+    if (nearest_floor == destination_floor)
+    {
+        return 0;
+    }
+    floor_t before_destination = next_floor_towards(destination_floor, current_floor);
+    if (!stop_queue_take(&car->stops, get_call_direction(current_floor, destination_floor), nearest_floor,
+                         before_destination, stop))
+    {
+        return 0;
+    }
+
+    stop_queue_push(&car->stops, car->target);
+    *requeued = car->target;
+    car->target = *stop;
+    return 1;
+}
+
+// Function: Updates the call queue with a call's stops: the pickup now, the dropoff once the car
+// has been sent to the pickup. A call whose floors are the same queues nothing.
+// Arguments:
+// - source_floor: the floor the passenger is waiting on.
+// - destination_floor: the floor the passenger is going to.
+// - chosen_car: the car assigned to the call.
+// Returns: void
+void update_call_queue(floor_t source_floor, floor_t destination_floor, CarNode *chosen_car)
+{
+    stop_queue_push_call(&chosen_car->stops, source_floor, destination_floor);
+}
+
+// Function: adds a single stop to the car's queue, if it is not queued already.
+// Arguments:
+// - car: the car the call is assigned to.
+// - new_call: a struct containing the floor and direction.
+// Returns: void.
+void add_call_request(CarNode *car, call_requests new_call)
+{
+    stop_queue_push(&car->stops, new_call);
+}
+
+// Function: Initialises an empty car list.
+// Arguments: list - the list to initialise.
+// Returns: void
+void car_list_init(car_list *list)
+{
+    pthread_mutex_init(&list->mutex, NULL);
+    list->head = NULL;
+    memset(&list->eligibility, 0, sizeof(list->eligibility));
+}
+
+// Function: Adds a new car the to car linked list.
+// Arguments:
+// - list: the car list.
+// - new_car: struct containing important information about the available cars.
+// - car_conn: the connection the car registered on.
+// Returns: A pointer to the new CarNode, or NULL if it could not be allocated.
+CarNode *add_car_to_list(car_list *list, car_information new_car, struct connection *car_conn)
+{
+    pthread_mutex_lock(&list->mutex);
+
+    CarNode *new_node = pool_alloc(&car_node_pool);
+    if (new_node == NULL)
+    {
+        perror("pool_alloc()");
+        pthread_mutex_unlock(&list->mutex);
+        return NULL;
+    }
+
+    new_node->car_info = new_car;
+    new_node->connection = car_conn;
+    new_node->target.direction = 0;
+    new_node->journal_id = -1;
+    new_node->serial = __atomic_add_fetch(&next_car_serial, 1, __ATOMIC_RELAXED);
+    new_node->index_slot = car_index_add(&list->eligibility, new_node, new_car.lowest_floor, new_car.highest_floor);
+    if (new_node->index_slot == -1)
+    {
+        pool_free(&car_node_pool, new_node);
+        pthread_mutex_unlock(&list->mutex);
+        return NULL;
+    }
+    stop_queue_init(&new_node->stops);
+    new_node->next = list->head;
+
+    list->head = new_node;
+
+    pthread_mutex_unlock(&list->mutex);
+    return new_node;
+}
+
+// Function: Removes a car from the car linked list.
+// Arguments:
+// - list: the car list.
+// - car_fd: the file descriptor for the car to be removed.
+// Returns: void
+void remove_car_from_list(car_list *list, int car_fd)
+{
+    pthread_mutex_lock(&list->mutex);
+
+    CarNode *current = list->head;
+    CarNode *prev = NULL;
+
+    // Loop through the car linked list
+    while (current != NULL)
+    {
+        // If found a matching car.
+        if (current->car_info.car_fd == car_fd)
+        {
+            if (prev == NULL)
+            {
+                list->head = current->next;
+            }
+            else
+            {
+                prev->next = current->next;
+            }
+            car_index_remove(&list->eligibility, current->index_slot,
+                             current->car_info.lowest_floor, current->car_info.highest_floor);
+            stop_queue_destroy(&current->stops);
+            pool_free(&car_node_pool, current);
+            break;
+        }
+        prev = current;
+        current = current->next;
+    }
+
+    pthread_mutex_unlock(&list->mutex);
+}
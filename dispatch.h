@@ -0,0 +1,70 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include <pthread.h>
+#include "common.h"
+#include "stop_queue.h"
+#include "car_index.h"
+
+typedef struct
+{
+    int car_fd;
+    char name[100];
+    floor_t lowest_floor;
+    floor_t highest_floor;
+    floor_t current_floor;
+    floor_t destination_floor;
+    car_status status;
+    int delay_ms; // The car's time per door phase and per floor travelled
+} car_information;
+
+// Linked list node structure
+typedef struct CarNode
+{
+    car_information car_info;
+    struct connection *connection; // The car's connection, used to wake its event loop
+    stop_queue stops;              // Stops assigned to this car
+    call_requests target;          // The stop last sent to the car, direction 0 if none is outstanding
+    int index_slot;                // The car's bit in the eligibility index
+    int journal_id;                // The car's id in the call journal (journal.h), -1 until it has one, -2 if it is not journaled
+    uint64_t serial;               // Unique to this registration, so a stale pointer to a reused node can be told apart
+    struct CarNode *next;
+} CarNode;
+
+// A set of registered cars. The mutex protects the list, its floor eligibility index and the cars'
+// car_info. The controller keeps one for the building, or one per shard (controller -S).
+typedef struct
+{
+    pthread_mutex_t mutex;
+    CarNode *head;
+    car_index eligibility;
+} car_list;
+
+// A car selection strategy. choose returns the car to assign a call to, or NULL if none can serve
+// it, and sets *cost (if not NULL) to a score comparable with the strategy's choice from another list.
+typedef struct
+{
+    const char *name;
+    CarNode *(*choose)(car_list *list, floor_t source_floor, floor_t destination_floor, long *cost);
+} dispatch_strategy;
+
+#define DEFAULT_CAR_DELAY_MS 1000 // Assumed for cars that do not report their delay
+
+// Function declarations
+void car_list_init(car_list *list);
+CarNode *add_car_to_list(car_list *list, car_information new_car, struct connection *car_conn);
+void remove_car_from_list(car_list *list, int car_fd);
+int set_dispatch_strategy(const char *name);
+const char *get_dispatch_strategy_name(void);
+void print_dispatch_strategies(void);
+CarNode *choose_car(car_list *list, floor_t source_floor, floor_t destination_floor, long *cost);
+CarNode *choose_first_fit_car(car_list *list, floor_t source_floor, floor_t destination_floor, long *cost);
+CarNode *choose_lowest_cost_car(car_list *list, floor_t source_floor, floor_t destination_floor, long *cost);
+long estimate_call_cost(CarNode *car, floor_t source_floor, floor_t destination_floor);
+int is_car_available(floor_t source_floor, floor_t destination_floor, CarNode *car);
+void update_call_queue(floor_t source_floor, floor_t destination_floor, CarNode *chosen_car);
+void add_call_request(CarNode *car, call_requests new_call);
+int get_and_pop_first_stop(CarNode *car, floor_t *floor);
+int take_next_stop(CarNode *car, call_requests *stop, call_requests *requeued);
+
+#endif // DISPATCH_H
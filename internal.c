@@ -14,11 +14,14 @@
 #include <fcntl.h>
 #include <signal.h>
 #include "common.h"
+#include "car_shm.h"
+#include "car_wakeup.h"
+#include "trace.h"
 
 car_shared_mem *shared_mem;
 
 int is_floor_change_allowed();
-void update_shared_mem(uint8_t *ptr_to_update, int new_val);
+void update_shared_mem(uint8_t *ptr_to_update, int new_val, uint32_t channel);
 void handle_floor_change(int direction);
 
 int main(int argc, char **argv)
@@ -29,22 +32,21 @@ int main(int argc, char **argv)
         printf("Usage: {car name} {operation}\n");
         exit(EXIT_FAILURE);
     }
+    trace_init("internal", argv[1]);
 
-    // Create the shared memory name by appending the car name
-    char car_name[100] = "/car";
-    strcat(car_name, argv[1]);
-
-    // Open the shared memory segment for the specified car
-    int shm_fd = shm_open(car_name, O_RDWR, 0666);
-    if (shm_fd == -1)
+    // Open and map the shared memory segment for the specified car
+    car_shm_result result = car_shm_open(argv[1], 1, &shared_mem);
+    if (result == CAR_SHM_NOT_FOUND)
     {
         printf("Unable to access car %s.\n", argv[1]);
         exit(EXIT_FAILURE);
     }
-
-    // Map the shared memory segment into the process's address space
-    shared_mem = mmap(0, sizeof(car_shared_mem), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    if (shared_mem == MAP_FAILED)
+    if (result == CAR_SHM_WRONG_LAYOUT)
+    {
+        printf("Car %s uses a different shared memory layout (this program needs version %d).\n", argv[1], CAR_SHM_VERSION);
+        exit(EXIT_FAILURE);
+    }
+    if (result != CAR_SHM_OK)
     {
         perror("mmap");
         exit(EXIT_FAILURE);
@@ -53,33 +55,41 @@ int main(int argc, char **argv)
     // Determine operation based on command-line argument
     if (!strcmp(argv[2], "open"))
     {
-        update_shared_mem(&shared_mem->open_button, 1);
+        trace_emit(TRACE_CONTROL, NULL, TRACE_CONTROL_OPEN, 0, 0);
+        update_shared_mem(&shared_mem->open_button, 1, CAR_CHANGE_BUTTONS);
     }
     else if (!strcmp(argv[2], "close"))
     {
-        update_shared_mem(&shared_mem->close_button, 1);
+        trace_emit(TRACE_CONTROL, NULL, TRACE_CONTROL_CLOSE, 0, 0);
+        update_shared_mem(&shared_mem->close_button, 1, CAR_CHANGE_BUTTONS);
     }
     else if (!strcmp(argv[2], "stop"))
     {
-        update_shared_mem(&shared_mem->emergency_stop, 1);
+        trace_emit(TRACE_CONTROL, NULL, TRACE_CONTROL_STOP, 0, 0);
+        update_shared_mem(&shared_mem->emergency_stop, 1, CAR_CHANGE_SAFETY);
     }
     else if (!strcmp(argv[2], "service_on"))
     {
         // Enable service mode
+        trace_emit(TRACE_CONTROL, NULL, TRACE_CONTROL_SERVICE_ON, 0, 0);
         pthread_mutex_lock(&shared_mem->mutex);
+        car_shm_write_begin(shared_mem);
         shared_mem->emergency_mode = 0;
+        car_shm_write_end(shared_mem);
         pthread_mutex_unlock(&shared_mem->mutex);
 
-        update_shared_mem(&shared_mem->individual_service_mode, 1);
+        update_shared_mem(&shared_mem->individual_service_mode, 1, CAR_CHANGE_SAFETY);
     }
     else if (!strcmp(argv[2], "service_off"))
     {
         // Disable service mode
-        update_shared_mem(&shared_mem->individual_service_mode, 0);
+        trace_emit(TRACE_CONTROL, NULL, TRACE_CONTROL_SERVICE_OFF, 0, 0);
+        update_shared_mem(&shared_mem->individual_service_mode, 0, CAR_CHANGE_SAFETY);
     }
     else if (!strcmp(argv[2], "up"))
     {
         // Attempt to move up if allowed
+        trace_emit(TRACE_CONTROL, NULL, TRACE_CONTROL_UP, 0, 0);
         if (is_floor_change_allowed() == 1)
         {
             handle_floor_change(1);
@@ -88,6 +98,7 @@ int main(int argc, char **argv)
     else if (!strcmp(argv[2], "down"))
     {
         // Attempt to move down if allowed
+        trace_emit(TRACE_CONTROL, NULL, TRACE_CONTROL_DOWN, 0, 0);
         if (is_floor_change_allowed() == 1)
         {
             handle_floor_change(-1);
@@ -103,32 +114,36 @@ int main(int argc, char **argv)
     return EXIT_SUCCESS;
 }
 
-// Function that checks the shared memory to determine whether the elevator can be moved.
+// Function that checks the shared memory to determine whether the elevator can be moved. Only reads,
+// so it takes a snapshot (car_shm_read) instead of the mutex.
 // Returns:
 // - int: 1 if the elevator is allowed to be moved, else 0.
 int is_floor_change_allowed(void)
 {
-    pthread_mutex_lock(&shared_mem->mutex);
+    car_shm_snapshot snapshot;
+    if (car_shm_read(shared_mem, &snapshot) == -1)
+    {
+        printf("Car state is not readable.\n");
+        return 0;
+    }
 
-    if (shared_mem->individual_service_mode == 0)
+    if (snapshot.individual_service_mode == 0)
     {
         printf("Operation only allowed in service mode.\n");
     }
-    else if (strcmp(shared_mem->status, "Between") == 0)
+    else if (snapshot.status == CAR_STATUS_BETWEEN)
     {
         printf("Operation not allowed while elevator is moving.\n");
     }
-    else if (strcmp(shared_mem->status, "Closed") != 0)
+    else if (snapshot.status != CAR_STATUS_CLOSED)
     {
         printf("Operation not allowed while doors are open.\n");
     }
     else
     {
-        pthread_mutex_unlock(&shared_mem->mutex);
-        return 1; // Operation allowed, exit function early
+        return 1; // Operation allowed
     }
 
-    pthread_mutex_unlock(&shared_mem->mutex);
     return 0;
 }
 
@@ -136,11 +151,14 @@ int is_floor_change_allowed(void)
 // Arguments:
 // - ptr_to_update: A pointer to the shared memory member that's going to be changed.
 // - new_value: the value that the struct member should be updated to.
-void update_shared_mem(uint8_t *ptr_to_update, int new_value)
+// - channel: the CAR_CHANGE_* wakeup channel the member belongs to.
+void update_shared_mem(uint8_t *ptr_to_update, int new_value, uint32_t channel)
 {
     pthread_mutex_lock(&shared_mem->mutex);
+    car_shm_write_begin(shared_mem);
     *ptr_to_update = new_value;
-    pthread_cond_broadcast(&shared_mem->cond);
+    car_shm_write_end(shared_mem);
+    car_notify(shared_mem, channel);
     pthread_mutex_unlock(&shared_mem->mutex);
 }
 
@@ -151,55 +169,35 @@ void handle_floor_change(int direction)
 {
     pthread_mutex_lock(&shared_mem->mutex); // Lock shared state
 
-    int current_floor = atoi(shared_mem->current_floor); // Convert current floor to integer
-
-    if (shared_mem->current_floor[0] == 'B') // Handle basement floors
+    floor_t current_floor = shared_mem->current_floor;
+    if (current_floor == 0 || current_floor < FLOOR_LOWEST || current_floor > FLOOR_HIGHEST)
     {
-        current_floor = atoi(shared_mem->current_floor + 1); // Skip 'B'
-        if (direction == 1)                                  // Going up
-        {
-            if (strcmp(shared_mem->current_floor, "B1") == 0)
-            {
-                strcpy(shared_mem->destination_floor, "1"); // Destination to first floor
-            }
-            else
-            {
-                current_floor--; // Move to previous basement floor
-            }
-        }
-        else // Going down
-        {
-            current_floor++; // Move to next basement floor
-        }
-        snprintf(shared_mem->destination_floor, 4, "B%02d", current_floor); // Set destination
+        pthread_mutex_unlock(&shared_mem->mutex);
+        printf("Car is on an invalid floor.\n");
+        exit(EXIT_FAILURE);
     }
-    else // Handle regular floors
+
+    floor_t destination_floor = current_floor + direction;
+    if (destination_floor == 0) // There is no floor 0 between B1 and 1
     {
-        if (direction == 1) // Going up
-        {
-            current_floor++; // Increment floor
-        }
-        else // Going down
-        {
-            current_floor--; // Decrement floor
-        }
+        destination_floor += direction;
+    }
 
-        // Set destination based on current floor limits
-        if (current_floor <= 0)
-        {
-            snprintf(shared_mem->destination_floor, 4, "B1"); // Set to basement if below ground
-        }
-        else
-        {
-            if (current_floor > 999) // Cap at maximum floor
-            {
-                current_floor = 999;
-            }
-            snprintf(shared_mem->destination_floor, 4, "%d", current_floor); // Set destination
-        }
+    // Stay within the building
+    if (destination_floor < FLOOR_LOWEST)
+    {
+        destination_floor = FLOOR_LOWEST;
+    }
+    if (destination_floor > FLOOR_HIGHEST)
+    {
+        destination_floor = FLOOR_HIGHEST;
     }
 
-    pthread_cond_broadcast(&shared_mem->cond);
+    car_shm_write_begin(shared_mem);
+    shared_mem->destination_floor = destination_floor; // Set destination
+    car_shm_write_end(shared_mem);
+
+    car_notify(shared_mem, CAR_CHANGE_MOTION);
     pthread_mutex_unlock(&shared_mem->mutex);
     exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+}
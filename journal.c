@@ -0,0 +1,641 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "journal.h"
+
+#define NAME_SLOTS(length) (((length) + sizeof(journal_record) - 1) / sizeof(journal_record))
+// The most slots one call appends: a car's name record, a pop and the stop it put back.
+#define OPERATION_SLOTS (1 + NAME_SLOTS(sizeof(((journal_car *)0)->name) - 1) + 2)
+
+static int checkpoint(call_journal *journal);
+
+// FNV-1a, continuing from hash.
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t length)
+{
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ bytes[i]) * 16777619U;
+    }
+    return hash;
+}
+
+static journal_record *slot_at(char *map, uint64_t slot)
+{
+    return (journal_record *)(map + JOURNAL_HEADER_SIZE + slot * sizeof(journal_record));
+}
+
+// Function: writes one record, and for JOURNAL_CAR the name after it, into a mapping.
+// Returns: the number of slots used.
+static uint64_t write_record(char *map, uint64_t slot, journal_record_type type, int car, char direction,
+                             floor_t floor, floor_t floor2, const char *name)
+{
+    journal_record record;
+    memset(&record, 0, sizeof(record));
+    record.slot = (uint32_t)slot;
+    record.type = (uint8_t)type;
+    record.direction = (uint8_t)direction;
+    record.car = (uint16_t)car;
+    record.floor = floor;
+    record.floor2 = floor2;
+
+    uint64_t name_slots = 0;
+    uint32_t checksum = fnv1a(2166136261U, &record, offsetof(journal_record, checksum));
+    if (type == JOURNAL_CAR)
+    {
+        name_slots = NAME_SLOTS((size_t)floor);
+        memset(slot_at(map, slot + 1), 0, name_slots * sizeof(journal_record));
+        memcpy(slot_at(map, slot + 1), name, (size_t)floor);
+        checksum = fnv1a(checksum, name, (size_t)floor);
+    }
+    record.checksum = checksum;
+    memcpy(slot_at(map, slot), &record, sizeof(record)); // Written last, so a torn name fails the checksum
+    return 1 + name_slots;
+}
+
+// Function: finds a car name's id. Mutex held.
+// Returns: the id, or -1 if the journal has not seen the name.
+static int find_car(call_journal *journal, const char *name)
+{
+    for (int id = 0; id < journal->car_count; id++)
+    {
+        if (strcmp(journal->cars[id]->name, name) == 0)
+        {
+            return id;
+        }
+    }
+    return -1;
+}
+
+// Function: gives a car name the next id, without journaling it. Mutex held.
+// Returns: the id, or -1 if there are too many names or no memory.
+static int add_car(call_journal *journal, const char *name)
+{
+    if (journal->car_count == JOURNAL_MAX_CARS)
+    {
+        return -1;
+    }
+    if (journal->car_count == journal->car_capacity)
+    {
+        int capacity = (journal->car_capacity == 0) ? 64 : journal->car_capacity * 2;
+        journal_car **cars = realloc(journal->cars, capacity * sizeof(journal_car *));
+        if (cars == NULL)
+        {
+            perror("realloc()");
+            return -1;
+        }
+        journal->cars = cars;
+        journal->car_capacity = capacity;
+    }
+
+    journal_car *entry = calloc(1, sizeof(journal_car));
+    if (entry == NULL)
+    {
+        perror("calloc()");
+        return -1;
+    }
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    stop_queue_init(&entry->stops);
+    journal->cars[journal->car_count] = entry;
+    return journal->car_count++;
+}
+
+// Function: makes room for the records one call may append, checkpointing if the file is full.
+// Called before the call changes anything: a checkpoint writes out the queues as they are, so it must
+// not see a change whose record is still to come, and it may wait for a commit without the mutex.
+// Mutex held.
+// Returns: void. Exits if the journal cannot be written, as the controller's state could no longer be recovered.
+static void reserve(call_journal *journal)
+{
+    uint64_t slot = journal->written - journal->base;
+    if (JOURNAL_HEADER_SIZE + (slot + OPERATION_SLOTS) * sizeof(journal_record) > journal->size &&
+        checkpoint(journal) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Function: appends a record into the room made by reserve. Mutex held.
+// Returns: void
+static void append(call_journal *journal, journal_record_type type, int car, char direction, floor_t floor,
+                   floor_t floor2, const char *name)
+{
+    journal->written += write_record(journal->map, journal->written - journal->base, type, car, direction, floor,
+                                     floor2, name);
+}
+
+// Function: the journal's entry for a registered car, handing it any recovered stops the first time.
+// A second car registered under a name already in use is not journaled. Mutex held, room reserved.
+// Returns: the entry, or NULL if the car is not journaled.
+static journal_car *claim(call_journal *journal, CarNode *car)
+{
+    if (car->journal_id == -2)
+    {
+        return NULL;
+    }
+    if (car->journal_id >= 0)
+    {
+        return journal->cars[car->journal_id];
+    }
+
+    int id = find_car(journal, car->car_info.name);
+    if (id == -1)
+    {
+        id = add_car(journal, car->car_info.name);
+        if (id == -1)
+        {
+            car->journal_id = -2;
+            return NULL;
+        }
+        append(journal, JOURNAL_CAR, id, 0, (floor_t)strlen(car->car_info.name), 0, car->car_info.name);
+    }
+
+    journal_car *entry = journal->cars[id];
+    if (entry->car != NULL && entry->car != car)
+    {
+        car->journal_id = -2;
+        return NULL;
+    }
+
+    // The car takes over the stops recovered under its name.
+    int count = stop_queue_length(&entry->stops);
+    if (count > 0)
+    {
+        call_requests *stops = malloc(count * sizeof(call_requests));
+        floor_t *dropoffs = malloc(count * sizeof(floor_t));
+        if (stops == NULL || dropoffs == NULL)
+        {
+            perror("malloc()");
+            exit(EXIT_FAILURE);
+        }
+        count = stop_queue_entries(&entry->stops, stops, dropoffs, count);
+        for (int i = 0; i < count; i++)
+        {
+            if (dropoffs[i] == FLOOR_INVALID)
+            {
+                stop_queue_push(&car->stops, stops[i]);
+            }
+            else
+            {
+                stop_queue_push_call(&car->stops, stops[i].floor, dropoffs[i]);
+            }
+        }
+        free(dropoffs);
+        free(stops);
+        printf("Journal: car %s recovered %d stops\n", entry->name, count);
+    }
+    entry->car = car;
+    car->journal_id = id;
+    return entry;
+}
+
+// Function: applies one replayed record to the journal's copy of the queues.
+// Returns: 1 if the record was applied, 0 if it refers to something the journal never saw.
+static int apply(call_journal *journal, const journal_record *record, const char *name)
+{
+    if (record->type == JOURNAL_CAR)
+    {
+        char copy[100];
+        if (record->floor <= 0 || record->floor >= (floor_t)sizeof(copy) || record->car != journal->car_count)
+        {
+            return 0;
+        }
+        memcpy(copy, name, record->floor);
+        copy[record->floor] = '\0';
+        return add_car(journal, copy) != -1;
+    }
+    if (record->car >= journal->car_count)
+    {
+        return 0;
+    }
+
+    stop_queue *stops = &journal->cars[record->car]->stops;
+    if (record->type == JOURNAL_ASSIGN)
+    {
+        stop_queue_push_call(stops, record->floor, record->floor2);
+    }
+    else if (record->type == JOURNAL_STOP)
+    {
+        call_requests queued = {(char)record->direction, record->floor};
+        stop_queue_push(stops, queued);
+    }
+    else if (record->type == JOURNAL_POP)
+    {
+        call_requests popped = {(char)record->direction, record->floor};
+        stop_queue_remove(stops, popped);
+    }
+    else if (record->type == JOURNAL_DROP)
+    {
+        stop_queue_clear(stops);
+    }
+    else
+    {
+        return 0;
+    }
+    return 1;
+}
+
+// Function: replays an existing journal file into the journal's copy of the queues.
+// Returns: 0 if there was nothing to replay or it was replayed, -1 if the file is not a journal.
+static int replay(call_journal *journal, size_t *file_size)
+{
+    int fd = open(journal->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size < JOURNAL_HEADER_SIZE)
+    {
+        close(fd);
+        return (st.st_size == 0) ? 0 : -1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    const journal_header *header = (const journal_header *)map;
+    if (header->magic != JOURNAL_MAGIC || header->version != JOURNAL_VERSION || header->record_size != sizeof(journal_record))
+    {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    journal->checkpoints = header->checkpoints;
+    *file_size = st.st_size;
+
+    uint64_t slots = (st.st_size - JOURNAL_HEADER_SIZE) / sizeof(journal_record);
+    uint64_t slot = 0;
+    while (slot < slots)
+    {
+        const journal_record *record = slot_at(map, slot);
+        uint64_t name_slots = (record->type == JOURNAL_CAR && record->floor > 0) ? NAME_SLOTS((size_t)record->floor) : 0;
+        if (record->slot != slot || slot + 1 + name_slots > slots)
+        {
+            break; // Never written, or left over from before the last checkpoint
+        }
+
+        const char *name = (const char *)slot_at(map, slot + 1);
+        uint32_t checksum = fnv1a(2166136261U, record, offsetof(journal_record, checksum));
+        if (name_slots > 0)
+        {
+            checksum = fnv1a(checksum, name, (size_t)record->floor);
+        }
+        if (checksum != record->checksum || !apply(journal, record, name))
+        {
+            break; // Torn by a crash mid-write
+        }
+        journal->replayed++;
+        slot += 1 + name_slots;
+    }
+
+    munmap(map, st.st_size);
+    return 0;
+}
+
+// Function: opens the journal, replaying what the last controller left in it, and rewrites it as a
+// checkpoint ready for appending.
+// Arguments:
+// - journal: the journal to set up.
+// - path: the journal file; created if it does not exist.
+// - size: the file size to use, in bytes (JOURNAL_DEFAULT_SIZE); an existing larger file keeps its size.
+// Returns: 0 on success, -1 on failure (with the reason printed).
+int journal_open(call_journal *journal, const char *path, size_t size)
+{
+    memset(journal, 0, sizeof(*journal));
+    pthread_mutex_init(&journal->mutex, NULL);
+    pthread_cond_init(&journal->synced_cond, NULL);
+    journal->path = strdup(path);
+    journal->fd = -1;
+    journal->size = size;
+    if (journal->path == NULL)
+    {
+        perror("strdup()");
+        return -1;
+    }
+
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t file_size = 0;
+    if (replay(journal, &file_size) == -1)
+    {
+        fprintf(stderr, "%s: not a journal this controller can read: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (file_size > journal->size)
+    {
+        journal->size = file_size;
+    }
+
+    pthread_mutex_lock(&journal->mutex);
+    int result = checkpoint(journal);
+    pthread_mutex_unlock(&journal->mutex);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    if (result == -1)
+    {
+        return -1;
+    }
+
+    int stops = 0;
+    for (int id = 0; id < journal->car_count; id++)
+    {
+        stops += stop_queue_length(&journal->cars[id]->stops);
+    }
+    printf("Journal: replayed %llu records in %.1f ms, %d stops queued for %d cars\n",
+           (unsigned long long)journal->replayed,
+           (finish.tv_sec - start.tv_sec) * 1e3 + (finish.tv_nsec - start.tv_nsec) / 1e6, stops, journal->car_count);
+    return 0;
+}
+
+// Function: rewrites the journal as a new file holding just the cars' names and queued stops, then
+// switches appends to it. Used on startup and, through reserve, whenever the file fills. Mutex held.
+// Returns: 0 on success, -1 on failure (with the reason printed).
+static int checkpoint(call_journal *journal)
+{
+    while (journal->syncing)
+    {
+        pthread_cond_wait(&journal->synced_cond, &journal->mutex); // A commit is using the old mapping
+    }
+
+    // Size the new file so that at least half of it is free for appends.
+    uint64_t needed = OPERATION_SLOTS;
+    for (int id = 0; id < journal->car_count; id++)
+    {
+        needed += 1 + NAME_SLOTS(strlen(journal->cars[id]->name)) + stop_queue_length(&journal->cars[id]->stops);
+    }
+    size_t size = journal->size;
+    while (JOURNAL_HEADER_SIZE + needed * sizeof(journal_record) > size / 2)
+    {
+        size *= 2;
+    }
+
+    char temporary_path[4096];
+    snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", journal->path);
+    int fd = open(temporary_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || ftruncate(fd, size) == -1)
+    {
+        perror("journal open()/ftruncate()");
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("journal mmap()");
+        close(fd);
+        return -1;
+    }
+
+    journal_header *header = (journal_header *)map;
+    header->magic = JOURNAL_MAGIC;
+    header->version = JOURNAL_VERSION;
+    header->record_size = sizeof(journal_record);
+    header->checkpoints = journal->checkpoints + 1;
+
+    uint64_t slot = 0;
+    for (int id = 0; id < journal->car_count; id++)
+    {
+        journal_car *entry = journal->cars[id];
+        slot += write_record(map, slot, JOURNAL_CAR, id, 0, (floor_t)strlen(entry->name), 0, entry->name);
+
+        // A call still waiting for its pickup is written as its assignment, so its dropoff waits again.
+        int count = stop_queue_length(&entry->stops);
+        call_requests *stops = malloc((count > 0 ? count : 1) * sizeof(call_requests));
+        floor_t *dropoffs = malloc((count > 0 ? count : 1) * sizeof(floor_t));
+        if (stops == NULL || dropoffs == NULL)
+        {
+            perror("malloc()");
+            free(stops);
+            free(dropoffs);
+            munmap(map, size);
+            close(fd);
+            return -1;
+        }
+        count = stop_queue_entries(&entry->stops, stops, dropoffs, count);
+        for (int i = 0; i < count; i++)
+        {
+            if (dropoffs[i] == FLOOR_INVALID)
+            {
+                slot += write_record(map, slot, JOURNAL_STOP, id, stops[i].direction, stops[i].floor, 0, NULL);
+            }
+            else
+            {
+                slot += write_record(map, slot, JOURNAL_ASSIGN, id, 0, stops[i].floor, dropoffs[i], NULL);
+            }
+        }
+        free(dropoffs);
+        free(stops);
+    }
+
+    // The new file must be on disk before it replaces the old one, and the rename before either is dropped.
+    if (msync(map, JOURNAL_HEADER_SIZE + slot * sizeof(journal_record), MS_SYNC) == -1 ||
+        rename(temporary_path, journal->path) == -1)
+    {
+        perror("journal msync()/rename()");
+        munmap(map, size);
+        close(fd);
+        return -1;
+    }
+    char directory_path[4096];
+    snprintf(directory_path, sizeof(directory_path), "%s", journal->path);
+    int directory_fd = open(dirname(directory_path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directory_fd != -1)
+    {
+        fsync(directory_fd);
+        close(directory_fd);
+    }
+
+    if (journal->map != NULL)
+    {
+        munmap(journal->map, journal->size);
+        close(journal->fd);
+    }
+    journal->map = map;
+    journal->fd = fd;
+    journal->size = size;
+    journal->base = journal->written - slot;
+    journal->synced = journal->written;
+    journal->checkpoints++;
+    return 0;
+}
+
+// Function: gives a newly registered car the stops recovered under its name, if any.
+// Arguments:
+// - journal: the journal.
+// - car: the car, already on the car list.
+// Returns: void
+void journal_register(call_journal *journal, CarNode *car)
+{
+    pthread_mutex_lock(&journal->mutex);
+    reserve(journal);
+    claim(journal, car);
+    pthread_mutex_unlock(&journal->mutex);
+}
+
+// Function: records that a car has left and its stops were discarded with it.
+// Arguments:
+// - journal: the journal.
+// - name: the car's name; the car is already off the car list.
+// Returns: void
+void journal_drop(call_journal *journal, const char *name)
+{
+    pthread_mutex_lock(&journal->mutex);
+    reserve(journal);
+    int id = find_car(journal, name);
+    if (id != -1 && journal->cars[id]->car != NULL)
+    {
+        stop_queue_clear(&journal->cars[id]->stops);
+        journal->cars[id]->car = NULL;
+        append(journal, JOURNAL_DROP, id, 0, 0, 0, NULL);
+    }
+    pthread_mutex_unlock(&journal->mutex);
+}
+
+// Function: adds a call's stops to the journal's copy of a car's queue and appends its record. Mutex
+// held, room reserved.
+static void record_assign(call_journal *journal, CarNode *car, floor_t source_floor, floor_t destination_floor)
+{
+    journal_car *entry = claim(journal, car);
+    if (entry != NULL)
+    {
+        stop_queue_push_call(&entry->stops, source_floor, destination_floor);
+        append(journal, JOURNAL_ASSIGN, car->journal_id, 0, source_floor, destination_floor, NULL);
+    }
+}
+
+// Function: queues a call's stops on a car (update_call_queue) and journals the assignment.
+// Arguments:
+// - journal: the journal.
+// - car: the car chosen, which must stay on the car list meanwhile.
+// - source_floor, destination_floor: the call's floors.
+// Returns: the position to commit before the call is answered.
+uint64_t journal_assign(call_journal *journal, CarNode *car, floor_t source_floor, floor_t destination_floor)
+{
+    pthread_mutex_lock(&journal->mutex);
+    reserve(journal);
+    update_call_queue(source_floor, destination_floor, car);
+    record_assign(journal, car, source_floor, destination_floor);
+    uint64_t position = journal->written;
+    pthread_mutex_unlock(&journal->mutex);
+    return position;
+}
+
+// Function: journals an assignment whose stops are queued on the car later, by the shard that owns
+// it (controller -S). The car's pops remove their own stops from the journal's copy, so stops may be
+// journaled ahead of the car's queue.
+// Arguments: as journal_assign.
+// Returns: the position to commit before the call is answered.
+uint64_t journal_record_assign(call_journal *journal, CarNode *car, floor_t source_floor, floor_t destination_floor)
+{
+    pthread_mutex_lock(&journal->mutex);
+    reserve(journal);
+    record_assign(journal, car, source_floor, destination_floor);
+    uint64_t position = journal->written;
+    pthread_mutex_unlock(&journal->mutex);
+    return position;
+}
+
+// Function: takes the stop a car should be sent now (take_next_stop) and journals it, along with the
+// stop put back in its place, if any.
+// Arguments:
+// - journal: the journal.
+// - car: the car, owned by the calling loop.
+// - floor: receives the stop's floor.
+// Returns: 1 if a stop should be sent, 0 if not.
+int journal_pop_stop(call_journal *journal, CarNode *car, floor_t *floor)
+{
+    call_requests stop;
+    call_requests requeued;
+
+    pthread_mutex_lock(&journal->mutex);
+    reserve(journal);
+    journal_car *entry = claim(journal, car);
+    int found = take_next_stop(car, &stop, &requeued);
+    if (found && entry != NULL)
+    {
+        stop_queue_remove(&entry->stops, stop);
+        append(journal, JOURNAL_POP, car->journal_id, stop.direction, stop.floor, 0, NULL);
+        if (requeued.direction != 0)
+        {
+            stop_queue_push(&entry->stops, requeued);
+            append(journal, JOURNAL_STOP, car->journal_id, requeued.direction, requeued.floor, 0, NULL);
+        }
+    }
+    pthread_mutex_unlock(&journal->mutex);
+
+    if (found)
+    {
+        *floor = stop.floor;
+    }
+    return found;
+}
+
+// Function: waits until the journal is on disk up to a position. One caller at a time runs msync,
+// for everything appended so far; callers that arrive meanwhile wait and are covered by the next.
+// Arguments:
+// - journal: the journal.
+// - position: from journal_assign.
+// Returns: void. Exits if the journal cannot be synced.
+void journal_commit(call_journal *journal, uint64_t position)
+{
+    pthread_mutex_lock(&journal->mutex);
+    while (journal->synced < position)
+    {
+        if (journal->syncing)
+        {
+            pthread_cond_wait(&journal->synced_cond, &journal->mutex);
+            continue;
+        }
+
+        journal->syncing = 1;
+        uint64_t target = journal->written;
+        uint64_t from = (journal->synced > journal->base) ? journal->synced - journal->base : 0;
+        size_t start = (JOURNAL_HEADER_SIZE + from * sizeof(journal_record)) & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+        size_t end = JOURNAL_HEADER_SIZE + (target - journal->base) * sizeof(journal_record);
+        char *map = journal->map;
+        pthread_mutex_unlock(&journal->mutex);
+
+        int result = msync(map + start, end - start, MS_SYNC);
+
+        pthread_mutex_lock(&journal->mutex);
+        if (result == -1)
+        {
+            perror("journal msync()");
+            exit(EXIT_FAILURE);
+        }
+        journal->synced = target;
+        journal->syncing = 0;
+        pthread_cond_broadcast(&journal->synced_cond);
+    }
+    pthread_mutex_unlock(&journal->mutex);
+}
+
+// Function: commits everything appended and closes the journal file. The queues are left as they are.
+void journal_close(call_journal *journal)
+{
+    journal_commit(journal, journal->written);
+    munmap(journal->map, journal->size);
+    close(journal->fd);
+    journal->map = NULL;
+    journal->fd = -1;
+}
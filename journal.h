@@ -0,0 +1,105 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "common.h"
+#include "dispatch.h"
+
+// Write-ahead journal of the controller's call state, so a restarted controller still serves the
+// stops it had queued before it went down.
+//
+// The journal is a memory-mapped file of 16-byte records: a call assigned to a car, a stop popped
+// to be sent to a car (and the stop it took the place of, put back when a moving car is sent a nearer
+// one), a car leaving (its stops go with it), and the names cars are journaled under.
+// Every change to a car's stop queue is made together with its record under the journal mutex, so
+// records are in the order the queues changed. The journal also keeps its own copy of every car's
+// stops, which it replays into on startup and writes out as a checkpoint whenever the file fills.
+// A sharded controller (controller -S) journals an assignment on the shard that took the call, before
+// the shard that owns the car queues it; a pop names the stop it removed, so that still replays.
+//
+// Appending only copies a record into the mapping. Records reach the disk in groups: journal_commit
+// msyncs everything appended so far, and callers that arrive while a sync is running wait for it and
+// share the next one. The controller holds call replies until the batch of events they came in is
+// committed, so a passenger is only told a car is coming once the call would survive a crash. Stops
+// popped but not yet committed are simply served again after a restart.
+//
+// On startup the file is replayed up to the first record that is torn, unwritten or stale, then
+// rewritten as a checkpoint. A car that registers under a name with recovered stops is given them.
+
+#define JOURNAL_MAGIC 0x314E4A45 // "EJN1"
+#define JOURNAL_VERSION 1
+#define JOURNAL_HEADER_SIZE 64
+#define JOURNAL_DEFAULT_SIZE (16 * 1024 * 1024) // Bytes; the file is checkpointed when it fills
+#define JOURNAL_MAX_CARS 65535
+
+typedef enum
+{
+    JOURNAL_CAR = 1, // floor: the name's length; the name follows in the next slots
+    JOURNAL_ASSIGN,  // floor, floor2: a call's source and destination; the dropoff waits for the pickup's pop
+    JOURNAL_STOP,    // direction, floor: one queued stop, written by a checkpoint or put back by a pop
+    JOURNAL_POP,     // direction, floor: a stop taken from the car's queue to be sent to it
+    JOURNAL_DROP     // The car left and its stops were discarded
+} journal_record_type;
+
+typedef struct
+{
+    uint32_t slot;     // The record's slot in the file, so a stale or unwritten slot does not match
+    uint8_t type;      // journal_record_type
+    uint8_t direction; // 'U' or 'D', for JOURNAL_STOP and JOURNAL_POP
+    uint16_t car;      // Set by the JOURNAL_CAR record that named it
+    floor_t floor;
+    floor_t floor2;
+    uint32_t checksum; // FNV-1a of the record up to here, and for JOURNAL_CAR of the name too
+} journal_record;
+
+_Static_assert(sizeof(journal_record) == 16, "journal records are 16 bytes");
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint64_t checkpoints; // Times the journal has been rewritten
+    char reserved[JOURNAL_HEADER_SIZE - 16];
+} journal_header;
+
+_Static_assert(sizeof(journal_header) == JOURNAL_HEADER_SIZE, "the journal header fills its space");
+
+// A car name the journal has seen, and the stops queued under it.
+typedef struct
+{
+    char name[100];
+    stop_queue stops;
+    CarNode *car; // The registered car that owns the stops, or NULL while none does
+} journal_car;
+
+typedef struct
+{
+    pthread_mutex_t mutex; // Everything below
+    pthread_cond_t synced_cond;
+    char *path;
+    int fd;
+    char *map;
+    size_t size;       // Bytes mapped
+    uint64_t base;     // Position of the file's first slot
+    uint64_t written;  // Position appended up to, in records since the journal was created
+    uint64_t synced;   // Position known to be on disk
+    int syncing;       // A commit is running msync without the mutex
+    uint64_t checkpoints;
+    uint64_t replayed;  // Records replayed by journal_open
+    journal_car **cars; // Indexed by car id
+    int car_count;
+    int car_capacity;
+} call_journal;
+
+int journal_open(call_journal *journal, const char *path, size_t size);
+void journal_register(call_journal *journal, CarNode *car);
+void journal_drop(call_journal *journal, const char *name);
+uint64_t journal_assign(call_journal *journal, CarNode *car, floor_t source_floor, floor_t destination_floor);
+uint64_t journal_record_assign(call_journal *journal, CarNode *car, floor_t source_floor, floor_t destination_floor);
+int journal_pop_stop(call_journal *journal, CarNode *car, floor_t *floor);
+void journal_commit(call_journal *journal, uint64_t position);
+void journal_close(call_journal *journal);
+
+#endif // JOURNAL_H
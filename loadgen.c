@@ -0,0 +1,774 @@
+// loadgen - drives the controller with fake cars and call pads over the normal protocol and reports
+// how it performs.
+//
+// Fake cars register with CAR, and answer every FLOOR at once with "STATUS Opening {floor} {floor}",
+// as if the car arrived instantly, so the controller is the only thing being measured. Call pads
+// keep one session open each and send CALLs with request IDs, either on a fixed schedule (open loop,
+// the total rate split across the pads) or one after another as replies arrive (closed loop).
+//
+// Reported:
+// - CALL->CAR: from when a call was due to be sent (open loop) or was sent (closed loop) until its
+//   reply arrives. Measuring from the schedule keeps a stalled controller from hiding its own delay.
+// - STATUS->FLOOR: from a car's STATUS until the FLOOR it triggers. A FLOOR that follows a newly
+//   assigned call rather than a STATUS is not counted.
+// - Achieved calls per second.
+//
+// With -t, the cars and pads are split across that many threads, each with its own epoll, so one
+// loadgen can keep a sharded controller (controller -t N -S) busy on every core.
+//
+// Usage: loadgen [-c {cars}] [-r {lowest floor}:{highest floor}]... [-p {pads}] [-m open|closed]
+//                [-R {calls per second}] [-w {calls in flight per pad}] [-d {seconds}] [-v {protocol version}]
+//                [-t {threads}]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <arpa/inet.h>
+#include "network_utils.h"
+#include "common.h"
+#include "protocol.h"
+
+#define MAX_FLOOR_RANGES 16
+#define MAX_EVENTS 64
+#define DRAIN_SECONDS 2 // How long to wait for outstanding replies once sending stops
+
+typedef struct
+{
+    floor_t lowest_floor;
+    floor_t highest_floor;
+} floor_range;
+
+typedef struct
+{
+    int fd;
+    frame_reader reader;
+    char name[PROTOCOL_MAX_NAME];
+    floor_t lowest_floor;
+    floor_t highest_floor;
+    uint64_t last_status_ns;   // When the last STATUS was sent
+    uint64_t last_assigned_ns; // When a call was last assigned to this car; set by any thread, relaxed atomics
+} fake_car;
+
+typedef struct
+{
+    uint32_t request_id;
+    uint64_t start_ns;
+} pad_request;
+
+typedef struct
+{
+    int fd;
+    frame_reader reader;
+    pad_request *in_flight; // Indexed by request ID modulo in_flight_capacity
+    uint32_t in_flight_capacity;
+    uint32_t in_flight_count;
+    uint32_t next_request_id;
+    uint64_t next_due_ns; // Open loop: when the next call is due
+} fake_pad;
+
+// Latency samples in nanoseconds; percentiles are read after sorting.
+typedef struct
+{
+    uint64_t *values;
+    size_t count;
+    size_t capacity;
+} sample_set;
+
+// Run configuration and one thread's state. Each thread runs a slice of the cars and pads.
+typedef struct
+{
+    int car_count;
+    int pad_count;
+    floor_range ranges[MAX_FLOOR_RANGES];
+    int range_count;
+    int closed_loop;
+    double rate;
+    uint32_t window;
+    double duration;
+    int protocol;
+
+    fake_car *cars;     // This thread's slice of all_cars
+    int first_car;      // Index of cars[0] in all_cars
+    fake_car *all_cars; // Every thread's cars, for finding the car a reply names
+    int all_car_count;
+    fake_pad *pads;
+    pthread_t thread;
+    double elapsed; // Seconds the thread ran, sending and draining
+    floor_t call_lowest;  // Calls are drawn from the union of the car ranges
+    floor_t call_highest;
+    uint64_t interval_ns; // Open loop: time between calls on one pad
+    int epoll_fd;
+    int timer_fd;
+    int sending;
+    uint64_t random_state;
+
+    long calls_sent;
+    long calls_assigned;
+    long calls_unavailable;
+    sample_set call_latency;
+    sample_set status_delay;
+} loadgen;
+
+uint64_t now_ns();
+void usage();
+void *run_thread(void *arg);
+int parse_floor_range(const char *text, floor_range *range);
+void start_cars(loadgen *lg);
+void start_pads(loadgen *lg);
+void run(loadgen *lg);
+void handle_car_readable(loadgen *lg, fake_car *car);
+void handle_pad_readable(loadgen *lg, fake_pad *pad);
+void send_car_status(loadgen *lg, fake_car *car, car_status status, floor_t floor);
+void send_call(loadgen *lg, fake_pad *pad, uint64_t start_ns);
+void send_due_calls(loadgen *lg);
+void arm_timer(loadgen *lg);
+fake_car *find_car(loadgen *lg, const char *name);
+floor_t random_floor(loadgen *lg);
+void add_sample(sample_set *set, uint64_t value);
+void report(loadgen *lg, loadgen *threads, int thread_count);
+void print_percentiles(const char *label, sample_set *set);
+
+int main(int argc, char **argv)
+{
+    loadgen lg;
+    memset(&lg, 0, sizeof(lg));
+    lg.car_count = 4;
+    lg.pad_count = 4;
+    lg.rate = 1000;
+    lg.window = 1;
+    lg.duration = 10;
+    lg.protocol = PROTOCOL_TEXT;
+    lg.random_state = 0x9E3779B97F4A7C15ULL;
+    int thread_count = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:r:p:m:R:w:d:v:t:")) != -1)
+    {
+        if (opt == 'c' && atoi(optarg) > 0)
+        {
+            lg.car_count = atoi(optarg);
+        }
+        else if (opt == 'r' && lg.range_count < MAX_FLOOR_RANGES && parse_floor_range(optarg, &lg.ranges[lg.range_count]))
+        {
+            lg.range_count++;
+        }
+        else if (opt == 'p' && atoi(optarg) > 0)
+        {
+            lg.pad_count = atoi(optarg);
+        }
+        else if (opt == 'm' && (strcmp(optarg, "open") == 0 || strcmp(optarg, "closed") == 0))
+        {
+            lg.closed_loop = strcmp(optarg, "closed") == 0;
+        }
+        else if (opt == 'R' && atof(optarg) > 0)
+        {
+            lg.rate = atof(optarg);
+        }
+        else if (opt == 'w' && atoi(optarg) > 0)
+        {
+            lg.window = (uint32_t)atoi(optarg);
+        }
+        else if (opt == 'd' && atof(optarg) > 0)
+        {
+            lg.duration = atof(optarg);
+        }
+        else if (opt == 'v' && (atoi(optarg) == PROTOCOL_TEXT || atoi(optarg) == PROTOCOL_VERSION))
+        {
+            lg.protocol = atoi(optarg);
+        }
+        else if (opt == 't' && atoi(optarg) > 0)
+        {
+            thread_count = atoi(optarg);
+        }
+        else
+        {
+            usage();
+        }
+    }
+    if (optind != argc || thread_count > lg.pad_count)
+    {
+        usage();
+    }
+
+    if (lg.range_count == 0)
+    {
+        lg.ranges[0].lowest_floor = 1;
+        lg.ranges[0].highest_floor = 20;
+        lg.range_count = 1;
+    }
+
+    lg.call_lowest = FLOOR_HIGHEST;
+    lg.call_highest = FLOOR_LOWEST;
+    for (int i = 0; i < lg.range_count; i++)
+    {
+        lg.call_lowest = (lg.ranges[i].lowest_floor < lg.call_lowest) ? lg.ranges[i].lowest_floor : lg.call_lowest;
+        lg.call_highest = (lg.ranges[i].highest_floor > lg.call_highest) ? lg.ranges[i].highest_floor : lg.call_highest;
+    }
+    lg.interval_ns = (uint64_t)(1e9 * lg.pad_count / lg.rate); // The same on every thread, as pads and rate split alike
+    lg.all_car_count = lg.car_count;
+    lg.all_cars = calloc(lg.car_count, sizeof(fake_car));
+    loadgen *threads = calloc(thread_count, sizeof(loadgen));
+    if (lg.all_cars == NULL || threads == NULL)
+    {
+        perror("calloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    // Every thread's cars register before any thread starts calling.
+    for (int t = 0; t < thread_count; t++)
+    {
+        loadgen *thread = &threads[t];
+        *thread = lg;
+        thread->first_car = lg.car_count * t / thread_count;
+        thread->car_count = lg.car_count * (t + 1) / thread_count - thread->first_car;
+        thread->cars = lg.all_cars + thread->first_car;
+        thread->pad_count = lg.pad_count * (t + 1) / thread_count - lg.pad_count * t / thread_count;
+        thread->random_state = lg.random_state + 0x9E3779B97F4A7C15ULL * t;
+
+        thread->epoll_fd = epoll_create1(0);
+        thread->timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+        if (thread->epoll_fd == -1 || thread->timer_fd == -1)
+        {
+            perror("epoll_create1()/timerfd_create()");
+            exit(EXIT_FAILURE);
+        }
+        start_cars(thread);
+        start_pads(thread);
+    }
+
+    for (int t = 1; t < thread_count; t++)
+    {
+        if (pthread_create(&threads[t].thread, NULL, run_thread, &threads[t]) != 0)
+        {
+            perror("pthread_create()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    run(&threads[0]);
+    for (int t = 1; t < thread_count; t++)
+    {
+        pthread_join(threads[t].thread, NULL);
+    }
+
+    report(&lg, threads, thread_count);
+    return 0;
+}
+
+void *run_thread(void *arg)
+{
+    run((loadgen *)arg);
+    return NULL;
+}
+
+void usage()
+{
+    printf("Usage: loadgen [-c {cars}] [-r {lowest floor}:{highest floor}]... [-p {pads}] [-m open|closed]\n");
+    printf("               [-R {calls per second}] [-w {calls in flight per pad}] [-d {seconds}] [-v {protocol version}]\n");
+    printf("               [-t {threads, at most the pads}]\n");
+    printf("Cars take the -r ranges in turn (default 1:20). -R sets the open-loop rate across all pads,\n");
+    printf("-w the calls each closed-loop pad keeps in flight.\n");
+    exit(EXIT_FAILURE);
+}
+
+// Function: Parses "{lowest floor}:{highest floor}", e.g. "B2:20".
+// Returns: 1 if the range is valid, else 0.
+int parse_floor_range(const char *text, floor_range *range)
+{
+    char lowest[8], highest[8];
+    if (sscanf(text, "%7[^:]:%7s", lowest, highest) != 2)
+    {
+        return 0;
+    }
+    range->lowest_floor = parse_floor(lowest);
+    range->highest_floor = parse_floor(highest);
+    return range->lowest_floor != FLOOR_INVALID && range->highest_floor != FLOOR_INVALID &&
+           range->lowest_floor < range->highest_floor;
+}
+
+// Function: Connects every fake car, registers it and reports its starting position.
+void start_cars(loadgen *lg)
+{
+    for (int i = 0; i < lg->car_count; i++)
+    {
+        fake_car *car = &lg->cars[i];
+        int index = lg->first_car + i;
+        floor_range *range = &lg->ranges[index % lg->range_count];
+        snprintf(car->name, sizeof(car->name), "LG%d", index);
+        car->lowest_floor = range->lowest_floor;
+        car->highest_floor = range->highest_floor;
+        car->fd = establish_connection();
+        if (frame_reader_init(&car->reader, DEFAULT_MAX_FRAME_SIZE) == -1)
+        {
+            perror("frame_reader_init()");
+            exit(EXIT_FAILURE);
+        }
+
+        if (lg->protocol == PROTOCOL_VERSION)
+        {
+            proto_car registration;
+            send_frame(car->fd, &registration, proto_encode_car(&registration, car->name, car->lowest_floor, car->highest_floor, 0));
+        }
+        else
+        {
+            char message[160], lowest[FLOOR_STRING_SIZE], highest[FLOOR_STRING_SIZE];
+            format_floor(car->lowest_floor, lowest);
+            format_floor(car->highest_floor, highest);
+            snprintf(message, sizeof(message), "CAR %s %s %s 0", car->name, lowest, highest);
+            send_message(car->fd, message);
+        }
+        send_car_status(lg, car, CAR_STATUS_CLOSED, car->lowest_floor);
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = car;
+        if (epoll_ctl(lg->epoll_fd, EPOLL_CTL_ADD, car->fd, &ev) == -1)
+        {
+            perror("epoll_ctl()");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Function: Connects every call pad session.
+void start_pads(loadgen *lg)
+{
+    lg->pads = calloc(lg->pad_count, sizeof(fake_pad));
+    if (lg->pads == NULL)
+    {
+        perror("calloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    // Closed loop needs room for the window; open loop for whatever piles up while the controller lags.
+    uint32_t capacity = lg->closed_loop ? lg->window : 65536;
+    for (int i = 0; i < lg->pad_count; i++)
+    {
+        fake_pad *pad = &lg->pads[i];
+        pad->fd = establish_connection();
+        pad->in_flight_capacity = capacity;
+        pad->in_flight = calloc(capacity, sizeof(pad_request));
+        if (pad->in_flight == NULL || frame_reader_init(&pad->reader, DEFAULT_MAX_FRAME_SIZE) == -1)
+        {
+            perror("calloc()");
+            exit(EXIT_FAILURE);
+        }
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = pad;
+        if (epoll_ctl(lg->epoll_fd, EPOLL_CTL_ADD, pad->fd, &ev) == -1)
+        {
+            perror("epoll_ctl()");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Function: Runs one thread's load for the configured duration and drains its replies.
+void run(loadgen *lg)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // NULL marks the timer
+    if (epoll_ctl(lg->epoll_fd, EPOLL_CTL_ADD, lg->timer_fd, &ev) == -1)
+    {
+        perror("epoll_ctl()");
+        exit(EXIT_FAILURE);
+    }
+
+    usleep(100000); // Let the cars register before the first call
+
+    uint64_t start = now_ns();
+    uint64_t stop = start + (uint64_t)(lg->duration * 1e9);
+    lg->sending = 1;
+
+    if (lg->closed_loop)
+    {
+        for (int i = 0; i < lg->pad_count; i++)
+        {
+            for (uint32_t j = 0; j < lg->window; j++)
+            {
+                send_call(lg, &lg->pads[i], now_ns());
+            }
+        }
+    }
+    else
+    {
+        // Stagger the pads across one interval so the calls are evenly spread
+        for (int i = 0; i < lg->pad_count; i++)
+        {
+            lg->pads[i].next_due_ns = start + lg->interval_ns * i / lg->pad_count;
+        }
+        arm_timer(lg);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    for (;;)
+    {
+        uint64_t now = now_ns();
+        if (lg->sending && now >= stop)
+        {
+            lg->sending = 0;
+        }
+        if (!lg->sending)
+        {
+            long outstanding = lg->calls_sent - lg->calls_assigned - lg->calls_unavailable;
+            if (outstanding == 0 || now >= stop + DRAIN_SECONDS * 1000000000ULL)
+            {
+                break;
+            }
+        }
+
+        int timeout_ms = (int)(((lg->sending ? stop : stop + DRAIN_SECONDS * 1000000000ULL) - now) / 1000000) + 1;
+        int count = epoll_wait(lg->epoll_fd, events, MAX_EVENTS, timeout_ms);
+        if (count == -1 && errno != EINTR)
+        {
+            perror("epoll_wait()");
+            exit(EXIT_FAILURE);
+        }
+
+        // Replies to pads first, so an assignment is recorded before the FLOOR it causes.
+        for (int i = 0; i < count; i++)
+        {
+            void *ptr = events[i].data.ptr;
+            if (ptr != NULL && ptr >= (void *)lg->pads && ptr < (void *)(lg->pads + lg->pad_count))
+            {
+                handle_pad_readable(lg, ptr);
+            }
+        }
+        for (int i = 0; i < count; i++)
+        {
+            void *ptr = events[i].data.ptr;
+            if (ptr == NULL)
+            {
+                uint64_t expirations;
+                if (read(lg->timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+                {
+                    perror("read(timerfd)");
+                }
+                send_due_calls(lg);
+            }
+            else if (ptr >= (void *)lg->cars && ptr < (void *)(lg->cars + lg->car_count))
+            {
+                handle_car_readable(lg, ptr);
+            }
+        }
+    }
+
+    lg->elapsed = (now_ns() - start) / 1e9;
+}
+
+// Function: Answers every FLOOR with an immediate arrival.
+void handle_car_readable(loadgen *lg, fake_car *car)
+{
+    if (frame_reader_fill(&car->reader, car->fd) <= 0)
+    {
+        printf("Car %s lost its connection to the controller.\n", car->name);
+        exit(EXIT_FAILURE);
+    }
+    uint64_t received = now_ns();
+
+    char *msg;
+    uint32_t len;
+    while (frame_reader_next(&car->reader, &msg, &len) == 1)
+    {
+        floor_t floor = FLOOR_INVALID;
+        char floor_text[4];
+
+        if (lg->protocol == PROTOCOL_VERSION)
+        {
+            proto_decode_floor(msg, len, &floor);
+        }
+        else if (sscanf(msg, "FLOOR %3s", floor_text) == 1)
+        {
+            floor = parse_floor(floor_text);
+        }
+        if (floor == FLOOR_INVALID)
+        {
+            continue;
+        }
+
+        // Only a FLOOR received after the STATUS, with no assignment in between, was caused by it
+        if (__atomic_load_n(&car->last_assigned_ns, __ATOMIC_RELAXED) < car->last_status_ns && car->last_status_ns < received)
+        {
+            add_sample(&lg->status_delay, received - car->last_status_ns);
+        }
+        send_car_status(lg, car, CAR_STATUS_OPENING, floor);
+    }
+}
+
+// Function: Records each reply's latency and, in closed loop, sends the pad's next call.
+void handle_pad_readable(loadgen *lg, fake_pad *pad)
+{
+    if (frame_reader_fill(&pad->reader, pad->fd) <= 0)
+    {
+        printf("A call pad lost its connection to the controller.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char *msg;
+    uint32_t len;
+    while (frame_reader_next(&pad->reader, &msg, &len) == 1)
+    {
+        uint64_t now = now_ns();
+        char name[PROTOCOL_MAX_NAME] = "";
+        uint32_t request_id;
+
+        if (lg->protocol == PROTOCOL_VERSION)
+        {
+            if (!proto_decode_assignment(msg, len, &request_id, name))
+            {
+                continue;
+            }
+        }
+        else if (sscanf(msg, "CAR %99s %u", name, &request_id) != 2 && sscanf(msg, "UNAVAILABLE %u", &request_id) != 1)
+        {
+            continue;
+        }
+
+        pad_request *request = &pad->in_flight[request_id % pad->in_flight_capacity];
+        if (request->request_id != request_id)
+        {
+            continue; // Overwritten after the open-loop backlog outgrew the table
+        }
+        add_sample(&lg->call_latency, now - request->start_ns);
+        pad->in_flight_count--;
+
+        if (name[0] == '\0')
+        {
+            lg->calls_unavailable++;
+        }
+        else
+        {
+            lg->calls_assigned++;
+            fake_car *car = find_car(lg, name);
+            if (car != NULL)
+            {
+                __atomic_store_n(&car->last_assigned_ns, now, __ATOMIC_RELAXED);
+            }
+        }
+
+        if (lg->closed_loop && lg->sending)
+        {
+            send_call(lg, pad, now_ns());
+        }
+    }
+}
+
+// Function: Sends one STATUS for a fake car and notes when.
+void send_car_status(loadgen *lg, fake_car *car, car_status status, floor_t floor)
+{
+    if (lg->protocol == PROTOCOL_VERSION)
+    {
+        proto_status frame;
+        send_frame(car->fd, &frame, proto_encode_status(&frame, status, floor, floor));
+    }
+    else
+    {
+        char message[32], floor_text[FLOOR_STRING_SIZE];
+        format_floor(floor, floor_text);
+        snprintf(message, sizeof(message), "STATUS %s %s %s", format_status(status), floor_text, floor_text);
+        send_message(car->fd, message);
+    }
+    car->last_status_ns = now_ns();
+}
+
+// Function: Sends one random call from a pad.
+// Arguments: start_ns is the time the call's latency is measured from.
+void send_call(loadgen *lg, fake_pad *pad, uint64_t start_ns)
+{
+    floor_t source_floor = random_floor(lg);
+    floor_t destination_floor;
+    do
+    {
+        destination_floor = random_floor(lg);
+    } while (destination_floor == source_floor);
+
+    uint32_t request_id = pad->next_request_id++;
+    pad_request *request = &pad->in_flight[request_id % pad->in_flight_capacity];
+    request->request_id = request_id;
+    request->start_ns = start_ns;
+    pad->in_flight_count++;
+    lg->calls_sent++;
+
+    if (lg->protocol == PROTOCOL_VERSION)
+    {
+        proto_call_batch batch;
+        proto_encode_call_entry(&batch.calls[0], request_id, source_floor, destination_floor);
+        send_frame(pad->fd, &batch, proto_encode_call_batch(&batch, 1));
+    }
+    else
+    {
+        char message[48], source_text[FLOOR_STRING_SIZE], destination_text[FLOOR_STRING_SIZE];
+        format_floor(source_floor, source_text);
+        format_floor(destination_floor, destination_text);
+        snprintf(message, sizeof(message), "CALL %s %s %u", source_text, destination_text, request_id);
+        send_message(pad->fd, message);
+    }
+}
+
+// Function: Open loop: sends every call whose time has come, then re-arms the timer.
+void send_due_calls(loadgen *lg)
+{
+    if (!lg->sending)
+    {
+        return;
+    }
+
+    uint64_t now = now_ns();
+    for (int i = 0; i < lg->pad_count; i++)
+    {
+        fake_pad *pad = &lg->pads[i];
+        while (pad->next_due_ns <= now)
+        {
+            send_call(lg, pad, pad->next_due_ns); // Measured from when it was due
+            pad->next_due_ns += lg->interval_ns;
+        }
+    }
+    arm_timer(lg);
+}
+
+// Function: Arms the timer for the earliest call due on any pad.
+void arm_timer(loadgen *lg)
+{
+    uint64_t next = UINT64_MAX;
+    for (int i = 0; i < lg->pad_count; i++)
+    {
+        next = (lg->pads[i].next_due_ns < next) ? lg->pads[i].next_due_ns : next;
+    }
+
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = next / 1000000000ULL;
+    timer.it_value.tv_nsec = next % 1000000000ULL;
+    if (timerfd_settime(lg->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) == -1)
+    {
+        perror("timerfd_settime()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+fake_car *find_car(loadgen *lg, const char *name)
+{
+    // Names are LG{index}
+    int index = atoi(name + 2);
+    if (strncmp(name, "LG", 2) == 0 && index >= 0 && index < lg->all_car_count)
+    {
+        return &lg->all_cars[index];
+    }
+    return NULL;
+}
+
+// Function: Picks a floor uniformly from the call range, skipping the nonexistent floor 0.
+floor_t random_floor(loadgen *lg)
+{
+    // xorshift64
+    lg->random_state ^= lg->random_state << 13;
+    lg->random_state ^= lg->random_state >> 7;
+    lg->random_state ^= lg->random_state << 17;
+
+    int span = lg->call_highest - lg->call_lowest + 1 - (lg->call_lowest < 0 && lg->call_highest > 0);
+    int floor = lg->call_lowest + (int)(lg->random_state % (uint64_t)span);
+    if (lg->call_lowest < 0 && floor >= 0)
+    {
+        floor++;
+    }
+    return (floor_t)floor;
+}
+
+void add_sample(sample_set *set, uint64_t value)
+{
+    if (set->count == set->capacity)
+    {
+        set->capacity = set->capacity == 0 ? 4096 : set->capacity * 2;
+        set->values = realloc(set->values, set->capacity * sizeof(uint64_t));
+        if (set->values == NULL)
+        {
+            perror("realloc()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    set->values[set->count++] = value;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+void print_percentiles(const char *label, sample_set *set)
+{
+    if (set->count == 0)
+    {
+        printf("%-16s no samples\n", label);
+        return;
+    }
+
+    qsort(set->values, set->count, sizeof(uint64_t), compare_samples);
+    printf("%-16s %10.1f %10.1f %10.1f %10.1f %10zu\n", label,
+           set->values[set->count * 50 / 100] / 1e3,
+           set->values[set->count * 99 / 100] / 1e3,
+           set->values[set->count * 999 / 1000] / 1e3,
+           set->values[set->count - 1] / 1e3,
+           set->count);
+}
+
+// Function: Adds the threads' counts and samples together and prints the report.
+void report(loadgen *lg, loadgen *threads, int thread_count)
+{
+    double elapsed = 0;
+    for (int t = 0; t < thread_count; t++)
+    {
+        loadgen *thread = &threads[t];
+        lg->calls_sent += thread->calls_sent;
+        lg->calls_assigned += thread->calls_assigned;
+        lg->calls_unavailable += thread->calls_unavailable;
+        for (size_t i = 0; i < thread->call_latency.count; i++)
+        {
+            add_sample(&lg->call_latency, thread->call_latency.values[i]);
+        }
+        for (size_t i = 0; i < thread->status_delay.count; i++)
+        {
+            add_sample(&lg->status_delay, thread->status_delay.values[i]);
+        }
+        elapsed = (thread->elapsed > elapsed) ? thread->elapsed : elapsed;
+    }
+    long answered = lg->calls_assigned + lg->calls_unavailable;
+
+    printf("%d cars, %d pads, %d thread%s, ", lg->car_count, lg->pad_count, thread_count, thread_count == 1 ? "" : "s");
+    if (lg->closed_loop)
+    {
+        printf("closed loop with %u in flight per pad", lg->window);
+    }
+    else
+    {
+        printf("open loop at %.0f calls/s", lg->rate);
+    }
+    printf(", protocol %s, %.1f s\n", lg->protocol == PROTOCOL_VERSION ? "2 (binary)" : "1 (text)", lg->duration);
+    printf("calls: %ld sent, %ld assigned, %ld unavailable, %ld unanswered\n", lg->calls_sent, lg->calls_assigned,
+           lg->calls_unavailable, lg->calls_sent - answered);
+    printf("achieved: %.0f calls/s\n\n", answered / elapsed);
+
+    printf("%-16s %10s %10s %10s %10s %10s\n", "latency (us)", "p50", "p99", "p99.9", "max", "samples");
+    print_percentiles("CALL->CAR", &lg->call_latency);
+    print_percentiles("STATUS->FLOOR", &lg->status_delay);
+}
+
+uint64_t now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include "mailbox.h"
+
+// Function: initialises an empty mailbox.
+// Arguments:
+// - box: the mailbox.
+// - wake_fd: the owner's eventfd, written when a message arrives in a drained mailbox.
+// Returns: void
+void mailbox_init(mailbox *box, int wake_fd)
+{
+    box->stub.next = NULL;
+    box->head = &box->stub;
+    box->tail = &box->stub;
+    box->wake_fd = wake_fd;
+    box->signalled = 0;
+}
+
+// Links a node in as the newest. Lock-free: the exchange orders posting threads, and a node is
+// reachable from the previous one once the store lands.
+static void link_node(mailbox *box, mailbox_node *node)
+{
+    __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+    mailbox_node *previous = __atomic_exchange_n(&box->head, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&previous->next, node, __ATOMIC_RELEASE);
+}
+
+// Function: posts a message, waking the owner if it has drained the mailbox since the last wakeup.
+// Arguments:
+// - box: the owner's mailbox.
+// - node: the message's node; the owner takes over the message.
+// Returns: void
+void mailbox_post(mailbox *box, mailbox_node *node)
+{
+    link_node(box, node);
+    if (!__atomic_exchange_n(&box->signalled, 1, __ATOMIC_SEQ_CST))
+    {
+        uint64_t one = 1;
+        if (write(box->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        {
+            perror("write() to eventfd");
+        }
+    }
+}
+
+// Function: tells posting threads the owner is about to take everything, so the next post wakes it
+// again. Call when woken, before taking.
+// Arguments: box - the owner's mailbox.
+// Returns: void
+void mailbox_drained(mailbox *box)
+{
+    __atomic_store_n(&box->signalled, 0, __ATOMIC_SEQ_CST);
+}
+
+// Function: takes the oldest message. Owner only.
+// Arguments: box - the owner's mailbox.
+// Returns: the message's node, or NULL if there is none or the next is still being posted.
+mailbox_node *mailbox_take(mailbox *box)
+{
+    mailbox_node *tail = box->tail;
+    mailbox_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &box->stub)
+    {
+        if (next == NULL)
+        {
+            return NULL;
+        }
+        box->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL)
+    {
+        box->tail = next;
+        return tail;
+    }
+
+    // tail is the newest node seen. Unless a post has already moved head past it, put the stub
+    // behind it so tail can be handed out without leaving the queue empty of nodes.
+    if (tail != __atomic_load_n(&box->head, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    link_node(box, &box->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL)
+    {
+        box->tail = next;
+        return tail;
+    }
+    return NULL;
+}
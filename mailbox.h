@@ -0,0 +1,31 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+// A lock-free many-to-one queue of messages for a thread that waits in epoll, as the controller's
+// shards pass each other calls and connections.
+//
+// Messages embed a mailbox_node. Posting is one atomic exchange and a store, from any thread; only
+// the owning thread takes. The first post after the owner last drained the mailbox writes its
+// eventfd, so a burst of messages costs one wakeup. A message posted while the owner is taking may
+// not be seen until that post completes; its own wakeup then arrives.
+
+typedef struct mailbox_node
+{
+    struct mailbox_node *next;
+} mailbox_node;
+
+typedef struct
+{
+    mailbox_node *head; // Last posted; exchanged by posting threads
+    mailbox_node *tail; // Next to take; owner only
+    mailbox_node stub;  // Keeps the queue non-empty so posting never has to touch tail
+    int wake_fd;        // eventfd written when the mailbox goes from drained to not
+    int signalled;      // Set once wake_fd has been written since the owner last drained
+} mailbox;
+
+void mailbox_init(mailbox *box, int wake_fd);
+void mailbox_post(mailbox *box, mailbox_node *node);
+void mailbox_drained(mailbox *box);
+mailbox_node *mailbox_take(mailbox *box);
+
+#endif // MAILBOX_H
@@ -0,0 +1,304 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "metrics.h"
+#include "network_utils.h"
+
+#define REQUEST_WAIT_MS 100 // How long a scraper has to send an HTTP request line before plain text is sent
+
+typedef struct
+{
+    int listen_fd;
+    metrics_writer writer;
+    void *arg;
+} metrics_server;
+
+static void *serve_scrapes(void *arg);
+
+// Function: adds to a counter. Only the counter's owning thread may call this.
+// Arguments:
+// - counter: the counter.
+// - amount: the amount to add.
+// Returns: void
+void metrics_add(uint64_t *counter, uint64_t amount)
+{
+    __atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
+
+// Function: reads a counter owned by another thread.
+uint64_t metrics_read(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static int bucket_of(uint64_t value)
+{
+    if (value < METRICS_SUB_BUCKETS)
+    {
+        return (int)value;
+    }
+    int shift = 63 - __builtin_clzll(value) - METRICS_SUB_BUCKET_BITS;
+    return (shift + 1) * METRICS_SUB_BUCKETS + (int)((value >> shift) & (METRICS_SUB_BUCKETS - 1));
+}
+
+// The largest value counted in a bucket.
+static uint64_t bucket_highest(int bucket)
+{
+    if (bucket < METRICS_SUB_BUCKETS)
+    {
+        return (uint64_t)bucket;
+    }
+    int shift = bucket / METRICS_SUB_BUCKETS - 1;
+    uint64_t lowest = (uint64_t)(METRICS_SUB_BUCKETS + bucket % METRICS_SUB_BUCKETS) << shift;
+    return lowest + ((1ULL << shift) - 1);
+}
+
+// Function: records one value. Only the histogram's owning thread may call this.
+// Arguments:
+// - histogram: the histogram.
+// - value: the value, e.g. a latency in nanoseconds.
+// Returns: void
+void metrics_record(metrics_histogram *histogram, uint64_t value)
+{
+    metrics_add(&histogram->buckets[bucket_of(value)], 1);
+    metrics_add(&histogram->count, 1);
+    metrics_add(&histogram->sum, value);
+    if (value > histogram->max)
+    {
+        __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+// Function: adds a histogram owned by another thread into a running total.
+// Arguments:
+// - total: the scraper's total, not shared.
+// - histogram: one thread's histogram.
+// Returns: void
+void metrics_merge(metrics_histogram *total, const metrics_histogram *histogram)
+{
+    for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++)
+    {
+        total->buckets[i] += metrics_read(&histogram->buckets[i]);
+    }
+    total->count += metrics_read(&histogram->count);
+    total->sum += metrics_read(&histogram->sum);
+    uint64_t max = metrics_read(&histogram->max);
+    if (max > total->max)
+    {
+        total->max = max;
+    }
+}
+
+// Function: the value at a quantile of a merged histogram, rounded up to the top of its bucket.
+// Arguments:
+// - histogram: the histogram.
+// - quantile: between 0 and 1, e.g. 0.99.
+// Returns: the value, no more than the largest recorded; 0 if nothing has been recorded.
+uint64_t metrics_quantile(const metrics_histogram *histogram, double quantile)
+{
+    uint64_t counted = 0;
+    for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++)
+    {
+        counted += histogram->buckets[i];
+    }
+    if (counted == 0)
+    {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(quantile * counted + 0.5);
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+        {
+            uint64_t highest = bucket_highest(i);
+            return (highest < histogram->max) ? highest : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+// Function: writes a merged histogram of nanosecond values as a summary in seconds: p50, p90, p99
+// and p99.9, then the sum, count and maximum.
+// Arguments:
+// - out: where to write.
+// - name, help: the metric's name and description.
+// - histogram: the merged histogram.
+// Returns: void
+void metrics_write_histogram(FILE *out, const char *name, const char *help, const metrics_histogram *histogram)
+{
+    static const char *quantile_labels[] = {"0.5", "0.9", "0.99", "0.999"};
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+    for (int i = 0; i < 4; i++)
+    {
+        fprintf(out, "%s{quantile=\"%s\"} %.9f\n", name, quantile_labels[i], metrics_quantile(histogram, quantiles[i]) / 1e9);
+    }
+    fprintf(out, "%s_sum %.9f\n%s_count %llu\n", name, histogram->sum / 1e9, name, (unsigned long long)histogram->count);
+    fprintf(out, "# TYPE %s_max gauge\n%s_max %.9f\n", name, name, histogram->max / 1e9);
+}
+
+// Function: current CLOCK_MONOTONIC time in nanoseconds.
+uint64_t metrics_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Function: listens for scrapes on a Unix socket or a local TCP port, answering each from a thread of
+// its own so scrapes never run on the caller's threads.
+// Arguments:
+// - address: a TCP port on 127.0.0.1 if it is all digits, otherwise the path of a Unix socket
+//   (replacing any left behind).
+// - writer: writes the exposition for each scrape.
+// - arg: passed to writer.
+// Returns: 0 once listening, -1 on failure (with the reason printed).
+int metrics_serve(const char *address, metrics_writer writer, void *arg)
+{
+    int is_port = address[0] != '\0' && strspn(address, "0123456789") == strlen(address);
+    int listen_fd = socket(is_port ? AF_INET : AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1)
+    {
+        perror("socket()");
+        return -1;
+    }
+
+    int bound;
+    if (is_port)
+    {
+        int opt_enable = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof(opt_enable));
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)atoi(address));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Local scrapers only
+        bound = bind(listen_fd, (const struct sockaddr *)&addr, sizeof(addr));
+    }
+    else
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(addr.sun_path))
+        {
+            fprintf(stderr, "Metrics socket path is too long.\n");
+            close(listen_fd);
+            return -1;
+        }
+        strcpy(addr.sun_path, address);
+        unlink(address);
+        bound = bind(listen_fd, (const struct sockaddr *)&addr, sizeof(addr));
+    }
+    if (bound == -1 || listen(listen_fd, 16) == -1)
+    {
+        perror("metrics bind()/listen()");
+        close(listen_fd);
+        return -1;
+    }
+
+    metrics_server *server = malloc(sizeof(metrics_server));
+    if (server == NULL)
+    {
+        perror("malloc()");
+        close(listen_fd);
+        return -1;
+    }
+    server->listen_fd = listen_fd;
+    server->writer = writer;
+    server->arg = arg;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_scrapes, server) != 0)
+    {
+        perror("pthread_create() for metrics");
+        close(listen_fd);
+        free(server);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Function: metrics thread. Answers one scrape at a time: an HTTP GET gets an HTTP response, anything
+// else (or nothing within REQUEST_WAIT_MS, as from socat or nc) gets the plain text.
+static void *serve_scrapes(void *arg)
+{
+    metrics_server *server = arg;
+
+    for (;;)
+    {
+        int client_fd = accept(server->listen_fd, NULL, NULL);
+        if (client_fd == -1)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+            {
+                perror("metrics accept()");
+                sleep(1); // e.g. out of descriptors; the controller itself carries on
+            }
+            continue;
+        }
+
+        char request[512];
+        ssize_t received = 0;
+        struct pollfd pfd = {client_fd, POLLIN, 0};
+        if (poll(&pfd, 1, REQUEST_WAIT_MS) == 1)
+        {
+            received = read(client_fd, request, sizeof(request) - 1);
+        }
+        int is_http = received >= 4 && memcmp(request, "GET ", 4) == 0;
+
+        char *body = NULL;
+        size_t body_len = 0;
+        FILE *out = open_memstream(&body, &body_len);
+        if (out == NULL)
+        {
+            perror("open_memstream()");
+            close(client_fd);
+            continue;
+        }
+        int written = server->writer(out, server->arg);
+        fclose(out);
+        if (written == -1)
+        {
+            // Better no answer than part of one: the scraper sees a failed scrape, not missing cars.
+            if (is_http)
+            {
+                const char *failed = "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+                write_looped(client_fd, failed, strlen(failed));
+            }
+            free(body);
+            close(client_fd);
+            continue;
+        }
+
+        if (is_http)
+        {
+            char header[128];
+            int header_len = snprintf(header, sizeof(header),
+                                      "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body_len);
+            write_looped(client_fd, header, header_len);
+        }
+        write_looped(client_fd, body, body_len);
+        free(body);
+        close(client_fd);
+    }
+    return NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Instrumentation that is cheap to record from an event loop and merged only when scraped.
+//
+// Every counter and histogram has a single writer, the thread that owns it, so recording is a plain
+// add stored with a relaxed atomic store: no locked instruction and no shared cache line. A scrape
+// loads each thread's copy with relaxed atomic loads and adds them up; a value recorded during the
+// scrape may or may not be included.
+//
+// Histograms are HDR-style: values below 32 get a bucket each, and every power of two above that
+// is split into 32 linear sub-buckets, so any value is counted within 1/32 (3.1%) of its size over
+// the whole 64-bit range without configuring a range up front.
+
+#define METRICS_SUB_BUCKET_BITS 5
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+#define METRICS_HISTOGRAM_BUCKETS ((64 - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS)
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+} metrics_histogram;
+
+// Writes the text exposition of every metric to out. Returns 0, or -1 if it could not write them all.
+typedef int (*metrics_writer)(FILE *out, void *arg);
+
+void metrics_add(uint64_t *counter, uint64_t amount);
+uint64_t metrics_read(const uint64_t *counter);
+void metrics_record(metrics_histogram *histogram, uint64_t value);
+void metrics_merge(metrics_histogram *total, const metrics_histogram *histogram);
+uint64_t metrics_quantile(const metrics_histogram *histogram, double quantile);
+void metrics_write_histogram(FILE *out, const char *name, const char *help, const metrics_histogram *histogram);
+uint64_t metrics_now_ns();
+int metrics_serve(const char *address, metrics_writer writer, void *arg);
+
+#endif // METRICS_H
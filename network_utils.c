@@ -4,7 +4,10 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
 
 // Function implementations
 void recv_looped(int fd, void *buf, size_t sz)
@@ -20,12 +23,28 @@ void recv_looped(int fd, void *buf, size_t sz)
             perror("read()");
             exit(1);
         }
+        if (received == 0)
+        {
+            fprintf(stderr, "read(): connection closed\n");
+            exit(1);
+        }
         ptr += received;
         remain -= received;
     }
 }
 
 void send_looped(int fd, const void *buf, size_t sz)
+{
+    if (write_looped(fd, buf, sz) == -1)
+    {
+        perror("write()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Function: Writes the whole buffer, retrying short writes.
+// Returns: 0 on success, -1 with errno set if the connection failed.
+int write_looped(int fd, const void *buf, size_t sz)
 {
     const char *ptr = buf;
     size_t remain = sz;
@@ -33,21 +52,79 @@ void send_looped(int fd, const void *buf, size_t sz)
     while (remain > 0)
     {
         ssize_t sent = write(fd, ptr, remain);
+        if (sent == -1 && errno == EINTR)
+        {
+            continue;
+        }
         if (sent == -1)
         {
-            perror("write()");
-            exit(EXIT_FAILURE);
+            return -1;
         }
         ptr += sent;
         remain -= sent;
     }
+    return 0;
 }
 
 void send_message(int fd, const char *buf)
 {
-    uint32_t len = htonl(strlen(buf));
-    send_looped(fd, &len, sizeof(len));
-    send_looped(fd, buf, strlen(buf));
+    send_frame(fd, buf, strlen(buf));
+}
+
+void send_frame(int fd, const void *buf, size_t len)
+{
+    if (write_frame(fd, buf, len) == -1)
+    {
+        perror("write()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Function: Writes one length-prefixed frame, for callers that outlive a failed connection.
+// Returns: 0 on success, -1 with errno set if the connection failed.
+int write_frame(int fd, const void *buf, size_t len)
+{
+    uint32_t nlen = htonl(len);
+    char frame[FRAME_HEADER_SIZE + SMALL_FRAME_SIZE];
+
+    // Small frames are copied behind their header and go out in one write. Larger ones are gathered
+    // from the header and the caller's buffer by one writev; either way the header and body are not
+    // split into two segments.
+    if (len <= SMALL_FRAME_SIZE)
+    {
+        memcpy(frame, &nlen, sizeof(nlen));
+        memcpy(frame + sizeof(nlen), buf, len);
+        return write_looped(fd, frame, sizeof(nlen) + len);
+    }
+
+    struct iovec parts[2] = {{&nlen, sizeof(nlen)}, {(void *)buf, len}};
+    struct iovec *part = parts;
+    int part_count = 2;
+    while (part_count > 0)
+    {
+        ssize_t sent = writev(fd, part, part_count);
+        if (sent == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent == -1)
+        {
+            return -1;
+        }
+        // Step past whatever went out; a short write resumes part way through a part.
+        while (part_count > 0 && (size_t)sent >= part->iov_len)
+        {
+            sent -= part->iov_len;
+            part++;
+            part_count--;
+        }
+        if (part_count > 0)
+        {
+            part->iov_base = (char *)part->iov_base + sent;
+            part->iov_len -= sent;
+        }
+    }
+    return 0;
 }
 
 char *receive_msg(int fd)
@@ -55,13 +132,189 @@ char *receive_msg(int fd)
     uint32_t nlen;
     recv_looped(fd, &nlen, sizeof(nlen));
     uint32_t len = ntohl(nlen);
+    if (len > DEFAULT_MAX_FRAME_SIZE)
+    {
+        fprintf(stderr, "receive_msg(): %u byte frame exceeds the %d byte limit\n", len, DEFAULT_MAX_FRAME_SIZE);
+        exit(EXIT_FAILURE);
+    }
 
     char *buf = malloc(len + 1);
+    if (buf == NULL)
+    {
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
     buf[len] = '\0';
     recv_looped(fd, buf, len);
     return buf;
 }
 
+// Function: Sets up a frame reader.
+// Arguments:
+// - reader: the reader to initialise.
+// - max_frame: the largest frame body accepted; larger frames are a protocol error.
+// Returns: 0 on success, -1 if the buffer could not be allocated.
+int frame_reader_init(frame_reader *reader, uint32_t max_frame)
+{
+    reader->capacity = FRAME_HEADER_SIZE + (size_t)max_frame;
+    reader->buf = malloc(reader->capacity + 1);
+    reader->start = 0;
+    reader->end = 0;
+    reader->max_frame = max_frame;
+    reader->terminator = SIZE_MAX;
+    return (reader->buf == NULL) ? -1 : 0;
+}
+
+// Function: Frees a frame reader's buffer. Frames it handed out are no longer valid.
+void frame_reader_destroy(frame_reader *reader)
+{
+    free(reader->buf);
+    reader->buf = NULL;
+}
+
+// Function: Puts back the byte overwritten by the last frame's NUL terminator.
+static void frame_reader_restore(frame_reader *reader)
+{
+    if (reader->terminator != SIZE_MAX)
+    {
+        reader->buf[reader->terminator] = reader->saved;
+        reader->terminator = SIZE_MAX;
+    }
+}
+
+// Function: Reclaims consumed bytes before new ones are added: all of them if everything has been
+// handed out, or by moving the partial frame left at the very end to the front.
+static void frame_reader_reclaim(frame_reader *reader)
+{
+    if (reader->start == reader->end)
+    {
+        reader->start = 0; // Everything consumed: start again at the front
+        reader->end = 0;
+    }
+    else if (reader->end == reader->capacity)
+    {
+        // A valid frame always fits in the buffer, so this makes room for the rest of it.
+        memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+}
+
+// Function: Reads as many bytes as are available (up to the free space) with a single read().
+// Frames handed out before this call are no longer valid. Call it only once frame_reader_next has
+// returned 0, so that the buffer is never full.
+// Arguments:
+// - reader: the connection's reader.
+// - fd: the connection.
+// Returns: the number of bytes read, 0 at end of file, or -1 with errno set (EAGAIN on a
+// non-blocking socket with nothing to read).
+ssize_t frame_reader_fill(frame_reader *reader, int fd)
+{
+    frame_reader_restore(reader);
+    frame_reader_reclaim(reader);
+
+    ssize_t received;
+    do
+    {
+        received = read(fd, reader->buf + reader->end, reader->capacity - reader->end);
+    } while (received == -1 && errno == EINTR);
+
+    if (received > 0)
+    {
+        reader->end += (size_t)received;
+    }
+    return received;
+}
+
+// Function: Adds bytes received some other way (into an io_uring buffer) as frame_reader_fill adds
+// what it reads. Frames handed out before this call are no longer valid.
+// Arguments:
+// - reader: the connection's reader.
+// - data: the bytes received.
+// - len: how many.
+// Returns: how many bytes were taken. Fewer than len means the buffer is full: hand out the frames
+// it holds with frame_reader_next, then add the rest.
+size_t frame_reader_append(frame_reader *reader, const char *data, size_t len)
+{
+    frame_reader_restore(reader);
+    frame_reader_reclaim(reader);
+
+    size_t space = reader->capacity - reader->end;
+    if (space < len && reader->start > 0)
+    {
+        memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+        space = reader->capacity - reader->end;
+    }
+
+    size_t taken = (len < space) ? len : space;
+    memcpy(reader->buf + reader->end, data, taken);
+    reader->end += taken;
+    return taken;
+}
+
+// Function: Hands out the next complete frame already in the buffer.
+// Arguments:
+// - reader: the connection's reader.
+// - frame: set to the frame body, which stays valid until the next fill.
+// - len: set to the body length.
+// Returns: 1 if a frame was handed out, 0 if more bytes are needed, -1 if the next frame is larger
+// than the reader's maximum.
+int frame_reader_next(frame_reader *reader, char **frame, uint32_t *len)
+{
+    frame_reader_restore(reader);
+
+    size_t available = reader->end - reader->start;
+    if (available < FRAME_HEADER_SIZE)
+    {
+        return 0;
+    }
+
+    uint32_t nlen;
+    memcpy(&nlen, reader->buf + reader->start, sizeof(nlen));
+    uint32_t body_length = ntohl(nlen);
+    if (body_length > reader->max_frame)
+    {
+        return -1;
+    }
+    if (available - FRAME_HEADER_SIZE < body_length)
+    {
+        return 0;
+    }
+
+    *frame = reader->buf + reader->start + FRAME_HEADER_SIZE;
+    *len = body_length;
+    reader->start += FRAME_HEADER_SIZE + body_length;
+
+    // NUL-terminate in place for the text protocol, remembering the byte underneath.
+    reader->terminator = reader->start;
+    reader->saved = reader->buf[reader->terminator];
+    reader->buf[reader->terminator] = '\0';
+    return 1;
+}
+
+// Function: Blocking helper for clients: returns the next frame, reading as needed.
+// Arguments: as frame_reader_next, plus the connection fd.
+// Returns: 1 if a frame was handed out, 0 at end of file, -1 on a read error or oversized frame.
+int frame_reader_read(frame_reader *reader, int fd, char **frame, uint32_t *len)
+{
+    for (;;)
+    {
+        int status = frame_reader_next(reader, frame, len);
+        if (status != 0)
+        {
+            return status;
+        }
+
+        ssize_t received = frame_reader_fill(reader, fd);
+        if (received <= 0)
+        {
+            return (int)received;
+        }
+    }
+}
+
 int establish_connection()
 {
     // Create a new socket for each request.
@@ -79,6 +332,13 @@ int establish_connection()
         exit(EXIT_FAILURE);
     }
 
+    // Messages are small and answered at once; do not hold them back waiting for an ACK.
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt_enable, sizeof(opt_enable)) == -1)
+    {
+        perror("setsockopt()");
+        exit(EXIT_FAILURE);
+    }
+
     // Setup socket address for server connection.
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
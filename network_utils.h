@@ -1,13 +1,44 @@
 #ifndef NETWORK_UTILS_H
 #define NETWORK_UTILS_H
 
-#include <stddef.h> // for size_t
+#include <stddef.h>    // for size_t
+#include <stdint.h>    // for uint32_t
+#include <sys/types.h> // for ssize_t
+
+#define FRAME_HEADER_SIZE 4
+#define DEFAULT_MAX_FRAME_SIZE 4096
+#define SMALL_FRAME_SIZE 256 // send_frame copies frames up to this size behind their header; larger ones go out with writev()
+
+// Buffered reader for length-prefixed frames on one connection. Each read() pulls in as many bytes as
+// are available, and complete frames are handed out in place, NUL-terminated, without being copied or
+// allocated. The buffer is reused for the life of the connection: consumed bytes are reclaimed when it
+// empties, and a partial frame left at the end is moved to the front once the end is reached.
+typedef struct
+{
+    char *buf;
+    size_t capacity;   // Usable bytes; one more is allocated for the NUL after a frame
+    size_t start;      // First byte not yet handed out
+    size_t end;        // One past the last byte received
+    uint32_t max_frame;
+    size_t terminator; // Where the last frame's NUL was written, or SIZE_MAX
+    char saved;        // The byte the NUL replaced
+} frame_reader;
 
 // Function declarations
 void recv_looped(int fd, void *buf, size_t sz);
 void send_looped(int fd, const void *buf, size_t sz);
+int write_looped(int fd, const void *buf, size_t sz);
 void send_message(int fd, const char *buf);
+void send_frame(int fd, const void *buf, size_t len);
+int write_frame(int fd, const void *buf, size_t len);
 char *receive_msg(int fd);
 int establish_connection();
 
+int frame_reader_init(frame_reader *reader, uint32_t max_frame);
+void frame_reader_destroy(frame_reader *reader);
+ssize_t frame_reader_fill(frame_reader *reader, int fd);
+size_t frame_reader_append(frame_reader *reader, const char *data, size_t len);
+int frame_reader_next(frame_reader *reader, char **frame, uint32_t *len);
+int frame_reader_read(frame_reader *reader, int fd, char **frame, uint32_t *len);
+
 #endif // NETWORK_UTILS_H
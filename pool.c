@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+// One thread's free list of one pool. Never freed, so a reader can walk a pool's caches at any time;
+// a thread that exits gives its objects back to the pool and leaves its counters.
+typedef struct pool_cache
+{
+    object_pool *pool;
+    pool_object *free_list;
+    uint64_t free_count;
+    uint64_t allocations; // Single writer: the owning thread
+    uint64_t frees;
+    struct pool_cache *next;
+} pool_cache;
+
+// Set before the first allocation to have every pool call malloc and free instead, for comparison in
+// benchmarks and so that leak and use-after-free checkers can see each object.
+int pool_use_malloc;
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static object_pool *registry[POOL_MAX_POOLS];
+static int registry_count;
+
+static __thread pool_cache *thread_caches[POOL_MAX_POOLS];
+static pthread_key_t exit_key;
+static pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+
+// Counters are only written by their own thread; a relaxed store keeps a concurrent reader from
+// seeing a torn value without costing a locked instruction.
+static void count(uint64_t *counter)
+{
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+// Function: gives a thread's cached objects back to their pools when it exits.
+static void return_thread_caches(void *arg)
+{
+    pool_cache **caches = arg;
+    for (int i = 0; i < POOL_MAX_POOLS; i++)
+    {
+        pool_cache *cache = caches[i];
+        if (cache == NULL || cache->free_list == NULL)
+        {
+            continue;
+        }
+        pool_object *last = cache->free_list;
+        while (last->next != NULL)
+        {
+            last = last->next;
+        }
+        object_pool *pool = cache->pool;
+        pthread_mutex_lock(&pool->mutex);
+        last->next = pool->free_list;
+        pool->free_list = cache->free_list;
+        pool->free_count += cache->free_count;
+        pthread_mutex_unlock(&pool->mutex);
+        cache->free_list = NULL;
+        cache->free_count = 0;
+    }
+}
+
+static void make_exit_key()
+{
+    pthread_key_create(&exit_key, return_thread_caches);
+}
+
+// Function: finds the calling thread's cache of a pool, registering the pool and creating the cache
+// on first use.
+// Returns: the cache, or NULL if it could not be allocated or there are too many pools.
+static pool_cache *thread_cache(object_pool *pool)
+{
+    int id = __atomic_load_n(&pool->id, __ATOMIC_ACQUIRE);
+    if (id == 0)
+    {
+        pthread_mutex_lock(&registry_mutex);
+        id = pool->id;
+        if (id == 0 && registry_count < POOL_MAX_POOLS)
+        {
+            registry[registry_count++] = pool;
+            id = registry_count;
+            __atomic_store_n(&pool->id, id, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&registry_mutex);
+        if (id == 0)
+        {
+            fprintf(stderr, "pool_alloc(): more than %d pools\n", POOL_MAX_POOLS);
+            return NULL;
+        }
+    }
+
+    pool_cache *cache = thread_caches[id - 1];
+    if (cache != NULL)
+    {
+        return cache;
+    }
+    cache = calloc(1, sizeof(pool_cache));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    cache->pool = pool;
+    pthread_mutex_lock(&pool->mutex);
+    cache->next = pool->caches;
+    pool->caches = cache;
+    pthread_mutex_unlock(&pool->mutex);
+    thread_caches[id - 1] = cache;
+
+    pthread_once(&exit_key_once, make_exit_key);
+    pthread_setspecific(exit_key, thread_caches);
+    return cache;
+}
+
+// Function: moves a batch of objects from the pool's global free list to a thread's, carving a new
+// slab first if the global list is empty.
+// Returns: 0 on success, -1 if a slab could not be allocated.
+static int refill(object_pool *pool, pool_cache *cache)
+{
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->free_list == NULL)
+    {
+        size_t per_slab = POOL_SLAB_BYTES / pool->object_size;
+        if (per_slab < POOL_BATCH)
+        {
+            per_slab = POOL_BATCH;
+        }
+        char *slab = malloc(per_slab * pool->object_size);
+        if (slab == NULL)
+        {
+            pthread_mutex_unlock(&pool->mutex);
+            perror("malloc()");
+            return -1;
+        }
+        for (size_t i = per_slab; i > 0; i--)
+        {
+            pool_object *object = (pool_object *)(slab + (i - 1) * pool->object_size);
+            object->next = pool->free_list;
+            pool->free_list = object;
+        }
+        pool->free_count += per_slab;
+        __atomic_store_n(&pool->capacity, pool->capacity + per_slab, __ATOMIC_RELAXED);
+    }
+
+    for (int i = 0; i < POOL_BATCH && pool->free_list != NULL; i++)
+    {
+        pool_object *object = pool->free_list;
+        pool->free_list = object->next;
+        pool->free_count--;
+        object->next = cache->free_list;
+        cache->free_list = object;
+        cache->free_count++;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return 0;
+}
+
+// Function: allocates an object from a pool.
+// Arguments: pool - the pool.
+// Returns: the object, uninitialised, or NULL if memory ran out.
+void *pool_alloc(object_pool *pool)
+{
+    if (pool_use_malloc)
+    {
+        return malloc(pool->object_size);
+    }
+
+    pool_cache *cache = thread_cache(pool);
+    if (cache == NULL || (cache->free_list == NULL && refill(pool, cache) == -1))
+    {
+        return NULL;
+    }
+    pool_object *object = cache->free_list;
+    cache->free_list = object->next;
+    cache->free_count--;
+    count(&cache->allocations);
+    return object;
+}
+
+// Function: returns an object to its pool, on any thread. A thread holding more than two batches
+// gives one back to the global list.
+// Arguments:
+// - pool: the pool it was allocated from.
+// - object: the object, or NULL.
+// Returns: void
+void pool_free(object_pool *pool, void *object)
+{
+    if (object == NULL)
+    {
+        return;
+    }
+    if (pool_use_malloc)
+    {
+        free(object);
+        return;
+    }
+
+    pool_cache *cache = thread_cache(pool);
+    if (cache == NULL)
+    {
+        return; // The object is lost to the pool, but stays valid memory
+    }
+    pool_object *freed = object;
+    freed->next = cache->free_list;
+    cache->free_list = freed;
+    cache->free_count++;
+    count(&cache->frees);
+
+    if (cache->free_count >= 2 * POOL_BATCH)
+    {
+        pool_object *first = cache->free_list;
+        pool_object *last = first;
+        for (int i = 1; i < POOL_BATCH; i++)
+        {
+            last = last->next;
+        }
+        cache->free_list = last->next;
+        cache->free_count -= POOL_BATCH;
+
+        pthread_mutex_lock(&pool->mutex);
+        last->next = pool->free_list;
+        pool->free_list = first;
+        pool->free_count += POOL_BATCH;
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+// Function: lists the pools used so far.
+// Arguments:
+// - pools: receives the pools.
+// - max_pools: room in pools.
+// Returns: how many were written.
+int pool_list(object_pool **pools, int max_pools)
+{
+    pthread_mutex_lock(&registry_mutex);
+    int count = (registry_count < max_pools) ? registry_count : max_pools;
+    memcpy(pools, registry, count * sizeof(object_pool *));
+    pthread_mutex_unlock(&registry_mutex);
+    return count;
+}
+
+// Function: reads a pool's occupancy, adding up every thread's counters. Allocations and frees made
+// while it runs may or may not be included.
+// Arguments:
+// - pool: the pool.
+// - stats: receives the occupancy.
+// Returns: void
+void pool_read_stats(object_pool *pool, pool_stats *stats)
+{
+    uint64_t allocations = 0;
+    uint64_t frees = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (pool_cache *cache = pool->caches; cache != NULL; cache = cache->next)
+    {
+        allocations += __atomic_load_n(&cache->allocations, __ATOMIC_RELAXED);
+        frees += __atomic_load_n(&cache->frees, __ATOMIC_RELAXED);
+    }
+    stats->capacity = pool->capacity;
+    stats->free_global = pool->free_count;
+    pthread_mutex_unlock(&pool->mutex);
+
+    stats->allocations = allocations;
+    stats->in_use = (allocations > frees) ? allocations - frees : 0;
+}
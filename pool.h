@@ -0,0 +1,65 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Fixed-size object pools for what the controller allocates per call and per car: stop queue nodes,
+// car nodes and the calls shards pass each other.
+//
+// Objects are carved from slabs (POOL_SLAB_BYTES each) and never go back to malloc. Every thread
+// keeps its own free list of each pool, so allocating and freeing is a few pointer moves with no lock
+// and no locked instruction. A thread that runs dry takes POOL_BATCH objects from the pool's global
+// free list, and one that collects twice that many gives a batch back, so objects freed on another
+// thread than the one that allocated them (a stop queued by one event loop and popped by another)
+// find their way back. Only the global list, and carving a new slab, take the pool's mutex.
+//
+// A pool is defined statically with POOL_INITIALIZER and registers itself on first use, so that the
+// controller's metrics can list every pool's occupancy (pool_list, pool_read_stats). Like metrics.h,
+// each thread's counters have a single writer and are added up when read.
+
+#define POOL_MAX_POOLS 16
+#define POOL_BATCH 32
+#define POOL_SLAB_BYTES 16384
+
+typedef struct pool_object
+{
+    struct pool_object *next;
+} pool_object;
+
+struct pool_cache;
+
+typedef struct
+{
+    const char *name;
+    size_t object_size;
+    int id; // 1 + the pool's index among registered pools; 0 until first used
+
+    // Protected by mutex.
+    pthread_mutex_t mutex;
+    pool_object *free_list;
+    uint64_t free_count;
+    uint64_t capacity;         // Objects carved from slabs
+    struct pool_cache *caches; // Every thread's cache, for pool_read_stats
+} object_pool;
+
+#define POOL_INITIALIZER(name, size) {(name), (size), 0, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, NULL}
+
+// A pool's occupancy, as read by pool_read_stats.
+typedef struct
+{
+    uint64_t capacity;    // Objects carved from slabs
+    uint64_t in_use;      // Allocated and not yet freed
+    uint64_t free_global; // On the pool's global free list; the rest are cached by threads
+    uint64_t allocations; // Since the process started
+} pool_stats;
+
+extern int pool_use_malloc;
+
+void *pool_alloc(object_pool *pool);
+void pool_free(object_pool *pool, void *object);
+int pool_list(object_pool **pools, int max_pools);
+void pool_read_stats(object_pool *pool, pool_stats *stats);
+
+#endif // POOL_H
@@ -0,0 +1,319 @@
+#include "protocol.h"
+#include <stddef.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+// Frames are decoded where they lie in a connection's read buffer, at any alignment, so decoders read
+// fields by offset with memcpy rather than through the frame structs.
+
+// Function: reads a byte of a received frame.
+static uint8_t read_u8(const void *frame, size_t offset)
+{
+    return ((const uint8_t *)frame)[offset];
+}
+
+// Function: reads a 16-bit field of a received frame, in host byte order.
+static uint16_t read_u16(const void *frame, size_t offset)
+{
+    uint16_t value;
+    memcpy(&value, (const uint8_t *)frame + offset, sizeof(value));
+    return ntohs(value);
+}
+
+// Function: reads a 32-bit field of a received frame, in host byte order.
+static uint32_t read_u32(const void *frame, size_t offset)
+{
+    uint32_t value;
+    memcpy(&value, (const uint8_t *)frame + offset, sizeof(value));
+    return ntohl(value);
+}
+
+// Function: checks whether a floor value received in binary is one the building has.
+static int is_valid_floor_value(floor_t floor)
+{
+    return floor >= FLOOR_LOWEST && floor <= FLOOR_HIGHEST && floor != 0;
+}
+
+// Function: checks whether a frame is a version 2 binary frame.
+// Returns: 1 if the frame starts with a version 2 header, else 0.
+int proto_is_binary(const void *frame, size_t len)
+{
+    return len >= sizeof(proto_header) && read_u8(frame, offsetof(proto_header, magic)) == PROTOCOL_MAGIC &&
+           read_u8(frame, offsetof(proto_header, version)) == PROTOCOL_VERSION;
+}
+
+// Function: reads a binary frame's type.
+// Returns: the proto_type, or -1 if the frame is not a version 2 frame.
+int proto_type_of(const void *frame, size_t len)
+{
+    if (!proto_is_binary(frame, len))
+    {
+        return -1;
+    }
+    return read_u8(frame, offsetof(proto_header, type));
+}
+
+// Function: fills in a frame header; frames with no payload (UNAVAILABLE, EMERGENCY, ...) are just this.
+// Returns: the size of the header.
+size_t proto_encode_header(proto_header *frame, proto_type type)
+{
+    frame->magic = PROTOCOL_MAGIC;
+    frame->version = PROTOCOL_VERSION;
+    frame->type = (uint8_t)type;
+    frame->reserved = 0;
+    return sizeof(proto_header);
+}
+
+// Function: encodes a CAR frame.
+// Returns: the frame size.
+size_t proto_encode_car(proto_car *frame, const char *name, floor_t lowest_floor, floor_t highest_floor, uint32_t delay_ms)
+{
+    proto_encode_header(&frame->header, PROTO_CAR);
+    frame->lowest_floor = (int16_t)htons((uint16_t)lowest_floor);
+    frame->highest_floor = (int16_t)htons((uint16_t)highest_floor);
+    frame->delay_ms = htonl(delay_ms);
+    memset(frame->name, 0, sizeof(frame->name));
+    strncpy(frame->name, name, sizeof(frame->name) - 1);
+    return sizeof(proto_car);
+}
+
+// Function: encodes a STATUS frame.
+// Returns: the frame size.
+size_t proto_encode_status(proto_status *frame, car_status status, floor_t current_floor, floor_t destination_floor)
+{
+    proto_encode_header(&frame->header, PROTO_STATUS);
+    frame->status = (uint8_t)status;
+    frame->reserved = 0;
+    frame->current_floor = (int16_t)htons((uint16_t)current_floor);
+    frame->destination_floor = (int16_t)htons((uint16_t)destination_floor);
+    return sizeof(proto_status);
+}
+
+// Function: encodes a STATUS_UPDATE frame carrying only the given fields' values.
+// Arguments: fields - PROTO_FIELD_* bits; 0 makes a heartbeat. The other values are not sent.
+// Returns: the frame size.
+size_t proto_encode_status_update(proto_status_update *frame, uint8_t fields, car_status status, floor_t current_floor, floor_t destination_floor)
+{
+    proto_encode_header(&frame->header, PROTO_STATUS_UPDATE);
+    frame->fields = fields;
+    uint8_t *value = frame->values;
+    if (fields & PROTO_FIELD_STATUS)
+    {
+        *value++ = (uint8_t)status;
+    }
+    if (fields & PROTO_FIELD_CURRENT)
+    {
+        uint16_t floor = htons((uint16_t)current_floor);
+        memcpy(value, &floor, sizeof(floor));
+        value += sizeof(floor);
+    }
+    if (fields & PROTO_FIELD_DESTINATION)
+    {
+        uint16_t floor = htons((uint16_t)destination_floor);
+        memcpy(value, &floor, sizeof(floor));
+        value += sizeof(floor);
+    }
+    return (size_t)(value - (uint8_t *)frame);
+}
+
+// Function: encodes a CALL frame.
+// Returns: the frame size.
+size_t proto_encode_call(proto_call *frame, floor_t source_floor, floor_t destination_floor)
+{
+    proto_encode_header(&frame->header, PROTO_CALL);
+    frame->source_floor = (int16_t)htons((uint16_t)source_floor);
+    frame->destination_floor = (int16_t)htons((uint16_t)destination_floor);
+    return sizeof(proto_call);
+}
+
+// Function: encodes a FLOOR frame.
+// Returns: the frame size.
+size_t proto_encode_floor(proto_floor *frame, floor_t floor)
+{
+    proto_encode_header(&frame->header, PROTO_FLOOR);
+    frame->floor = (int16_t)htons((uint16_t)floor);
+    frame->reserved = 0;
+    return sizeof(proto_floor);
+}
+
+// Function: fills in one call of a CALL_BATCH frame.
+void proto_encode_call_entry(proto_call_entry *entry, uint32_t request_id, floor_t source_floor, floor_t destination_floor)
+{
+    entry->request_id = htonl(request_id);
+    entry->source_floor = (int16_t)htons((uint16_t)source_floor);
+    entry->destination_floor = (int16_t)htons((uint16_t)destination_floor);
+}
+
+// Function: encodes a CALL_BATCH frame whose first count entries are already filled in.
+// Returns: the frame size, which covers only those entries.
+size_t proto_encode_call_batch(proto_call_batch *frame, uint16_t count)
+{
+    proto_encode_header(&frame->header, PROTO_CALL_BATCH);
+    frame->count = htons(count);
+    frame->reserved = 0;
+    return offsetof(proto_call_batch, calls) + count * sizeof(proto_call_entry);
+}
+
+// Function: encodes an ASSIGNMENT frame.
+// Arguments: name is the assigned car, or NULL when no car is available.
+// Returns: the frame size.
+size_t proto_encode_assignment(proto_assignment *frame, uint32_t request_id, const char *name)
+{
+    proto_encode_header(&frame->header, PROTO_ASSIGNMENT);
+    frame->request_id = htonl(request_id);
+    memset(frame->name, 0, sizeof(frame->name));
+    if (name != NULL)
+    {
+        strncpy(frame->name, name, sizeof(frame->name) - 1);
+    }
+    return sizeof(proto_assignment);
+}
+
+// Function: decodes a CAR frame.
+// Arguments: name must hold PROTOCOL_MAX_NAME bytes.
+// Returns: 1 if the frame is a well-formed CAR frame, else 0.
+int proto_decode_car(const void *frame, size_t len, char *name, floor_t *lowest_floor, floor_t *highest_floor, uint32_t *delay_ms)
+{
+    if (len != sizeof(proto_car) || proto_type_of(frame, len) != PROTO_CAR)
+    {
+        return 0;
+    }
+
+    memcpy(name, (const uint8_t *)frame + offsetof(proto_car, name), PROTOCOL_MAX_NAME);
+    name[PROTOCOL_MAX_NAME - 1] = '\0';
+    *lowest_floor = (floor_t)read_u16(frame, offsetof(proto_car, lowest_floor));
+    *highest_floor = (floor_t)read_u16(frame, offsetof(proto_car, highest_floor));
+    *delay_ms = read_u32(frame, offsetof(proto_car, delay_ms));
+    return is_valid_floor_value(*lowest_floor) && is_valid_floor_value(*highest_floor);
+}
+
+// Function: decodes a STATUS frame.
+// Returns: 1 if the frame is a well-formed STATUS frame, else 0.
+int proto_decode_status(const void *frame, size_t len, car_status *status, floor_t *current_floor, floor_t *destination_floor)
+{
+    if (len != sizeof(proto_status) || proto_type_of(frame, len) != PROTO_STATUS ||
+        read_u8(frame, offsetof(proto_status, status)) >= CAR_STATUS_INVALID)
+    {
+        return 0;
+    }
+
+    *status = (car_status)read_u8(frame, offsetof(proto_status, status));
+    *current_floor = (floor_t)read_u16(frame, offsetof(proto_status, current_floor));
+    *destination_floor = (floor_t)read_u16(frame, offsetof(proto_status, destination_floor));
+    return is_valid_floor_value(*current_floor) && is_valid_floor_value(*destination_floor);
+}
+
+// Function: decodes a STATUS_UPDATE frame. Only the values of the fields it carries are set.
+// Returns: 1 if the frame is a well-formed STATUS_UPDATE frame, else 0.
+int proto_decode_status_update(const void *frame, size_t len, uint8_t *fields, car_status *status, floor_t *current_floor, floor_t *destination_floor)
+{
+    if (len < offsetof(proto_status_update, values) || proto_type_of(frame, len) != PROTO_STATUS_UPDATE ||
+        (read_u8(frame, offsetof(proto_status_update, fields)) & ~PROTO_FIELDS_ALL) != 0)
+    {
+        return 0;
+    }
+
+    *fields = read_u8(frame, offsetof(proto_status_update, fields));
+    size_t expected = offsetof(proto_status_update, values) + ((*fields & PROTO_FIELD_STATUS) ? 1 : 0) +
+                      ((*fields & PROTO_FIELD_CURRENT) ? 2 : 0) + ((*fields & PROTO_FIELD_DESTINATION) ? 2 : 0);
+    if (len != expected)
+    {
+        return 0;
+    }
+
+    size_t value = offsetof(proto_status_update, values);
+    if (*fields & PROTO_FIELD_STATUS)
+    {
+        if (read_u8(frame, value) >= CAR_STATUS_INVALID)
+        {
+            return 0;
+        }
+        *status = (car_status)read_u8(frame, value++);
+    }
+    if (*fields & PROTO_FIELD_CURRENT)
+    {
+        *current_floor = (floor_t)read_u16(frame, value);
+        value += sizeof(uint16_t);
+        if (!is_valid_floor_value(*current_floor))
+        {
+            return 0;
+        }
+    }
+    if (*fields & PROTO_FIELD_DESTINATION)
+    {
+        *destination_floor = (floor_t)read_u16(frame, value);
+        if (!is_valid_floor_value(*destination_floor))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function: decodes a CALL frame.
+// Returns: 1 if the frame is a well-formed CALL frame, else 0.
+int proto_decode_call(const void *frame, size_t len, floor_t *source_floor, floor_t *destination_floor)
+{
+    if (len != sizeof(proto_call) || proto_type_of(frame, len) != PROTO_CALL)
+    {
+        return 0;
+    }
+
+    *source_floor = (floor_t)read_u16(frame, offsetof(proto_call, source_floor));
+    *destination_floor = (floor_t)read_u16(frame, offsetof(proto_call, destination_floor));
+    return is_valid_floor_value(*source_floor) && is_valid_floor_value(*destination_floor);
+}
+
+// Function: decodes a FLOOR frame.
+// Returns: 1 if the frame is a well-formed FLOOR frame, else 0.
+int proto_decode_floor(const void *frame, size_t len, floor_t *floor)
+{
+    if (len != sizeof(proto_floor) || proto_type_of(frame, len) != PROTO_FLOOR)
+    {
+        return 0;
+    }
+
+    *floor = (floor_t)read_u16(frame, offsetof(proto_floor, floor));
+    return is_valid_floor_value(*floor);
+}
+
+// Function: checks a CALL_BATCH frame; its entries are then read with proto_decode_call_entry.
+// Returns: 1 if the frame is a well-formed CALL_BATCH frame, else 0.
+int proto_decode_call_batch(const void *frame, size_t len, uint16_t *count)
+{
+    if (len < offsetof(proto_call_batch, calls) || proto_type_of(frame, len) != PROTO_CALL_BATCH)
+    {
+        return 0;
+    }
+
+    *count = read_u16(frame, offsetof(proto_call_batch, count));
+    return *count <= PROTOCOL_MAX_BATCH && len == offsetof(proto_call_batch, calls) + *count * sizeof(proto_call_entry);
+}
+
+// Function: decodes one call of a CALL_BATCH frame already checked by proto_decode_call_batch.
+// Arguments: index - the call's position in the batch, below its count.
+// Returns: 1 if both floors are valid, else 0 (the request ID is decoded either way).
+int proto_decode_call_entry(const void *frame, uint16_t index, uint32_t *request_id, floor_t *source_floor, floor_t *destination_floor)
+{
+    size_t entry = offsetof(proto_call_batch, calls) + index * sizeof(proto_call_entry);
+    *request_id = read_u32(frame, entry + offsetof(proto_call_entry, request_id));
+    *source_floor = (floor_t)read_u16(frame, entry + offsetof(proto_call_entry, source_floor));
+    *destination_floor = (floor_t)read_u16(frame, entry + offsetof(proto_call_entry, destination_floor));
+    return is_valid_floor_value(*source_floor) && is_valid_floor_value(*destination_floor);
+}
+
+// Function: decodes an ASSIGNMENT frame.
+// Arguments: name must hold PROTOCOL_MAX_NAME bytes; it is set to "" when no car is available.
+// Returns: 1 if the frame is a well-formed ASSIGNMENT frame, else 0.
+int proto_decode_assignment(const void *frame, size_t len, uint32_t *request_id, char *name)
+{
+    if (len != sizeof(proto_assignment) || proto_type_of(frame, len) != PROTO_ASSIGNMENT)
+    {
+        return 0;
+    }
+
+    *request_id = read_u32(frame, offsetof(proto_assignment, request_id));
+    memcpy(name, (const uint8_t *)frame + offsetof(proto_assignment, name), PROTOCOL_MAX_NAME);
+    name[PROTOCOL_MAX_NAME - 1] = '\0';
+    return 1;
+}
@@ -0,0 +1,147 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+
+// Binary wire protocol, version 2.
+//
+// Frames use the same 32-bit length prefix as the text protocol, but the body is a fixed-size
+// struct starting with a proto_header. The header's first byte is PROTOCOL_MAGIC, which is never the
+// first byte of a text message, so the first frame a client sends decides the protocol for the whole
+// connection: text clients keep working and binary clients are answered in binary.
+//
+// Multi-byte fields are in network byte order. Floors are floor_t values and statuses car_status
+// values. Received frames may sit at any alignment, so the decoders read them by field offset and
+// never through these structs.
+
+#define PROTOCOL_MAGIC 0xE7
+#define PROTOCOL_VERSION 2
+#define PROTOCOL_TEXT 1
+#define PROTOCOL_MAX_NAME 100
+#define PROTOCOL_MAX_BATCH 256 // Calls in one CALL_BATCH frame
+
+typedef enum
+{
+    PROTO_CAR = 1,            // Car registration, or the car assigned to a call
+    PROTO_STATUS = 2,
+    PROTO_CALL = 3,
+    PROTO_FLOOR = 4,
+    PROTO_UNAVAILABLE = 5,
+    PROTO_EMERGENCY = 6,
+    PROTO_INDIVIDUAL_SERVICE = 7,
+    PROTO_CALL_BATCH = 8,     // Several calls in one frame, each with a request ID
+    PROTO_ASSIGNMENT = 9,     // The answer to one call of a batch, in the batch's order
+    PROTO_STATUS_UPDATE = 10  // The STATUS fields that changed since the last report; none is a heartbeat
+} proto_type;
+
+// Fields carried by a STATUS_UPDATE frame, whose values follow in this order.
+#define PROTO_FIELD_STATUS 0x01      // 1 byte
+#define PROTO_FIELD_CURRENT 0x02     // 2 bytes
+#define PROTO_FIELD_DESTINATION 0x04 // 2 bytes
+#define PROTO_FIELDS_ALL (PROTO_FIELD_STATUS | PROTO_FIELD_CURRENT | PROTO_FIELD_DESTINATION)
+
+typedef struct
+{
+    uint8_t magic;
+    uint8_t version;
+    uint8_t type;
+    uint8_t reserved;
+} proto_header;
+
+typedef struct
+{
+    proto_header header;
+    int16_t lowest_floor;
+    int16_t highest_floor;
+    uint32_t delay_ms;
+    char name[PROTOCOL_MAX_NAME]; // NUL-padded
+} proto_car;
+
+typedef struct
+{
+    proto_header header;
+    uint8_t status;
+    uint8_t reserved;
+    int16_t current_floor;
+    int16_t destination_floor;
+} proto_status;
+
+// Only the values of the fields set are sent, packed: 5 to 10 bytes.
+typedef struct
+{
+    proto_header header;
+    uint8_t fields; // PROTO_FIELD_* bits
+    uint8_t values[5];
+} proto_status_update;
+
+typedef struct
+{
+    proto_header header;
+    int16_t source_floor;
+    int16_t destination_floor;
+} proto_call;
+
+typedef struct
+{
+    proto_header header;
+    int16_t floor;
+    uint16_t reserved;
+} proto_floor;
+
+typedef struct
+{
+    uint32_t request_id; // Chosen by the call pad, echoed in the ASSIGNMENT
+    int16_t source_floor;
+    int16_t destination_floor;
+} proto_call_entry;
+
+// Only the first count entries are sent.
+typedef struct
+{
+    proto_header header;
+    uint16_t count;
+    uint16_t reserved;
+    proto_call_entry calls[PROTOCOL_MAX_BATCH];
+} proto_call_batch;
+
+typedef struct
+{
+    proto_header header;
+    uint32_t request_id;
+    char name[PROTOCOL_MAX_NAME]; // The assigned car, or empty when no car is available
+} proto_assignment;
+
+_Static_assert(sizeof(proto_header) == 4, "proto_header layout");
+_Static_assert(sizeof(proto_car) == 112, "proto_car layout");
+_Static_assert(sizeof(proto_status) == 10, "proto_status layout");
+_Static_assert(sizeof(proto_status_update) == 10, "proto_status_update layout");
+_Static_assert(sizeof(proto_call) == 8, "proto_call layout");
+_Static_assert(sizeof(proto_floor) == 8, "proto_floor layout");
+_Static_assert(sizeof(proto_call_entry) == 8, "proto_call_entry layout");
+_Static_assert(sizeof(proto_assignment) == 108, "proto_assignment layout");
+
+int proto_is_binary(const void *frame, size_t len);
+int proto_type_of(const void *frame, size_t len);
+
+size_t proto_encode_header(proto_header *frame, proto_type type);
+size_t proto_encode_car(proto_car *frame, const char *name, floor_t lowest_floor, floor_t highest_floor, uint32_t delay_ms);
+size_t proto_encode_status(proto_status *frame, car_status status, floor_t current_floor, floor_t destination_floor);
+size_t proto_encode_status_update(proto_status_update *frame, uint8_t fields, car_status status, floor_t current_floor, floor_t destination_floor);
+size_t proto_encode_call(proto_call *frame, floor_t source_floor, floor_t destination_floor);
+size_t proto_encode_floor(proto_floor *frame, floor_t floor);
+void proto_encode_call_entry(proto_call_entry *entry, uint32_t request_id, floor_t source_floor, floor_t destination_floor);
+size_t proto_encode_call_batch(proto_call_batch *frame, uint16_t count);
+size_t proto_encode_assignment(proto_assignment *frame, uint32_t request_id, const char *name);
+
+int proto_decode_car(const void *frame, size_t len, char *name, floor_t *lowest_floor, floor_t *highest_floor, uint32_t *delay_ms);
+int proto_decode_status(const void *frame, size_t len, car_status *status, floor_t *current_floor, floor_t *destination_floor);
+int proto_decode_status_update(const void *frame, size_t len, uint8_t *fields, car_status *status, floor_t *current_floor, floor_t *destination_floor);
+int proto_decode_call(const void *frame, size_t len, floor_t *source_floor, floor_t *destination_floor);
+int proto_decode_floor(const void *frame, size_t len, floor_t *floor);
+int proto_decode_call_batch(const void *frame, size_t len, uint16_t *count);
+int proto_decode_call_entry(const void *frame, uint16_t index, uint32_t *request_id, floor_t *source_floor, floor_t *destination_floor);
+int proto_decode_assignment(const void *frame, size_t len, uint32_t *request_id, char *name);
+
+#endif // PROTOCOL_H
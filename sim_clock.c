@@ -0,0 +1,314 @@
+#include "sim_clock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Function: orders two queued events by time, then by the order they were queued.
+static int event_before(sim_clock *clock, int a, int b)
+{
+    const sim_clock_event *x = &clock->events[a];
+    const sim_clock_event *y = &clock->events[b];
+    return x->time_us < y->time_us || (x->time_us == y->time_us && x->sequence < y->sequence);
+}
+
+static void heap_swap(sim_clock *clock, int i, int j)
+{
+    int event = clock->heap[i];
+    clock->heap[i] = clock->heap[j];
+    clock->heap[j] = event;
+    clock->events[clock->heap[i]].heap_position = i;
+    clock->events[clock->heap[j]].heap_position = j;
+}
+
+static void heap_sift_up(sim_clock *clock, int i)
+{
+    while (i > 0 && event_before(clock, clock->heap[i], clock->heap[(i - 1) / 2]))
+    {
+        heap_swap(clock, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void heap_sift_down(sim_clock *clock, int i)
+{
+    for (;;)
+    {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < clock->heap_length && event_before(clock, clock->heap[left], clock->heap[smallest]))
+        {
+            smallest = left;
+        }
+        if (right < clock->heap_length && event_before(clock, clock->heap[right], clock->heap[smallest]))
+        {
+            smallest = right;
+        }
+        if (smallest == i)
+        {
+            return;
+        }
+        heap_swap(clock, i, smallest);
+        i = smallest;
+    }
+}
+
+// Function: takes an event out of the queue, wherever it is.
+static void heap_remove(sim_clock *clock, int event)
+{
+    int position = clock->events[event].heap_position;
+    clock->heap_length--;
+    if (position != clock->heap_length)
+    {
+        heap_swap(clock, position, clock->heap_length);
+        heap_sift_up(clock, position);
+        heap_sift_down(clock, clock->events[clock->heap[position]].heap_position);
+    }
+    clock->events[event].heap_position = -1;
+}
+
+// Function: changes a participant's busy flag, keeping the busy count in step. Mutex held.
+static void set_participant_busy(sim_clock *clock, int participant, int busy)
+{
+    if (clock->participants[participant].busy != busy)
+    {
+        clock->participants[participant].busy = busy;
+        clock->busy += busy ? 1 : -1;
+    }
+    clock->generation++;
+    pthread_cond_broadcast(&clock->cond);
+}
+
+// Function: opens the named clock, creating it if this is the first participant.
+// Arguments:
+// - name: the shared memory name, e.g. "/simclock".
+// - participant: set to this participant's slot, used in every other call.
+// Returns: the mapped clock. The participant starts out busy.
+sim_clock *sim_clock_join(const char *name, int *participant)
+{
+    int created = 1;
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0666);
+    if (fd == -1 && errno == EEXIST)
+    {
+        created = 0;
+        fd = shm_open(name, O_RDWR, 0666);
+    }
+    if (fd == -1)
+    {
+        perror("shm_open()");
+        exit(EXIT_FAILURE);
+    }
+
+    if (created && ftruncate(fd, sizeof(sim_clock)) == -1)
+    {
+        perror("ftruncate()");
+        exit(EXIT_FAILURE);
+    }
+
+    // A participant starting at the same moment as the creator waits for the segment to be sized.
+    struct stat info;
+    while (fstat(fd, &info) == 0 && (size_t)info.st_size < sizeof(sim_clock))
+    {
+        usleep(1000);
+    }
+
+    sim_clock *clock = mmap(0, sizeof(sim_clock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (clock == MAP_FAILED)
+    {
+        perror("mmap()");
+        exit(EXIT_FAILURE);
+    }
+
+    if (created)
+    {
+        pthread_mutexattr_t mutattr;
+        pthread_mutexattr_init(&mutattr);
+        pthread_mutexattr_setpshared(&mutattr, PTHREAD_PROCESS_SHARED);
+        pthread_mutex_init(&clock->mutex, &mutattr);
+        pthread_mutexattr_destroy(&mutattr);
+
+        pthread_condattr_t condattr;
+        pthread_condattr_init(&condattr);
+        pthread_condattr_setpshared(&condattr, PTHREAD_PROCESS_SHARED);
+        pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+        pthread_cond_init(&clock->cond, &condattr);
+        pthread_condattr_destroy(&condattr);
+
+        for (int i = 0; i < SIM_CLOCK_MAX_EVENTS; i++)
+        {
+            clock->events[i].heap_position = -1;
+        }
+        __atomic_store_n(&clock->magic, SIM_CLOCK_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    while (__atomic_load_n(&clock->magic, __ATOMIC_ACQUIRE) != SIM_CLOCK_MAGIC)
+    {
+        usleep(1000);
+    }
+
+    pthread_mutex_lock(&clock->mutex);
+    int slot = 0;
+    while (slot < SIM_CLOCK_MAX_PARTICIPANTS && clock->participants[slot].in_use)
+    {
+        slot++;
+    }
+    if (slot == SIM_CLOCK_MAX_PARTICIPANTS)
+    {
+        pthread_mutex_unlock(&clock->mutex);
+        fprintf(stderr, "sim_clock_join(): more than %d participants\n", SIM_CLOCK_MAX_PARTICIPANTS);
+        exit(EXIT_FAILURE);
+    }
+    clock->participants[slot].in_use = 1;
+    clock->participants[slot].sleeping_event = -1;
+    clock->participant_count++;
+    set_participant_busy(clock, slot, 1);
+    pthread_mutex_unlock(&clock->mutex);
+
+    *participant = slot;
+    return clock;
+}
+
+// Function: leaves the clock, dropping any event the participant was waiting for. The last
+// participant out removes the clock, so the next run starts again at zero.
+void sim_clock_leave(sim_clock *clock, const char *name, int participant)
+{
+    pthread_mutex_lock(&clock->mutex);
+    int event = clock->participants[participant].sleeping_event;
+    if (event != -1 && !clock->events[event].fired)
+    {
+        heap_remove(clock, event);
+        clock->events[event].fired = 1;
+        clock->events[event].interrupted = 1;
+    }
+    set_participant_busy(clock, participant, 0);
+    clock->participants[participant].in_use = 0;
+    clock->participant_count--;
+    int last = clock->participant_count == 0;
+    pthread_mutex_unlock(&clock->mutex);
+
+    munmap(clock, sizeof(sim_clock));
+    if (last)
+    {
+        shm_unlink(name);
+    }
+}
+
+// Function: reads the simulated time.
+// Returns: microseconds since the clock was created.
+uint64_t sim_clock_now(sim_clock *clock)
+{
+    pthread_mutex_lock(&clock->mutex);
+    uint64_t now = clock->now_us;
+    pthread_mutex_unlock(&clock->mutex);
+    return now;
+}
+
+// Function: waits for delay_us of simulated time. While every participant is waiting, this is also
+// where the clock is moved on to the earliest event.
+// Arguments:
+// - clock: the shared clock.
+// - participant: the caller's slot; it counts as waiting until the delay ends.
+// - delay_us: how long to wait.
+// Returns: 1 if the full delay passed, 0 if it was interrupted.
+int sim_clock_sleep(sim_clock *clock, int participant, uint64_t delay_us)
+{
+    pthread_mutex_lock(&clock->mutex);
+
+    int event = 0;
+    while (event < SIM_CLOCK_MAX_EVENTS && clock->events[event].in_use)
+    {
+        event++;
+    }
+    if (event == SIM_CLOCK_MAX_EVENTS)
+    {
+        pthread_mutex_unlock(&clock->mutex);
+        fprintf(stderr, "sim_clock_sleep(): more than %d events queued\n", SIM_CLOCK_MAX_EVENTS);
+        exit(EXIT_FAILURE);
+    }
+
+    sim_clock_event *queued = &clock->events[event];
+    queued->in_use = 1;
+    queued->fired = 0;
+    queued->interrupted = 0;
+    queued->time_us = clock->now_us + delay_us;
+    queued->sequence = clock->next_sequence++;
+    queued->heap_position = clock->heap_length;
+    clock->heap[clock->heap_length++] = event;
+    heap_sift_up(clock, queued->heap_position);
+    clock->participants[participant].sleeping_event = event;
+    set_participant_busy(clock, participant, 0);
+
+    while (!queued->fired)
+    {
+        if (clock->busy > 0 || clock->heap_length == 0)
+        {
+            pthread_cond_wait(&clock->cond, &clock->mutex);
+            continue;
+        }
+
+        // Everyone is waiting. Let in-flight messages settle, then move time on if nothing stirred.
+        uint64_t generation = clock->generation;
+        struct timespec settle;
+        clock_gettime(CLOCK_MONOTONIC, &settle);
+        settle.tv_nsec += SIM_CLOCK_SETTLE_US * 1000;
+        if (settle.tv_nsec >= 1000000000)
+        {
+            settle.tv_sec += 1;
+            settle.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&clock->cond, &clock->mutex, &settle);
+
+        if (!queued->fired && clock->busy == 0 && clock->heap_length > 0 && clock->generation == generation)
+        {
+            int next = clock->heap[0];
+            heap_remove(clock, next);
+            if (clock->events[next].time_us > clock->now_us)
+            {
+                clock->now_us = clock->events[next].time_us;
+            }
+            clock->events[next].fired = 1;
+            clock->generation++;
+            pthread_cond_broadcast(&clock->cond);
+        }
+    }
+
+    int completed = !queued->interrupted;
+    queued->in_use = 0;
+    clock->participants[participant].sleeping_event = -1;
+    set_participant_busy(clock, participant, 1);
+    pthread_mutex_unlock(&clock->mutex);
+    return completed;
+}
+
+// Function: ends a participant's sim_clock_sleep early, at the current simulated time. Nothing
+// happens if it is not sleeping.
+void sim_clock_interrupt(sim_clock *clock, int participant)
+{
+    pthread_mutex_lock(&clock->mutex);
+    int event = clock->participants[participant].sleeping_event;
+    if (event != -1 && !clock->events[event].fired)
+    {
+        heap_remove(clock, event);
+        clock->events[event].fired = 1;
+        clock->events[event].interrupted = 1;
+        clock->generation++;
+        pthread_cond_broadcast(&clock->cond);
+    }
+    pthread_mutex_unlock(&clock->mutex);
+}
+
+// Function: marks a participant as running (1) or waiting for outside input (0). Time can only
+// move while nobody is running.
+void sim_clock_set_busy(sim_clock *clock, int participant, int busy)
+{
+    pthread_mutex_lock(&clock->mutex);
+    set_participant_busy(clock, participant, busy);
+    pthread_mutex_unlock(&clock->mutex);
+}
@@ -0,0 +1,63 @@
+#ifndef SIM_CLOCK_H
+#define SIM_CLOCK_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+// Simulated clock shared by car processes through POSIX shared memory.
+//
+// Instead of sleeping, a participant that has to wait puts an event (wake-up time, sequence number)
+// into the clock's queue. Time only moves when no participant is busy: the clock then jumps straight
+// to the earliest queued event and wakes its owner. Events with equal times fire in the order they
+// were queued, so a run replays in the same order however fast the machine is.
+//
+// Messages between processes (a STATUS to the controller and the FLOOR that answers it) are not
+// events. Before advancing, the clock waits SIM_CLOCK_SETTLE_US of real time with nobody busy, which
+// gives a round trip through the controller time to land and make its car busy again.
+
+#define SIM_CLOCK_MAGIC 0x53494D43 // "SIMC"
+#define SIM_CLOCK_MAX_EVENTS 256
+#define SIM_CLOCK_MAX_PARTICIPANTS 64
+#define SIM_CLOCK_SETTLE_US 200
+
+typedef struct
+{
+    uint64_t time_us;
+    uint64_t sequence;
+    int in_use;
+    int fired;
+    int interrupted;
+    int heap_position; // -1 when not queued
+} sim_clock_event;
+
+typedef struct
+{
+    int in_use;
+    int busy;
+    int sleeping_event; // The event this participant is waiting for, or -1
+} sim_clock_participant;
+
+typedef struct
+{
+    uint32_t magic;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        // Broadcast whenever anything below changes
+    uint64_t now_us;            // Simulated time since the clock was created
+    uint64_t next_sequence;
+    uint64_t generation;        // Bumped on every change, so a settling waiter can tell it was disturbed
+    int participant_count;
+    int busy;                   // Participants that are running rather than waiting
+    sim_clock_participant participants[SIM_CLOCK_MAX_PARTICIPANTS];
+    int heap_length;
+    int heap[SIM_CLOCK_MAX_EVENTS]; // Event indexes, earliest (time, sequence) first
+    sim_clock_event events[SIM_CLOCK_MAX_EVENTS];
+} sim_clock;
+
+sim_clock *sim_clock_join(const char *name, int *participant);
+void sim_clock_leave(sim_clock *clock, const char *name, int participant);
+uint64_t sim_clock_now(sim_clock *clock);
+int sim_clock_sleep(sim_clock *clock, int participant, uint64_t delay_us);
+void sim_clock_interrupt(sim_clock *clock, int participant);
+void sim_clock_set_busy(sim_clock *clock, int participant, int busy);
+
+#endif // SIM_CLOCK_H
@@ -0,0 +1,618 @@
+#include "stop_queue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+#define LAST_BIT (STOP_QUEUE_FLOORS - 1)
+#define CYCLE (2L * STOP_QUEUE_FLOORS) // Places round the sweep order, see cycle_index
+
+static object_pool stop_call_pool = POOL_INITIALIZER("stop_call", sizeof(stop_call));
+
+// Function: finds the lowest floor of a set in a range: the rest of the first word, then the next
+// word in use.
+// Arguments:
+// - set: the floors.
+// - from, to: the range of bits, inclusive; empty if from > to.
+// Returns: the bit, or -1 if none is set.
+static int first_set(const floor_set *set, int from, int to)
+{
+    if (from < 0)
+    {
+        from = 0;
+    }
+    if (to > LAST_BIT)
+    {
+        to = LAST_BIT;
+    }
+    if (from > to)
+    {
+        return -1;
+    }
+
+    int word = from / 64;
+    uint64_t mask = set->words[word] & (~0ULL << (from % 64));
+    if (mask == 0)
+    {
+        uint32_t later = set->used & (~1U << word);
+        if (later == 0)
+        {
+            return -1;
+        }
+        word = __builtin_ctz(later);
+        mask = set->words[word];
+    }
+    int found = word * 64 + __builtin_ctzll(mask);
+    return (found <= to) ? found : -1;
+}
+
+// Function: finds the highest floor of a set in a range.
+// Arguments: as first_set.
+// Returns: the bit, or -1 if none is set.
+static int last_set(const floor_set *set, int from, int to)
+{
+    if (from < 0)
+    {
+        from = 0;
+    }
+    if (to > LAST_BIT)
+    {
+        to = LAST_BIT;
+    }
+    if (from > to)
+    {
+        return -1;
+    }
+
+    int word = to / 64;
+    uint64_t mask = set->words[word] & ((to % 64 == 63) ? ~0ULL : (1ULL << (to % 64 + 1)) - 1);
+    if (mask == 0)
+    {
+        uint32_t earlier = set->used & ((1U << word) - 1);
+        if (earlier == 0)
+        {
+            return -1;
+        }
+        word = 31 - __builtin_clz(earlier);
+        mask = set->words[word];
+    }
+    int found = word * 64 + 63 - __builtin_clzll(mask);
+    return (found >= from) ? found : -1;
+}
+
+// Function: picks the stop a car serves next from a floor, in LOOK order: the nearest stop ahead in
+// the sweep's direction; at the end of the sweep, the furthest stop of the other direction (the car
+// turns there); failing that, the furthest stop of the same direction behind it.
+// Arguments:
+// - up, down: the stops.
+// - position: the car's floor.
+// - sweep: the direction of the stop taken last.
+// - call: receives the stop.
+// Returns: 1 if a stop was found, 0 if there are none.
+static int next_stop(const floor_set *up, const floor_set *down, floor_t position, char sweep, call_requests *call)
+{
+    int bit = position - FLOOR_LOWEST;
+    int found;
+
+    if (sweep == 'U')
+    {
+        if ((found = first_set(up, bit, LAST_BIT)) != -1)
+        {
+            call->direction = 'U';
+        }
+        else if ((found = last_set(down, 0, LAST_BIT)) != -1)
+        {
+            call->direction = 'D';
+        }
+        else if ((found = first_set(up, 0, LAST_BIT)) != -1)
+        {
+            call->direction = 'U';
+        }
+    }
+    else
+    {
+        if ((found = last_set(down, 0, bit)) != -1)
+        {
+            call->direction = 'D';
+        }
+        else if ((found = first_set(up, 0, LAST_BIT)) != -1)
+        {
+            call->direction = 'U';
+        }
+        else if ((found = last_set(down, 0, LAST_BIT)) != -1)
+        {
+            call->direction = 'D';
+        }
+    }
+
+    if (found == -1)
+    {
+        return 0;
+    }
+    call->floor = (floor_t)(found + FLOOR_LOWEST);
+    return 1;
+}
+
+// Function: sets or clears a stop's bit.
+// Arguments:
+// - up, down: the stops.
+// - call: the stop.
+// - add: 1 to set the bit, 0 to clear it.
+// Returns: 1 if the bit changed, 0 if it already had that value.
+static int change_stop(floor_set *up, floor_set *down, call_requests call, int add)
+{
+    floor_set *set = (call.direction == 'D') ? down : up;
+    int bit = call.floor - FLOOR_LOWEST;
+    int word = bit / 64;
+    uint64_t mask = 1ULL << (bit % 64);
+    int was_set = (set->words[word] & mask) != 0;
+
+    if (add)
+    {
+        set->words[word] |= mask;
+        set->used |= 1U << word;
+    }
+    else
+    {
+        set->words[word] &= ~mask;
+        if (set->words[word] == 0)
+        {
+            set->used &= ~(1U << word);
+        }
+    }
+    return was_set != add;
+}
+
+// Function: sets or clears a floor's bit in a set.
+static void change_floor(floor_set *set, floor_t floor, int add)
+{
+    call_requests call = {'U', floor};
+    change_stop(set, set, call, add);
+}
+
+// Function: tests whether a floor is in a set.
+static int has_floor(const floor_set *set, floor_t floor)
+{
+    int bit = floor - FLOOR_LOWEST;
+    return (set->words[bit / 64] >> (bit % 64)) & 1;
+}
+
+// Function: tests whether a stop is queued.
+static int has_stop(const floor_set *up, const floor_set *down, call_requests call)
+{
+    return has_floor((call.direction == 'D') ? down : up, call.floor);
+}
+
+// Function: removes a stop that has been taken and queues the dropoffs of the calls picked up
+// there. Mutex held.
+static void serve_stop(stop_queue *queue, call_requests call)
+{
+    queue->length -= change_stop(&queue->up, &queue->down, call, 0);
+    if (!has_floor(&queue->pickups, call.floor))
+    {
+        return;
+    }
+
+    int still_waiting = 0; // A call picked up here going the other way
+    stop_call **link = &queue->waiting;
+    while (*link != NULL)
+    {
+        stop_call *waiting = *link;
+        if (waiting->pickup.direction == call.direction && waiting->pickup.floor == call.floor)
+        {
+            call_requests dropoff = {call.direction, waiting->dropoff};
+            *link = waiting->next;
+            queue->length += change_stop(&queue->up, &queue->down, dropoff, 1) - 1;
+            pool_free(&stop_call_pool, waiting);
+        }
+        else
+        {
+            still_waiting |= (waiting->pickup.floor == call.floor);
+            link = &waiting->next;
+        }
+    }
+    if (!still_waiting)
+    {
+        change_floor(&queue->pickups, call.floor, 0);
+    }
+}
+
+// Function: initialises an empty stop queue.
+// Arguments: queue - the queue to initialise.
+// Returns: void
+void stop_queue_init(stop_queue *queue)
+{
+    pthread_mutex_init(&queue->mutex, NULL);
+    memset(&queue->up, 0, sizeof(queue->up));
+    memset(&queue->down, 0, sizeof(queue->down));
+    memset(&queue->pickups, 0, sizeof(queue->pickups));
+    queue->waiting = NULL;
+    queue->length = 0;
+    queue->sweep = 'U';
+}
+
+// Function: frees the dropoffs left waiting and releases the queue's mutex.
+// Arguments: queue - the queue to destroy.
+// Returns: void
+void stop_queue_destroy(stop_queue *queue)
+{
+    stop_queue_clear(queue);
+    pthread_mutex_destroy(&queue->mutex);
+}
+
+// Function: queues a stop. A stop already queued is left as it is. O(1).
+// Arguments:
+// - queue: the car's stop queue.
+// - call: the stop to add.
+// Returns: 1
+int stop_queue_push(stop_queue *queue, call_requests call)
+{
+    pthread_mutex_lock(&queue->mutex);
+    queue->length += change_stop(&queue->up, &queue->down, call, 1);
+    pthread_mutex_unlock(&queue->mutex);
+    return 1;
+}
+
+// Function: queues a call: its pickup now, and its dropoff once the pickup has been taken.
+// Arguments:
+// - queue: the car's stop queue.
+// - source_floor, destination_floor: the call's floors.
+// Returns: 1 on success, 0 if the floors are the same (nothing is queued, as no stop would ever
+// release the dropoff) or the dropoff could not be allocated (the pickup is still queued).
+int stop_queue_push_call(stop_queue *queue, floor_t source_floor, floor_t destination_floor)
+{
+    call_requests pickup = {get_call_direction(source_floor, destination_floor), source_floor};
+    if (pickup.direction == 'S')
+    {
+        return 0;
+    }
+    stop_call *waiting = pool_alloc(&stop_call_pool);
+
+    pthread_mutex_lock(&queue->mutex);
+    queue->length += change_stop(&queue->up, &queue->down, pickup, 1);
+    if (waiting != NULL)
+    {
+        waiting->pickup = pickup;
+        waiting->dropoff = destination_floor;
+        waiting->next = queue->waiting;
+        queue->waiting = waiting;
+        queue->length++;
+        change_floor(&queue->pickups, source_floor, 1);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    if (waiting == NULL)
+    {
+        perror("pool_alloc()");
+        return 0;
+    }
+    return 1;
+}
+
+// Function: removes the stop a car at a floor serves next (see next_stop), and makes its direction
+// the sweep's. A few find-first-set scans of the floor sets, however many stops are queued.
+// Arguments:
+// - queue: the car's stop queue.
+// - position: the car's floor.
+// - call: receives the removed stop.
+// Returns: 1 if a stop was removed, 0 if the queue was empty.
+int stop_queue_pop(stop_queue *queue, floor_t position, call_requests *call)
+{
+    pthread_mutex_lock(&queue->mutex);
+    int found = next_stop(&queue->up, &queue->down, position, queue->sweep, call);
+    if (found)
+    {
+        serve_stop(queue, *call);
+        queue->sweep = call->direction;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return found;
+}
+
+// Function: removes the stop of one direction nearest to a floor within a range, for a moving car
+// to stop at on its way, and makes the direction the sweep's.
+// Arguments:
+// - queue: the car's stop queue.
+// - direction: the direction the car is travelling in.
+// - from: the nearest floor the car can still stop at.
+// - to: the furthest floor to look at, no nearer than from in that direction.
+// - call: receives the removed stop.
+// Returns: 1 if a stop was removed, 0 if there is none in the range.
+int stop_queue_take(stop_queue *queue, char direction, floor_t from, floor_t to, call_requests *call)
+{
+    pthread_mutex_lock(&queue->mutex);
+    int found = (direction == 'U') ? first_set(&queue->up, from - FLOOR_LOWEST, to - FLOOR_LOWEST)
+                                   : last_set(&queue->down, to - FLOOR_LOWEST, from - FLOOR_LOWEST);
+    if (found != -1)
+    {
+        call->direction = direction;
+        call->floor = (floor_t)(found + FLOOR_LOWEST);
+        serve_stop(queue, *call);
+        queue->sweep = direction;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return found != -1;
+}
+
+// Function: removes a stop as if it had been taken, queueing the dropoffs of calls picked up there.
+// Arguments:
+// - queue: the car's stop queue.
+// - call: the stop to remove.
+// Returns: 1 if the stop was queued, 0 if not.
+int stop_queue_remove(stop_queue *queue, call_requests call)
+{
+    pthread_mutex_lock(&queue->mutex);
+    int found = has_stop(&queue->up, &queue->down, call);
+    if (found)
+    {
+        serve_stop(queue, call);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return found;
+}
+
+// Function: removes every stop and waiting dropoff.
+// Arguments: queue - the car's stop queue.
+// Returns: void
+void stop_queue_clear(stop_queue *queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    stop_call *waiting = queue->waiting;
+    memset(&queue->up, 0, sizeof(queue->up));
+    memset(&queue->down, 0, sizeof(queue->down));
+    memset(&queue->pickups, 0, sizeof(queue->pickups));
+    queue->waiting = NULL;
+    queue->length = 0;
+    pthread_mutex_unlock(&queue->mutex);
+
+    while (waiting != NULL)
+    {
+        stop_call *next = waiting->next;
+        pool_free(&stop_call_pool, waiting);
+        waiting = next;
+    }
+}
+
+// Function: places a stop in the order a car sweeping the building takes stops in: upward stops from
+// the lowest floor to the highest, then downward stops from the highest to the lowest, then round
+// again. A car in LOOK order (next_stop) always takes the next stop round this cycle from its own
+// place in it, which is its floor in the direction of its sweep.
+// Arguments: call - the stop.
+// Returns: the stop's place in the cycle, 0 to CYCLE - 1.
+static long cycle_index(call_requests call)
+{
+    int bit = call.floor - FLOOR_LOWEST;
+    return (call.direction == 'D') ? CYCLE - 1 - bit : bit;
+}
+
+// Function: finds the first place round the cycle, counting on from a place, where a stop comes.
+// Arguments:
+// - call: the stop.
+// - from: the place to count from, less than two laps round.
+// - after: 1 if the stop must come after from, 0 if at from will do.
+// Returns: the place.
+static long next_place(call_requests call, long from, int after)
+{
+    long place = ((from >= CYCLE) ? CYCLE : 0) + cycle_index(call);
+    if (place < from || (after && place == from))
+    {
+        place += CYCLE;
+    }
+    return place;
+}
+
+// Function: finds the stop at a place round the cycle.
+// Arguments:
+// - place: the place, less than three laps round.
+// - call: receives the stop.
+// Returns: void
+static void stop_at(long place, call_requests *call)
+{
+    long index = place;
+    while (index >= CYCLE)
+    {
+        index -= CYCLE;
+    }
+    call->direction = (index < STOP_QUEUE_FLOORS) ? 'U' : 'D';
+    call->floor = (floor_t)(((index < STOP_QUEUE_FLOORS) ? index : CYCLE - 1 - index) + FLOOR_LOWEST);
+}
+
+// Function: finds the first queued stop at or after a place round the cycle. Mutex held.
+// Arguments:
+// - queue: the car's stop queue.
+// - from: the place to look from, up to a lap on.
+// - end: the place to stop looking at.
+// Returns: the stop's place, or -1 if there is none before end.
+static long next_queued(stop_queue *queue, long from, long end)
+{
+    long lap = (from >= CYCLE) ? CYCLE : 0;
+    long index = from - lap;
+    while (lap + index < end)
+    {
+        int bit = (index < STOP_QUEUE_FLOORS) ? first_set(&queue->up, (int)index, LAST_BIT) : -1;
+        if (bit != -1)
+        {
+            return (lap + bit < end) ? lap + bit : -1;
+        }
+        bit = last_set(&queue->down, 0, (index < STOP_QUEUE_FLOORS) ? LAST_BIT : (int)(CYCLE - 1 - index));
+        if (bit != -1)
+        {
+            return (lap + CYCLE - 1 - bit < end) ? lap + CYCLE - 1 - bit : -1;
+        }
+        lap += CYCLE;
+        index = 0;
+    }
+    return -1;
+}
+
+// Function: lists the floors a car would stop at, in order, if it took every queued stop in turn
+// from a floor and no more were added; and, for estimating a call's cost, the same with the call
+// added. Taking stops in LOOK order goes once round the cycle (cycle_index) from the car's place
+// in it, so every queued stop comes up on that first lap, and the dropoff of a call waiting for its
+// pickup comes up at its first place after the pickup's. The route is those two lists merged,
+// with the call's stops slotted in the same way.
+// Arguments:
+// - queue: the car's stop queue.
+// - position: the floor the car takes its next stop from.
+// - source_floor, destination_floor: the call.
+// - route: receives up to max_floors floors without the call.
+// - route_with_call: receives up to max_floors + 2 floors with the call.
+// - max_floors: the capacity of route, at most STOP_QUEUE_MAX_ROUTE.
+// - with_count: receives the number of floors in route_with_call.
+// - dropoff_index: receives the index in route_with_call of the call's dropoff, or -1 if it lies
+//   beyond the stops listed.
+// Returns: the number of floors in route.
+int stop_queue_route(stop_queue *queue, floor_t position, floor_t source_floor, floor_t destination_floor,
+                     floor_t *route, floor_t *route_with_call, int max_floors, int *with_count, int *dropoff_index)
+{
+    char direction = get_call_direction(source_floor, destination_floor);
+    call_requests pickup = {direction, source_floor};
+    call_requests dropoff = {direction, destination_floor};
+    long releases[STOP_QUEUE_MAX_ROUTE]; // Places of waiting dropoffs, the nearest in order
+    int release_count = 0;
+    int count = 0;
+    int added = 0;
+    int picked_up = 0;
+    *dropoff_index = -1;
+    if (max_floors > STOP_QUEUE_MAX_ROUTE)
+    {
+        max_floors = STOP_QUEUE_MAX_ROUTE;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    call_requests here = {queue->sweep, position};
+    long start = cycle_index(here);
+    long end = start + CYCLE;
+    long pickup_place = next_place(pickup, start, 0);
+    long dropoff_place = next_place(dropoff, pickup_place, 1);
+
+    for (stop_call *waiting = queue->waiting; waiting != NULL; waiting = waiting->next)
+    {
+        call_requests released = {waiting->pickup.direction, waiting->dropoff};
+        long place = next_place(released, next_place(waiting->pickup, start, 0), 1);
+        int i = (release_count < max_floors) ? release_count++ : max_floors;
+        for (; i > 0 && releases[i - 1] > place; i--)
+        {
+            if (i < max_floors)
+            {
+                releases[i] = releases[i - 1];
+            }
+        }
+        if (i < max_floors)
+        {
+            releases[i] = place;
+        }
+    }
+
+    int next_release = 0;
+    long next = next_queued(queue, start, end);
+    while (count < max_floors && (next != -1 || next_release < release_count))
+    {
+        long place;
+        if (next_release < release_count && (next == -1 || releases[next_release] <= next))
+        {
+            place = releases[next_release];
+            while (next_release < release_count && releases[next_release] == place)
+            {
+                next_release++;
+            }
+        }
+        else
+        {
+            place = next;
+        }
+        if (next == place)
+        {
+            next = next_queued(queue, next + 1, end);
+        }
+
+        // The call's stops, before this one or the same stop as it
+        if (!picked_up && pickup_place <= place)
+        {
+            if (pickup_place < place)
+            {
+                route_with_call[added++] = source_floor;
+            }
+            picked_up = 1;
+        }
+        if (picked_up && *dropoff_index == -1 && dropoff_place <= place)
+        {
+            *dropoff_index = added;
+            if (dropoff_place < place)
+            {
+                route_with_call[added++] = destination_floor;
+            }
+        }
+
+        call_requests call;
+        stop_at(place, &call);
+        route[count++] = call.floor;
+        route_with_call[added++] = call.floor;
+    }
+    int more = (next != -1 || next_release < release_count);
+    pthread_mutex_unlock(&queue->mutex);
+
+    // Past the last stop the car goes on to the call's.
+    if (!more)
+    {
+        if (!picked_up)
+        {
+            route_with_call[added++] = source_floor;
+        }
+        if (*dropoff_index == -1)
+        {
+            *dropoff_index = added;
+            route_with_call[added++] = destination_floor;
+        }
+    }
+    *with_count = added;
+    return count;
+}
+
+// Function: copies the queue's contents, for the journal: every stop, then every call waiting for
+// its pickup, in no particular order.
+// Arguments:
+// - queue: the car's stop queue.
+// - stops: receives the stops, and for waiting calls their pickups.
+// - dropoffs: receives FLOOR_INVALID for a stop, or a waiting call's dropoff.
+// - max_entries: the capacity of stops and dropoffs; stop_queue_length entries are enough.
+// Returns: the number of entries copied.
+int stop_queue_entries(stop_queue *queue, call_requests *stops, floor_t *dropoffs, int max_entries)
+{
+    int count = 0;
+
+    pthread_mutex_lock(&queue->mutex);
+    for (int direction = 0; direction < 2; direction++)
+    {
+        const floor_set *set = (direction == 0) ? &queue->up : &queue->down;
+        for (int word = 0; word < STOP_QUEUE_WORDS; word++)
+        {
+            for (uint64_t mask = set->words[word]; mask != 0 && count < max_entries; mask &= mask - 1)
+            {
+                stops[count].direction = (direction == 0) ? 'U' : 'D';
+                stops[count].floor = (floor_t)(word * 64 + __builtin_ctzll(mask) + FLOOR_LOWEST);
+                dropoffs[count++] = FLOOR_INVALID;
+            }
+        }
+    }
+    for (stop_call *waiting = queue->waiting; waiting != NULL && count < max_entries; waiting = waiting->next)
+    {
+        stops[count] = waiting->pickup;
+        dropoffs[count++] = waiting->dropoff;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    return count;
+}
+
+// Function: reports how many stops are queued, counting each call still waiting for its pickup as
+// one more.
+// Arguments: queue - the car's stop queue.
+// Returns: the number of queued stops.
+int stop_queue_length(stop_queue *queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    int length = queue->length;
+    pthread_mutex_unlock(&queue->mutex);
+    return length;
+}
@@ -0,0 +1,63 @@
+#ifndef STOP_QUEUE_H
+#define STOP_QUEUE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "common.h"
+
+#define STOP_QUEUE_FLOORS (FLOOR_HIGHEST - FLOOR_LOWEST + 1) // One bit per floor from B99 to 999
+#define STOP_QUEUE_WORDS ((STOP_QUEUE_FLOORS + 63) / 64)
+#define STOP_QUEUE_MAX_ROUTE 128 // Most floors stop_queue_route lists
+
+typedef struct
+{
+    char direction;
+    floor_t floor;
+} call_requests;
+
+// A set of floors, with a bit per word in use so that a search goes straight to the next word with
+// a floor in it.
+typedef struct
+{
+    uint64_t words[STOP_QUEUE_WORDS]; // Bit floor - FLOOR_LOWEST
+    uint32_t used;                    // Bit per non-zero word
+} floor_set;
+
+// A call whose pickup is queued but not yet served. Its dropoff joins the stops once the pickup has
+// been taken, so a car never stops for a passenger it has not picked up yet.
+typedef struct stop_call
+{
+    call_requests pickup;
+    floor_t dropoff;
+    struct stop_call *next;
+} stop_call;
+
+// A car's pending stops, as two sets of floors: stops for passengers going up and for passengers
+// going down. A stop is queued once however many calls share it. The car serves them in LOOK order
+// from its floor: every stop in the direction of its sweep, then the stops of the other direction
+// from the far end, then whatever is left. Each car owns one, guarded by its own mutex.
+typedef struct
+{
+    pthread_mutex_t mutex;
+    floor_set up;       // Stops for passengers going up
+    floor_set down;     // Stops for passengers going down
+    stop_call *waiting; // Dropoffs of calls whose pickup has not been taken
+    floor_set pickups;  // Floors with a call in waiting, so a stop elsewhere need not look through it
+    int length;         // Stops queued plus dropoffs waiting
+    char sweep;         // Direction of the stop taken last, 'U' or 'D'
+} stop_queue;
+
+void stop_queue_init(stop_queue *queue);
+void stop_queue_destroy(stop_queue *queue);
+int stop_queue_push(stop_queue *queue, call_requests call);
+int stop_queue_push_call(stop_queue *queue, floor_t source_floor, floor_t destination_floor);
+int stop_queue_pop(stop_queue *queue, floor_t position, call_requests *call);
+int stop_queue_take(stop_queue *queue, char direction, floor_t from, floor_t to, call_requests *call);
+int stop_queue_remove(stop_queue *queue, call_requests call);
+void stop_queue_clear(stop_queue *queue);
+int stop_queue_length(stop_queue *queue);
+int stop_queue_route(stop_queue *queue, floor_t position, floor_t source_floor, floor_t destination_floor,
+                     floor_t *route, floor_t *route_with_call, int max_floors, int *with_count, int *dropoff_index);
+int stop_queue_entries(stop_queue *queue, call_requests *stops, floor_t *dropoffs, int max_entries);
+
+#endif // STOP_QUEUE_H
@@ -0,0 +1,281 @@
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define WHEEL_SPAN (1ULL << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) // Ticks the top level reaches
+
+// Function: Links a timer at the head of a list.
+static void push(timer_wheel_timer **head, timer_wheel_timer *timer)
+{
+    timer->next = *head;
+    if (timer->next != NULL)
+    {
+        timer->next->link = &timer->next;
+    }
+    *head = timer;
+    timer->link = head;
+}
+
+// Function: Unlinks an armed timer from its slot or the due list, clearing the slot's bit if it
+// leaves the slot empty. Mutex held.
+static void unlink_timer(timer_wheel *wheel, timer_wheel_timer *timer)
+{
+    timer_wheel_timer **link = timer->link;
+    *link = timer->next;
+    if (timer->next != NULL)
+    {
+        timer->next->link = link;
+    }
+    timer->next = NULL;
+    timer->link = NULL;
+
+    timer_wheel_timer **first_slot = &wheel->slots[0][0];
+    if (*link == NULL && link >= first_slot && link < first_slot + TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS)
+    {
+        size_t index = link - first_slot;
+        wheel->occupied[index / TIMER_WHEEL_SLOTS] &= ~(1ULL << (index % TIMER_WHEEL_SLOTS));
+    }
+}
+
+// Function: Puts a timer due after the current tick into the slot its deadline falls in, at the
+// lowest level that reaches that far. Mutex held.
+static void insert(timer_wheel *wheel, timer_wheel_timer *timer)
+{
+    uint64_t delta = timer->expires - wheel->current;
+    uint64_t position = timer->expires;
+    int level = 0;
+    if (delta >= WHEEL_SPAN)
+    {
+        // Beyond the top level: wait in its last slot and be moved round again.
+        position = wheel->current + WHEEL_SPAN - 1;
+        level = TIMER_WHEEL_LEVELS - 1;
+    }
+    else
+    {
+        while (delta >= (1ULL << (TIMER_WHEEL_SLOT_BITS * (level + 1))))
+        {
+            level++;
+        }
+    }
+
+    int slot = (position >> (TIMER_WHEEL_SLOT_BITS * level)) & SLOT_MASK;
+    push(&wheel->slots[level][slot], timer);
+    wheel->occupied[level] |= 1ULL << slot;
+}
+
+// Function: Finds the next tick at which a level 0 slot expires or a higher level's slot has to move
+// its timers down: for each level, the first occupied slot after the current one, wrapping round.
+// Mutex held.
+// Returns: the tick, or 0 when no timer is in the wheel.
+static uint64_t next_tick(timer_wheel *wheel)
+{
+    uint64_t earliest = 0;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        uint64_t bits = wheel->occupied[level];
+        if (bits == 0)
+        {
+            continue;
+        }
+        int shift = TIMER_WHEEL_SLOT_BITS * level;
+        uint64_t base = wheel->current >> shift;
+        int start = (int)((base + 1) & SLOT_MASK);
+        uint64_t rotated = (start == 0) ? bits : (bits >> start) | (bits << (TIMER_WHEEL_SLOTS - start));
+        uint64_t tick = (base + 1 + __builtin_ctzll(rotated)) << shift;
+        if (earliest == 0 || tick < earliest)
+        {
+            earliest = tick;
+        }
+    }
+    return earliest;
+}
+
+// Function: Moves the timers of a slot above level 0 down, or to the due list if their tick has come.
+// Mutex held.
+static void cascade(timer_wheel *wheel, int level, int slot)
+{
+    timer_wheel_timer *timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~(1ULL << slot);
+    while (timer != NULL)
+    {
+        timer_wheel_timer *next = timer->next;
+        if (timer->expires <= wheel->current)
+        {
+            push(&wheel->due, timer);
+        }
+        else
+        {
+            insert(wheel, timer);
+        }
+        timer = next;
+    }
+}
+
+// Function: Turns the wheel up to a tick, jumping straight between the ticks at which something is
+// in a slot, and moves every timer due by then to the due list. Mutex held.
+static void advance(timer_wheel *wheel, uint64_t now)
+{
+    uint64_t tick;
+    while ((tick = next_tick(wheel)) != 0 && tick <= now)
+    {
+        wheel->current = tick;
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++)
+        {
+            int shift = TIMER_WHEEL_SLOT_BITS * level;
+            if (tick & ((1ULL << shift) - 1))
+            {
+                break; // Not the start of a slot at this level or any above it
+            }
+            cascade(wheel, level, (tick >> shift) & SLOT_MASK);
+        }
+
+        int slot = tick & SLOT_MASK;
+        timer_wheel_timer *timer = wheel->slots[0][slot];
+        wheel->slots[0][slot] = NULL;
+        wheel->occupied[0] &= ~(1ULL << slot);
+        while (timer != NULL)
+        {
+            timer_wheel_timer *next = timer->next;
+            push(&wheel->due, timer);
+            timer = next;
+        }
+    }
+    if (now > wheel->current)
+    {
+        wheel->current = now;
+    }
+}
+
+// Function: Sets the timerfd for the next tick with anything to do, at once if timers are due, or
+// disarms it when the wheel is empty. Mutex held.
+static void arm_timer_fd(timer_wheel *wheel)
+{
+    uint64_t deadline = (wheel->due != NULL) ? 1 : next_tick(wheel) * TIMER_WHEEL_TICK_NS; // 1 ns: already past
+    if (deadline == wheel->armed_ns)
+    {
+        return;
+    }
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = deadline / 1000000000ULL;
+    spec.it_value.tv_nsec = deadline % 1000000000ULL;
+    timerfd_settime(wheel->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+    wheel->armed_ns = deadline;
+}
+
+// Function: Creates an empty wheel and its timerfd.
+// Arguments: wheel - the wheel to set up.
+// Returns: 0 on success, -1 with errno set on failure.
+int timer_wheel_init(timer_wheel *wheel)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (wheel->timer_fd == -1)
+    {
+        return -1;
+    }
+    wheel->current = timer_wheel_now() / TIMER_WHEEL_TICK_NS;
+    pthread_mutex_init(&wheel->mutex, NULL);
+    return 0;
+}
+
+// Function: Closes the timerfd. Timers still armed are forgotten.
+void timer_wheel_destroy(timer_wheel *wheel)
+{
+    close(wheel->timer_fd);
+    pthread_mutex_destroy(&wheel->mutex);
+}
+
+// Function: Arms a timer, moving it if it is already armed. Safe to call from any thread.
+// Arguments:
+// - wheel: the wheel.
+// - timer: the timer, zeroed before it is first armed.
+// - deadline_ns: CLOCK_MONOTONIC time to expire at (see timer_wheel_now).
+// Returns: void
+void timer_wheel_arm(timer_wheel *wheel, timer_wheel_timer *timer, uint64_t deadline_ns)
+{
+    pthread_mutex_lock(&wheel->mutex);
+    if (timer->link != NULL)
+    {
+        unlink_timer(wheel, timer);
+    }
+    timer->generation++;
+    timer->expires = (deadline_ns + TIMER_WHEEL_TICK_NS - 1) / TIMER_WHEEL_TICK_NS;
+    if (timer->expires <= wheel->current)
+    {
+        push(&wheel->due, timer);
+    }
+    else
+    {
+        insert(wheel, timer);
+    }
+    arm_timer_fd(wheel);
+    pthread_mutex_unlock(&wheel->mutex);
+}
+
+// Function: Cancels a timer. Safe to call from any thread. A timer that timer_wheel_expire has
+// already handed back is still reported, with the generation it had; this one is newer.
+// Arguments:
+// - wheel: the wheel.
+// - timer: the timer.
+// Returns: 1 if the timer was armed, 0 if not.
+int timer_wheel_cancel(timer_wheel *wheel, timer_wheel_timer *timer)
+{
+    pthread_mutex_lock(&wheel->mutex);
+    int armed = timer->link != NULL;
+    if (armed)
+    {
+        unlink_timer(wheel, timer);
+        arm_timer_fd(wheel);
+    }
+    timer->generation++;
+    pthread_mutex_unlock(&wheel->mutex);
+    return armed;
+}
+
+// Function: Called when the timerfd is readable. Turns the wheel to the current tick, hands back the
+// timers that are due and sets the timerfd for the rest.
+// Arguments:
+// - wheel: the wheel.
+// - expired: receives the due timers.
+// - max: room in expired; any further due timers stay due and the timerfd fires again at once.
+// Returns: the number of timers written to expired.
+size_t timer_wheel_expire(timer_wheel *wheel, timer_expiry *expired, size_t max)
+{
+    uint64_t ticks;
+    while (read(wheel->timer_fd, &ticks, sizeof(ticks)) == -1 && errno == EINTR)
+    {
+    }
+
+    uint64_t now = timer_wheel_now() / TIMER_WHEEL_TICK_NS;
+    size_t count = 0;
+
+    pthread_mutex_lock(&wheel->mutex);
+    advance(wheel, now);
+    while (count < max && wheel->due != NULL)
+    {
+        timer_wheel_timer *timer = wheel->due;
+        unlink_timer(wheel, timer);
+        expired[count].timer = timer;
+        expired[count].generation = timer->generation;
+        count++;
+    }
+    wheel->armed_ns = 0; // The read above consumed the expiry, so always set the timerfd again
+    arm_timer_fd(wheel);
+    pthread_mutex_unlock(&wheel->mutex);
+    return count;
+}
+
+// Function: Current CLOCK_MONOTONIC time in nanoseconds, the clock deadlines are measured on.
+uint64_t timer_wheel_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,61 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// One-shot timers for many owners behind a single timerfd, so an epoll loop (or an io_uring poll)
+// can wait for all of them along with its sockets. Deadlines are CLOCK_MONOTONIC nanoseconds, rounded
+// up to the next millisecond tick, so a timer never expires early and wall-clock steps never move it.
+//
+// The timers sit in a hierarchical timing wheel: TIMER_WHEEL_LEVELS wheels of TIMER_WHEEL_SLOTS
+// slots, each level's slots TIMER_WHEEL_SLOTS times as wide as the level below (1 ms, 64 ms, 4.1 s
+// and 4.4 minutes). A timer goes into the slot its deadline falls in at the lowest level that reaches
+// that far, and is moved down a level each time its slot comes round, until it expires from level 0.
+// Arming, re-arming and cancelling only link or unlink the timer from a slot's list: O(1) however
+// many timers are pending. Deadlines beyond the top level wait there and are moved round again.
+//
+// Timers are embedded in their owners and never allocated. Each arm and cancel bumps the timer's
+// generation, which timer_wheel_expire hands back with it, so an owner can tell a timer that expired
+// just as it was cancelled or re-armed from the one it armed since.
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_TICK_NS 1000000ULL
+
+typedef struct timer_wheel_timer
+{
+    struct timer_wheel_timer *next;
+    struct timer_wheel_timer **link; // The pointer to this timer in its list, or NULL when not armed
+    uint64_t expires;                // Tick
+    uint64_t generation;             // Bumped by every arm and cancel
+} timer_wheel_timer;
+
+// An expired timer, as it was when it expired.
+typedef struct
+{
+    timer_wheel_timer *timer;
+    uint64_t generation;
+} timer_expiry;
+
+typedef struct
+{
+    pthread_mutex_t mutex;
+    int timer_fd;
+    uint64_t current; // Every timer due at or before this tick has been moved to due
+    uint64_t occupied[TIMER_WHEEL_LEVELS]; // Bit per slot with timers in it
+    timer_wheel_timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    timer_wheel_timer *due; // Expired, waiting for timer_wheel_expire to hand them back
+    uint64_t armed_ns;      // Deadline the timerfd is set for, or 0 when disarmed
+} timer_wheel;
+
+int timer_wheel_init(timer_wheel *wheel);
+void timer_wheel_destroy(timer_wheel *wheel);
+void timer_wheel_arm(timer_wheel *wheel, timer_wheel_timer *timer, uint64_t deadline_ns);
+int timer_wheel_cancel(timer_wheel *wheel, timer_wheel_timer *timer);
+size_t timer_wheel_expire(timer_wheel *wheel, timer_expiry *expired, size_t max);
+uint64_t timer_wheel_now();
+
+#endif // TIMER_WHEEL_H
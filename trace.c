@@ -0,0 +1,324 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "trace.h"
+
+#define DRAIN_CHUNK 256 // Events copied out of a ring and written at a time
+
+// One thread's events. The owning thread is the only writer; the trace thread (or trace_flush) reads
+// behind it under trace_mutex.
+typedef struct trace_ring
+{
+    uint64_t head;         // Events recorded, published with a release store
+    uint64_t tail;         // Events written out or lost; trace_mutex
+    uint32_t tid;
+    struct trace_ring *next; // trace_mutex
+    trace_event events[TRACE_RING_EVENTS];
+} trace_ring;
+
+int trace_active = 0;
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring *rings = NULL; // Every thread's ring; trace_mutex
+static int trace_fd = -1;        // trace_mutex
+static char program_name[16];
+static char program_subject[TRACE_SUBJECT_SIZE];
+static __thread trace_ring *thread_ring = NULL;
+static __thread char thread_subject[TRACE_SUBJECT_SIZE];
+static __thread char thread_name[TRACE_SUBJECT_SIZE];
+
+static void *run_trace_thread(void *arg);
+static void drain_ring(trace_ring *ring);
+static void write_events(const trace_event *events, size_t count);
+static int open_trace_file();
+
+// Copies a name into a fixed-size field, truncating it and padding with NULs.
+static void copy_name(char *field, size_t size, const char *name)
+{
+    size_t length = strnlen(name, size);
+    memcpy(field, name, length);
+    memset(field + length, 0, size - length);
+}
+
+// Function: sets up tracing for the program. Call first in main, before any thread is created: it
+// blocks SIGUSR1 so that only the trace thread it starts receives it.
+// Arguments:
+// - program: the program's name, e.g. "controller".
+// - subject: the car the program is for, or NULL.
+// Returns: void. Tracing is left off if the trace thread cannot be started.
+void trace_init(const char *program, const char *subject)
+{
+    copy_name(program_name, sizeof(program_name), program);
+    copy_name(program_subject, sizeof(program_subject), subject != NULL ? subject : "");
+
+    // The trace thread starts with every signal blocked, so no handler of the program runs on it.
+    sigset_t all_signals, previous;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &previous);
+    pthread_t thread;
+    int created = pthread_create(&thread, NULL, run_trace_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (created != 0)
+    {
+        perror("pthread_create() for tracing");
+        return;
+    }
+    pthread_detach(thread);
+
+    sigset_t toggle_set;
+    sigemptyset(&toggle_set);
+    sigaddset(&toggle_set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &toggle_set, NULL);
+    atexit(trace_flush);
+
+    const char *initially = getenv("ELEVATOR_TRACE");
+    if (initially != NULL && initially[0] != '\0' && strcmp(initially, "0") != 0)
+    {
+        pthread_mutex_lock(&trace_mutex);
+        if (open_trace_file() == 0)
+        {
+            __atomic_store_n(&trace_active, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&trace_mutex);
+    }
+}
+
+// Function: sets the subject of the calling thread's events that do not name one, e.g. the car a
+// carhost worker is running.
+void trace_subject(const char *subject)
+{
+    copy_name(thread_subject, sizeof(thread_subject), subject);
+}
+
+// Function: names the calling thread on the timeline.
+void trace_name_thread(const char *name)
+{
+    copy_name(thread_name, sizeof(thread_name), name);
+    trace_emit(TRACE_THREAD_NAME, thread_name, 0, 0, 0);
+}
+
+// Function: creates the calling thread's ring and adds it to the ones the trace thread writes out.
+static trace_ring *create_ring()
+{
+    trace_ring *ring = calloc(1, sizeof(trace_ring));
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+    ring->tid = (uint32_t)gettid();
+
+    pthread_mutex_lock(&trace_mutex);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&trace_mutex);
+
+    thread_ring = ring;
+    if (thread_name[0] != '\0')
+    {
+        trace_record(TRACE_THREAD_NAME, thread_name, 0, 0, 0); // Named before tracing was turned on
+    }
+    return ring;
+}
+
+// Function: records an event in the calling thread's ring. Use trace_emit, which checks that
+// tracing is on first.
+void trace_record(trace_event_type type, const char *subject, uint16_t detail, floor_t floor, floor_t floor2)
+{
+    trace_ring *ring = thread_ring;
+    if (ring == NULL && (ring = create_ring()) == NULL)
+    {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint64_t head = ring->head;
+    trace_event *event = &ring->events[head & (TRACE_RING_EVENTS - 1)];
+    event->timestamp_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    event->tid = ring->tid;
+    event->type = (uint16_t)type;
+    event->detail = detail;
+    event->floor = floor;
+    event->floor2 = floor2;
+    if (subject == NULL)
+    {
+        subject = (thread_subject[0] != '\0') ? thread_subject : program_subject;
+    }
+    copy_name(event->subject, sizeof(event->subject), subject);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Function: writes out every event recorded so far. Registered with atexit by trace_init.
+void trace_flush()
+{
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_fd != -1)
+    {
+        for (trace_ring *ring = rings; ring != NULL; ring = ring->next)
+        {
+            drain_ring(ring);
+        }
+    }
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+// Function: the trace thread. Writes the rings out while tracing is on, and toggles it on SIGUSR1.
+static void *run_trace_thread(void *arg)
+{
+    (void)arg;
+    sigset_t toggle_set;
+    sigemptyset(&toggle_set);
+    sigaddset(&toggle_set, SIGUSR1);
+
+    for (;;)
+    {
+        int sig;
+        if (__atomic_load_n(&trace_active, __ATOMIC_RELAXED))
+        {
+            struct timespec interval = {0, TRACE_DRAIN_INTERVAL_MS * 1000000L};
+            sig = sigtimedwait(&toggle_set, NULL, &interval);
+        }
+        else if (sigwait(&toggle_set, &sig) != 0)
+        {
+            continue;
+        }
+
+        if (sig == SIGUSR1 && !__atomic_load_n(&trace_active, __ATOMIC_RELAXED))
+        {
+            pthread_mutex_lock(&trace_mutex);
+            if (open_trace_file() == 0)
+            {
+                __atomic_store_n(&trace_active, 1, __ATOMIC_RELAXED);
+            }
+            pthread_mutex_unlock(&trace_mutex);
+            continue;
+        }
+        if (sig == SIGUSR1)
+        {
+            __atomic_store_n(&trace_active, 0, __ATOMIC_RELAXED);
+        }
+        trace_flush();
+    }
+    return NULL;
+}
+
+// Function: opens the trace file and writes its header, the first time tracing is turned on.
+// Later periods of tracing are appended. trace_mutex held.
+// Returns: 0 if the file is open, -1 otherwise (with the reason printed).
+static int open_trace_file()
+{
+    if (trace_fd != -1)
+    {
+        return 0;
+    }
+
+    const char *directory = getenv("ELEVATOR_TRACE_DIR");
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s-%d.trace", directory != NULL ? directory : "/tmp", program_name, (int)getpid());
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        perror("open() for trace file");
+        return -1;
+    }
+
+    trace_file_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.event_size = sizeof(trace_event);
+    header.pid = (uint32_t)getpid();
+    memcpy(header.program, program_name, sizeof(program_name));
+    memcpy(header.subject, program_subject, sizeof(program_subject));
+    if (write(fd, &header, sizeof(header)) != sizeof(header))
+    {
+        perror("write() for trace file");
+        close(fd);
+        return -1;
+    }
+    trace_fd = fd;
+    return 0;
+}
+
+// Function: writes out the events a ring holds that have not been written yet. An event overwritten
+// while it was being copied is dropped and counted as lost, like one overwritten before. trace_mutex held.
+static void drain_ring(trace_ring *ring)
+{
+    trace_event chunk[DRAIN_CHUNK];
+    uint64_t lost = 0;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+
+    if (head - tail > TRACE_RING_EVENTS)
+    {
+        lost += head - tail - TRACE_RING_EVENTS;
+        tail = head - TRACE_RING_EVENTS;
+    }
+
+    while (tail < head)
+    {
+        size_t count = (head - tail < DRAIN_CHUNK) ? (size_t)(head - tail) : DRAIN_CHUNK;
+        for (size_t i = 0; i < count; i++)
+        {
+            chunk[i] = ring->events[(tail + i) & (TRACE_RING_EVENTS - 1)];
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        // The writer may since have reused slots: everything before the one it is writing now.
+        uint64_t writing = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        uint64_t reused_below = (writing + 1 > TRACE_RING_EVENTS) ? writing + 1 - TRACE_RING_EVENTS : 0;
+        size_t skip = 0;
+        if (reused_below > tail)
+        {
+            skip = (reused_below - tail < count) ? (size_t)(reused_below - tail) : count;
+        }
+        lost += skip;
+        write_events(chunk + skip, count - skip);
+        tail += count;
+    }
+    ring->tail = tail;
+
+    while (lost > 0)
+    {
+        trace_event lost_event;
+        memset(&lost_event, 0, sizeof(lost_event));
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        lost_event.timestamp_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+        lost_event.tid = ring->tid;
+        lost_event.type = TRACE_LOST;
+        lost_event.detail = (lost > UINT16_MAX) ? UINT16_MAX : (uint16_t)lost;
+        lost -= lost_event.detail;
+        write_events(&lost_event, 1);
+    }
+}
+
+// Function: appends events to the trace file. trace_mutex held.
+static void write_events(const trace_event *events, size_t count)
+{
+    const char *bytes = (const char *)events;
+    size_t remaining = count * sizeof(trace_event);
+    while (remaining > 0)
+    {
+        ssize_t written = write(trace_fd, bytes, remaining);
+        if (written == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            perror("write() for trace file");
+            return;
+        }
+        bytes += written;
+        remaining -= written;
+    }
+}
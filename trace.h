@@ -0,0 +1,125 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "common.h"
+
+// Event tracing shared by every program, for putting the controller, cars, call pads and safety
+// monitors of a building on one timeline (tracejson turns the files into Chrome/Perfetto JSON).
+//
+// Each thread writes fixed-size events with CLOCK_MONOTONIC timestamps into a ring of its own, so
+// recording takes no lock; while tracing is off it is a single load. A trace thread started by
+// trace_init writes the rings out to {ELEVATOR_TRACE_DIR, default /tmp}/{program}-{pid}.trace every
+// TRACE_DRAIN_INTERVAL_MS, and once more when the program exits normally. A thread that records more
+// than a ring holds between two drains loses its oldest events; the loss is recorded in the file.
+//
+// Tracing starts on if ELEVATOR_TRACE is set to anything but 0, and SIGUSR1 turns it on and off at
+// runtime. Turning it off writes out everything recorded so far.
+
+#define TRACE_MAGIC 0x31525445 // "ETR1"
+#define TRACE_VERSION 1
+#define TRACE_SUBJECT_SIZE 12
+#define TRACE_RING_EVENTS 16384 // Per thread; a power of two
+#define TRACE_DRAIN_INTERVAL_MS 100
+
+typedef enum
+{
+    TRACE_THREAD_NAME = 1,  // subject: the name of the thread
+    TRACE_LOST,             // detail: events overwritten before they were written out
+    TRACE_MESSAGE_RECEIVED, // detail: trace_message; floor, floor2 as the message carries them
+    TRACE_CALL_SENT,        // floor, floor2: source and destination
+    TRACE_CALL_QUEUED,      // subject: the car assigned; floor, floor2: source and destination
+    TRACE_CALL_UNAVAILABLE, // floor, floor2: source and destination
+    TRACE_STOP_POPPED,      // floor: the car's next stop
+    TRACE_FLOOR_SENT,       // floor: the floor dispatched
+    TRACE_STATUS,           // detail: the new car_status; floor, floor2: current and destination
+    TRACE_SAFETY_TRIP,      // detail: trace_trip
+    TRACE_CONTROL,          // detail: trace_control
+    TRACE_EVENT_TYPES
+} trace_event_type;
+
+// Message kinds for TRACE_MESSAGE_RECEIVED.
+typedef enum
+{
+    TRACE_MESSAGE_OTHER,
+    TRACE_MESSAGE_CAR,
+    TRACE_MESSAGE_STATUS,
+    TRACE_MESSAGE_CALL,
+    TRACE_MESSAGE_CALL_BATCH,
+    TRACE_MESSAGE_FLOOR,
+    TRACE_MESSAGE_UNAVAILABLE
+} trace_message;
+
+// Why the safety system stepped in, for TRACE_SAFETY_TRIP.
+typedef enum
+{
+    TRACE_TRIP_OBSTRUCTION, // Doors reopened
+    TRACE_TRIP_EMERGENCY_STOP,
+    TRACE_TRIP_OVERLOAD,
+    TRACE_TRIP_DATA_ERROR
+} trace_trip;
+
+// Operations of the internal controls, for TRACE_CONTROL.
+typedef enum
+{
+    TRACE_CONTROL_OPEN,
+    TRACE_CONTROL_CLOSE,
+    TRACE_CONTROL_STOP,
+    TRACE_CONTROL_SERVICE_ON,
+    TRACE_CONTROL_SERVICE_OFF,
+    TRACE_CONTROL_UP,
+    TRACE_CONTROL_DOWN
+} trace_control;
+
+// One event, as recorded and as written to the file.
+typedef struct
+{
+    uint64_t timestamp_ns; // CLOCK_MONOTONIC, the same in every process
+    uint32_t tid;
+    uint16_t type;   // trace_event_type
+    uint16_t detail;
+    floor_t floor;
+    floor_t floor2;
+    char subject[TRACE_SUBJECT_SIZE]; // Usually the car's name; NUL padded, not terminated when full
+} trace_event;
+
+_Static_assert(sizeof(trace_event) == 32, "trace events are 32 bytes");
+
+// The start of every trace file, followed by trace_events.
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t event_size;
+    uint32_t pid;
+    uint32_t reserved;
+    char program[16];
+    char subject[16]; // The car a car, safety or internal process is for; empty otherwise
+} trace_file_header;
+
+_Static_assert(sizeof(trace_file_header) == 48, "the trace file header is 48 bytes");
+
+extern int trace_active;
+
+void trace_init(const char *program, const char *subject);
+void trace_subject(const char *subject);
+void trace_name_thread(const char *name);
+void trace_record(trace_event_type type, const char *subject, uint16_t detail, floor_t floor, floor_t floor2);
+void trace_flush();
+
+// Function: records an event if tracing is on.
+// Arguments:
+// - type: what happened.
+// - subject: the car it happened to, or NULL for the thread's subject (trace_subject, or the
+//   program's, given to trace_init).
+// - detail, floor, floor2: as listed for the type.
+// Returns: void
+static inline void trace_emit(trace_event_type type, const char *subject, uint16_t detail, floor_t floor, floor_t floor2)
+{
+    if (__atomic_load_n(&trace_active, __ATOMIC_RELAXED))
+    {
+        trace_record(type, subject, detail, floor, floor2);
+    }
+}
+
+#endif // TRACE_H
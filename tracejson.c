@@ -0,0 +1,404 @@
+// tracejson - merges the trace files (trace.h) of any number of programs into one Chrome/Perfetto
+// JSON timeline, so a whole building can be read together in chrome://tracing or ui.perfetto.dev.
+//
+// Every program becomes a process with its threads, and every event an instant on the thread that
+// recorded it (safety trips are marked across the whole timeline). Each car also gets a track of
+// its own under "Cars": a slice per status as the car reported it, with a "door cycle" slice around
+// each run from Opening to the doors closing again. Timestamps are CLOCK_MONOTONIC in every
+// process, so the files line up as recorded; the timeline starts at the first event.
+//
+// Usage: tracejson {trace file}... > building.json
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "common.h"
+#include "trace.h"
+
+#define CARS_PID 1000000000 // Above any Linux pid, for the process holding the car tracks
+#define MAX_CARS 4096
+
+typedef struct
+{
+    trace_event event;
+    int process; // Index into processes
+    size_t order; // Position across the files, to keep events with equal timestamps in order
+} loaded_event;
+
+typedef struct
+{
+    uint32_t pid;
+    char name[40]; // Program, and the car it is for if any
+} process_info;
+
+// A car's track and the slices still open on it.
+typedef struct
+{
+    char name[TRACE_SUBJECT_SIZE + 1];
+    int has_status;
+    uint16_t status;
+    floor_t current_floor;
+    floor_t destination_floor;
+    uint64_t status_since_ns;
+    int in_door_cycle;
+    uint64_t door_cycle_since_ns;
+} car_track;
+
+loaded_event *events = NULL;
+size_t event_count = 0;
+size_t event_capacity = 0;
+process_info *processes;
+car_track cars[MAX_CARS];
+int car_count = 0;
+uint64_t start_ns;
+int first_output = 1;
+
+void load_file(const char *path, int process);
+int compare_events(const void *a, const void *b);
+void write_event(const loaded_event *loaded);
+void write_status(const loaded_event *loaded);
+car_track *find_car(const char *subject);
+void write_slice(const char *name, int track, uint64_t from_ns, uint64_t to_ns, const car_track *car);
+void begin_object();
+void print_string(const char *text, size_t max);
+double micros(uint64_t timestamp_ns);
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("Usage: tracejson {trace file}... > building.json\n");
+        exit(1);
+    }
+
+    processes = calloc(argc - 1, sizeof(process_info));
+    if (processes == NULL)
+    {
+        perror("calloc()");
+        exit(1);
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        load_file(argv[i], i - 1);
+    }
+    qsort(events, event_count, sizeof(loaded_event), compare_events);
+    start_ns = (event_count > 0) ? events[0].event.timestamp_ns : 0;
+
+    printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    begin_object();
+    printf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"Cars\"}}", CARS_PID);
+    begin_object();
+    printf("{\"name\":\"process_sort_index\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"sort_index\":-1}}", CARS_PID);
+    for (int i = 0; i < argc - 1; i++)
+    {
+        begin_object();
+        printf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":", processes[i].pid);
+        print_string(processes[i].name, sizeof(processes[i].name));
+        printf("}}");
+    }
+
+    for (size_t i = 0; i < event_count; i++)
+    {
+        write_event(&events[i]);
+    }
+
+    // Close the slices still open at the end of the trace.
+    uint64_t end_ns = (event_count > 0) ? events[event_count - 1].event.timestamp_ns : 0;
+    for (int i = 0; i < car_count; i++)
+    {
+        if (cars[i].has_status)
+        {
+            write_slice(format_status(cars[i].status), i + 1, cars[i].status_since_ns, end_ns, &cars[i]);
+        }
+        if (cars[i].in_door_cycle)
+        {
+            write_slice("door cycle", i + 1, cars[i].door_cycle_since_ns, end_ns, NULL);
+        }
+    }
+    printf("\n]}\n");
+
+    fprintf(stderr, "%zu events from %d files, %d cars.\n", event_count, argc - 1, car_count);
+    return 0;
+}
+
+// Function: reads one trace file's header and events.
+// Arguments:
+// - path: the file.
+// - process: its index in processes.
+// Returns: void. Exits if the file cannot be read or is not a trace file.
+void load_file(const char *path, int process)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+
+    trace_file_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC ||
+        header.version != TRACE_VERSION || header.event_size != sizeof(trace_event))
+    {
+        fprintf(stderr, "%s is not a trace file of version %d.\n", path, TRACE_VERSION);
+        exit(1);
+    }
+
+    process_info *info = &processes[process];
+    info->pid = header.pid;
+    if (header.subject[0] != '\0')
+    {
+        snprintf(info->name, sizeof(info->name), "%.16s %.16s", header.program, header.subject);
+    }
+    else
+    {
+        snprintf(info->name, sizeof(info->name), "%.16s", header.program);
+    }
+
+    trace_event event;
+    while (fread(&event, sizeof(event), 1, file) == 1)
+    {
+        if (event_count == event_capacity)
+        {
+            event_capacity = (event_capacity == 0) ? 65536 : event_capacity * 2;
+            events = realloc(events, event_capacity * sizeof(loaded_event));
+            if (events == NULL)
+            {
+                perror("realloc()");
+                exit(1);
+            }
+        }
+        events[event_count].event = event;
+        events[event_count].process = process;
+        events[event_count].order = event_count;
+        event_count++;
+    }
+    fclose(file);
+}
+
+int compare_events(const void *a, const void *b)
+{
+    const loaded_event *first = a, *second = b;
+    if (first->event.timestamp_ns != second->event.timestamp_ns)
+    {
+        return (first->event.timestamp_ns < second->event.timestamp_ns) ? -1 : 1;
+    }
+    return (first->order < second->order) ? -1 : (first->order > second->order);
+}
+
+// Function: writes one event: thread names as metadata, statuses onto the car's track and
+// everything else as an instant on the thread that recorded it.
+void write_event(const loaded_event *loaded)
+{
+    static const char *message_names[] = {"message received", "CAR received", "STATUS received", "CALL received",
+                                          "CALL_BATCH received", "FLOOR received", "UNAVAILABLE received"};
+    static const char *trip_names[] = {"safety: doors obstructed", "safety: emergency stop", "safety: overload",
+                                       "safety: data consistency error"};
+    static const char *control_names[] = {"internal: open", "internal: close", "internal: stop", "internal: service on",
+                                          "internal: service off", "internal: up", "internal: down"};
+    const trace_event *event = &loaded->event;
+    uint32_t pid = processes[loaded->process].pid;
+    const char *name;
+    const char *scope = "t";
+
+    if (event->type == TRACE_THREAD_NAME)
+    {
+        begin_object();
+        printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":", pid, event->tid);
+        print_string(event->subject, TRACE_SUBJECT_SIZE);
+        printf("}}");
+        return;
+    }
+    if (event->type == TRACE_STATUS)
+    {
+        write_status(loaded);
+        return;
+    }
+
+    if (event->type == TRACE_MESSAGE_RECEIVED && event->detail <= TRACE_MESSAGE_UNAVAILABLE)
+    {
+        name = message_names[event->detail];
+    }
+    else if (event->type == TRACE_SAFETY_TRIP && event->detail <= TRACE_TRIP_DATA_ERROR)
+    {
+        name = trip_names[event->detail];
+        scope = "g"; // Marked across the whole timeline
+    }
+    else if (event->type == TRACE_CONTROL && event->detail <= TRACE_CONTROL_DOWN)
+    {
+        name = control_names[event->detail];
+    }
+    else if (event->type == TRACE_LOST)
+    {
+        name = "events lost";
+    }
+    else if (event->type == TRACE_CALL_SENT)
+    {
+        name = "CALL sent";
+    }
+    else if (event->type == TRACE_CALL_QUEUED)
+    {
+        name = "call queued";
+    }
+    else if (event->type == TRACE_CALL_UNAVAILABLE)
+    {
+        name = "call unavailable";
+    }
+    else if (event->type == TRACE_STOP_POPPED)
+    {
+        name = "stop popped";
+    }
+    else if (event->type == TRACE_FLOOR_SENT)
+    {
+        name = "FLOOR sent";
+    }
+    else
+    {
+        name = "unknown event";
+    }
+
+    begin_object();
+    printf("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"%s\",\"ts\":%.3f,\"pid\":%u,\"tid\":%u,\"args\":{",
+           name, scope, micros(event->timestamp_ns), pid, event->tid);
+    printf("\"car\":");
+    print_string(event->subject, TRACE_SUBJECT_SIZE);
+    if (event->type == TRACE_LOST)
+    {
+        printf(",\"count\":%u", event->detail);
+    }
+    else if (event->floor != 0)
+    {
+        char floor_text[FLOOR_STRING_SIZE], floor2_text[FLOOR_STRING_SIZE];
+        format_floor(event->floor, floor_text);
+        printf(",\"floor\":\"%s\"", floor_text);
+        if (event->floor2 != 0)
+        {
+            format_floor(event->floor2, floor2_text);
+            printf(",\"to\":\"%s\"", floor2_text);
+        }
+    }
+    printf("}}");
+}
+
+// Function: ends the car's previous status slice, and its door cycle when the doors have closed.
+void write_status(const loaded_event *loaded)
+{
+    const trace_event *event = &loaded->event;
+    car_track *car = find_car(event->subject);
+    if (car == NULL)
+    {
+        return;
+    }
+    int track = (int)(car - cars) + 1;
+
+    if (car->has_status)
+    {
+        write_slice(format_status(car->status), track, car->status_since_ns, event->timestamp_ns, car);
+    }
+    if (event->detail == CAR_STATUS_OPENING && !car->in_door_cycle)
+    {
+        car->in_door_cycle = 1;
+        car->door_cycle_since_ns = event->timestamp_ns;
+    }
+    else if ((event->detail == CAR_STATUS_CLOSED || event->detail == CAR_STATUS_BETWEEN) && car->in_door_cycle)
+    {
+        write_slice("door cycle", track, car->door_cycle_since_ns, event->timestamp_ns, NULL);
+        car->in_door_cycle = 0;
+    }
+
+    car->has_status = 1;
+    car->status = event->detail;
+    car->current_floor = event->floor;
+    car->destination_floor = event->floor2;
+    car->status_since_ns = event->timestamp_ns;
+}
+
+// Function: finds a car's track, creating it (and naming it) the first time the car is seen.
+// Returns: the track, or NULL if there are more than MAX_CARS cars.
+car_track *find_car(const char *subject)
+{
+    for (int i = 0; i < car_count; i++)
+    {
+        if (strncmp(cars[i].name, subject, TRACE_SUBJECT_SIZE) == 0)
+        {
+            return &cars[i];
+        }
+    }
+    if (car_count == MAX_CARS)
+    {
+        return NULL;
+    }
+
+    car_track *car = &cars[car_count++];
+    memset(car, 0, sizeof(*car));
+    memcpy(car->name, subject, TRACE_SUBJECT_SIZE);
+
+    char track_name[TRACE_SUBJECT_SIZE + 8];
+    snprintf(track_name, sizeof(track_name), "Car %s", car->name);
+    begin_object();
+    printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", CARS_PID, car_count);
+    print_string(track_name, sizeof(track_name));
+    printf("}}");
+    return car;
+}
+
+// Function: writes a complete slice on a car's track.
+// Arguments:
+// - name: the slice's name.
+// - track: the car's track (thread) number.
+// - from_ns, to_ns: when it started and ended.
+// - car: for a status slice, the car whose floors go in its arguments; NULL for none.
+// Returns: void
+void write_slice(const char *name, int track, uint64_t from_ns, uint64_t to_ns, const car_track *car)
+{
+    begin_object();
+    printf("{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d", name, micros(from_ns),
+           (to_ns - from_ns) / 1e3, CARS_PID, track);
+    if (car != NULL)
+    {
+        char current_text[FLOOR_STRING_SIZE], destination_text[FLOOR_STRING_SIZE];
+        format_floor(car->current_floor, current_text);
+        format_floor(car->destination_floor, destination_text);
+        printf(",\"args\":{\"floor\":\"%s\",\"destination\":\"%s\"}", current_text, destination_text);
+    }
+    printf("}");
+}
+
+// Function: separates JSON objects in the event array.
+void begin_object()
+{
+    if (!first_output)
+    {
+        printf(",\n");
+    }
+    first_output = 0;
+}
+
+// Function: prints a NUL-padded field of at most max bytes as a JSON string.
+void print_string(const char *text, size_t max)
+{
+    putchar('"');
+    for (size_t i = 0; i < max && text[i] != '\0'; i++)
+    {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '"' || c == '\\')
+        {
+            printf("\\%c", c);
+        }
+        else if (c < 0x20)
+        {
+            printf("\\u%04x", c);
+        }
+        else
+        {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+// Function: a timestamp in microseconds since the first event, as Chrome's "ts" expects.
+double micros(uint64_t timestamp_ns)
+{
+    return (timestamp_ns - start_ns) / 1e3;
+}
@@ -0,0 +1,336 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+// Function: sets up a ring and maps its queues.
+// Arguments:
+// - ring: the ring to set up.
+// - entries: submission queue entries, a power of two; more requests than this in one batch are
+//   submitted early.
+// - cq_entries: completion queue entries. Every multishot receive can complete many times per batch,
+//   so this wants to be well above entries; the kernel keeps any overflow until there is room.
+// Returns: 0 on success, -1 with errno set.
+int uring_init(uring *ring, unsigned entries, unsigned cq_entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    params.cq_entries = cq_entries;
+
+    // Completions are only reaped by the thread that set the ring up, when it enters, so the kernel
+    // can leave their work until then rather than interrupting it (Linux 6.1). Older kernels fall back
+    // to cooperative task running.
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1 && errno == EINVAL)
+    {
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+        ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (ring->fd == -1)
+    {
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+        {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        close(ring->fd);
+        return -1;
+    }
+    ring->cq_ring = ring->sq_ring;
+    if (!single_mmap)
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        int saved_errno = errno;
+        uring_destroy(ring);
+        errno = saved_errno;
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Entry i of the submission queue is always request slot i.
+    for (unsigned i = 0; i < ring->sq_entries; i++)
+    {
+        ring->sq_array[i] = i;
+    }
+    return 0;
+}
+
+// Function: unmaps and closes a ring. Requests still in flight are cancelled by the kernel.
+void uring_destroy(uring *ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Function: takes the next free request slot, cleared. If the submission queue is full, everything
+// prepared so far is submitted first.
+// Arguments: ring - the ring.
+// Returns: the request to fill in. Exits if the kernel will not take requests.
+struct io_uring_sqe *uring_get_sqe(uring *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries)
+    {
+        if (uring_enter(ring, 0) == -1)
+        {
+            perror("io_uring_enter()");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+// Function: submits every request prepared since the last call and, with wait_count, waits for
+// completions, in one system call.
+// Arguments:
+// - ring: the ring.
+// - wait_count: how many completions to wait for; 0 just submits.
+// Returns: 0 on success, -1 with errno set.
+int uring_enter(uring *ring, unsigned wait_count)
+{
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    for (;;)
+    {
+        unsigned to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (to_submit == 0 && wait_count == 0)
+        {
+            return 0;
+        }
+        ring->enters++;
+        long result = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_count,
+                              wait_count > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (result >= 0)
+        {
+            return 0;
+        }
+        if (errno != EINTR)
+        {
+            return -1; // EBUSY: completions are backed up; drain them and enter again
+        }
+    }
+}
+
+// Function: looks at the oldest completion without consuming it.
+// Arguments: ring - the ring.
+// Returns: the completion, or NULL if there is none; pass it to uring_seen when done with it.
+struct io_uring_cqe *uring_peek(uring *ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+// Function: consumes the completion uring_peek returned, giving its slot back to the kernel.
+void uring_seen(uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Function: allocates receive buffers and registers them with a ring as a provided buffer group.
+// Arguments:
+// - ring: the ring.
+// - buffers: the buffers to set up.
+// - group: the group id multishot receives name.
+// - count: how many buffers, a power of two up to 32768.
+// - size: bytes in each.
+// Returns: 0 on success, -1 with errno set.
+int uring_buffers_init(uring *ring, uring_buffers *buffers, uint16_t group, unsigned count, unsigned size)
+{
+    memset(buffers, 0, sizeof(*buffers));
+    buffers->ring_size = count * sizeof(struct io_uring_buf);
+    buffers->ring = mmap(NULL, buffers->ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers->ring == MAP_FAILED)
+    {
+        return -1;
+    }
+    buffers->memory = malloc((size_t)count * size);
+    if (buffers->memory == NULL)
+    {
+        munmap(buffers->ring, buffers->ring_size);
+        return -1;
+    }
+    buffers->count = count;
+    buffers->size = size;
+    buffers->group = group;
+
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (uint64_t)(uintptr_t)buffers->ring;
+    registration.ring_entries = count;
+    registration.bgid = group;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) == -1)
+    {
+        int saved_errno = errno;
+        free(buffers->memory);
+        munmap(buffers->ring, buffers->ring_size);
+        errno = saved_errno;
+        return -1;
+    }
+
+    for (unsigned i = 0; i < count; i++)
+    {
+        struct io_uring_buf *buf = &buffers->ring->bufs[i];
+        buf->addr = (uint64_t)(uintptr_t)(buffers->memory + (size_t)i * size);
+        buf->len = size;
+        buf->bid = (uint16_t)i;
+    }
+    buffers->tail = (uint16_t)count;
+    __atomic_store_n(&buffers->ring->tail, buffers->tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Function: finds the bytes a receive completion delivered.
+// Arguments:
+// - buffers: the group the receive named.
+// - cqe: a completion with IORING_CQE_F_BUFFER set; cqe->res bytes were received.
+// Returns: the start of the buffer.
+char *uring_buffer(uring_buffers *buffers, const struct io_uring_cqe *cqe)
+{
+    unsigned id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    return buffers->memory + (size_t)id * buffers->size;
+}
+
+// Function: gives a completion's buffer back to the kernel once its bytes have been used.
+// Arguments:
+// - buffers: the group the receive named.
+// - cqe: the completion, with IORING_CQE_F_BUFFER set.
+// Returns: void
+void uring_buffer_recycle(uring_buffers *buffers, const struct io_uring_cqe *cqe)
+{
+    unsigned id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    struct io_uring_buf *buf = &buffers->ring->bufs[buffers->tail & (buffers->count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(buffers->memory + (size_t)id * buffers->size);
+    buf->len = buffers->size;
+    buf->bid = (uint16_t)id;
+    buffers->tail++;
+    __atomic_store_n(&buffers->ring->tail, buffers->tail, __ATOMIC_RELEASE);
+}
+
+// Function: prepares an accept that completes once for every connection, each with a non-blocking socket.
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = user_data;
+}
+
+// Function: prepares a receive that completes once for every read, into a buffer from the group.
+// It ends, without IORING_CQE_F_MORE, at end of file, on an error or when the group runs dry (-ENOBUFS).
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, const uring_buffers *buffers, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffers->group;
+    sqe->user_data = user_data;
+}
+
+// Function: prepares a send of one buffer; the kernel may take less than all of it.
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, size_t len, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+// Function: prepares a poll that completes every time the descriptor becomes readable, for a caller
+// that reads it itself.
+void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = user_data;
+}
+
+// Function: prepares a read, for eventfds and timerfds.
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf, size_t len, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->off = (uint64_t)-1; // No offset: the descriptor is not seekable
+    sqe->user_data = user_data;
+}
+
+// Function: prepares the cancellation of the request submitted with user_data target. The target
+// then completes with -ECANCELED, unless it completed first.
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
@@ -0,0 +1,78 @@
+#ifndef URING_H
+#define URING_H
+
+// A minimal io_uring, set up and driven with the raw system calls (no liburing), for the event loops
+// that can run on one instead of epoll (controller -U, carhost -U). Built only with `make URING=1`,
+// which needs kernel headers and a kernel from 5.19 on, for multishot receive and provided buffer
+// rings.
+//
+// Requests are prepared in the submission queue and all go to the kernel with the next uring_enter,
+// which also waits for completions: one system call per batch of events, however many sends and
+// receives the batch queued. A multishot receive stays armed and completes once for every read,
+// into a buffer the kernel picks from a ring of buffers registered with it.
+//
+// A ring belongs to the thread that sets it up.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+typedef struct
+{
+    int fd;
+
+    // Submission queue, shared with the kernel.
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail; // One past the last request prepared; published by uring_enter
+
+    // Completion queue, shared with the kernel.
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring; // The same mapping as sq_ring when the kernel maps both rings at once
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    uint64_t enters; // io_uring_enter calls made, for benchmarks
+} uring;
+
+// Receive buffers registered with a ring; a multishot receive takes one per completion.
+typedef struct
+{
+    struct io_uring_buf_ring *ring;
+    size_t ring_size;
+    char *memory;
+    unsigned count; // A power of two
+    unsigned size;  // Bytes in each buffer
+    uint16_t group;
+    uint16_t tail;
+} uring_buffers;
+
+int uring_init(uring *ring, unsigned entries, unsigned cq_entries);
+void uring_destroy(uring *ring);
+struct io_uring_sqe *uring_get_sqe(uring *ring);
+int uring_enter(uring *ring, unsigned wait_count);
+struct io_uring_cqe *uring_peek(uring *ring);
+void uring_seen(uring *ring);
+
+int uring_buffers_init(uring *ring, uring_buffers *buffers, uint16_t group, unsigned count, unsigned size);
+char *uring_buffer(uring_buffers *buffers, const struct io_uring_cqe *cqe);
+void uring_buffer_recycle(uring_buffers *buffers, const struct io_uring_cqe *cqe);
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, const uring_buffers *buffers, uint64_t user_data);
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, size_t len, uint64_t user_data);
+void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf, size_t len, uint64_t user_data);
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target, uint64_t user_data);
+
+#endif // URING_H